@@ -0,0 +1,189 @@
+/*
+ * Convert the text symbol file (magiclantern.sym) into the binary one loaded by the module loader
+ * (see src/module_syms.h): names hashed for TCC, duplicates removed, sorted by name.
+ * The version strings are taken from the version.c linked into the same autoexec.bin.
+ *
+ *   sym2bin magiclantern.sym version.c 5D3_113.syb
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "module_syms.h"
+
+struct symbol
+{
+    char * name;
+    uint32_t address;
+    int order;              /* position in the text file */
+};
+
+static struct symbol * symbols = NULL;
+static int symbol_count = 0;
+static int symbol_alloc = 0;
+
+static void add_symbol(void * ctx, const char * name, uint32_t address)
+{
+    if (symbol_count == symbol_alloc)
+    {
+        symbol_alloc = symbol_alloc ? symbol_alloc * 2 : 1024;
+        symbols = realloc(symbols, symbol_alloc * sizeof(symbols[0]));
+        if (!symbols)
+        {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+
+    symbols[symbol_count].name = strdup(name);
+    symbols[symbol_count].address = address;
+    symbols[symbol_count].order = symbol_count;
+    symbol_count++;
+}
+
+/* value of a string constant from the generated version.c, e.g. const char build_id[] = "NO_HG"; */
+static int read_build_string(const char * text, const char * name, char * out, int out_size)
+{
+    char decl[64];
+    snprintf(decl, sizeof(decl), "%s[]", name);
+
+    const char * p = strstr(text, decl);
+    if (!p || !(p = strchr(p, '"')))
+    {
+        return 0;
+    }
+
+    int len = 0;
+    for (p++; *p && *p != '"' && len < out_size - 1; p++)
+    {
+        if (*p == '\\' && p[1])
+        {
+            p++;
+        }
+        out[len++] = *p;
+    }
+    out[len] = 0;
+    return *p == '"';
+}
+
+static char * read_file(const char * filename, long * size)
+{
+    FILE * f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("Failed to open %s\n", filename);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char * buf = malloc(*size + 1);
+    if (!buf || fread(buf, 1, *size, f) != (size_t) *size)
+    {
+        printf("Failed to read %s\n", filename);
+        exit(1);
+    }
+    buf[*size] = 0;
+    fclose(f);
+    return buf;
+}
+
+static int compare_symbols(const void * a, const void * b)
+{
+    const struct symbol * sa = a;
+    const struct symbol * sb = b;
+    int cmp = strcmp(sa->name, sb->name);
+    return cmp ? cmp : sa->order - sb->order;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 4)
+    {
+        printf("Usage: %s magiclantern.sym version.c output.syb\n", argv[0]);
+        return 1;
+    }
+
+    long size;
+    char * text = read_file(argv[1], &size);
+
+    /* the module loader only uses the binary file on the build it was made for */
+    long version_size;
+    char * version_c = read_file(argv[2], &version_size);
+    char build_version[256], build_id[256], build_date[256];
+    if (!read_build_string(version_c, "build_version", build_version, sizeof(build_version)) ||
+        !read_build_string(version_c, "build_id", build_id, sizeof(build_id)) ||
+        !read_build_string(version_c, "build_date", build_date, sizeof(build_date)))
+    {
+        printf("No version strings in %s\n", argv[2]);
+        return 1;
+    }
+
+    /* same parser as the module loader, so both files have the same symbols */
+    module_syms_parse_text(text, size, add_symbol, NULL);
+
+    /* sort by name; for duplicates, TCC keeps the first one from the text file */
+    qsort(symbols, symbol_count, sizeof(symbols[0]), compare_symbols);
+
+    int count = 0;
+    uint32_t strings_size = 0;
+    for (int i = 0; i < symbol_count; i++)
+    {
+        if (count && strcmp(symbols[i].name, symbols[count-1].name) == 0)
+        {
+            continue;
+        }
+        symbols[count++] = symbols[i];
+        strings_size += strlen(symbols[i].name) + 1;
+    }
+
+    struct module_syms_header header = {
+        .magic          = MODULE_SYMS_MAGIC,
+        .version        = MODULE_SYMS_VERSION,
+        .count          = count,
+        .strings_size   = strings_size,
+        .build_hash     = module_syms_build_hash(build_version, build_id, build_date),
+    };
+
+    struct module_syms_entry * entries = malloc(count * sizeof(entries[0]) + 1);
+    char * strings = malloc(strings_size + 1);
+    if (!entries || !strings)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    uint32_t offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t len = strlen(symbols[i].name) + 1;
+        memcpy(strings + offset, symbols[i].name, len);
+        entries[i].address = symbols[i].address;
+        entries[i].hash = module_syms_hash(symbols[i].name);
+        entries[i].name = offset;
+        offset += len;
+    }
+
+    FILE * f = fopen(argv[3], "wb");
+    if (!f)
+    {
+        printf("Failed to create %s\n", argv[3]);
+        return 1;
+    }
+
+    int ok =
+        fwrite(&header, sizeof(header), 1, f) == 1 &&
+        fwrite(entries, sizeof(entries[0]), count, f) == (size_t) count &&
+        fwrite(strings, 1, strings_size, f) == strings_size;
+
+    if (fclose(f) != 0 || !ok)
+    {
+        printf("Failed to write %s\n", argv[3]);
+        remove(argv[3]);
+        return 1;
+    }
+
+    return 0;
+}
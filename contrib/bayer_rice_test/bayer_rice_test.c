@@ -0,0 +1,181 @@
+/*
+ * Host test for the bayer Rice codec (modules/mlv_rec/bayer_rice.c, mlv_dump --rice).
+ *
+ * - round trip through bayer_rice_encode / bayer_rice_decode for all bit depths (1 to 16),
+ *   sizes from 1x1 up to a full HD frame (odd sizes, partial strips) and different kinds of images:
+ *   clean and noisy bayer data, a delta frame of a static scene (mlv_dump -e), pure noise, flat and full range.
+ *   The images are chosen so that all predictors and the stored (packed) fallback are used.
+ * - the encoded size never exceeds bayer_rice_encode_bound, and the header describes the image
+ * - truncated data must be rejected, damaged data must not be decoded past the end of the image
+ *
+ *   bayer_rice_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bayer_rice.h"
+#include "host_test.h"
+
+/* from bayer_rice.c: the predictor of the first strip is in the two bits after the 16 byte header */
+#define BR_HEADER_SIZE      16
+#define BR_FLAG_STORED      0x01
+
+/* how often each predictor (and the stored fallback, as 3) was picked for the first strip */
+static int modes_used[4];
+
+static void test_image(int width, int height, int depth, int kind, int print_stats)
+{
+    char what[100];
+    snprintf(what, sizeof(what), "%dx%d, %d bits, %s", width, height, depth, test_image_names[kind]);
+
+    int pixels = width * height;
+    uint16_t * image = malloc(pixels * sizeof(uint16_t));
+    uint16_t * decoded = malloc((pixels + 1) * sizeof(uint16_t));
+    test_make_image(image, width, height, depth, kind);
+
+    uint32_t bound = bayer_rice_encode_bound(width, height, depth);
+    uint8_t * data = malloc(bound + 16);
+    memset(data + bound, 0xAA, 16);
+
+    double t0 = test_seconds();
+    uint32_t size = bayer_rice_encode(image, width, height, depth, data, bound);
+    double t1 = test_seconds();
+
+    bayer_rice_info_t info;
+    if (!size || size > bound || data[bound] != 0xAA || bayer_rice_read_info(data, size, &info)
+        || info.width != width || info.height != height || info.depth != depth)
+    {
+        printf("%s: encoded to %d bytes (bound %d), bad header or output overrun\n", what, size, bound);
+        errors++;
+        goto end;
+    }
+
+    modes_used[(data[4] & BR_FLAG_STORED) ? 3 : data[BR_HEADER_SIZE] >> 6]++;
+
+    decoded[pixels] = 0x1234;
+    double t2 = test_seconds();
+    int ret = bayer_rice_decode(data, size, decoded, pixels);
+    double t3 = test_seconds();
+
+    if (ret || memcmp(decoded, image, pixels * sizeof(uint16_t)) || decoded[pixels] != 0x1234)
+    {
+        printf("%s: decoded image differs\n", what);
+        errors++;
+        goto end;
+    }
+
+    if (!bayer_rice_decode(data, size, decoded, pixels - 1))
+    {
+        printf("%s: decoded into a buffer that is too small\n", what);
+        errors++;
+    }
+
+    if (print_stats)
+    {
+        uint32_t packed = (pixels * depth + 7) / 8;
+        printf("%-24s %5.1f%% of packed, encode %6.1f MB/s, decode %6.1f MB/s\n",
+            what, size * 100.0 / packed, packed / 1e6 / (t1 - t0), packed / 1e6 / (t3 - t2));
+    }
+
+end:
+    free(data);
+    free(decoded);
+    free(image);
+}
+
+static void test_damaged_data()
+{
+    int width = 300;
+    int height = 40;
+    int pixels = width * height;
+    uint16_t * image = malloc(pixels * sizeof(uint16_t));
+    test_make_image(image, width, height, 14, TEST_IMAGE_BAYER);
+
+    uint32_t bound = bayer_rice_encode_bound(width, height, 14);
+    uint8_t * data = malloc(bound);
+    uint8_t * damaged = malloc(bound);
+    uint32_t size = bayer_rice_encode(image, width, height, 14, data, bound);
+
+    uint16_t * decoded = malloc((pixels + 1) * sizeof(uint16_t));
+
+    /* every truncation must fail */
+    for (uint32_t cut = 0; cut < size; cut += (cut < 1000 ? 1 : 31))
+    {
+        if (!bayer_rice_decode(data, cut, decoded, pixels))
+        {
+            printf("Data cut to %d of %d bytes was decoded\n", cut, size);
+            errors++;
+            break;
+        }
+    }
+
+    /* random damage: decoding may succeed (there is no checksum), but must stay inside the image */
+    for (int i = 0; i < 20000; i++)
+    {
+        memcpy(damaged, data, size);
+        int count = 1 + rand() % 4;
+        for (int k = 0; k < count; k++)
+        {
+            /* mostly in the header */
+            damaged[(rand() % 2) ? rand() % BR_HEADER_SIZE : rand() % size] = rand();
+        }
+
+        decoded[pixels] = 0x1234;
+        bayer_rice_decode(damaged, size, decoded, pixels);
+        if (decoded[pixels] != 0x1234)
+        {
+            printf("Damaged data decoded past the end of the image\n");
+            errors++;
+            break;
+        }
+    }
+
+    /* invalid arguments */
+    if (bayer_rice_encode(image, width, height, 0, data, bound) || bayer_rice_encode(image, width, height, 17, data, bound)
+        || bayer_rice_encode(image, 0, height, 14, data, bound) || bayer_rice_encode(image, width, height, 14, data, bound - 1))
+    {
+        printf("Encoded with invalid arguments\n");
+        errors++;
+    }
+
+    free(decoded);
+    free(damaged);
+    free(data);
+    free(image);
+}
+
+int main(int argc, char *argv[])
+{
+    static const int sizes[][2] = { { 1, 1 }, { 2, 2 }, { 3, 5 }, { 17, 33 }, { 256, 16 }, { 1920, 1080 } };
+
+    srand(1234);
+
+    for (int depth = 1; depth <= 16; depth++)
+    {
+        for (int s = 0; s < 6; s++)
+        {
+            /* full frames only at the bit depths the cameras record */
+            if (s == 5 && (depth < 10 || depth % 2))
+            {
+                continue;
+            }
+
+            for (int kind = 0; kind < TEST_IMAGE_KINDS; kind++)
+            {
+                test_image(sizes[s][0], sizes[s][1], depth, kind, depth == 14 && s == 5);
+            }
+        }
+    }
+
+    test_damaged_data();
+
+    if (!modes_used[0] || !modes_used[1] || !modes_used[2] || !modes_used[3])
+    {
+        printf("Not all predictors were tested: MED %d, AVG %d, FLAT %d, stored %d\n", modes_used[0], modes_used[1], modes_used[2], modes_used[3]);
+        errors++;
+    }
+
+    return test_result();
+}
@@ -0,0 +1,322 @@
+/*
+ * Host test for the tiled lossless JPEG DNG output of cr2hdr
+ * (modules/dual_iso/dng_tiles.c, dng_set_tiles / save_dng_parts in src/chdk-dng.c).
+ *
+ * - dng_tiles_encode: for several image sizes (tiles sticking out on the right and bottom),
+ *   tile sizes and bit depths, every tile must decode (modules/mlv_rec/lj92.c) to the matching
+ *   part of the image
+ * - save_dng_parts with tiles: the raw IFD must be a valid tiled DNG (compression 7, TileWidth,
+ *   TileLength, TileOffsets, TileByteCounts, no strip tags, tags in ascending order), and every
+ *   tile read from the file at its offset must decode to the image
+ * - after dng_set_tiles(0, ...), the same image is saved as one uncompressed strip again
+ *
+ *   dng_tiles_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raw.h"
+#include "chdk-dng.h"
+#include "dng_tiles.h"
+#include "lj92.h"
+#include "host_test.h"
+
+#define DNG_FILE "test.dng"
+
+/* used by chdk-dng.c for the thumbnail */
+struct raw_info raw_info;
+
+int raw_get_pixel(int x, int y)
+{
+    return ((uint16_t *) raw_info.buffer)[x + y * raw_info.width];
+}
+
+/* decode one tile and compare its visible part with the image */
+static int check_tile(const uint8_t * data, uint32_t size, int tile_width, int tile_length, int bits,
+                      const uint16_t * image, int width, int height, int x0, int y0)
+{
+    lj92_info_t info;
+    if (lj92_read_info(data, size, &info) || info.width != tile_width || info.height != tile_length
+        || info.components != 2 || info.precision != bits)
+    {
+        return 1;
+    }
+
+    uint16_t * tile = malloc(tile_width * tile_length * sizeof(uint16_t));
+    int ret = lj92_decode(data, size, tile, tile_width * tile_length);
+
+    for (int y = 0; y < tile_length && y0 + y < height && !ret; y++)
+    {
+        for (int x = 0; x < tile_width && x0 + x < width; x++)
+        {
+            if (tile[x + y * tile_width] != image[(x0 + x) + (y0 + y) * width])
+            {
+                ret = 1;
+                break;
+            }
+        }
+    }
+
+    free(tile);
+    return ret;
+}
+
+static void test_encode()
+{
+    static const int sizes[][2] = { { 2, 1 }, { 100, 60 }, { 256, 256 }, { 600, 301 } };
+    static const int tile_sizes[] = { 16, 128, 256 };
+    static const int depths[] = { 10, 12, 14, 16 };
+
+    for (int s = 0; s < 4; s++)
+    {
+        for (int t = 0; t < 3; t++)
+        {
+            for (int d = 0; d < 4; d++)
+            {
+                int width = sizes[s][0];
+                int height = sizes[s][1];
+                int tile_size = tile_sizes[t];
+                int bits = depths[d];
+                uint16_t * image = malloc(width * height * sizeof(uint16_t));
+                test_make_image(image, width, height, bits, TEST_IMAGE_BAYER);
+
+                struct dng_tiles tiles;
+                int across = (width + tile_size - 1) / tile_size;
+                int down = (height + tile_size - 1) / tile_size;
+
+                if (dng_tiles_encode(&tiles, image, width, height, bits, tile_size, 0)
+                    || tiles.count != across * down || tiles.tile_width != tile_size || tiles.tile_length != tile_size)
+                {
+                    printf("%dx%d, %d bit, %d px tiles: encoding failed\n", width, height, bits, tile_size);
+                    errors++;
+                    free(image);
+                    continue;
+                }
+
+                for (int i = 0; i < tiles.count; i++)
+                {
+                    if (check_tile(tiles.data[i], tiles.size[i], tile_size, tile_size, bits,
+                                   image, width, height, (i % across) * tile_size, (i / across) * tile_size))
+                    {
+                        printf("%dx%d, %d bit, %d px tiles: tile %d differs\n", width, height, bits, tile_size, i);
+                        errors++;
+                        break;
+                    }
+                }
+
+                dng_tiles_free(&tiles);
+                free(image);
+            }
+        }
+    }
+
+    /* invalid tile sizes */
+    uint16_t image[64] = { 0 };
+    struct dng_tiles tiles;
+    if (!dng_tiles_encode(&tiles, image, 8, 8, 14, 8, 0) || !dng_tiles_encode(&tiles, image, 8, 8, 14, 0, 0))
+    {
+        printf("Encoded with an invalid tile size\n");
+        errors++;
+    }
+}
+
+/* minimal TIFF reader, little endian only (as written by chdk-dng.c) */
+static uint8_t * file_data = NULL;
+static uint32_t file_size = 0;
+
+static uint32_t get16(uint32_t offset)
+{
+    return offset + 2 <= file_size ? file_data[offset] | (file_data[offset + 1] << 8) : 0;
+}
+
+static uint32_t get32(uint32_t offset)
+{
+    return offset + 4 <= file_size ? get16(offset) | (get16(offset + 2) << 16) : 0;
+}
+
+static int load_file(const char * filename)
+{
+    FILE * f = fopen(filename, "rb");
+    if (!f)
+    {
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    file_size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    free(file_data);
+    file_data = malloc(file_size);
+    int ok = fread(file_data, 1, file_size, f) == file_size;
+    fclose(f);
+    return !ok || file_size < 8 || file_data[0] != 'I' || file_data[1] != 'I' || get16(2) != 42;
+}
+
+/* offset of the entry for tag in the IFD at ifd, 0 if not there; also checks the tag order */
+static uint32_t find_tag(uint32_t ifd, int tag)
+{
+    int count = get16(ifd);
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t entry = ifd + 2 + i * 12;
+        if (get16(entry) == tag)
+        {
+            return entry;
+        }
+    }
+    return 0;
+}
+
+static int tags_sorted(uint32_t ifd)
+{
+    int count = get16(ifd);
+    for (int i = 1; i < count; i++)
+    {
+        if (get16(ifd + 2 + i * 12) <= get16(ifd + 2 + (i - 1) * 12))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* value n of a SHORT or LONG tag */
+static uint32_t tag_value(uint32_t entry, int n)
+{
+    int type = get16(entry + 2);
+    uint32_t count = get32(entry + 4);
+    int size = (type == 3) ? 2 : 4;
+    uint32_t offset = (count * size <= 4) ? entry + 8 : get32(entry + 8);
+    return (type == 3) ? get16(offset + n * 2) : get32(offset + n * 4);
+}
+
+/* the raw image IFD: the first SubIFD */
+static uint32_t raw_ifd()
+{
+    uint32_t sub = find_tag(get32(4), 0x14A);
+    return sub ? tag_value(sub, 0) : 0;
+}
+
+static void save_test_dng(uint16_t * image, int width, int height, const struct dng_image_part * parts, int count)
+{
+    memset(&raw_info, 0, sizeof(raw_info));
+    raw_info.buffer = image;
+    raw_info.width = width;
+    raw_info.height = height;
+    raw_info.bits_per_pixel = 16;
+    raw_info.pitch = width * 2;
+    raw_info.frame_size = width * height * 2;
+    raw_info.black_level = 2048;
+    raw_info.white_level = 15000;
+    raw_info.cfa_pattern = 0x02010100;
+    raw_info.active_area.x2 = width;
+    raw_info.active_area.y2 = height;
+    raw_info.jpeg.width = width;
+    raw_info.jpeg.height = height;
+
+    if (!save_dng_parts(DNG_FILE, &raw_info, parts, count) || load_file(DNG_FILE))
+    {
+        printf("Could not save " DNG_FILE "\n");
+        exit(1);
+    }
+}
+
+static void test_dng()
+{
+    int width = 1000;
+    int height = 333;
+    int tile_size = 256;
+    int bits = 14;
+    uint16_t * image = malloc(width * height * sizeof(uint16_t));
+    test_make_image(image, width, height, bits, TEST_IMAGE_BAYER);
+
+    struct dng_tiles tiles;
+    if (dng_tiles_encode(&tiles, image, width, height, bits, tile_size, 0))
+    {
+        printf("Encoding failed\n");
+        errors++;
+        return;
+    }
+
+    struct dng_image_part * parts = malloc(tiles.count * sizeof(parts[0]));
+    for (int i = 0; i < tiles.count; i++)
+    {
+        parts[i].data = tiles.data[i];
+        parts[i].size = tiles.size[i];
+        parts[i].swap16 = 0;
+    }
+
+    if (!dng_set_tiles(tile_size, tile_size, tiles.count, tiles.size))
+    {
+        printf("dng_set_tiles failed\n");
+        exit(1);
+    }
+    save_test_dng(image, width, height, parts, tiles.count);
+    dng_set_tiles(0, 0, 0, NULL);
+
+    uint32_t ifd = raw_ifd();
+    uint32_t offsets = find_tag(ifd, 0x144);
+    uint32_t sizes = find_tag(ifd, 0x145);
+
+    if (!ifd || !tags_sorted(ifd) || find_tag(ifd, 0x111) || find_tag(ifd, 0x117) || !offsets || !sizes
+        || tag_value(find_tag(ifd, 0x103), 0) != 7
+        || tag_value(find_tag(ifd, 0x100), 0) != width || tag_value(find_tag(ifd, 0x101), 0) != height
+        || tag_value(find_tag(ifd, 0x142), 0) != tile_size || tag_value(find_tag(ifd, 0x143), 0) != tile_size
+        || get32(offsets + 4) != tiles.count || get32(sizes + 4) != tiles.count)
+    {
+        printf("Tiled DNG: bad raw IFD\n");
+        errors++;
+    }
+    else
+    {
+        int across = (width + tile_size - 1) / tile_size;
+        for (int i = 0; i < tiles.count; i++)
+        {
+            uint32_t offset = tag_value(offsets, i);
+            uint32_t size = tag_value(sizes, i);
+            if (size != tiles.size[i] || offset + size > file_size
+                || check_tile(file_data + offset, size, tile_size, tile_size, bits,
+                              image, width, height, (i % across) * tile_size, (i / across) * tile_size))
+            {
+                printf("Tiled DNG: tile %d at %d (%d bytes) differs\n", i, offset, size);
+                errors++;
+                break;
+            }
+        }
+    }
+
+    /* back to one uncompressed strip (big endian, as saved by save_dng) */
+    uint16_t * swapped = malloc(width * height * sizeof(uint16_t));
+    for (int i = 0; i < width * height; i++)
+    {
+        swapped[i] = (image[i] >> 8) | (image[i] << 8);
+    }
+    struct dng_image_part strip = { swapped, width * height * 2, 0 };
+    save_test_dng(image, width, height, &strip, 1);
+
+    ifd = raw_ifd();
+    uint32_t strip_offset = tag_value(find_tag(ifd, 0x111), 0);
+    if (!ifd || !tags_sorted(ifd) || find_tag(ifd, 0x142) || find_tag(ifd, 0x144)
+        || tag_value(find_tag(ifd, 0x103), 0) != 1 || tag_value(find_tag(ifd, 0x117), 0) != width * height * 2
+        || strip_offset + width * height * 2 > file_size || memcmp(file_data + strip_offset, swapped, width * height * 2))
+    {
+        printf("Uncompressed DNG after tiles: bad raw IFD or image data\n");
+        errors++;
+    }
+
+    free(swapped);
+    free(parts);
+    dng_tiles_free(&tiles);
+    free(image);
+    remove(DNG_FILE);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1234);
+    test_encode();
+    test_dng();
+
+    return test_result();
+}
@@ -0,0 +1,68 @@
+/*
+ * Shared by the host tests in contrib/ (see host_test.h)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "host_test.h"
+
+int errors = 0;
+
+int test_result()
+{
+    if (errors)
+    {
+        printf("%d errors\n", errors);
+        return 1;
+    }
+
+    printf("ok\n");
+    return 0;
+}
+
+double test_seconds()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+const char * test_image_names[TEST_IMAGE_KINDS] = { "bayer", "noise", "flat", "extremes", "smooth", "delta" };
+
+void test_make_image(uint16_t * image, int width, int height, int bits, int kind)
+{
+    int max = (1 << bits) - 1;
+
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int v = 0;
+            int base = max / 8 + ((x * 37 + y * 11) >> 3) % (max / 4 + 1) + ((x % 2) ? max / 5 : 0) + ((y % 2) ? max / 9 : 0);
+
+            switch (kind)
+            {
+                case TEST_IMAGE_BAYER:
+                    v = base + rand() % (max / 32 + 1);
+                    break;
+                case TEST_IMAGE_NOISE:
+                    v = rand();
+                    break;
+                case TEST_IMAGE_FLAT:
+                    v = max / 3;
+                    break;
+                case TEST_IMAGE_EXTREMES:
+                    v = (rand() % 2) ? max : 0;
+                    break;
+                case TEST_IMAGE_SMOOTH:
+                    v = base;
+                    break;
+                case TEST_IMAGE_DELTA:
+                    v = (max + 1) / 2 + rand() % 9 - 4;
+                    break;
+            }
+            image[y * width + x] = v & max;
+        }
+    }
+}
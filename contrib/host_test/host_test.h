@@ -0,0 +1,36 @@
+/*
+ * Shared by the host tests in contrib/ (make check, see host_test.mk).
+ */
+
+#ifndef _host_test_h_
+#define _host_test_h_
+
+#include <stdint.h>
+
+/* number of failed checks; each one is printed where it's detected */
+extern int errors;
+
+/* prints "ok" or the number of errors; returns the exit code for main */
+int test_result();
+
+/* monotonic time, for the timings printed by some tests */
+double test_seconds();
+
+/* synthetic raw images for the codec tests */
+enum
+{
+    TEST_IMAGE_BAYER,           /* smooth gradients, different level for each bayer colour, a bit of noise */
+    TEST_IMAGE_NOISE,
+    TEST_IMAGE_FLAT,
+    TEST_IMAGE_EXTREMES,        /* only 0 and the maximum: maximal differences between neighbours */
+    TEST_IMAGE_SMOOTH,          /* bayer without noise */
+    TEST_IMAGE_DELTA,           /* difference to the previous frame of a static scene (mlv_dump -e) */
+    TEST_IMAGE_KINDS
+};
+
+extern const char * test_image_names[TEST_IMAGE_KINDS];
+
+/* width * height samples of the given bit depth, from rand() (so call srand first) */
+void test_make_image(uint16_t * image, int width, int height, int bits, int kind);
+
+#endif
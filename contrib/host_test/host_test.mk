@@ -0,0 +1,22 @@
+# Shared by the host tests in contrib/, included by their Makefile after setting:
+#   TEST        the test program, built from SOURCES (and host_test.c), rebuilt when HEADERS change
+#   CFLAGS      extra flags (include paths etc.), LIBS for the linker
+#   TEST_ARGS   arguments for the test in make check, CHECK_DEPS what else it needs
+#   OUTPUTS     files written by the test, removed by make clean
+# make check builds and runs it; rules after the include can add more steps with check:: and clean::
+
+HOST_TEST_DIR := $(dir $(lastword $(MAKEFILE_LIST)))
+
+CC ?= gcc
+CFLAGS += -O2 -Wall -std=gnu99 -I$(HOST_TEST_DIR)
+SOURCES += $(HOST_TEST_DIR)host_test.c
+HEADERS += $(HOST_TEST_DIR)host_test.h
+
+$(TEST): $(SOURCES) $(HEADERS)
+	$(CC) $(CFLAGS) $(SOURCES) $(LIBS) -o $@
+
+check:: $(TEST) $(CHECK_DEPS)
+	./$(TEST) $(TEST_ARGS)
+
+clean::
+	rm -f $(TEST) $(OUTPUTS)
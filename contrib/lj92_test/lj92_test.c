@@ -0,0 +1,392 @@
+/*
+ * Host test for the lossless JPEG codec (modules/mlv_rec/lj92.c, used by mlv_dump and cr2hdr).
+ *
+ * - round trip through lj92_encode / lj92_decode for all precisions, 1 to 4 components,
+ *   odd sizes and different kinds of images (smooth bayer data, noise, flat, full range)
+ * - decoding of streams from a minimal, independent writer (below), for what the encoder
+ *   never produces: predictors 2 to 7, restart intervals, point transform, scan components
+ *   in a different order than in the frame header
+ * - truncated and corrupted streams must be rejected (or at least decoded without overrun)
+ *
+ *   lj92_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lj92.h"
+#include "host_test.h"
+
+static void check_decode(const uint8_t * data, uint32_t size, const uint16_t * image, int width, int height, int components, int precision, const char * what)
+{
+    lj92_info_t info;
+    if (lj92_read_info(data, size, &info)
+        || info.width != width || info.height != height || info.components != components || info.precision != precision)
+    {
+        printf("%s: bad info %dx%d, %d components, %d bits\n", what, info.width, info.height, info.components, info.precision);
+        errors++;
+        return;
+    }
+
+    /* one more sample at the end, to catch writes past the image */
+    uint16_t * decoded = malloc((width * height + 1) * sizeof(uint16_t));
+    decoded[width * height] = 0x1234;
+
+    if (lj92_decode(data, size, decoded, width * height) || memcmp(decoded, image, width * height * sizeof(uint16_t)) || decoded[width * height] != 0x1234)
+    {
+        printf("%s: decoded image differs\n", what);
+        errors++;
+    }
+
+    /* too small output buffer */
+    if (!lj92_decode(data, size, decoded, width * height - 1))
+    {
+        printf("%s: decoded into a buffer that is too small\n", what);
+        errors++;
+    }
+
+    free(decoded);
+}
+
+static void test_round_trip()
+{
+    static const int sizes[][2] = { { 2, 1 }, { 4, 3 }, { 30, 17 }, { 642, 41 } };
+
+    for (int precision = 2; precision <= 16; precision++)
+    {
+        for (int components = 1; components <= 4; components++)
+        {
+            for (int s = 0; s < 4; s++)
+            {
+                for (int kind = 0; kind < TEST_IMAGE_KINDS; kind++)
+                {
+                    /* the width has to be a multiple of the component count */
+                    int width = sizes[s][0] * components;
+                    int height = sizes[s][1];
+                    uint16_t * image = malloc(width * height * sizeof(uint16_t));
+                    test_make_image(image, width, height, precision, kind);
+
+                    uint32_t bound = lj92_encode_bound(width, height);
+                    uint8_t * data = malloc(bound);
+                    uint32_t size = lj92_encode(image, width, height, components, precision, data, bound);
+
+                    char what[100];
+                    snprintf(what, sizeof(what), "round trip %dx%d, %d components, %d bits, %s", width, height, components, precision, test_image_names[kind]);
+
+                    if (!size)
+                    {
+                        printf("%s: encoding failed\n", what);
+                        errors++;
+                    }
+                    else
+                    {
+                        check_decode(data, size, image, width, height, components, precision, what);
+                    }
+
+                    free(data);
+                    free(image);
+                }
+            }
+        }
+    }
+
+    /* invalid arguments */
+    uint16_t image[16] = { 0 };
+    uint8_t data[1024];
+    if (lj92_encode(image, 4, 4, 1, 1, data, sizeof(data)) || lj92_encode(image, 4, 4, 1, 17, data, sizeof(data))
+        || lj92_encode(image, 4, 4, 3, 12, data, sizeof(data)) || lj92_encode(image, 4, 4, 1, 12, data, 10))
+    {
+        printf("Encoded with invalid arguments\n");
+        errors++;
+    }
+}
+
+/* a minimal lossless JPEG writer: every symbol gets a 5 bit code, any predictor, restart interval and point transform */
+struct bit_writer
+{
+    uint8_t * out;
+    uint32_t size;
+    uint32_t bits;
+    int count;
+};
+
+static void put_byte(struct bit_writer * w, uint8_t b)
+{
+    w->out[w->size++] = b;
+}
+
+static void put_bits(struct bit_writer * w, uint32_t value, int count)
+{
+    for (int i = count - 1; i >= 0; i--)
+    {
+        w->bits = (w->bits << 1) | ((value >> i) & 1);
+        if (++w->count == 8)
+        {
+            put_byte(w, w->bits);
+            if (w->bits == 0xFF)
+            {
+                put_byte(w, 0);
+            }
+            w->bits = 0;
+            w->count = 0;
+        }
+    }
+}
+
+static void flush_bits(struct bit_writer * w)
+{
+    while (w->count)
+    {
+        put_bits(w, 1, 1);
+    }
+}
+
+static void put_segment(struct bit_writer * w, int marker, const uint8_t * data, int size)
+{
+    put_byte(w, 0xFF);
+    put_byte(w, marker);
+    put_byte(w, (size + 2) >> 8);
+    put_byte(w, (size + 2) & 0xFF);
+    for (int i = 0; i < size; i++)
+    {
+        put_byte(w, data[i]);
+    }
+}
+
+static int predict(int predictor, int ra, int rb, int rc)
+{
+    switch (predictor)
+    {
+        case 1: return ra;
+        case 2: return rb;
+        case 3: return rc;
+        case 4: return ra + rb - rc;
+        case 5: return ra + ((rb - rc) >> 1);
+        case 6: return rb + ((ra - rc) >> 1);
+        default: return (ra + rb) >> 1;
+    }
+}
+
+/* image is width x height samples (all components), values are multiples of 1 << pt; restart_rows: restart interval in rows, 0 = none */
+static uint32_t write_reference(uint8_t * out, const uint16_t * image, int width, int height, int components, int precision, int predictor, int pt, int restart_rows)
+{
+    struct bit_writer w = { out, 0, 0, 0 };
+    int columns = width / components;
+    uint8_t seg[64];
+
+    put_byte(&w, 0xFF);
+    put_byte(&w, 0xD8);
+
+    /* SOF3 */
+    seg[0] = precision;
+    seg[1] = height >> 8; seg[2] = height & 0xFF;
+    seg[3] = columns >> 8; seg[4] = columns & 0xFF;
+    seg[5] = components;
+    for (int c = 0; c < components; c++)
+    {
+        seg[6 + c * 3] = 10 + c;
+        seg[7 + c * 3] = 0x11;
+        seg[8 + c * 3] = 0;
+    }
+    put_segment(&w, 0xC3, seg, 6 + components * 3);
+
+    /* DHT: 17 codes of 5 bits, symbol n = code n */
+    memset(seg, 0, sizeof(seg));
+    seg[0] = 0;
+    seg[1 + 4] = 17;
+    for (int s = 0; s < 17; s++)
+    {
+        seg[17 + s] = s;
+    }
+    put_segment(&w, 0xC4, seg, 17 + 17);
+
+    int restart_interval = restart_rows * columns;
+    if (restart_interval)
+    {
+        seg[0] = restart_interval >> 8;
+        seg[1] = restart_interval & 0xFF;
+        put_segment(&w, 0xDD, seg, 2);
+    }
+
+    /* SOS, components in reverse order */
+    seg[0] = components;
+    for (int i = 0; i < components; i++)
+    {
+        seg[1 + i * 2] = 10 + components - 1 - i;
+        seg[2 + i * 2] = 0;
+    }
+    seg[1 + components * 2] = predictor;
+    seg[2 + components * 2] = 0;
+    seg[3 + components * 2] = pt;
+    put_segment(&w, 0xDA, seg, 4 + components * 2);
+
+    int restarts = 0;
+    for (int y = 0; y < height; y++)
+    {
+        int first_line = (y == 0);
+        if (restart_rows && y && y % restart_rows == 0)
+        {
+            flush_bits(&w);
+            put_byte(&w, 0xFF);
+            put_byte(&w, 0xD0 + restarts++ % 8);
+            first_line = 1;
+        }
+
+        for (int col = 0; col < columns; col++)
+        {
+            for (int i = 0; i < components; i++)
+            {
+                int pos = y * width + col * components + components - 1 - i;
+                int value = image[pos] >> pt;
+                int pred;
+
+                if (first_line && !col)
+                {
+                    pred = 1 << (precision - pt - 1);
+                }
+                else if (first_line)
+                {
+                    pred = image[pos - components] >> pt;
+                }
+                else if (!col)
+                {
+                    pred = image[pos - width] >> pt;
+                }
+                else
+                {
+                    pred = predict(predictor, image[pos - components] >> pt, image[pos - width] >> pt, image[pos - width - components] >> pt);
+                }
+
+                int diff = (int16_t)((value - pred) & 0xFFFF);
+                int ssss = 0;
+                while (ssss < 16 && (abs(diff) >> ssss))
+                {
+                    ssss++;
+                }
+
+                put_bits(&w, ssss, 5);
+                if (ssss && ssss < 16)
+                {
+                    put_bits(&w, diff >= 0 ? diff : diff - 1, ssss);
+                }
+            }
+        }
+    }
+
+    flush_bits(&w);
+    put_byte(&w, 0xFF);
+    put_byte(&w, 0xD9);
+    return w.size;
+}
+
+static void test_reference_streams()
+{
+    int width_columns = 37;
+    int height = 23;
+
+    for (int predictor = 1; predictor <= 7; predictor++)
+    {
+        for (int components = 1; components <= 4; components++)
+        {
+            for (int pt = 0; pt <= 2; pt++)
+            {
+                for (int restart_rows = 0; restart_rows <= 5; restart_rows += 5)
+                {
+                    int precision = (predictor % 2) ? 16 : 12;
+                    int width = width_columns * components;
+                    uint16_t * image = malloc(width * height * sizeof(uint16_t));
+                    test_make_image(image, width, height, precision - pt, predictor == 7 ? TEST_IMAGE_EXTREMES : TEST_IMAGE_NOISE);
+                    for (int i = 0; i < width * height; i++)
+                    {
+                        image[i] <<= pt;
+                    }
+
+                    uint8_t * data = malloc(width * height * 4 + 1024);
+                    uint32_t size = write_reference(data, image, width, height, components, precision, predictor, pt, restart_rows);
+
+                    char what[100];
+                    snprintf(what, sizeof(what), "predictor %d, %d components, %d bits, pt %d, restart every %d rows", predictor, components, precision, pt, restart_rows);
+                    check_decode(data, size, image, width, height, components, precision, what);
+
+                    free(data);
+                    free(image);
+                }
+            }
+        }
+    }
+}
+
+static void test_damaged_streams()
+{
+    int width = 200;
+    int height = 50;
+    uint16_t * image = malloc(width * height * sizeof(uint16_t));
+    test_make_image(image, width, height, 14, TEST_IMAGE_BAYER);
+
+    uint32_t bound = lj92_encode_bound(width, height);
+    uint8_t * data = malloc(bound);
+    uint8_t * damaged = malloc(bound);
+    uint32_t size = lj92_encode(image, width, height, 2, 14, data, bound);
+
+    /* the decoder may write anywhere in the image it was given, but not past it */
+    int max_samples = 1 << 16;
+    uint16_t * decoded = malloc((max_samples + 1) * sizeof(uint16_t));
+
+    if (lj92_decode(data, size - 2, decoded, width * height))
+    {
+        printf("Stream without end marker was not decoded\n");
+        errors++;
+    }
+
+    /* every truncation must fail, except for a missing end marker */
+    for (uint32_t cut = 0; cut < size - 2; cut += (cut < 1000 ? 1 : 97))
+    {
+        if (!lj92_decode(data, cut, decoded, width * height))
+        {
+            printf("Stream cut to %d of %d bytes was decoded\n", cut, size);
+            errors++;
+            break;
+        }
+    }
+
+    /* random damage: decoding may succeed (the data is not checksummed), but must stay inside the buffer */
+    for (int i = 0; i < 20000; i++)
+    {
+        memcpy(damaged, data, size);
+        int count = 1 + rand() % 4;
+        for (int k = 0; k < count; k++)
+        {
+            /* mostly in the headers */
+            damaged[(rand() % 2) ? rand() % 200 : rand() % size] = rand();
+        }
+
+        lj92_info_t info;
+        if (!lj92_read_info(damaged, size, &info))
+        {
+            decoded[max_samples] = 0x1234;
+            lj92_decode(damaged, size, decoded, max_samples);
+            if (decoded[max_samples] != 0x1234)
+            {
+                printf("Damaged stream decoded past the end of the image\n");
+                errors++;
+                break;
+            }
+        }
+    }
+
+    free(decoded);
+    free(damaged);
+    free(data);
+    free(image);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1234);
+    test_round_trip();
+    test_reference_streams();
+    test_damaged_streams();
+
+    return test_result();
+}
@@ -0,0 +1,318 @@
+/*
+ * Host test for the MLV block index (modules/mlv_rec/mlv_index.c, used by mlv_dump and mlv_play).
+ *
+ * Builds the block list of a recording spread over several chunks, the way mlv_rec writes them
+ * (frames alternate between the chunks, a few are out of order, some frame numbers are skipped,
+ * many blocks share their timestamp), adds it to the index chunk by chunk and compares the
+ * result with a reference stable sort. Then checks the frame and timestamp lookups, and that
+ * the XREF block (.IDX file) loads back into the same index.
+ *
+ *   mlv_index_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <raw.h>
+#include "mlv.h"
+#include "mlv_index.h"
+#include "host_test.h"
+
+#define CHUNKS          3
+#define FRAMES          20000
+#define MAX_BLOCKS      (FRAMES * 3)
+
+/* the block headers of one chunk; a block at position n is stored at offset n * BLOCK_SPACING */
+#define BLOCK_SPACING   1000
+
+struct test_block
+{
+    mlv_vidf_hdr_t hdr;         /* large enough for the frame number of VIDF and AUDF */
+    int indexed;                /* not a NULL or BKUP block */
+    int order;                  /* position in the order the blocks are added to the index */
+};
+
+static struct test_block blocks[CHUNKS][MAX_BLOCKS];
+static int block_count[CHUNKS];
+
+static struct test_block * add_block(int chunk, const char * type, uint64_t timestamp, uint32_t frame_number)
+{
+    struct test_block * b = &blocks[chunk][block_count[chunk]++];
+    memset(b, 0, sizeof(*b));
+    memcpy(b->hdr.blockType, type, 4);
+    b->hdr.blockSize = sizeof(mlv_hdr_t);
+    b->hdr.timestamp = timestamp;
+    b->indexed = memcmp(type, "NULL", 4) && memcmp(type, "BKUP", 4);
+
+    if (!memcmp(type, "VIDF", 4) || !memcmp(type, "AUDF", 4))
+    {
+        b->hdr.blockSize = sizeof(mlv_vidf_hdr_t);
+        b->hdr.frameNumber = frame_number;
+    }
+
+    if (!memcmp(type, "MLVI", 4))
+    {
+        /* the file header has the version string where other blocks have the timestamp */
+        memcpy(&b->hdr.timestamp, "v2.0\0\0\0\0", 8);
+    }
+
+    return b;
+}
+
+static void build_recording()
+{
+    uint64_t time = 1000;
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        add_block(chunk, "MLVI", 0, 0);
+    }
+
+    /* the info blocks all share one timestamp */
+    add_block(0, "RAWI", time, 0);
+    add_block(0, "IDNT", time, 0);
+    add_block(0, "EXPO", time, 0);
+    add_block(0, "NULL", time, 0);
+
+    uint32_t frame_number = 0;
+    for (int frame = 0; frame < FRAMES; frame++)
+    {
+        int chunk = frame % CHUNKS;
+        time += 33333 + rand() % 3;
+
+        /* dropped frames leave gaps in the frame numbers */
+        frame_number += (rand() % 50 == 0) ? 2 : 1;
+
+        add_block(chunk, "VIDF", time, frame_number);
+
+        if (frame % 10 == 0)
+        {
+            add_block(chunk, "AUDF", time, frame / 10);
+        }
+
+        if (frame % 100 == 0)
+        {
+            /* same timestamp as the frame */
+            add_block(chunk, "EXPO", time, 0);
+            add_block(chunk, "BKUP", time, 0);
+        }
+
+        if (frame % 7 == 0)
+        {
+            add_block(chunk, "NULL", time, 0);
+        }
+    }
+
+    /* the writer may finish a frame after a later one; swap some neighbours within the chunks */
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        for (int i = 10; i < block_count[chunk] - 1; i += 97)
+        {
+            struct test_block tmp = blocks[chunk][i];
+            blocks[chunk][i] = blocks[chunk][i + 1];
+            blocks[chunk][i + 1] = tmp;
+        }
+    }
+}
+
+static uint64_t index_time(struct test_block * b)
+{
+    return memcmp(b->hdr.blockType, "MLVI", 4) ? b->hdr.timestamp : 0;
+}
+
+/* stable reference order: timestamp, then the order the blocks were added in */
+static int compare_blocks(const void * a, const void * b)
+{
+    struct test_block * x = *(struct test_block **) a;
+    struct test_block * y = *(struct test_block **) b;
+    uint64_t tx = index_time(x);
+    uint64_t ty = index_time(y);
+
+    if (tx != ty)
+    {
+        return tx < ty ? -1 : 1;
+    }
+    return x->order - y->order;
+}
+
+static const mlv_hdr_t * read_block(void * ctx, uint16_t file_number, uint64_t offset)
+{
+    if (file_number >= CHUNKS || offset % BLOCK_SPACING || offset / BLOCK_SPACING >= block_count[file_number])
+    {
+        return NULL;
+    }
+    return (const mlv_hdr_t *) &blocks[file_number][offset / BLOCK_SPACING].hdr;
+}
+
+static struct test_block * entry_block(frame_xref_t * entry)
+{
+    return &blocks[entry->fileNumber][entry->frameOffset / BLOCK_SPACING];
+}
+
+static void check_index(mlv_index_t * index, const char * name)
+{
+    static struct test_block * sorted[CHUNKS * MAX_BLOCKS];
+    uint32_t count = 0;
+    uint32_t vidf_count = 0;
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        for (int i = 0; i < block_count[chunk]; i++)
+        {
+            if (blocks[chunk][i].indexed)
+            {
+                sorted[count++] = &blocks[chunk][i];
+                vidf_count += !memcmp(blocks[chunk][i].hdr.blockType, "VIDF", 4);
+            }
+        }
+    }
+    qsort(sorted, count, sizeof(sorted[0]), compare_blocks);
+
+    if (index->entry_count != count || index->sorted_count != count || index->vidf_count != vidf_count)
+    {
+        printf("%s: %d entries (%d sorted, %d VIDF), expected %d (%d VIDF)\n",
+            name, index->entry_count, index->sorted_count, index->vidf_count, count, vidf_count);
+        errors++;
+        return;
+    }
+
+    uint32_t vidf = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        frame_xref_t * entry = &index->entries[i];
+        struct test_block * b = entry_block(entry);
+        int type = !memcmp(b->hdr.blockType, "VIDF", 4) ? MLV_FRAME_VIDF : !memcmp(b->hdr.blockType, "AUDF", 4) ? MLV_FRAME_AUDF : MLV_FRAME_UNSPECIFIED;
+
+        if (b != sorted[i] || entry->frameTime != index_time(b) || entry->frameType != type
+            || (type != MLV_FRAME_UNSPECIFIED && entry->frameNumber != b->hdr.frameNumber))
+        {
+            printf("%s: entry %d is %.4s at %d:%llu, expected %.4s at time %llu\n", name, i,
+                b->hdr.blockType, entry->fileNumber, (unsigned long long) entry->frameOffset,
+                sorted[i]->hdr.blockType, (unsigned long long) index_time(sorted[i]));
+            errors++;
+            return;
+        }
+
+        if (type == MLV_FRAME_VIDF && index->vidf[vidf++] != i)
+        {
+            printf("%s: VIDF %d is entry %d, expected %d\n", name, vidf - 1, index->vidf[vidf - 1], i);
+            errors++;
+            return;
+        }
+    }
+
+    /* every frame number, including the skipped ones and some past the end */
+    uint32_t last_frame = index->entries[index->vidf[vidf_count - 1]].frameNumber;
+    for (uint32_t frame_number = 0; frame_number < last_frame + 10; frame_number++)
+    {
+        int32_t expected = -1;
+        for (uint32_t v = 0; v < vidf_count; v++)
+        {
+            if (index->entries[index->vidf[v]].frameNumber == frame_number)
+            {
+                expected = index->vidf[v];
+                break;
+            }
+        }
+
+        int32_t found = mlv_index_find_frame(index, frame_number);
+        if (found != expected)
+        {
+            printf("%s: frame %d found at entry %d, expected %d\n", name, frame_number, found, expected);
+            errors++;
+        }
+    }
+
+    /* timestamps at, between, before and after the blocks */
+    for (int i = 0; i < 10000; i++)
+    {
+        uint64_t timestamp = rand() % (index->entries[count - 1].frameTime + 100000);
+        if (i % 2)
+        {
+            timestamp = index->entries[rand() % count].frameTime;
+        }
+
+        int32_t expected = -1;
+        for (uint32_t e = 0; e < count; e++)
+        {
+            if (index->entries[e].frameTime >= timestamp)
+            {
+                expected = e;
+                break;
+            }
+        }
+
+        int32_t found = mlv_index_find_time(index, timestamp);
+        if (found != expected)
+        {
+            printf("%s: time %llu found at entry %d, expected %d\n", name, (unsigned long long) timestamp, found, expected);
+            errors++;
+        }
+    }
+}
+
+/* add the blocks of all chunks; sort after each chunk, or only at the end */
+static void fill_index(mlv_index_t * index, int sort_each_chunk)
+{
+    int order = 0;
+    mlv_index_init(index);
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        for (int i = 0; i < block_count[chunk]; i++)
+        {
+            struct test_block * b = &blocks[chunk][i];
+            if (mlv_index_add(index, (const mlv_hdr_t *) &b->hdr, chunk, (uint64_t) i * BLOCK_SPACING))
+            {
+                printf("mlv_index_add failed\n");
+                exit(1);
+            }
+            b->order = order++;
+        }
+
+        if ((sort_each_chunk || chunk == CHUNKS - 1) && mlv_index_sort(index))
+        {
+            printf("mlv_index_sort failed\n");
+            exit(1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1234);
+    build_recording();
+
+    mlv_index_t index;
+    fill_index(&index, 1);
+    check_index(&index, "sorted per chunk");
+    mlv_index_free(&index);
+
+    fill_index(&index, 0);
+    check_index(&index, "sorted once");
+
+    /* save to XREF and load it back, like mlv_dump with an .IDX file */
+    mlv_xref_hdr_t * xref = mlv_index_get_xref(&index);
+    mlv_index_t loaded;
+    mlv_index_init(&loaded);
+    if (!xref || xref->entryCount != index.entry_count || mlv_index_load_xref(&loaded, xref, read_block, NULL))
+    {
+        printf("Could not load the XREF block\n");
+        return 1;
+    }
+
+    if (loaded.entry_count != index.entry_count || memcmp(loaded.entries, index.entries, index.entry_count * sizeof(frame_xref_t)))
+    {
+        printf("Index loaded from XREF differs\n");
+        errors++;
+    }
+    check_index(&loaded, "loaded from XREF");
+
+    free(xref);
+    mlv_index_free(&loaded);
+    mlv_index_free(&index);
+
+    printf("%d + %d + %d blocks\n", block_count[0], block_count[1], block_count[2]);
+    return test_result();
+}
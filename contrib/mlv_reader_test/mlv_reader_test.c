@@ -0,0 +1,252 @@
+/*
+ * Host test for the memory mapped MLV reader (modules/mlv_rec/mlv_reader.c, used by mlv_dump and raw2dng).
+ *
+ * Writes a recording split into several chunks (test.MLV, test.M00 ...), with blocks of random
+ * size and content, then reads it back through the reader and compares every byte:
+ * sequentially with the cursor functions (read, get, seek, tell, eof), and in random order with
+ * mlv_reader_block. Also checks that ranges past the end of a chunk and truncated blocks are rejected.
+ *
+ * The Makefile builds it twice: with the whole chunks mapped (64 bit hosts), and with a small
+ * sliding window (what 32 bit hosts use), so most blocks need a new mapping or cross the window.
+ *
+ *   mlv_reader_test
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "mlv_reader.h"
+#include "host_test.h"
+
+#define CHUNKS          4       /* test.MLV, test.M00, test.M01 (empty), test.M02 (truncated block at the end) */
+#define MAX_BLOCKS      1000
+
+struct test_block
+{
+    int chunk;
+    uint64_t offset;
+    uint32_t size;
+};
+
+static uint8_t * chunk_data[CHUNKS];
+static uint64_t chunk_size[CHUNKS];
+static struct test_block blocks[MAX_BLOCKS];
+static int block_count = 0;
+
+static const char * chunk_filename(int chunk)
+{
+    static char name[16];
+    if (chunk == 0)
+    {
+        snprintf(name, sizeof(name), "test.MLV");
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "test.M%02d", chunk - 1);
+    }
+    return name;
+}
+
+static void add_block(int chunk, const char * type, uint32_t size)
+{
+    uint8_t * data = chunk_data[chunk] + chunk_size[chunk];
+    mlv_hdr_t hdr;
+
+    memcpy(hdr.blockType, type, 4);
+    hdr.blockSize = size;
+    hdr.timestamp = block_count;
+    memcpy(data, &hdr, sizeof(hdr));
+
+    for (uint32_t i = sizeof(hdr); i < size; i++)
+    {
+        data[i] = rand();
+    }
+
+    blocks[block_count].chunk = chunk;
+    blocks[block_count].offset = chunk_size[chunk];
+    blocks[block_count].size = size;
+    block_count++;
+    chunk_size[chunk] += size;
+}
+
+static void write_chunks()
+{
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        chunk_data[chunk] = malloc(32 << 20);
+        chunk_size[chunk] = 0;
+
+        if (chunk == 2)
+        {
+            /* empty chunks are valid, but have nothing to map */
+            continue;
+        }
+
+        add_block(chunk, "MLVI", sizeof(mlv_file_hdr_t));
+
+        for (int i = 0; i < 150; i++)
+        {
+            /* mostly frames (some of them larger than the test window), with small blocks in between */
+            int frame = rand() % 4;
+            uint32_t size = frame ? 1000 + rand() % 300000 : sizeof(mlv_hdr_t) + rand() % 200;
+            add_block(chunk, frame ? "VIDF" : "NULL", size);
+        }
+    }
+
+    /* a block that claims more than what is left in the file */
+    uint8_t * data = chunk_data[CHUNKS - 1] + chunk_size[CHUNKS - 1];
+    mlv_hdr_t hdr = { "VIDF", 5000, 0 };
+    memcpy(data, &hdr, sizeof(hdr));
+    memset(data + sizeof(hdr), 0x55, 1000);
+    chunk_size[CHUNKS - 1] += sizeof(hdr) + 1000;
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        FILE * f = fopen(chunk_filename(chunk), "wb");
+        if (!f || fwrite(chunk_data[chunk], 1, chunk_size[chunk], f) != chunk_size[chunk])
+        {
+            printf("Could not write %s\n", chunk_filename(chunk));
+            exit(1);
+        }
+        fclose(f);
+    }
+}
+
+static void check(int ok, const char * what, int chunk, uint64_t offset)
+{
+    if (!ok)
+    {
+        printf("%s: chunk %d, offset %llu\n", what, chunk, (unsigned long long) offset);
+        errors++;
+    }
+}
+
+/* walk through every chunk like mlv_dump does: header, then payload or skip */
+static void test_sequential(mlv_reader_t * reader)
+{
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        check(mlv_reader_select(reader, chunk) == 0, "select", chunk, 0);
+
+        int skip = 0;
+        while (1)
+        {
+            uint64_t offset = mlv_reader_tell(reader);
+            mlv_hdr_t hdr;
+
+            if (!mlv_reader_read(reader, &hdr, sizeof(hdr)))
+            {
+                check(mlv_reader_eof(reader), "no EOF after a short read", chunk, offset);
+                check(offset + sizeof(hdr) > chunk_size[chunk], "short read inside the chunk", chunk, offset);
+                break;
+            }
+
+            check(memcmp(&hdr, chunk_data[chunk] + offset, sizeof(hdr)) == 0, "header", chunk, offset);
+
+            if (offset + hdr.blockSize > chunk_size[chunk])
+            {
+                /* the truncated block: its payload must not be there */
+                const void * payload = mlv_reader_get(reader, hdr.blockSize - sizeof(hdr));
+                check(!payload && mlv_reader_eof(reader), "truncated payload", chunk, offset);
+                check(mlv_reader_tell(reader) == chunk_size[chunk], "position after a short read", chunk, offset);
+                break;
+            }
+
+            if (skip++ % 2)
+            {
+                check(mlv_reader_seek(reader, hdr.blockSize - sizeof(hdr), SEEK_CUR) == 0, "seek", chunk, offset);
+            }
+            else
+            {
+                const uint8_t * payload = mlv_reader_get(reader, hdr.blockSize - sizeof(hdr));
+                check(payload && memcmp(payload, chunk_data[chunk] + offset + sizeof(hdr), hdr.blockSize - sizeof(hdr)) == 0, "payload", chunk, offset);
+            }
+
+            check(mlv_reader_tell(reader) == offset + hdr.blockSize, "tell", chunk, offset);
+        }
+
+        /* seek back and read the first header again */
+        check(mlv_reader_seek(reader, -(int64_t) chunk_size[chunk], SEEK_END) == 0, "seek from the end", chunk, 0);
+        check(mlv_reader_seek(reader, -1, SEEK_CUR) != 0, "seek before the start", chunk, 0);
+        if (chunk_size[chunk])
+        {
+            mlv_hdr_t hdr;
+            check(mlv_reader_read(reader, &hdr, sizeof(hdr)) && !mlv_reader_eof(reader), "read after seek", chunk, 0);
+            check(memcmp(&hdr, chunk_data[chunk], sizeof(hdr)) == 0, "header after seek", chunk, 0);
+        }
+    }
+}
+
+/* jump around like the index based frame access (mlv_dump with an .IDX, mlv_play) */
+static void test_random(mlv_reader_t * reader)
+{
+    for (int i = 0; i < 5000; i++)
+    {
+        struct test_block * b = &blocks[rand() % block_count];
+        const mlv_hdr_t * hdr = mlv_reader_block(reader, b->chunk, b->offset);
+        check(hdr && hdr->blockSize == b->size && memcmp(hdr, chunk_data[b->chunk] + b->offset, b->size) == 0, "block", b->chunk, b->offset);
+
+        /* a part of the block, e.g. only the frame header */
+        uint32_t part_offset = rand() % b->size;
+        uint32_t part_size = rand() % (b->size - part_offset + 1);
+        const uint8_t * part = mlv_reader_map(reader, b->chunk, b->offset + part_offset, part_size);
+        check(part && memcmp(part, chunk_data[b->chunk] + b->offset + part_offset, part_size) == 0, "map", b->chunk, b->offset + part_offset);
+    }
+}
+
+static void test_limits(mlv_reader_t * reader)
+{
+    int last = CHUNKS - 1;
+    uint64_t end = chunk_size[last];
+
+    check(mlv_reader_map(reader, last, end - 1, 1) != NULL, "last byte", last, end - 1);
+    check(mlv_reader_map(reader, last, end - 1, 2) == NULL, "range past the end", last, end - 1);
+    check(mlv_reader_map(reader, last, end, 0) == NULL, "empty range at the end", last, end);
+    check(mlv_reader_map(reader, 2, 0, 0) == NULL, "empty chunk", 2, 0);
+    check(mlv_reader_map(reader, CHUNKS, 0, 1) == NULL, "chunk number out of range", CHUNKS, 0);
+    check(mlv_reader_block(reader, last, end - sizeof(mlv_hdr_t) - 1000) == NULL, "truncated block", last, end - sizeof(mlv_hdr_t) - 1000);
+    check(mlv_reader_select(reader, CHUNKS) != 0, "select out of range", CHUNKS, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1234);
+    write_chunks();
+
+    /* one more chunk than there are files: the reader stops at the first missing one */
+    mlv_reader_t * reader = mlv_reader_open(chunk_filename(0), CHUNKS + 1);
+    if (!reader)
+    {
+        printf("Could not open %s\n", chunk_filename(0));
+        return 1;
+    }
+
+    if (mlv_reader_chunk_count(reader) != CHUNKS)
+    {
+        printf("Chunk count: %d, expected %d\n", mlv_reader_chunk_count(reader), CHUNKS);
+        return 1;
+    }
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        if (mlv_reader_chunk_size(reader, chunk) != chunk_size[chunk] || strcmp(mlv_reader_chunk_name(reader, chunk), chunk_filename(chunk)))
+        {
+            printf("Chunk %d: %s, %llu bytes\n", chunk, mlv_reader_chunk_name(reader, chunk), (unsigned long long) mlv_reader_chunk_size(reader, chunk));
+            errors++;
+        }
+    }
+
+    test_sequential(reader);
+    test_random(reader);
+    test_limits(reader);
+    mlv_reader_close(reader);
+
+    for (int chunk = 0; chunk < CHUNKS; chunk++)
+    {
+        remove(chunk_filename(chunk));
+    }
+
+    printf("%d blocks in %d chunks\n", block_count, CHUNKS);
+    return test_result();
+}
@@ -0,0 +1,299 @@
+/*
+ * Host test for the prelinked module cache (src/module_cache.c).
+ *
+ * Links a small fake image the way TCC does (same encoding as relocate_section in tcc/tccelf.c,
+ * same arguments to the relocation hook), saves it to the cache, loads it back at a different
+ * address and checks that ARM and Thumb MOVW/MOVT pairs, absolute pointers, module pointers
+ * and core symbols point to the right places in the moved image. Then checks that a cache
+ * with another key (directory listing) is still used if the files have the same contents,
+ * and not after a module changed.
+ *
+ *   module_cache_test
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "host_test.h"
+
+/* just enough of the camera environment for module_cache.c */
+#define _dryos_h_
+#define _version_h_
+
+#define MAX(a,b)                ((a) > (b) ? (a) : (b))
+#define streq(a,b)              (strcmp(a,b) == 0)
+#define COUNT(x)                ((int)(sizeof(x)/sizeof((x)[0])))
+
+/* module_cache.c stores addresses as 32-bit values: keep everything it sees below 4 GiB */
+static uint8_t * low_pool = NULL;
+static size_t low_used = 0;
+#define LOW_POOL_SIZE           (64 << 20)
+
+static void * low_malloc(size_t size)
+{
+    if (!low_pool)
+    {
+        low_pool = mmap(NULL, LOW_POOL_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+        if (low_pool == MAP_FAILED)
+        {
+            printf("mmap failed\n");
+            exit(1);
+        }
+    }
+
+    size = (size + 15) & ~15;
+    if (low_used + size > LOW_POOL_SIZE)
+    {
+        return NULL;
+    }
+
+    void * p = low_pool + low_used;
+    low_used += size;
+    return p;
+}
+
+static void low_free(void * p)
+{
+}
+
+#define malloc                  low_malloc
+#define free                    low_free
+#define fio_free                low_free
+
+/* the cache file goes to the current directory */
+static const char * cache_filename(const char * filename)
+{
+    const char * slash = strrchr(filename, '/');
+    return slash ? slash + 1 : filename;
+}
+
+#define FIO_CreateFile(f)       fopen(cache_filename(f), "wb")
+#define FIO_WriteFile(f,b,s)    ((int) fwrite(b, 1, s, f))
+#define FIO_CloseFile(f)        fclose(f)
+#define FIO_RemoveFile(f)       remove(cache_filename(f))
+
+static void * read_entire_file(const char * filename, int * size)
+{
+    FILE * f = fopen(cache_filename(filename), "rb");
+    if (!f)
+    {
+        return NULL;
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void * buf = malloc(*size);
+    if (!buf || fread(buf, 1, *size, f) != (size_t) *size)
+    {
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    return buf;
+}
+
+const char build_version[] = "test";
+const char build_id[] = "test";
+const char build_date[] = "test";
+
+#include "../../src/module_cache.c"
+
+#define IMAGE_SIZE              0x1000
+#define OUTSIDE                 0x12345678      /* some address in the core */
+
+#define SYM_FILE                "test.sym"
+#define MODULE_FILE             "test.mo"
+
+static void write_file(const char * filename, const char * contents)
+{
+    FILE * f = fopen(filename, "wb");
+    fputs(contents, f);
+    fclose(f);
+}
+
+static uint32_t saved_key()
+{
+    int size = 0;
+    struct module_cache_header * header = read_entire_file(MODULE_CACHE_FILE, &size);
+    return (header && size >= (int) sizeof(*header)) ? header->key : 0;
+}
+
+/* relocate one location like tcc/tccelf.c (relocate_section), then report it to the hook */
+static void tcc_relocate(uint8_t * image, uint32_t offset, int type, uint32_t val)
+{
+    uint8_t * ptr = image + offset;
+    uint32_t word = read32(ptr);
+    uint32_t v = (type == R_ARM_MOVT_ABS || type == R_ARM_THM_MOVT_ABS) ? val >> 16 : val;
+
+    switch (type)
+    {
+        case R_ARM_MOVW_ABS_NC:
+        case R_ARM_MOVT_ABS:
+            word += ((v >> 12 & 0xf) << 16) | (v & 0xfff);
+            break;
+
+        case R_ARM_THM_MOVW_ABS_NC:
+            word += thumb_mov_imm(v);
+            break;
+
+        case R_ARM_THM_MOVT_ABS:
+            word |= thumb_mov_imm(v);
+            break;
+
+        case R_ARM_ABS32:
+            word += val;
+            break;
+    }
+
+    write32(ptr, word);
+    module_cache_reloc_hook(NULL, (uint32_t) image + offset, type, val);
+}
+
+static uint32_t arm_mov_value(uint32_t word)
+{
+    return ((word >> 16 & 0xF) << 12) | (word & 0xFFF);
+}
+
+static uint32_t thumb_mov_value(uint32_t word)
+{
+    return ((word & 0xF) << 12) | ((word >> 10 & 1) << 11) | ((word >> 28 & 0x7) << 8) | (word >> 16 & 0xFF);
+}
+
+struct test_pair
+{
+    uint32_t offset;            /* MOVW here, MOVT right after */
+    int thumb;
+    uint32_t movw;              /* instructions before relocation (register fields only) */
+    uint32_t movt;
+    int inside;                 /* target inside the image? */
+    uint32_t target;            /* offset from the image start if inside, absolute address otherwise */
+};
+
+static struct test_pair pairs[] = {
+    { 0x00, 0, 0xE3000000, 0xE3400000, 1, 0x8A4 },     /* movw r0 / movt r0 */
+    { 0x08, 0, 0xE3005000, 0xE3405000, 0, OUTSIDE },   /* movw r5 / movt r5 */
+    { 0x10, 1, 0x0100F240, 0x0100F2C0, 1, 0xF12 },     /* movw.w r1 / movt r1 */
+    { 0x18, 1, 0x0700F240, 0x0700F2C0, 0, OUTSIDE },   /* movw.w r7 / movt r7 */
+};
+
+int main(int argc, char *argv[])
+{
+    uint8_t * image = malloc(IMAGE_SIZE);
+    uint32_t base = (uint32_t) image;
+    memset(image, 0, IMAGE_SIZE);
+
+    for (int i = 0; i < COUNT(pairs); i++)
+    {
+        struct test_pair * t = &pairs[i];
+        uint32_t target = t->inside ? base + t->target : t->target;
+        write32(image + t->offset, t->movw);
+        write32(image + t->offset + 4, t->movt);
+        tcc_relocate(image, t->offset,     t->thumb ? R_ARM_THM_MOVW_ABS_NC : R_ARM_MOVW_ABS_NC, target);
+        tcc_relocate(image, t->offset + 4, t->thumb ? R_ARM_THM_MOVT_ABS : R_ARM_MOVT_ABS, target);
+    }
+
+    /* a pointer inside the image, and one to the core */
+    tcc_relocate(image, 0x20, R_ARM_ABS32, base + 0x400);
+    tcc_relocate(image, 0x24, R_ARM_ABS32, OUTSIDE);
+
+    write_file(SYM_FILE, "0xff001234 some_function\n");
+    write_file(MODULE_FILE, "module");
+
+    module_entry_t module;
+    memset(&module, 0, sizeof(module));
+    snprintf(module.name, sizeof(module.name), "test");
+    snprintf(module.long_filename, sizeof(module.long_filename), MODULE_FILE);
+    module.enabled = 1;
+    module.info = (void *)(base + 0x100);
+    module.cbr = (void *)(base + 0x180);
+
+    void * symbols[2] = { (void *)(base + 0x200), (void *) OUTSIDE };
+
+    uint32_t key = 0x12345678;
+    module_cache_save(key, SYM_FILE, image, IMAGE_SIZE, &module, 1, symbols, 2);
+
+    /* move the high half of the addresses, so the MOVT instructions really have to change */
+    malloc(0x123450);
+
+    memset(&module, 0, sizeof(module));
+    snprintf(module.name, sizeof(module.name), "test");
+    snprintf(module.long_filename, sizeof(module.long_filename), MODULE_FILE);
+    module.enabled = 1;
+    symbols[0] = symbols[1] = NULL;
+
+    uint8_t * moved = module_cache_load(key, SYM_FILE, &module, 1, symbols, 2);
+    if (!moved)
+    {
+        printf("Could not load the cache\n");
+        return 1;
+    }
+
+    uint32_t delta = (uint32_t) moved - base;
+    if (!(delta >> 16))
+    {
+        printf("Image did not move far enough (%x)\n", delta);
+        return 1;
+    }
+
+    for (int i = 0; i < COUNT(pairs); i++)
+    {
+        struct test_pair * t = &pairs[i];
+        uint32_t expected = t->inside ? (uint32_t) moved + t->target : t->target;
+        uint32_t movw = read32(moved + t->offset);
+        uint32_t movt = read32(moved + t->offset + 4);
+        uint32_t mask = t->thumb ? ~thumb_mov_imm(0xFFFF) : ~arm_mov_imm(0xFFFF);
+        uint32_t value = t->thumb
+            ? (thumb_mov_value(movt) << 16) | thumb_mov_value(movw)
+            : (arm_mov_value(movt) << 16) | arm_mov_value(movw);
+
+        if (value != expected || (movw & mask) != t->movw || (movt & mask) != t->movt)
+        {
+            printf("%s MOVW/MOVT at %x: %08x %08x loads %x, expected %x\n",
+                t->thumb ? "Thumb" : "ARM", t->offset, movw, movt, value, expected);
+            errors++;
+        }
+    }
+
+    if (read32(moved + 0x20) != (uint32_t) moved + 0x400 || read32(moved + 0x24) != OUTSIDE)
+    {
+        printf("ABS32: %x %x, expected %x %x\n", read32(moved + 0x20), read32(moved + 0x24), (uint32_t) moved + 0x400, OUTSIDE);
+        errors++;
+    }
+
+    if ((uint8_t *) module.info != moved + 0x100 || (uint8_t *) module.cbr != moved + 0x180 || module.config)
+    {
+        printf("Module pointers: %p %p %p\n", module.info, module.cbr, module.config);
+        errors++;
+    }
+
+    if ((uint8_t *) symbols[0] != moved + 0x200 || symbols[1] != (void *) OUTSIDE)
+    {
+        printf("Symbols: %p %p\n", symbols[0], symbols[1]);
+        errors++;
+    }
+
+    /* files copied again (other key), same contents: the cache is used and gets the new key */
+    if (!module_cache_load(key + 1, SYM_FILE, &module, 1, symbols, 2) || saved_key() != key + 1)
+    {
+        printf("Cache not used after the key changed\n");
+        errors++;
+    }
+
+    /* a module changed */
+    write_file(MODULE_FILE, "module, another build");
+    if (module_cache_load(key + 2, SYM_FILE, &module, 1, symbols, 2))
+    {
+        printf("Cache used after a module changed\n");
+        errors++;
+    }
+
+    remove(cache_filename(MODULE_CACHE_FILE));
+    remove(SYM_FILE);
+    remove(MODULE_FILE);
+    printf("Image moved from %x to %x\n", base, (uint32_t) moved);
+    return test_result();
+}
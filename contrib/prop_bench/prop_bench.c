@@ -0,0 +1,325 @@
+/*
+ * Host benchmark for the property handler lookup (src/prop_table.c, used by src/property.c).
+ *
+ * Registers the same handlers as Magic Lantern (plus optional extra ones, like modules would),
+ * then replays a property event trace through the old linear scan and through prop_table,
+ * checks that both call the same handlers in the same order, and prints the time per event.
+ *
+ *   prop_bench [trace.txt | -] [extra_handlers] [repeat]
+ *
+ * Trace: one event per line, the first hex number on each line is the property ID
+ * (e.g. "80050000", "0x80050000", or the "PROP 80050000:    4: ..." lines from prop_dump).
+ * Without a trace, a synthetic one is used: 60 seconds of movie recording at 30 fps
+ * (lens, exposure, focus and level updates on every frame, card and battery now and then).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <time.h>
+#include "property.h"
+#include "prop_table.h"
+
+/* properties with ML handlers (REGISTER_PROP_HANDLER / PROP_HANDLER in src and modules), and how many handlers each */
+static const struct { unsigned property; int count; } ml_handlers[] = {
+    { PROP_AE,                           2 },
+    { PROP_AFPOINT,                      1 },
+    { PROP_AF_MODE,                      1 },
+    { PROP_APERTURE,                     2 },
+    { PROP_APERTURE_AUTO,                2 },
+    { PROP_ARTIST_STRING,                1 },
+    { PROP_BATTERY_HISTORY,              1 },
+    { PROP_BATTERY_REPORT,               1 },
+    { PROP_BODY_ID,                      1 },
+    { PROP_BV,                           2 },
+    { PROP_CAM_MODEL,                    2 },
+    { PROP_CARD_SELECT,                  1 },
+    { PROP_CLUSTER_SIZE_A,               1 },
+    { PROP_CLUSTER_SIZE_B,               1 },
+    { PROP_CLUSTER_SIZE_C,               1 },
+    { PROP_COPYRIGHT_STRING,             1 },
+    { PROP_CUSTOM_WB,                    2 },
+    { PROP_DCIM_DIR_SUFFIX,              1 },
+    { PROP_DIGITAL_ZOOM_RATIO,           1 },
+    { PROP_DISPSENSOR_CTRL,              2 },
+    { PROP_DOF_PREVIEW_MAYBE,            1 },
+    { PROP_DRIVE,                        1 },
+    { PROP_FILE_NUMBER_A,                1 },
+    { PROP_FILE_NUMBER_B,                1 },
+    { PROP_FILE_NUMBER_C,                1 },
+    { PROP_FILE_PREFIX,                  1 },
+    { PROP_FIRMWARE_VER,                 1 },
+    { PROP_FOLDER_NUMBER_A,              1 },
+    { PROP_FOLDER_NUMBER_B,              1 },
+    { PROP_FOLDER_NUMBER_C,              1 },
+    { PROP_FREE_SPACE_A,                 1 },
+    { PROP_FREE_SPACE_B,                 1 },
+    { PROP_FREE_SPACE_C,                 1 },
+    { PROP_GUI_STATE,                    9 },
+    { PROP_HALF_SHUTTER,                 3 },
+    { PROP_HDMI_CHANGE,                  2 },
+    { PROP_HDMI_CHANGE_CODE,             3 },
+    { PROP_ICU_AUTO_POWEROFF,            1 },
+    { PROP_ISO,                          4 },
+    { PROP_ISO_AUTO,                     2 },
+    { PROP_LAST_JOB_STATE,               2 },
+    { PROP_LCD_POSITION,                 2 },
+    { PROP_LENS,                         1 },
+    { PROP_LENS_DYNAMIC_DATA,            1 },
+    { PROP_LENS_NAME,                    1 },
+    { PROP_LENS_STATIC_DATA,             1 },
+    { PROP_LIVE_VIEW_VIEWTYPE,           1 },
+    { PROP_LOGICAL_CONNECT,              1 },
+    { PROP_LV_ACTION,                    7 },
+    { PROP_LV_AFFRAME,                   2 },
+    { PROP_LV_DISPSIZE,                  3 },
+    { PROP_LV_FOCUS_DATA,                1 },
+    { PROP_LV_FOCUS_DONE,                2 },
+    { PROP_LV_LENS,                      2 },
+    { PROP_LV_LENS_D67,                  1 },
+    { PROP_LV_LENS_DRIVE_REMOTE,         1 },
+    { PROP_LV_LENS_STABILIZE,            2 },
+    { PROP_LV_MOVIE_SELECT,              1 },
+    { PROP_LV_OUTPUT_TYPE,               3 },
+    { PROP_MECHA_COUNTER,                1 },
+    { PROP_MIC_INSERTED,                 1 },
+    { PROP_MOVIE_SIZE_50D,               1 },
+    { PROP_MVR_REC_START,                8 },
+    { PROP_PC_FLAVOR1_PARAM,             1 },
+    { PROP_PC_FLAVOR2_PARAM,             1 },
+    { PROP_PC_FLAVOR3_PARAM,             1 },
+    { PROP_PICSTYLE_SETTINGS_AUTO,       1 },
+    { PROP_PICSTYLE_SETTINGS_FAITHFUL,   2 },
+    { PROP_PICSTYLE_SETTINGS_LANDSCAPE,  2 },
+    { PROP_PICSTYLE_SETTINGS_MONOCHROME, 2 },
+    { PROP_PICSTYLE_SETTINGS_NEUTRAL,    2 },
+    { PROP_PICSTYLE_SETTINGS_PORTRAIT,   2 },
+    { PROP_PICSTYLE_SETTINGS_STANDARD,   2 },
+    { PROP_PICSTYLE_SETTINGS_USERDEF1,   2 },
+    { PROP_PICSTYLE_SETTINGS_USERDEF2,   2 },
+    { PROP_PICSTYLE_SETTINGS_USERDEF3,   2 },
+    { PROP_PICTURE_STYLE,                3 },
+    { PROP_REBOOT,                       1 },
+    { PROP_RELEASE_COUNTER,              1 },
+    { PROP_REMOTE_AFSTART_BUTTON,        1 },
+    { PROP_REMOTE_SW1,                   1 },
+    { PROP_REMOTE_SW2,                   1 },
+    { PROP_ROLLING_PITCHING_LEVEL,       2 },
+    { PROP_SHOOTING_MODE,                1 },
+    { PROP_SHOOTING_MODE_2,              1 },
+    { PROP_SHOOTING_TYPE,                3 },
+    { PROP_SHUTDOWN_REASON,              1 },
+    { PROP_SHUTTER,                      2 },
+    { PROP_SHUTTER_AUTO,                 2 },
+    { PROP_SHUTTER_COUNTER,              1 },
+    { PROP_STROBO_AECOMP,                2 },
+    { PROP_TERMINATE_SHUT_REQ,           1 },
+    { PROP_USBRCA_MONITOR,               1 },
+    { PROP_VIDEO_MODE,                   7 },
+    { PROP_WBS_BA,                       2 },
+    { PROP_WBS_GM,                       2 },
+    { PROP_WB_KELVIN_LV,                 2 },
+    { PROP_WB_KELVIN_PH,                 1 },
+    { PROP_WB_MODE_LV,                   2 },
+    { PROP_WB_MODE_PH,                   1 },
+};
+
+/* properties changing on every frame while recording, and a few slower ones */
+static const unsigned movie_props_per_frame[] = {
+    PROP_LV_LENS, PROP_LENS_DYNAMIC_DATA, PROP_LV_FOCUS_DATA, PROP_BV, PROP_AE,
+    PROP_ISO_AUTO, PROP_SHUTTER_AUTO, PROP_APERTURE_AUTO, PROP_ROLLING_PITCHING_LEVEL,
+};
+static const unsigned movie_props_per_second[] = {
+    PROP_FREE_SPACE_A, PROP_BATTERY_REPORT, PROP_LV_LENS_STABILIZE, PROP_MIC_INSERTED,
+};
+
+static struct prop_handler handlers[PROP_TABLE_MAX_HANDLERS];
+static int num_handlers = 0;
+static struct prop_table table;
+
+/* checksum of the handler calls, to compare the two dispatchers */
+static uint32_t calls_hash;
+static int calls;
+
+static void handler_func(unsigned property, void * priv, void * addr, unsigned len)
+{
+    calls_hash = calls_hash * 31 + (uint32_t)(uintptr_t)priv + property;
+    calls++;
+}
+
+static void add_handler(unsigned property)
+{
+    if (num_handlers >= PROP_TABLE_MAX_HANDLERS)
+    {
+        return;
+    }
+    if (prop_table_add(&table, property, num_handlers) < 0)
+    {
+        return;
+    }
+    handlers[num_handlers].property = property;
+    handlers[num_handlers].handler = handler_func;
+    num_handlers++;
+}
+
+/* same as global_property_handler, the way it was before prop_table */
+static void dispatch_linear(unsigned property)
+{
+    for (int entry = 0; entry < num_handlers; entry++)
+    {
+        if (handlers[entry].property == property)
+        {
+            handlers[entry].property_ack = 1;
+            handlers[entry].handler(property, (void*)(uintptr_t)entry, 0, 4);
+        }
+    }
+}
+
+static void dispatch_table(unsigned property)
+{
+    for (int entry = prop_table_first(&table, property); entry >= 0; entry = prop_table_next(&table, entry))
+    {
+        handlers[entry].property_ack = 1;
+        handlers[entry].handler(property, (void*)(uintptr_t)entry, 0, 4);
+    }
+}
+
+static unsigned * load_trace(const char * filename, int * count)
+{
+    FILE * f = fopen(filename, "r");
+    if (!f)
+    {
+        return 0;
+    }
+
+    int size = 1024;
+    unsigned * trace = malloc(size * sizeof(trace[0]));
+    char line[1024];
+    *count = 0;
+
+    while (fgets(line, sizeof(line), f))
+    {
+        /* first hex number on the line */
+        char * p = line;
+        while (*p && !((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'f') || (*p >= 'A' && *p <= 'F')))
+        {
+            p++;
+        }
+        char * end;
+        unsigned property = strtoul(p, &end, 16);
+        if (end == p || (*end && !isspace((unsigned char) *end) && *end != ':'))
+        {
+            continue;
+        }
+
+        if (*count == size)
+        {
+            size *= 2;
+            trace = realloc(trace, size * sizeof(trace[0]));
+        }
+        trace[(*count)++] = property;
+    }
+
+    fclose(f);
+    return trace;
+}
+
+static unsigned * synthetic_trace(int * count)
+{
+    int fps = 30;
+    int seconds = 60;
+    int per_frame = sizeof(movie_props_per_frame) / sizeof(movie_props_per_frame[0]);
+    int per_second = sizeof(movie_props_per_second) / sizeof(movie_props_per_second[0]);
+    unsigned * trace = malloc((fps * per_frame + per_second) * seconds * sizeof(trace[0]));
+    *count = 0;
+
+    for (int s = 0; s < seconds; s++)
+    {
+        for (int i = 0; i < fps * per_frame; i++)
+        {
+            trace[(*count)++] = movie_props_per_frame[i % per_frame];
+        }
+        for (int i = 0; i < per_second; i++)
+        {
+            trace[(*count)++] = movie_props_per_second[i];
+        }
+    }
+    return trace;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double run(void (*dispatch)(unsigned), unsigned * trace, int count, int repeat, uint32_t * hash)
+{
+    calls_hash = 0;
+    calls = 0;
+    double t0 = now();
+    for (int r = 0; r < repeat; r++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            dispatch(trace[i]);
+        }
+    }
+    *hash = calls_hash;
+    return (now() - t0) / ((double) count * repeat) * 1e9;
+}
+
+int main(int argc, char ** argv)
+{
+    int count = 0;
+    unsigned * trace = argc > 1 && strcmp(argv[1], "-") ? load_trace(argv[1], &count) : synthetic_trace(&count);
+    int extra = argc > 2 ? atoi(argv[2]) : 0;
+    int repeat = argc > 3 ? atoi(argv[3]) : 100;
+
+    if (!trace || !count)
+    {
+        printf("Could not read the trace: %s\n", argv[1]);
+        return 1;
+    }
+
+    prop_table_reset(&table);
+    for (unsigned i = 0; i < sizeof(ml_handlers) / sizeof(ml_handlers[0]); i++)
+    {
+        for (int k = 0; k < ml_handlers[i].count; k++)
+        {
+            add_handler(ml_handlers[i].property);
+        }
+    }
+    int ml_count = num_handlers;
+
+    /* modules: more handlers on the busy properties, and some on other (made up) ones */
+    for (int i = 0; i < extra; i++)
+    {
+        add_handler(i % 2 ? movie_props_per_frame[i % 9] : 0x80FF0000 + i);
+    }
+
+    printf("Handlers: %d (%d from ML, %d extra)\n", num_handlers, ml_count, num_handlers - ml_count);
+    printf("Events  : %d x %d\n", count, repeat);
+
+    uint32_t hash_linear, hash_table;
+    double ns_linear = run(dispatch_linear, trace, count, repeat, &hash_linear);
+    int calls_linear = calls;
+    double ns_table = run(dispatch_table, trace, count, repeat, &hash_table);
+
+    printf("Linear  : %8.1f ns/event\n", ns_linear);
+    printf("Table   : %8.1f ns/event\n", ns_table);
+
+    if (hash_linear != hash_table || calls_linear != calls)
+    {
+        printf("Handler calls don't match!\n");
+        return 1;
+    }
+    printf("Handler calls match (%d per run).\n", calls / repeat);
+
+    free(trace);
+    return 0;
+}
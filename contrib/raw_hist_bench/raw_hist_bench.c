@@ -0,0 +1,301 @@
+/*
+ * Host benchmark for the raw histogram percentiles (src/raw_hist.c, used by src/histogram.c).
+ *
+ * Runs the full-resolution green histogram the old way (64K buffer allocated on each call,
+ * one linear walk per percentile) and with a reused raw_hist and its prefix index,
+ * checks that both return the same levels, and prints the time per call.
+ * Then checks progressive sampling (raw_hist_get_percentile_levels_progressive): on a static frame,
+ * speed x speed passes with speed > 1 must give the same levels as one pass at speed 1.
+ *
+ *   raw_hist_bench [raw.buf width height]
+ *
+ * raw.buf: 14-bit raw buffer, as saved by raw_update_params with RAW_DEBUG_DUMP (pitch = width * 14/8).
+ * Without a dump, a synthetic 5D3-sized frame is used (5936 x 3950).
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "raw_hist.h"
+#include "host_test.h"
+
+/* from src/raw.h */
+struct raw_pixblock
+{
+    unsigned int b_hi: 2;
+    unsigned int a: 14;     // even lines: red; odd lines: green
+    unsigned int c_hi: 4;
+    unsigned int b_lo: 12;
+    unsigned int d_hi: 6;
+    unsigned int c_lo: 10;
+    unsigned int e_hi: 8;
+    unsigned int d_lo: 8;
+    unsigned int f_hi: 10;
+    unsigned int e_lo: 6;
+    unsigned int g_hi: 12;
+    unsigned int f_lo: 4;
+    unsigned int h: 14;     // even lines: green; odd lines: blue
+    unsigned int g_lo: 2;
+} __attribute__((packed,aligned(2)));
+
+static void * buffer;
+static int width, height, pitch;
+
+static int get_pixel(int x, int y)
+{
+    struct raw_pixblock * p = (void*)buffer + y * pitch + (x/8)*14;
+    switch (x%8) {
+        case 0: return p->a;
+        case 1: return p->b_lo | (p->b_hi << 12);
+        case 2: return p->c_lo | (p->c_hi << 10);
+        case 3: return p->d_lo | (p->d_hi << 8);
+        case 4: return p->e_lo | (p->e_hi << 6);
+        case 5: return p->f_lo | (p->f_hi << 4);
+        case 6: return p->g_lo | (p->g_hi << 2);
+        case 7: return p->h;
+    }
+    return p->a;
+}
+
+static void set_pixel(int x, int y, int value)
+{
+    struct raw_pixblock * p = (void*)buffer + y * pitch + (x/8)*14;
+    switch (x%8) {
+        case 0: p->a = value; break;
+        case 1: p->b_lo = value; p->b_hi = value >> 12; break;
+        case 2: p->c_lo = value; p->c_hi = value >> 10; break;
+        case 3: p->d_lo = value; p->d_hi = value >> 8; break;
+        case 4: p->e_lo = value; p->e_hi = value >> 6; break;
+        case 5: p->f_lo = value; p->f_hi = value >> 4; break;
+        case 6: p->g_lo = value; p->g_hi = value >> 2; break;
+        case 7: p->h = value; break;
+    }
+}
+
+/* the green pixels, as in raw_hist_sample_full_green (whole frame here) */
+static void fill_full_green(uint32_t * hist)
+{
+    for (struct raw_pixblock * row = buffer; (void*)row < buffer + pitch * (height - 1); row += 2 * width / 8)
+    {
+        struct raw_pixblock * row2 = row + pitch / sizeof(struct raw_pixblock);
+        struct raw_pixblock * p;
+        struct raw_pixblock * q;
+        for (p = row, q = row2; (void*)p < (void*)row + width * 14/8; p++, q++)
+        {
+            hist[p->b_lo | (p->b_hi << 12)]++;
+            hist[p->d_lo | (p->d_hi << 8)]++;
+            hist[p->f_lo | (p->f_hi << 4)]++;
+            hist[p->h]++;
+            hist[q->a]++;
+            hist[q->c_lo | (q->c_hi << 10)]++;
+            hist[q->e_lo | (q->e_hi << 6)]++;
+            hist[q->g_lo | (q->g_hi << 2)]++;
+        }
+    }
+}
+
+/* raw_hist_get_percentile_levels before raw_hist.c */
+static void old_percentiles(const int * percentiles_x10, int * output_raw_values, int n)
+{
+    int* hist = malloc(16384*4);
+    memset(hist, 0, 16384*4);
+
+    fill_full_green((uint32_t *) hist);
+
+    int total = 0;
+    int i;
+    for( i=0 ; i < 16384 ; i++ )
+        total += hist[i];
+
+    for (int k = 0; k < n; k++)
+    {
+        int thr = (uint64_t)total * percentiles_x10[k] / 1000 - 2;  // 50% => median; allow up to 2 stuck pixels
+        int n = 0;
+        int ans = -1;
+
+        for( i=0 ; i < 16384; i++ )
+        {
+            n += hist[i];
+            if (n >= thr)
+            {
+                ans = i;
+                break;
+            }
+        }
+
+        output_raw_values[k] = ans;
+    }
+
+    free(hist);
+}
+
+static void new_percentiles(struct raw_hist * hist, const int * percentiles_x10, int * output_raw_values, int n)
+{
+    raw_hist_clear(hist);
+    fill_full_green(hist->bins);
+    raw_hist_finish(hist);
+    raw_hist_get_percentiles(hist, percentiles_x10, output_raw_values, n);
+}
+
+/* 720x480 LiveView grid mapped on the raw frame, downsampled by speed; as raw_hist_sample_lv */
+static void sample_lv(struct raw_hist * hist, int speed)
+{
+    int dx, dy;
+    raw_hist_grid_offset(speed, hist->passes, &dx, &dy);
+
+    for (int i = dy; i < 480; i += speed)
+    {
+        int y = i * (height - 1) / 480;
+        for (int j = dx; j < 720; j += speed)
+        {
+            int x = j * width / 720;
+            raw_hist_add(hist, get_pixel(x, y));
+        }
+    }
+
+    hist->passes++;
+}
+
+static void synthetic_frame()
+{
+    width = 5936;
+    height = 3950;
+    pitch = width * 14 / 8;
+    buffer = calloc(pitch, height);
+
+    /* dark corner to bright corner, some noise and a few clipped highlights */
+    srand(1);
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int v = 2048 + (x + y) * 12000 / (width + height) + rand() % 200 - 100;
+            if (rand() % 1000 == 0) v = 15000;
+            set_pixel(x, y, v);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4)
+    {
+        width = atoi(argv[2]);
+        height = atoi(argv[3]);
+        pitch = width * 14 / 8;
+        buffer = malloc(pitch * height);
+        FILE * f = fopen(argv[1], "rb");
+        if (!f || fread(buffer, pitch, height, f) != (size_t) height)
+        {
+            printf("Failed to read %d x %d from %s\n", width, height, argv[1]);
+            return 1;
+        }
+        fclose(f);
+    }
+    else if (argc == 1)
+    {
+        synthetic_frame();
+    }
+    else
+    {
+        printf("Usage: %s [raw.buf width height]\n", argv[0]);
+        return 1;
+    }
+
+    /* same percentiles as auto ETTR */
+    int percentiles[13] = {999, 950, 900, 800, 750, 700, 600, 500, 300, 200, 150, 100, 50};
+    int n = sizeof(percentiles) / sizeof(percentiles[0]);
+    int old_levels[13], new_levels[13];
+    int repeat = 10;
+
+    struct raw_hist * hist = malloc(sizeof(struct raw_hist));
+
+    double t0 = test_seconds();
+    for (int r = 0; r < repeat; r++)
+    {
+        old_percentiles(percentiles, old_levels, n);
+    }
+    double t1 = test_seconds();
+    for (int r = 0; r < repeat; r++)
+    {
+        new_percentiles(hist, percentiles, new_levels, n);
+    }
+    double t2 = test_seconds();
+
+    for (int k = 0; k < n; k++)
+    {
+        if (old_levels[k] != new_levels[k])
+        {
+            printf("Percentile %d.%d: %d, expected %d\n", percentiles[k]/10, percentiles[k]%10, new_levels[k], old_levels[k]);
+            errors++;
+        }
+    }
+
+    /* the queries alone: linear walks vs prefix index, every percentile from 0.1% to 100% */
+    int all[1000], levels_idx[1000];
+    for (int k = 0; k < 1000; k++) all[k] = k + 1;
+
+    double t3 = test_seconds();
+    for (int r = 0; r < repeat; r++)
+    {
+        raw_hist_get_percentiles(hist, all, levels_idx, 1000);
+    }
+    double t4 = test_seconds();
+    for (int k = 0; k < 1000; k++)
+    {
+        int thr = (uint64_t)hist->total * all[k] / 1000 - 2;
+        uint32_t acc = 0;
+        int ans = -1;
+        for (int i = 0; i < RAW_HIST_LEVELS; i++)
+        {
+            acc += hist->bins[i];
+            if ((int)acc >= thr) { ans = i; break; }
+        }
+        if (ans != levels_idx[k])
+        {
+            printf("Query %d: %d, expected %d\n", all[k], levels_idx[k], ans);
+            errors++;
+        }
+    }
+    double t5 = test_seconds();
+
+    printf("%d x %d, %d green samples\n", width, height, hist->total);
+    printf("full-res green, %d percentiles: old %.2f ms, new %.2f ms per call\n", n, (t1 - t0) * 1000 / repeat, (t2 - t1) * 1000 / repeat);
+    printf("1000 percentile queries: indexed %.3f ms, linear %.3f ms\n", (t4 - t3) * 1000 / repeat, (t5 - t4) * 1000);
+
+    /* progressive sampling on a static frame */
+    struct raw_hist * ref = malloc(sizeof(struct raw_hist));
+    raw_hist_clear(ref);
+    sample_lv(ref, 1);
+    raw_hist_finish(ref);
+    int ref_levels[13];
+    raw_hist_get_percentiles(ref, percentiles, ref_levels, n);
+
+    for (int speed = 2; speed <= 4; speed++)
+    {
+        raw_hist_clear(hist);
+        double t6 = test_seconds();
+        for (int pass = 0; pass < speed * speed; pass++)
+        {
+            sample_lv(hist, speed);
+            raw_hist_finish(hist);
+            raw_hist_get_percentiles(hist, percentiles, new_levels, n);
+        }
+        double t7 = test_seconds();
+
+        for (int k = 0; k < n; k++)
+        {
+            if (new_levels[k] != ref_levels[k])
+            {
+                printf("Speed %d, percentile %d.%d: %d after %d passes, expected %d\n",
+                    speed, percentiles[k]/10, percentiles[k]%10, new_levels[k], speed * speed, ref_levels[k]);
+                errors++;
+            }
+        }
+        printf("progressive, speed %d: %.3f ms per pass (%d passes to LiveView resolution)\n",
+            speed, (t7 - t6) * 1000 / (speed * speed), speed * speed);
+    }
+
+    return test_result();
+}
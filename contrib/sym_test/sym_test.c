@@ -0,0 +1,323 @@
+/*
+ * Host test for the binary symbol file (src/module_syms.c, build_tools/sym2bin).
+ *
+ * Checks that every symbol resolves to the same address through the binary file
+ * as through the text file, parsed the way the module loader used to parse it
+ * (one tcc_add_symbol call per line; for duplicate names, TCC keeps the first one),
+ * that the names are hashed the way TCC hashes them, that the binary file was made for
+ * this build (test_version.c, linked in here like version.c in autoexec.bin), and that TCC resolves every name to the same address after loading
+ * either file the way the module loader does (tcc_add_symbol per line, or tcc_add_symbols).
+ * Prints the time to load both.
+ *
+ *   sym_test magiclantern.sym 5D3_113.syb
+ *   sym_test --synth 5000 test.sym         (write a synthetic text file, with duplicates and CRLF lines)
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "module_syms.h"
+#include "libtcc.h"
+#include "version.h"
+#include "host_test.h"
+
+struct symbol
+{
+    char name[128];
+    uint32_t address;
+    int order;
+};
+
+static struct symbol * symbols = NULL;
+static int symbol_count = 0;
+static int symbol_alloc = 0;
+
+static void add_symbol(void * ctx, const char * name, uint32_t address)
+{
+    if (symbol_count == symbol_alloc)
+    {
+        symbol_alloc = symbol_alloc ? symbol_alloc * 2 : 1024;
+        symbols = realloc(symbols, symbol_alloc * sizeof(symbols[0]));
+    }
+
+    snprintf(symbols[symbol_count].name, sizeof(symbols[0].name), "%s", name);
+    symbols[symbol_count].address = address;
+    symbols[symbol_count].order = symbol_count;
+    symbol_count++;
+}
+
+/* the text parser from module_load_symbols, before it moved to module_syms.c */
+static int reference_parse(char * buf, uint32_t size)
+{
+    uint32_t pos = 0;
+    int count = 0;
+
+    while(pos < size && buf[pos])
+    {
+        char address_buf[16];
+        char symbol_buf[128];
+        uint32_t length = 0;
+        uint32_t address = 0;
+
+        while (pos + length < size &&
+               buf[pos + length] &&
+               buf[pos + length] != ' ' &&
+               length < sizeof(address_buf) - 1)
+        {
+            address_buf[length] = buf[pos + length];
+            length++;
+        }
+        address_buf[length] = '\000';
+
+        pos += length + 1;
+        length = 0;
+
+        while (pos + length < size &&
+               buf[pos + length] &&
+               buf[pos + length] != '\r' &&
+               buf[pos + length] != '\n' &&
+               length < sizeof(symbol_buf) - 1)
+        {
+            symbol_buf[length] = buf[pos + length];
+            length++;
+        }
+        symbol_buf[length] = '\000';
+
+        pos += length + 1;
+        length = 0;
+
+        while (pos + length < size &&
+               buf[pos + length] &&
+              (buf[pos + length] == '\r' ||
+               buf[pos + length] == '\n'))
+        {
+            pos++;
+        }
+        address = strtoul(address_buf, NULL, 16);
+
+        add_symbol(NULL, symbol_buf, address);
+        count++;
+    }
+
+    return count;
+}
+
+/* elf_hash from tcc/tccelf.c */
+static unsigned long tcc_elf_hash(const unsigned char *name)
+{
+    unsigned long h = 0, g;
+
+    while (*name) {
+        h = (h << 4) + *name++;
+        g = h & 0xf0000000;
+        if (g)
+            h ^= g >> 24;
+        h &= ~g;
+    }
+    return h;
+}
+
+static void tcc_add_symbol_text(void * state, const char * name, uint32_t address)
+{
+    tcc_add_symbol(state, name, (void *)(uintptr_t) address);
+}
+
+static int compare_symbols(const void * a, const void * b)
+{
+    const struct symbol * sa = a;
+    const struct symbol * sb = b;
+    int cmp = strcmp(sa->name, sb->name);
+    return cmp ? cmp : sa->order - sb->order;
+}
+
+static char * read_file(const char * filename, uint32_t * size)
+{
+    FILE * f = fopen(filename, "rb");
+    if (!f)
+    {
+        printf("Failed to open %s\n", filename);
+        exit(1);
+    }
+
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char * buf = malloc(*size + 1);
+    if (fread(buf, 1, *size, f) != *size)
+    {
+        printf("Failed to read %s\n", filename);
+        exit(1);
+    }
+    buf[*size] = 0;
+    fclose(f);
+    return buf;
+}
+
+static int synth(int count, const char * filename)
+{
+    FILE * f = fopen(filename, "wb");
+    if (!f)
+    {
+        printf("Failed to create %s\n", filename);
+        return 1;
+    }
+
+    srand(1234);
+    for (int i = 0; i < count; i++)
+    {
+        /* some names repeat (with another address), some lines end with CRLF */
+        int id = (i % 17 == 0 && i) ? rand() % i : i;
+        fprintf(f, "%08x %s_%d_%x%s", 0xFF000000u + (unsigned) rand() * 4,
+            (rand() % 3) ? "func" : "some_longer_symbol_name", id, id * 7,
+            (i % 5) ? "\n" : "\r\n");
+    }
+    fclose(f);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 4 && strcmp(argv[1], "--synth") == 0)
+    {
+        return synth(atoi(argv[2]), argv[3]);
+    }
+
+    if (argc != 3)
+    {
+        printf("Usage: %s magiclantern.sym file.syb\n", argv[0]);
+        printf("       %s --synth count file.sym\n", argv[0]);
+        return 1;
+    }
+
+    uint32_t text_size, bin_size;
+    char * text = read_file(argv[1], &text_size);
+    char * bin = read_file(argv[2], &bin_size);
+
+    /* the shared parser must see the same lines as the old one */
+    int reference_count = reference_parse(text, text_size);
+    struct symbol * reference = symbols;
+    symbols = NULL; symbol_count = symbol_alloc = 0;
+
+    double t0 = test_seconds();
+    int text_count = module_syms_parse_text(text, text_size, add_symbol, NULL);
+    double t1 = test_seconds();
+
+    if (text_count != reference_count)
+    {
+        printf("Text parser: %d symbols, expected %d\n", text_count, reference_count);
+        errors++;
+    }
+    for (int i = 0; i < text_count && i < reference_count; i++)
+    {
+        if (strcmp(symbols[i].name, reference[i].name) || symbols[i].address != reference[i].address)
+        {
+            printf("Line %d: %x %s, expected %x %s\n", i,
+                symbols[i].address, symbols[i].name, reference[i].address, reference[i].name);
+            errors++;
+        }
+    }
+
+    double t2 = test_seconds();
+    const struct module_syms_header * header = module_syms_check(bin, bin_size);
+    double t3 = test_seconds();
+
+    if (!header)
+    {
+        printf("%s: invalid binary symbol file\n", argv[2]);
+        return 1;
+    }
+
+    if (!module_syms_match(header, build_version, build_id, build_date))
+    {
+        printf("%s was not made for this build (%s %s %s)\n", argv[2], build_version, build_id, build_date);
+        errors++;
+    }
+
+    /* any other build must use the text file */
+    if (module_syms_match(header, build_version, build_id, "1970-01-01 00:00:00 UTC") ||
+        module_syms_match(header, build_version, "", build_date) ||
+        module_syms_match(header, "", build_version, build_date))
+    {
+        printf("%s matches another build\n", argv[2]);
+        errors++;
+    }
+
+    /* load both into TCC, like module_load_symbols */
+    double t4 = test_seconds();
+    TCCState * tcc_text = tcc_new();
+    tcc_set_options(tcc_text, "-nostdlib");
+    module_syms_parse_text(text, text_size, tcc_add_symbol_text, tcc_text);
+    double t5 = test_seconds();
+    TCCState * tcc_bin = tcc_new();
+    tcc_set_options(tcc_bin, "-nostdlib");
+    tcc_add_symbols(tcc_bin, (const TCCSymbol *) module_syms_entries(header), header->count,
+                    module_syms_strings(header), header->strings_size);
+    double t6 = test_seconds();
+
+    /* the text path resolves each name to its first occurrence */
+    qsort(reference, reference_count, sizeof(reference[0]), compare_symbols);
+    int unique = 0;
+    for (int i = 0; i < reference_count; i++)
+    {
+        if (i && strcmp(reference[i].name, reference[i-1].name) == 0)
+        {
+            continue;
+        }
+        unique++;
+
+        uint32_t address = 0;
+        if (!module_syms_find(header, reference[i].name, &address))
+        {
+            printf("%s: not found\n", reference[i].name);
+            errors++;
+        }
+        else if (address != reference[i].address)
+        {
+            printf("%s: %x, expected %x\n", reference[i].name, address, reference[i].address);
+            errors++;
+        }
+
+        uint32_t tcc_text_address = (uintptr_t) tcc_get_symbol(tcc_text, reference[i].name);
+        uint32_t tcc_bin_address = (uintptr_t) tcc_get_symbol(tcc_bin, reference[i].name);
+        if (tcc_text_address != reference[i].address || tcc_bin_address != reference[i].address)
+        {
+            printf("%s: %x (text) / %x (binary) in TCC, expected %x\n", reference[i].name,
+                tcc_text_address, tcc_bin_address, reference[i].address);
+            errors++;
+        }
+    }
+
+    if ((int) header->count != unique)
+    {
+        printf("Binary file: %d symbols, expected %d\n", header->count, unique);
+        errors++;
+    }
+
+    /* hashes as TCC computes them, names sorted (no duplicates) */
+    const struct module_syms_entry * entries = module_syms_entries(header);
+    const char * strings = module_syms_strings(header);
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        const char * name = strings + entries[i].name;
+        if (entries[i].hash != tcc_elf_hash((const unsigned char *) name))
+        {
+            printf("%s: wrong hash\n", name);
+            errors++;
+        }
+        if (i && strcmp(strings + entries[i-1].name, name) >= 0)
+        {
+            printf("%s: not sorted\n", name);
+            errors++;
+        }
+    }
+
+    printf("%d lines, %d symbols\n", text_count, unique);
+    printf("text:   %6d bytes, parsed in %.3f ms, loaded into TCC in %.3f ms\n", text_size, (t1 - t0) * 1000, (t5 - t4) * 1000);
+    printf("binary: %6d bytes, checked in %.3f ms, loaded into TCC in %.3f ms\n", bin_size, (t3 - t2) * 1000, (t6 - t5) * 1000);
+
+    tcc_delete(tcc_text);
+    tcc_delete(tcc_bin);
+
+    return test_result();
+}
@@ -0,0 +1,73 @@
+/*
+ * Host versions of the functions libtcc gets from ML (src/mem.h, src/tcc-glue.c),
+ * so sym_test can load the symbols into the same TCC as the camera.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "tcc_host.h"
+
+/* one big arena, like the camera heap: tcc_realloc copies the new size from the old block,
+ * which would run past the end of a smaller host malloc block. Nothing is freed; sym_test is short-lived. */
+#define ARENA_SIZE (1ul << 30)
+static char * arena = NULL;
+static size_t arena_used = 0;
+
+void * __mem_malloc(size_t len, unsigned int flags, const char * file, unsigned int line)
+{
+    if (!arena)
+    {
+        arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (arena == MAP_FAILED)
+        {
+            printf("mmap failed\n");
+            exit(1);
+        }
+    }
+
+    len = (len + 15) & ~15;
+    if (arena_used + len > ARENA_SIZE / 2)
+    {
+        return NULL;
+    }
+
+    void * p = arena + arena_used;
+    arena_used += len;
+    return p;
+}
+
+void __mem_free(void * buf)
+{
+}
+
+void _tcc_exit(int code)
+{
+    exit(code);
+}
+
+int _tcc_open(const char * pathname, int flags)
+{
+    return open(pathname, flags);
+}
+
+int _tcc_read(int fd, void * buf, int size)
+{
+    return read(fd, buf, size);
+}
+
+int _tcc_close(int fd)
+{
+    return close(fd);
+}
+
+int _tcc_lseek(int fd, int offset, int whence)
+{
+    return lseek(fd, offset, whence);
+}
+
+void dlclose(void * p)
+{
+}
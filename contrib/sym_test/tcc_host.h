@@ -0,0 +1,9 @@
+/*
+ * Declarations libtcc expects from ML (implemented in tcc_host.c).
+ * The camera build goes without them, but on a 64-bit host __mem_malloc must return a pointer, not an int.
+ */
+
+#include <stddef.h>
+
+void * __mem_malloc(size_t len, unsigned int flags, const char * file, unsigned int line);
+void __mem_free(void * buf);
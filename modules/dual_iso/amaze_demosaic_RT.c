@@ -32,6 +32,9 @@
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "amaze-port.c"
 
@@ -41,13 +44,18 @@ void amaze_demosaic_RT(
     float** green,      /* the interpolated green plane */
     float** blue,       /* the interpolated blue plane */
     int winx, int winy, /* crop window for demosaicing */
-    int winw, int winh
+    int winw, int winh,
+    int threads         /* number of OpenMP threads; 0 = one per core */
 )
 {
+#ifdef _OPENMP
+    if (threads <= 0) threads = omp_get_num_procs();
+    printf ("AMaZE interpolation (%d thread%s) ...\n", threads, threads == 1 ? "" : "s");
+    double t1 = omp_get_wtime();
+#else
     printf ("AMaZE interpolation ...\n");
-
-    clock_t	t1,t2;
-    t1 = clock();
+    clock_t t1 = clock();
+#endif
 
 #define HCLIP(x) x //is this still necessary???
 	//min(clip_pt,x)
@@ -100,7 +108,19 @@ void amaze_demosaic_RT(
 		float v;
 	};
 
-//~ #pragma omp parallel
+	//determine GRBG coset; (ey,ex) is the offset of the R subarray
+	//done before the parallel section, so the threads only read it
+	if (FC(0,0)==1) {//first pixel is G
+		if (FC(0,1)==0) {ey=0; ex=1;} else {ey=1; ex=0;}
+	} else {//first pixel is R or B
+		if (FC(0,0)==0) {ey=0; ex=0;} else {ey=1; ex=1;}
+	}
+
+// each thread allocates its own tile buffer; tiles overlap by 16 pixels,
+// but each one only writes its interior to red/green/blue, so the output writes don't overlap
+#ifdef _OPENMP
+#pragma omp parallel num_threads(threads)
+#endif
 {
 	//position of top/left corner of the tile
 	int top, left;
@@ -166,7 +186,8 @@ void amaze_demosaic_RT(
 
 #define CLF 1
 	// assign working space
-	buffer = (char *) calloc(22*sizeof(float)*TS*TS + sizeof(char)*TS*TSH+23*CLF*64 + 63, 1);
+	size_t buffer_size = 22*sizeof(float)*TS*TS + sizeof(char)*TS*TSH+23*CLF*64 + 63;
+	buffer = (char *) calloc(buffer_size, 1);
 	char 	*data;
 	data = (char*)( ( (uintptr_t)buffer + (uintptr_t)63) / 64 * 64);
 
@@ -200,20 +221,13 @@ void amaze_demosaic_RT(
 	// %%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%%
 
 
-	//determine GRBG coset; (ey,ex) is the offset of the R subarray
-	if (FC(0,0)==1) {//first pixel is G
-		if (FC(0,1)==0) {ey=0; ex=1;} else {ey=1; ex=0;}
-	} else {//first pixel is R or B
-		if (FC(0,0)==0) {ey=0; ex=0;} else {ey=1; ex=1;}
-	}
-
 	// Main algorithm: Tile loop
-	//#pragma omp parallel for shared(rawData,height,width,red,green,blue) private(top,left) schedule(dynamic)
-	//code is openmp ready; just have to pull local tile variable declarations inside the tile loop
 
 // Issue 1676
 // use collapse(2) to collapse the 2 loops to one large loop, so there is better scaling
-//~ #pragma omp for schedule(dynamic) collapse(2) nowait
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic) collapse(2) nowait
+#endif
 	for (top=winy-16; top < winy+height; top += TS-32)
 		for (left=winx-16; left < winx+width; left += TS-32) {
 			memset(nyquist, 0, sizeof(char)*TS*TSH);
@@ -227,6 +241,11 @@ void amaze_demosaic_RT(
 			//tile height (=TS except for bottom edge of image)
 			int cc1 = right - left;
 
+			//tiles at the bottom/right edge don't fill the whole buffer, but the vector loops read past the filled area;
+			//clear it, so the result does not depend on which tile this thread has processed before
+			if (rr1 < TS || cc1 < TS)
+				memset(buffer, 0, buffer_size);
+
 			//tile vars
 			//counters for pixel location in the image
 			int row, col;
@@ -1406,7 +1425,10 @@ void amaze_demosaic_RT(
 
 #undef TS
 
-t2 = clock() - t1;
-printf("Amaze took %.2f s\n", (double)t2 / CLOCKS_PER_SEC);
+#ifdef _OPENMP
+printf("Amaze took %.2f s\n", omp_get_wtime() - t1);
+#else
+printf("Amaze took %.2f s\n", (double)(clock() - t1) / CLOCKS_PER_SEC);
+#endif
 
 }
@@ -1,74 +1,214 @@
-#ifdef CHROMA_SMOOTH_2X2
-#define CHROMA_SMOOTH_FUNC chroma_smooth_2x2
-#define CHROMA_SMOOTH_MAX_IJ 2
-#define CHROMA_SMOOTH_FILTER_SIZE 5
-#define CHROMA_SMOOTH_MEDIAN opt_med5
-#elif defined(CHROMA_SMOOTH_3X3)
-#define CHROMA_SMOOTH_FUNC chroma_smooth_3x3
-#define CHROMA_SMOOTH_MAX_IJ 2
-#define CHROMA_SMOOTH_FILTER_SIZE 9
-#define CHROMA_SMOOTH_MEDIAN opt_med9
-#else
-#define CHROMA_SMOOTH_FUNC chroma_smooth_5x5
-#define CHROMA_SMOOTH_MAX_IJ 4
-#define CHROMA_SMOOTH_FILTER_SIZE 25
-#define CHROMA_SMOOTH_MEDIAN opt_med25
+/*
+ * Chroma smoothing for Bayer (RGGB) images (see chroma_smooth.h)
+ *
+ * Each cell is converted to EV once (green level, red - green, blue - green) into a sliding
+ * window of cell rows; the medians are then taken from that window, PIXELVALUE_LANES cells
+ * at a time, with the vectorized sorting networks from optmed.h. Same results as the old
+ * per-pixel version, which looked up all 25 (5x5) neighbour cells again for every cell.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "chroma_smooth.h"
+#include "optmed.h"
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#endif
+#ifndef ABS
+#define ABS(a) ((a) > 0 ? (a) : -(a))
 #endif
+#ifndef COERCE
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+#endif
+
+/* cell rows in the window: cy-2 ... cy+2 for 5x5 */
+#define WINDOW_ROWS 5
+#define MAX_FILTER_SIZE 25
+
+/* EV of the cell at row cy: mean of the two greens, red and blue relative to it */
+static void cell_row_fill(const uint32_t * inp, int w, int cy, int cells, const int * raw2ev, int * ge, int * dr, int * db)
+{
+    const uint32_t * row0 = inp + 2 * cy * w;
+    const uint32_t * row1 = row0 + w;
 
-static void CHROMA_SMOOTH_FUNC(uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw)
+    for (int cx = 0; cx < cells; cx++)
+    {
+        int g1 = row0[2*cx + 1];
+        int g2 = row1[2*cx];
+        int g = (raw2ev[g1] + raw2ev[g2]) / 2;
+        ge[cx] = g;
+        dr[cx] = raw2ev[row0[2*cx]] - g;
+        db[cx] = raw2ev[row1[2*cx + 1]] - g;
+    }
+}
+
+static inline void median_v(pixelvalue_v * p, int n)
 {
-    int w = raw_info.width;
-    int h = raw_info.height;
-    int x,y;
+    switch (n)
+    {
+        case 5:  opt_med5_v(p);  break;
+        case 9:  opt_med9_v(p);  break;
+        case 25: opt_med25_v(p); break;
+    }
+}
+
+static inline int median(int * p, int n)
+{
+    switch (n)
+    {
+        case 5:  return opt_med5(p);
+        case 9:  return opt_med9(p);
+        default: return opt_med25(p);
+    }
+}
+
+/* replace red and blue of cell (cx, cy), given the median differences */
+static inline void cell_write(uint32_t * out, int w, int cx, int cy, int ge, int dr, int db, const int * ev2raw, int ev_resolution)
+{
+    /* looks ugly in darkness */
+    if (ge < 2*ev_resolution) return;
+
+    if (ge + dr <= ev_resolution) return;
+    if (ge + db <= ev_resolution) return;
+
+    int x = 2 * cx;
+    int y = 2 * cy;
+    out[x   +     y * w] = ev2raw[COERCE(ge + dr, 0, 14*ev_resolution-1)];
+    out[x+1 + (y+1) * w] = ev2raw[COERCE(ge + db, 0, 14*ev_resolution-1)];
+}
+
+int chroma_smooth_run(int method, int w, int h, const uint32_t * inp, uint32_t * out, const int * raw2ev, const int * ev2raw, int ev_resolution, struct chroma_smooth_work * work)
+{
+    /* neighbour cells: offsets in cells, from -radius to +radius */
+    int radius;
+    int cross;
+    switch (method)
+    {
+        case 2: radius = 1; cross = 1; break;   /* 5 cells: the corners are skipped */
+        case 3: radius = 1; cross = 0; break;   /* 9 cells */
+        case 5: radius = 2; cross = 0; break;   /* 25 cells */
+        default: return 0;
+    }
+
+    /* same borders as before: pixels 4 ... w-5 and 4 ... h-6 */
+    int cells = w / 2;
+    int cx0 = 2, cx1 = (w - 3) / 2;
+    int cy0 = 2, cy1 = (h - 4) / 2;
+    cx1 = MIN(cx1, cells - radius);     /* odd widths: the last neighbours must be whole cells */
+    if (cx1 <= cx0 || cy1 <= cy0)
+    {
+        return 0;
+    }
+
+    struct chroma_smooth_work local = { 0, NULL };
+    if (!work)
+    {
+        work = &local;
+    }
+    if (work->cells < cells)
+    {
+        free(work->buf);
+        work->buf = malloc(cells * WINDOW_ROWS * 3 * sizeof(int));
+        work->cells = work->buf ? cells : 0;
+        if (!work->buf)
+        {
+            return -1;
+        }
+    }
 
-    for (y = 4; y < h-5; y += 2)
+    int * ge[WINDOW_ROWS];
+    int * dr[WINDOW_ROWS];
+    int * db[WINDOW_ROWS];
+    for (int i = 0; i < WINDOW_ROWS; i++)
     {
-        for (x = 4; x < w-4; x += 2)
+        ge[i] = work->buf + (3*i + 0) * cells;
+        dr[i] = work->buf + (3*i + 1) * cells;
+        db[i] = work->buf + (3*i + 2) * cells;
+    }
+
+    /* the input rows of a cell are only read before any output in (or above) that cell is written, so out may be inp */
+    int next = cy0 - radius;
+    for (int cy = cy0; cy < cy1; cy++)
+    {
+        for (; next <= cy + radius; next++)
+        {
+            int s = next % WINDOW_ROWS;
+            cell_row_fill(inp, w, next, cells, raw2ev, ge[s], dr[s], db[s]);
+        }
+
+        /* where to find each neighbour of cell cx: r_src[k][cx], b_src[k][cx] */
+        const int * r_src[MAX_FILTER_SIZE];
+        const int * b_src[MAX_FILTER_SIZE];
+        int n = 0;
+        for (int di = -radius; di <= radius; di++)
         {
-            int g1 = inp[x+1 +     y * w];
-            int g2 = inp[x   + (y+1) * w];
-            int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
-            
-            /* looks ugly in darkness */
-            if (ge < 2*EV_RESOLUTION) continue;
-
-            int i,j;
-            int k = 0;
-            int med_r[CHROMA_SMOOTH_FILTER_SIZE];
-            int med_b[CHROMA_SMOOTH_FILTER_SIZE];
-            for (i = -CHROMA_SMOOTH_MAX_IJ; i <= CHROMA_SMOOTH_MAX_IJ; i += 2)
+            for (int dj = -radius; dj <= radius; dj++)
             {
-                for (j = -CHROMA_SMOOTH_MAX_IJ; j <= CHROMA_SMOOTH_MAX_IJ; j += 2)
+                if (cross && ABS(di) + ABS(dj) == 2)
                 {
-                    #ifdef CHROMA_SMOOTH_2X2
-                    if (ABS(i) + ABS(j) == 4)
-                        continue;
-                    #endif
-                    
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int g1 = inp[x+i+1 +   (y+j) * w];
-                    int g2 = inp[x+i   + (y+j+1) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                    
-                    int ge = (raw2ev[g1] + raw2ev[g2]) / 2;
-                    med_r[k] = raw2ev[r] - ge;
-                    med_b[k] = raw2ev[b] - ge;
-                    k++;
+                    continue;
                 }
+                int s = (cy + dj) % WINDOW_ROWS;
+                r_src[n] = dr[s] + di;
+                b_src[n] = db[s] + di;
+                n++;
             }
-            int dr = CHROMA_SMOOTH_MEDIAN(med_r);
-            int db = CHROMA_SMOOTH_MEDIAN(med_b);
+        }
+        const int * ge_row = ge[cy % WINDOW_ROWS];
 
-            if (ge + dr <= EV_RESOLUTION) continue;
-            if (ge + db <= EV_RESOLUTION) continue;
+        /* PIXELVALUE_LANES cells at once */
+        int cx = cx0;
+        for (; cx + PIXELVALUE_LANES <= cx1; cx += PIXELVALUE_LANES)
+        {
+            pixelvalue_v med_r[MAX_FILTER_SIZE];
+            pixelvalue_v med_b[MAX_FILTER_SIZE];
+            for (int k = 0; k < n; k++)
+            {
+                memcpy(&med_r[k], r_src[k] + cx, sizeof(pixelvalue_v));
+                memcpy(&med_b[k], b_src[k] + cx, sizeof(pixelvalue_v));
+            }
+            median_v(med_r, n);
+            median_v(med_b, n);
 
-            out[x   +     y * w] = ev2raw[COERCE(ge + dr, 0, 14*EV_RESOLUTION-1)];
-            out[x+1 + (y+1) * w] = ev2raw[COERCE(ge + db, 0, 14*EV_RESOLUTION-1)];
+            int lanes_r[PIXELVALUE_LANES];
+            int lanes_b[PIXELVALUE_LANES];
+            memcpy(lanes_r, &med_r[n/2], sizeof(lanes_r));
+            memcpy(lanes_b, &med_b[n/2], sizeof(lanes_b));
+            for (int l = 0; l < PIXELVALUE_LANES; l++)
+            {
+                cell_write(out, w, cx + l, cy, ge_row[cx + l], lanes_r[l], lanes_b[l], ev2raw, ev_resolution);
+            }
         }
+
+        /* leftover cells at the end of the row */
+        for (; cx < cx1; cx++)
+        {
+            int med_r[MAX_FILTER_SIZE];
+            int med_b[MAX_FILTER_SIZE];
+            for (int k = 0; k < n; k++)
+            {
+                med_r[k] = r_src[k][cx];
+                med_b[k] = b_src[k][cx];
+            }
+            cell_write(out, w, cx, cy, ge_row[cx], median(med_r, n), median(med_b, n), ev2raw, ev_resolution);
+        }
+    }
+
+    if (work == &local)
+    {
+        chroma_smooth_work_free(&local);
     }
+
+    return 0;
 }
 
-#undef CHROMA_SMOOTH_FUNC
-#undef CHROMA_SMOOTH_MAX_IJ
-#undef CHROMA_SMOOTH_FILTER_SIZE
-#undef CHROMA_SMOOTH_MEDIAN
+void chroma_smooth_work_free(struct chroma_smooth_work * work)
+{
+    free(work->buf);
+    work->buf = NULL;
+    work->cells = 0;
+}
@@ -0,0 +1,39 @@
+/*
+ * Chroma smoothing for Bayer (RGGB) images, shared by cr2hdr, mlv_dump and raw2dng.
+ *
+ * For every RG/GB cell, red and blue are replaced by the green level of the cell
+ * plus the median red-green and blue-green difference (in EV) of the cells around it:
+ * 2x2 = the cell and its 4 direct neighbours, 3x3 and 5x5 = full square of cells.
+ * Dark and overexposed-looking cells are left alone.
+ */
+
+#ifndef _chroma_smooth_h_
+#define _chroma_smooth_h_
+
+#include <stdint.h>
+
+/**
+ * Scratch buffers: a sliding window of a few rows of cells (EV of green, red - green, blue - green),
+ * so the working set stays in cache whatever the image size. Grown on demand and kept between calls,
+ * so a workspace reused for every frame does not allocate anything after the first one.
+ * Start with all fields zero; one workspace per thread.
+ */
+struct chroma_smooth_work
+{
+    int cells;                  /* cells per row the buffers can hold */
+    int * buf;
+};
+
+/**
+ * method: 2 (2x2), 3 (3x3) or 5 (5x5); anything else does nothing.
+ * inp, out: w x h pixels; only the filtered red and blue pixels are written to out,
+ * so out must start as a copy of inp (or be inp itself: filtering in place is fine).
+ * raw2ev: raw level -> EV * ev_resolution; ev2raw: EV * ev_resolution -> raw level, valid from 0 to 14 EV.
+ * work: reusable scratch buffers, or NULL to allocate them for this call only.
+ * Returns 0, or -1 if the scratch buffers could not be allocated (image left untouched).
+ */
+int chroma_smooth_run(int method, int w, int h, const uint32_t * inp, uint32_t * out, const int * raw2ev, const int * ev2raw, int ev_resolution, struct chroma_smooth_work * work);
+
+void chroma_smooth_work_free(struct chroma_smooth_work * work);
+
+#endif
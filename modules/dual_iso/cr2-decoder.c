@@ -0,0 +1,397 @@
+/**
+ * Native CR2 decoder, replaces the dcraw round trip (dcraw -4 -E -c, PGM on a pipe).
+ *
+ * CR2 is a TIFF file; the fourth IFD holds the raw data as lossless JPEG,
+ * which may be split into vertical slices (tag 0xC640).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cr2-decoder.h"
+#include "../mlv_rec/lj92.h"
+#include "../../src/chdk-dng.h"
+
+/** Compute the number of entries in a static array */
+#define COUNT(x)        ((int)(sizeof(x)/sizeof((x)[0])))
+
+#define TIFF_ASCII  2
+#define TIFF_SHORT  3
+#define TIFF_LONG   4
+#define TIFF_BYTE   1
+
+// Borders around the active area, copied from dcraw.c (identify, canon[][])
+// Update as needed :)
+static const struct {
+    unsigned short raw_width, raw_height;
+    unsigned short left, top, right, bottom;
+} canon_margins[] = {
+    { 1944, 1416,   0,  0, 48,  0 },
+    { 2144, 1560,   4,  8, 52,  2 },
+    { 2224, 1456,  48,  6,  0,  2 },
+    { 2376, 1728,  12,  6, 52,  2 },
+    { 2672, 1968,  12,  6, 44,  2 },
+    { 3152, 2068,  64, 12,  0,  0 },
+    { 3160, 2344,  44, 12,  4,  4 },
+    { 3344, 2484,   4,  6, 52,  6 },
+    { 3516, 2328,  42, 14,  0,  0 },
+    { 3596, 2360,  74, 12,  0,  0 },
+    { 3744, 2784,  52, 12,  8, 12 },
+    { 3944, 2622,  30, 18,  6,  2 },
+    { 3948, 2622,  42, 18,  0,  2 },
+    { 3984, 2622,  76, 20,  0,  2 },
+    { 4104, 3048,  48, 12, 24, 12 },
+    { 4116, 2178,   4,  2,  0,  0 },
+    { 4152, 2772, 192, 12,  0,  0 },
+    { 4160, 3124, 104, 11,  8, 65 },
+    { 4176, 3062,  96, 17,  8,  0 },
+    { 4192, 3062,  96, 17, 24,  0 },
+    { 4312, 2876,  22, 18,  0,  2 },
+    { 4352, 2874,  62, 18,  0,  0 },    /* 1100D */
+    { 4476, 2954,  90, 34,  0,  0 },
+    { 4480, 3348,  12, 10, 36, 12 },
+    { 4480, 3366,  80, 50,  0,  0 },
+    { 4496, 3366,  80, 50, 12,  0 },
+    { 4768, 3516,  96, 16,  0,  0 },
+    { 4832, 3204,  62, 26,  0,  0 },    /* 500D */
+    { 4832, 3228,  62, 51,  0,  0 },    /* 50D */
+    { 5108, 3349,  98, 13,  0,  0 },
+    { 5120, 3318, 142, 45, 62,  0 },
+    { 5280, 3528,  72, 52,  0,  0 },    /* 650D, 700D, 100D, EOS M */
+    { 5344, 3516, 142, 51,  0,  0 },    /* 7D, 60D, 550D, 600D */
+    { 5344, 3584, 126,100,  0,  2 },
+    { 5360, 3516, 158, 51,  0,  0 },
+    { 5568, 3708,  72, 38,  0,  0 },    /* 6D, 70D */
+    { 5632, 3710,  96, 17,  0,  0 },
+    { 5712, 3774,  62, 20, 10,  2 },
+    { 5792, 3804, 158, 51,  0,  0 },    /* 5D Mark II */
+    { 5920, 3950, 122, 80,  2,  0 },    /* 5D Mark III */
+    { 6096, 4056,  72, 34,  0,  0 },
+    { 6288, 4056, 264, 34,  0,  0 },
+    { 8896, 5920, 160, 64,  0,  0 },
+};
+
+struct cr2_file
+{
+    uint8_t* data;
+    uint32_t size;
+};
+
+static int get2(struct cr2_file* f, uint32_t offset)
+{
+    if (f->size < 2 || offset > f->size - 2) return 0;
+    return f->data[offset] | (f->data[offset+1] << 8);
+}
+
+static uint32_t get4(struct cr2_file* f, uint32_t offset)
+{
+    if (f->size < 4 || offset > f->size - 4) return 0;
+    return f->data[offset] | (f->data[offset+1] << 8) | (f->data[offset+2] << 16) | ((uint32_t)f->data[offset+3] << 24);
+}
+
+/* value of a SHORT or LONG tag; values that don't fit into the entry itself are not supported */
+static uint32_t ifd_value(struct cr2_file* f, uint32_t entry)
+{
+    int type = get2(f, entry + 2);
+    return type == TIFF_SHORT ? (uint32_t) get2(f, entry + 8) : get4(f, entry + 8);
+}
+
+/* offset of the IFD entry with the given tag, 0 if there is none */
+static uint32_t ifd_find(struct cr2_file* f, uint32_t ifd, int tag)
+{
+    int count = get2(f, ifd);
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t entry = ifd + 2 + i * 12;
+        if (f->size < 12 || entry > f->size - 12) break;
+        if (get2(f, entry) == tag) return entry;
+    }
+    return 0;
+}
+
+static int read_file(const char* filename, struct cr2_file* f)
+{
+    FILE* fp = fopen(filename, "rb");
+    if (!fp) return 0;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+
+    f->data = size > 16 ? malloc(size) : 0;
+    f->size = size;
+    int ok = f->data && fread(f->data, 1, size, fp) == (size_t) size;
+    fclose(fp);
+
+    if (!ok)
+    {
+        free(f->data);
+        f->data = 0;
+    }
+    return ok;
+}
+
+static void read_model(struct cr2_file* f, uint32_t ifd0, char* model, int model_size)
+{
+    model[0] = 0;
+
+    uint32_t entry = ifd_find(f, ifd0, 0x110);
+    if (!entry || get2(f, entry + 2) != TIFF_ASCII) return;
+
+    uint32_t count = get4(f, entry + 4);
+    uint32_t offset = count > 4 ? get4(f, entry + 8) : entry + 8;
+    if (count == 0 || offset >= f->size || count > f->size - offset) return;
+
+    /* same as get_camera_model: "Canon EOS 5D Mark III" -> "EOS 5D Mark III" */
+    const char* s = (const char*) f->data + offset;
+    int len = strnlen(s, count);
+    if (len > 6 && strncmp(s, "Canon ", 6) == 0)
+    {
+        s += 6;
+        len -= 6;
+    }
+    while (len > 0 && s[len-1] == ' ') len--;
+    len = len < model_size - 1 ? len : model_size - 1;
+    memcpy(model, s, len);
+    model[len] = 0;
+}
+
+int cr2_read_raw(const char* filename, struct cr2_raw* raw)
+{
+    struct cr2_file f;
+    uint16_t* image = 0;
+    int ok = 0;
+
+    memset(raw, 0, sizeof(*raw));
+
+    if (!read_file(filename, &f))
+        return 0;
+
+    /* little endian TIFF with "CR" signature */
+    if (memcmp(f.data, "II*\0", 4) != 0 || memcmp(f.data + 8, "CR", 2) != 0)
+        goto end;
+
+    read_model(&f, get4(&f, 4), raw->model, sizeof(raw->model));
+
+    /* the header points to the raw IFD */
+    uint32_t raw_ifd = get4(&f, 12);
+    uint32_t strip_offset = ifd_find(&f, raw_ifd, 0x111);
+    uint32_t strip_size = ifd_find(&f, raw_ifd, 0x117);
+    uint32_t slice_tag = ifd_find(&f, raw_ifd, 0xC640);
+    if (!strip_offset || !strip_size)
+        goto end;
+
+    strip_offset = ifd_value(&f, strip_offset);
+    strip_size = ifd_value(&f, strip_size);
+    if (strip_offset >= f.size || strip_size > f.size - strip_offset)
+        goto end;
+
+    const uint8_t* jpeg = f.data + strip_offset;
+    lj92_info_t info;
+    if (lj92_read_info(jpeg, strip_size, &info))
+        goto end;
+
+    /* raw size, same rules as dcraw (parse_tiff_ifd) */
+    int raw_width = info.width;
+    int raw_height = info.height;
+    if (raw_width > 4 * raw_height && !(info.components & 1))
+    {
+        raw_width /= 2;
+        raw_height *= 2;
+    }
+
+    /* slices: count of full slices, their width, width of the last one */
+    int slices[3] = {0, raw_width, raw_width};
+    if (slice_tag && get4(&f, slice_tag + 4) == 3)
+    {
+        uint32_t offset = get4(&f, slice_tag + 8);
+        for (int i = 0; i < 3; i++)
+            slices[i] = get2(&f, offset + i * 2);
+
+        if (slices[0] * slices[1] + slices[2] != raw_width)
+        {
+            printf("CR2 slices don't match the image width\n");
+            goto end;
+        }
+    }
+
+    uint32_t samples = raw_width * raw_height;
+    raw->buffer = malloc((samples + raw_width) * 2); /* 1 extra line for handling GBRG easier */
+    image = slices[0] ? malloc(samples * 2) : raw->buffer;
+    if (!raw->buffer || !image || lj92_decode(jpeg, strip_size, image, samples))
+    {
+        printf("Could not decode the CR2 raw data\n");
+        goto end;
+    }
+
+    if (slices[0])
+    {
+        /* the JPEG holds the slices one after another, each of them raw_height rows tall */
+        uint16_t* src = image;
+        int x0 = 0;
+        for (int s = 0; s <= slices[0]; s++)
+        {
+            int w = s < slices[0] ? slices[1] : slices[2];
+            for (int y = 0; y < raw_height; y++, src += w)
+                memcpy(raw->buffer + y * raw_width + x0, src, w * 2);
+            x0 += w;
+        }
+    }
+
+    if (raw_width == 3984)
+    {
+        /* dcraw shifts this one by two columns */
+        memmove(raw->buffer, raw->buffer + 2, (samples - 2) * 2);
+        raw->buffer[samples - 2] = raw->buffer[samples - 1] = 0;
+    }
+
+    raw->raw_width = raw_width;
+    raw->raw_height = raw_height;
+    raw->out_width = raw_width;
+    raw->out_height = raw_height;
+    for (int i = 0; i < COUNT(canon_margins); i++)
+    {
+        if (canon_margins[i].raw_width == raw_width && canon_margins[i].raw_height == raw_height)
+        {
+            raw->out_width = raw_width - canon_margins[i].left - canon_margins[i].right;
+            raw->out_height = raw_height - canon_margins[i].top - canon_margins[i].bottom;
+            break;
+        }
+    }
+    ok = 1;
+
+end:
+    if (image != raw->buffer)
+        free(image);
+    if (!ok)
+    {
+        free(raw->buffer);
+        raw->buffer = 0;
+    }
+    free(f.data);
+    return ok;
+}
+
+/* size of one value of each TIFF type (1..12) */
+static const int tiff_type_sizes[] = { 0, 1, 1, 2, 4, 8, 1, 1, 2, 4, 8, 4, 8 };
+
+static void copy_ifd_tags(struct cr2_file* f, uint32_t ifd, int dng_ifd)
+{
+    if (!ifd) return;
+
+    int count = get2(f, ifd);
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t entry = ifd + 2 + i * 12;
+        if (f->size < 12 || entry > f->size - 12) break;
+
+        int tag = get2(f, entry);
+        int type = get2(f, entry + 2);
+        uint32_t num = get4(f, entry + 4);
+        if (type <= 0 || type >= COUNT(tiff_type_sizes) || num == 0 || num > f->size / tiff_type_sizes[type])
+            continue;
+
+        /* values up to 4 bytes are stored in the entry itself */
+        uint32_t size = num * tiff_type_sizes[type];
+        uint32_t offset = size <= 4 ? entry + 8 : get4(f, entry + 8);
+        if (offset >= f->size || size > f->size - offset)
+            continue;
+
+        /* both CR2 and our DNGs are little endian, so the values can be copied as they are */
+        /* tags describing the image data (or pointing inside the CR2) are refused by the DNG writer */
+        dng_set_extra_tag(dng_ifd, tag, type, num, f->data + offset);
+    }
+}
+
+/* Adobe's way to keep the maker notes valid in the DNG (DNGPrivateData, "Adobe" / "MakN" block):
+ * they use offsets from the start of the CR2, so we also store their original offset */
+static void copy_maker_notes(struct cr2_file* f, uint32_t exif_ifd)
+{
+    uint32_t entry = ifd_find(f, exif_ifd, 0x927C);
+    if (!entry) return;
+
+    uint32_t size = get4(f, entry + 4);
+    uint32_t offset = get4(f, entry + 8);
+    if (size <= 4 || offset >= f->size || size > f->size - offset)
+        return;
+
+    uint32_t block_size = 2 + 4 + size;
+    uint8_t* priv = malloc(6 + 4 + 4 + block_size);
+    if (!priv) return;
+
+    uint8_t* p = priv;
+    memcpy(p, "Adobe\0MakN", 10); p += 10;
+    for (int i = 3; i >= 0; i--) *p++ = block_size >> (i * 8);     /* big endian */
+    memcpy(p, "II", 2); p += 2;
+    for (int i = 3; i >= 0; i--) *p++ = offset >> (i * 8);
+    memcpy(p, f->data + offset, size); p += size;
+
+    dng_set_extra_tag(DNG_IFD0, 0xC634, TIFF_BYTE, p - priv, priv);
+    free(priv);
+}
+
+int cr2_copy_tags_to_dng(const char* filename)
+{
+    struct cr2_file f;
+    if (!read_file(filename, &f))
+        return 0;
+
+    int ok = 0;
+    if (memcmp(f.data, "II*\0", 4) != 0 || memcmp(f.data + 8, "CR", 2) != 0)
+        goto end;
+
+    uint32_t ifd0 = get4(&f, 4);
+    copy_ifd_tags(&f, ifd0, DNG_IFD0);
+
+    uint32_t exif_entry = ifd_find(&f, ifd0, 0x8769);
+    if (exif_entry)
+    {
+        uint32_t exif_ifd = ifd_value(&f, exif_entry);
+        copy_ifd_tags(&f, exif_ifd, DNG_EXIF_IFD);
+        copy_maker_notes(&f, exif_ifd);
+
+        /* the DNG writer adds these IFDs when it has tags for them */
+        uint32_t interop_entry = ifd_find(&f, exif_ifd, 0xA005);
+        if (interop_entry)
+            copy_ifd_tags(&f, ifd_value(&f, interop_entry), DNG_INTEROP_IFD);
+    }
+
+    /* geotagged images (e.g. from a GPS receiver or a phone app) */
+    uint32_t gps_entry = ifd_find(&f, ifd0, 0x8825);
+    if (gps_entry)
+        copy_ifd_tags(&f, ifd_value(&f, gps_entry), DNG_GPS_IFD);
+
+    /* same as exiftool "-UniqueCameraModel<Model" */
+    uint32_t model = ifd_find(&f, ifd0, 0x110);
+    if (model)
+    {
+        char name[32];
+        uint32_t count = get4(&f, model + 4);
+        uint32_t offset = count > 4 ? get4(&f, model + 8) : model + 8;
+        if (count && offset < f.size && count <= f.size - offset)
+        {
+            snprintf(name, sizeof(name), "%.*s", (int) count, (const char*) f.data + offset);
+            dng_set_camname(name);
+        }
+    }
+
+    /* same as exiftool "-xmp:subject=Dual-ISO" */
+    static const char xmp[] =
+        "<?xpacket begin='\xEF\xBB\xBF' id='W5M0MpCehiHzreSzNTczkc9d'?>\n"
+        "<x:xmpmeta xmlns:x='adobe:ns:meta/'>\n"
+        " <rdf:RDF xmlns:rdf='http://www.w3.org/1999/02/22-rdf-syntax-ns#'>\n"
+        "  <rdf:Description rdf:about='' xmlns:dc='http://purl.org/dc/elements/1.1/'>\n"
+        "   <dc:subject><rdf:Bag><rdf:li>Dual-ISO</rdf:li></rdf:Bag></dc:subject>\n"
+        "  </rdf:Description>\n"
+        " </rdf:RDF>\n"
+        "</x:xmpmeta>\n"
+        "<?xpacket end='w'?>";
+    dng_set_extra_tag(DNG_IFD0, 0x2BC, TIFF_BYTE, sizeof(xmp) - 1, xmp);
+
+    ok = 1;
+
+end:
+    free(f.data);
+    return ok;
+}
@@ -0,0 +1,24 @@
+#ifndef _CR2_DECODER_H
+#define _CR2_DECODER_H
+
+#include <stdint.h>
+
+/* raw data of a Canon CR2 file, the same one "dcraw -4 -E -t 0" would output */
+struct cr2_raw
+{
+    uint16_t* buffer;       /* raw_width x raw_height samples, plus one spare row */
+    int raw_width;          /* full size, including the optical black areas */
+    int raw_height;
+    int out_width;          /* active area, as reported by dcraw */
+    int out_height;
+    char model[64];         /* e.g. "EOS 5D Mark III", empty if the file doesn't say */
+};
+
+/* decode the lossless JPEG raw data of a CR2 file. returns 1 on success, 0 if this is not a CR2 we can decode */
+int cr2_read_raw(const char* filename, struct cr2_raw* raw);
+
+/* pass the IFD0 and EXIF tags of a CR2 file (and its maker notes) to the DNG writer, to be saved in the next DNGs
+ * (see dng_set_extra_tag; call dng_clear_extra_tags when done). Returns 1 on success, 0 if this is not a CR2 file */
+int cr2_copy_tags_to_dng(const char* filename);
+
+#endif
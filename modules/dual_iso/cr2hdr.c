@@ -45,8 +45,11 @@ static int is_bright[4];
 
 #include "wirth.h"  /* fast median, generic implementation (also kth_smallest) */
 #include "optmed.h" /* fast median for small common array sizes (3, 7, 9...) */
+#include "chroma_smooth.h"
+#include "dng_tiles.h"
 
 #include "dcraw-bridge.h"
+#include "cr2-decoder.h"
 #include "exiftool-bridge.h"
 #include "adobedng-bridge.h"
 #include "dither.h"
@@ -61,6 +64,7 @@ MODULE_STRINGS()
 /** Command-line interface */
 
 int interp_method = 0;          /* 0:amaze-edge, 1:mean23 */
+int amaze_threads = 0;          /* 0: one per CPU core */
 int chroma_smooth_method = 2;
 int fix_pink_dots = 0;
 int fix_bad_pixels = 1;
@@ -92,6 +96,7 @@ int plot_fullres_curve = 0;
 int compress = 0;
 int same_levels = 0;
 int skip_existing = 0;
+int jobs = 1;                   /* number of files converted in parallel */
 int embed_original = 0;
 
 int shortcut_fast = 0;
@@ -139,6 +144,7 @@ struct cmd_group options[] = {
         "Interpolation methods", (struct cmd_option[]) {
             { &interp_method, 0, "--amaze-edge",  "use a temporary demosaic step (AMaZE) followed by edge-directed interpolation (default)" },
             { &interp_method, 1, "--mean23",      "average the nearest 2 or 3 pixels of the same color from the Bayer grid (faster)" },
+            { &amaze_threads, 1, "--amaze-threads=%d", "number of threads used by AMaZE and DNG compression (default: one per CPU core)" },
             OPTION_EOL
         },
     },
@@ -198,15 +204,17 @@ struct cmd_group options[] = {
         },
     },
     {
-        "DNG compression (requires Adobe DNG Converter)", (struct cmd_option[]) {
-            { &compress,     1, "--compress",       "Lossless DNG compression" },
-            { &compress,     2, "--compress-lossy", "Lossy DNG compression (be careful, may destroy shadow detail)" },
+        "DNG compression", (struct cmd_option[]) {
+            { &compress,     1, "--compress",       "Lossless DNG compression (tiled lossless JPEG)" },
+            { &compress,     2, "--compress-lossy", "Lossy DNG compression (be careful, may destroy shadow detail)\n"
+                                "                  (requires Adobe DNG Converter)" },
             OPTION_EOL
         },
     },
     {
         "Misc settings", (struct cmd_option[]) {
             { &skip_existing,  1, "--skip-existing",  "Skip the conversion if the output file already exists" },
+            { &jobs,           1, "--jobs=%d",        "Convert N files in parallel (batch mode). AMaZE uses 1 thread per file, unless --amaze-threads is given" },
 
             { &embed_original, 1, "--embed-original", "Embed (move) the original CR2 file in the output DNG. The original will be deleted.\n"
                                     "                  You will be able to re-process the DNG with a different version or different conversion settings.\n"
@@ -374,6 +382,21 @@ static void solve_commandline_deps()
 {
     if (!use_fullres)
         use_alias_map = 0;
+
+    if (jobs < 1)
+        jobs = 1;
+
+    #if defined(WIN32) || defined(_WIN32)
+    if (jobs > 1)
+    {
+        printf("--jobs is not available on Windows, converting one file at a time.\n");
+        jobs = 1;
+    }
+    #endif
+
+    /* with several files in parallel, the CPU cores are already busy */
+    if (jobs > 1 && amaze_threads == 0)
+        amaze_threads = 1;
 }
 
 static void show_active_options()
@@ -404,8 +427,43 @@ static void show_active_options()
     }
 }
 
-/* here we only have a global raw_info */
-#define save_dng(filename) save_dng(filename, &raw_info)
+/* here we only have a global raw_info; its 16-bit pixels are written as they are (native byte order, matches the II header) */
+static int save_dng_native(char* filename)
+{
+    struct dng_image_part image = { raw_info.buffer, raw_info.frame_size, 0 };
+    return save_dng_parts(filename, &raw_info, &image, 1);
+}
+
+#define DNG_TILE_SIZE 256
+
+/* same, but compressed: lossless JPEG tiles, encoded on all cores */
+static int save_dng_tiled(char* filename)
+{
+    struct dng_tiles tiles;
+    if (dng_tiles_encode(&tiles, raw_info.buffer, raw_info.width, raw_info.height, raw_info.bits_per_pixel, DNG_TILE_SIZE, amaze_threads))
+    {
+        printf("Compression failed, saving uncompressed DNG.\n");
+        return save_dng_native(filename);
+    }
+
+    struct dng_image_part * parts = malloc(tiles.count * sizeof(parts[0]));
+    int ok = parts && dng_set_tiles(tiles.tile_width, tiles.tile_length, tiles.count, tiles.size);
+    if (ok)
+    {
+        for (int i = 0; i < tiles.count; i++)
+        {
+            parts[i].data = tiles.data[i];
+            parts[i].size = tiles.size[i];
+            parts[i].swap16 = 0;
+        }
+        ok = save_dng_parts(filename, &raw_info, parts, tiles.count);
+    }
+
+    dng_set_tiles(0, 0, 0, NULL);
+    free(parts);
+    dng_tiles_free(&tiles);
+    return ok;
+}
 
 #define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
 #define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
@@ -529,26 +587,13 @@ void raw_set_pixel_20to16_rand(int x, int y, int value) {
     raw_set_pixel16(x, y, COERCE((int)(value / 16.0 + fast_randn05() + 0.5), 0, 0xFFFF));
 }
 
-static void reverse_bytes_order(void* buf, int count)
-{
-    char* buf8 = (char*) buf;
-    uint16_t* buf16 = (uint16_t*) buf;
-    for (int i = 0; i < count/2; i++)
-    {
-        uint16_t x = buf16[i];
-        buf8[2*i+1] = x;
-        buf8[2*i] = x >> 8;
-    }
-}
-
 static void save_debug_dng(char* filename)
 {
     int black20 = raw_info.black_level;
     int white20 = raw_info.white_level;
     raw_info.black_level = black20/16;
     raw_info.white_level = white20/16;
-    reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
-    save_dng(filename);
+    save_dng_native(filename);
     raw_info.black_level = black20;
     raw_info.white_level = white20;
 }
@@ -567,304 +612,420 @@ static int is_file(const char* filename)
     }
 }
 
-int main(int argc, char** argv)
+/* convert one input file; returns 1 if a DNG was written, and its black and white levels */
+static int convert_file(char* filename, int* black, int* white)
 {
-    printf("cr2hdr: a post processing tool for Dual ISO images\n\n");
-    printf("Last update: %s\n", module_get_string(dual_iso_strings, "Last update"));
+    int ok = 0;
 
-    fast_randn_init();
+    printf("\nInput file      : %s\n", filename);
+    int len = strlen(filename);
 
-    if (argc == 1)
+    char orig_filename[1000]; orig_filename[0] = 0;
+    char out_filename[1000];
+
+    if (strcmp(filename+len-4, ".DNG") == 0)
     {
-        printf("No input files.\n\n");
-        printf("GUI usage: drag some CR2 or DNG files over cr2hdr.exe.\n\n");
-        show_commandline_help(argv[0]);
-        return 0;
+        /* this DNG might have embedded CR2 data inside */
+        /* note: we only save uppercase .DNGs, so a case-sensitive extension check should be fine */
+
+        if (dng_has_original_raw(filename))
+        {
+            snprintf(orig_filename, sizeof(orig_filename), "%s", filename);
+            orig_filename[len-3] = 'C';
+            orig_filename[len-2] = 'R';
+            orig_filename[len-1] = '2';
+            
+            if (is_file(orig_filename))
+            {
+                printf("Already exists  : %s (error)\n", orig_filename);
+                return 0;
+            }
+
+            if (extract_original_raw(filename, orig_filename))
+            {
+                /* use the extracted CR2 as input */
+                filename = orig_filename;
+            }
+            else
+            {
+                /* error message was already printed, now just skip this file */
+                return 0;
+            }
+        }
     }
-    
-    int r;
 
-    /* parse all command-line options */
-    for (int k = 1; k < argc; k++)
-        if (argv[k][0] == '-')
-            parse_commandline_option(argv[k]);
+    snprintf(out_filename, sizeof(out_filename), "%s", filename);
+    out_filename[len-3] = 'D';
+    out_filename[len-2] = 'N';
+    out_filename[len-1] = 'G';
     
-    solve_commandline_deps();
-    show_active_options();
+    /* note: skip_existing will be ignored if we are working on a DNG file with embedded RAW */
+    if (skip_existing && is_file(out_filename) && !orig_filename[0])
+    {
+        printf("Already exists  : %s (skipping)\n", out_filename);
+        return 0;
+    }
+
+    /* decode CR2 files right here, anything else goes through dcraw */
+    struct cr2_raw cr2;
+    if (!cr2_read_raw(filename, &cr2) && !dcraw_read_raw(filename, &cr2))
+    {
+        printf("Could not open this file\n");
+        return 0;
+    }
+
+    const char * model = cr2.model[0] ? cr2.model : get_camera_model(filename);
+    get_raw_info(model, &raw_info);
+
+    printf("Full size       : %d x %d\n", cr2.raw_width, cr2.raw_height);
+    printf("Active area     : %d x %d\n", cr2.out_width, cr2.out_height);
+
+    int width = cr2.raw_width;
+    int height = cr2.raw_height;
+    int left_margin = cr2.raw_width - cr2.out_width;
+    int top_margin = cr2.raw_height - cr2.out_height;
+    void* buf = cr2.buffer;
+
+    raw_info.buffer = buf;
     
-    /* keep track of black and white levels (useful for deflicker) */
-    /* (we will not have more than "argc" files) */
-    int* file_indices = malloc(argc * sizeof(file_indices[0]));
-    int* blacks = malloc(argc * sizeof(blacks[0]));
-    int* whites = malloc(argc * sizeof(whites[0]));
-    int num_files = 0;
+    /* did we read the raw data correctly? (right byte order etc) */
+    //~ for (int i = 0; i < 10; i++)
+        //~ printf("%d ", raw_get_pixel16(i, 0));
+    //~ printf("\n");
     
-    /* all other arguments are input files */
-    for (int k = 1; k < argc; k++)
-    {
-        if (argv[k][0] == '-')
-            continue;
-        
-        char* filename = argv[k];
+    raw_info.black_level = 2048;
+    raw_info.white_level = 15000;
 
-        printf("\nInput file      : %s\n", filename);
-        int len = strlen(filename);
+    raw_info.width = width;
+    raw_info.height = height;
+    raw_info.pitch = width * 2;
+    raw_info.frame_size = raw_info.height * raw_info.pitch;
 
-        char orig_filename[1000]; orig_filename[0] = 0;
-        char out_filename[1000];
+    raw_info.active_area.x1 = left_margin;
+    raw_info.active_area.x2 = raw_info.width;
+    raw_info.active_area.y1 = top_margin;
+    raw_info.active_area.y2 = raw_info.height;
+    raw_info.jpeg.x = 0;
+    raw_info.jpeg.y = 0;
+    raw_info.jpeg.width = raw_info.width - left_margin;
+    raw_info.jpeg.height = raw_info.height - top_margin;
+    
+    dng_set_thumbnail_size(384, 252);
 
-        if (strcmp(filename+len-4, ".DNG") == 0)
-        {
-            /* this DNG might have embedded CR2 data inside */
-            /* note: we only save uppercase .DNGs, so a case-sensitive extension check should be fine */
+    if (hdr_check())
+    {
+        if (!black_subtract(left_margin, top_margin))
+            printf("Black subtract didn't work\n");
 
-            if (dng_has_original_raw(filename))
+        if (hdr_interpolate())
+        {
+            /* This option doesn't really work, since Canon WB is broken with Dual ISO. */
+            if (exif_wb)
             {
-                snprintf(orig_filename, sizeof(orig_filename), "%s", filename);
-                orig_filename[len-3] = 'C';
-                orig_filename[len-2] = 'R';
-                orig_filename[len-1] = '2';
-                
-                if (is_file(orig_filename))
-                {
-                    printf("Already exists  : %s (error)\n", orig_filename);
-                    continue;
-                }
-
-                if (extract_original_raw(filename, orig_filename))
+                float red_balance = -1, blue_balance = -1;
+                read_white_balance(filename, &red_balance, &blue_balance);
+                if ((red_balance > 0) && (blue_balance > 0))
                 {
-                    /* use the extracted CR2 as input */
-                    filename = orig_filename;
+                    dng_set_wbgain(1000000, red_balance*1000000, 1, 1, 1000000, blue_balance*1000000);
+                    printf("AsShotNeutral   : %.2f 1 %.2f\n", 1/red_balance, 1/blue_balance);
                 }
                 else
                 {
-                    /* error message was already printed, now just skip this file */
-                    continue;
+                    printf("AsShotNeutral   : (using default values)\n");
                 }
             }
-        }
+            
+            char renamed_filename[1000];
+            char* old_filename = 0;
+            if (strcasecmp(filename, out_filename) == 0)
+            {
+                /* if the filesystem is not case-sensitive, we will overwrite the input file */
+                /* I don't know how to detect this in a portable way, so I'll rename the input file just in case */
+                /* if no overwriting takes place, the renaming will be undone */
+                //~ printf("Might overwrite input file.\n");
+                snprintf(renamed_filename, sizeof(renamed_filename), "%s", filename);
+                int len = strlen(renamed_filename);
+                renamed_filename[len-1] = '6';
+                rename(filename, renamed_filename);
+                old_filename = filename;
+                filename = renamed_filename;
+            }
 
-        snprintf(out_filename, sizeof(out_filename), "%s", filename);
-        out_filename[len-3] = 'D';
-        out_filename[len-2] = 'N';
-        out_filename[len-1] = 'G';
-        
-        /* note: skip_existing will be ignored if we are working on a DNG file with embedded RAW */
-        if (skip_existing && is_file(out_filename) && !orig_filename[0])
-        {
-            printf("Already exists  : %s (skipping)\n", out_filename);
-            continue;
-        }
+            if (orig_filename[0])
+            {
+                dng_backup_metadata(out_filename);
+            }
 
-        char dcraw_cmd[1000];
-        snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -v -i -t 0 \"%s\"", filename);
-        FILE* t = popen(dcraw_cmd, "r");
-        CHECK(t, "%s", filename);
-        
-        const char * model = get_camera_model(filename);
-        get_raw_info(model, &raw_info);
+            /* copy EXIF from CR2 files right here, anything else goes through exiftool */
+            int tags_copied = cr2_copy_tags_to_dng(filename);
 
-        int raw_width = 0, raw_height = 0;
-        int out_width = 0, out_height = 0;
-        
-        char line[100];
-        while (fgets(line, sizeof(line), t))
-        {
-            if (startswith(line, "Full size: "))
+            printf("Output file     : %s %s\n", out_filename, is_file(out_filename) ? "(already exists, overwriting)" : "");
+            if (compress == 1)
+                save_dng_tiled(out_filename);
+            else
+                save_dng_native(out_filename);
+            dng_clear_extra_tags();
+
+            if (!tags_copied)
             {
-                r = sscanf(line, "Full size: %d x %d\n", &raw_width, &raw_height);
-                CHECK(r == 2, "sscanf");
+                copy_tags_from_source(filename, out_filename);
             }
-            else if (startswith(line, "Output size: "))
+
+            if (orig_filename[0])
             {
-                r = sscanf(line, "Output size: %d x %d\n", &out_width, &out_height);
-                CHECK(r == 2, "sscanf");
+                dng_restore_metadata(out_filename);
+            }
+            
+            if (compress == 2)
+            {
+                dng_compress(out_filename, 1);
+            }
+            
+            if (embed_original || orig_filename[0])
+            {
+                /* this will move the input file into the DNG (and maybe delete the original) */
+                int delete_original = (embed_original != 2);
+                embed_original_raw(out_filename, filename, delete_original);
             }
-        }
-        pclose(t);
-        
-        if (raw_width == 0)
-        {
-            printf("dcraw could not open this file\n");
-            continue;
-        }
-
-        printf("Full size       : %d x %d\n", raw_width, raw_height);
-        printf("Active area     : %d x %d\n", out_width, out_height);
-        
-        int left_margin = raw_width - out_width;
-        int top_margin = raw_height - out_height;
-
-        snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -4 -E -c -t 0 \"%s\"", filename);
-        FILE* fp = popen(dcraw_cmd, "r");
-        CHECK(fp, "%s", filename);
-        #ifdef _O_BINARY
-        _setmode(_fileno(fp), _O_BINARY);
-        #endif
-
-        /* PGM read code from dcraw */
-          int dim[3]={0,0,0}, comment=0, number=0, error=0, nd=0, c;
 
-          if (fgetc(fp) != 'P' || fgetc(fp) != '5') error = 1;
-          while (!error && nd < 3 && (c = fgetc(fp)) != EOF) {
-            if (c == '#')  comment = 1;
-            if (c == '\n') comment = 0;
-            if (comment) continue;
-            if (isdigit(c)) number = 1;
-            if (number) {
-              if (isdigit(c)) dim[nd] = dim[nd]*10 + c -'0';
-              else if (isspace(c)) {
-            number = 0;  nd++;
-              } else error = 1;
+            if (old_filename && is_file(renamed_filename))
+            {
+                if (!is_file(old_filename))
+                {
+                    /* input file not overwritten, undo renaming */
+                    rename(renamed_filename, old_filename);
+                }
+                else
+                {
+                    /* output file would overwrite the input file */
+                    unlink(renamed_filename);
+                }
             }
-          }
 
-        if (error || nd < 3)
+            /* record black and white levels */
+            *black = raw_info.black_level;
+            *white = raw_info.white_level;
+            ok = 1;
+        }
+        else
         {
-            pclose(fp);
-            printf("dcraw output is not a valid PGM file\n");
-            continue;
+            printf("ISO blending didn't work\n");
         }
+    }
+    else
+    {
+        printf("Doesn't look like interlaced ISO\n");
+    }
 
-        int width = dim[0];
-        int height = dim[1];
-        CHECK(width == raw_width, "pgm width");
-        CHECK(height == raw_height, "pgm height");
+    free(buf);
+    return ok;
+}
 
-        void* buf = malloc(width * (height+1) * 2); /* 1 extra line for handling GBRG easier */
-        int size = fread(buf, 1, width * height * 2, fp);
-        CHECK(size == width * height * 2, "fread");
-        pclose(fp);
+static void show_progress(int done, int total)
+{
+    double elapsed = toc_seconds();
+    double remaining = elapsed * (total - done) / done;
+    printf("\nProgress        : %d/%d files, %.1f s elapsed, %.1f s remaining\n", done, total, elapsed, remaining);
+}
 
-        /* PGM is big endian, need to reverse it */
-        reverse_bytes_order(buf, width * height * 2);
+#if !defined(WIN32) && !defined(_WIN32)
+#include <sys/wait.h>
 
-        raw_info.buffer = buf;
-        
-        /* did we read the PGM correctly? (right byte order etc) */
-        //~ for (int i = 0; i < 10; i++)
-            //~ printf("%d ", raw_get_pixel16(i, 0));
-        //~ printf("\n");
-        
-        raw_info.black_level = 2048;
-        raw_info.white_level = 15000;
-
-        raw_info.width = width;
-        raw_info.height = height;
-        raw_info.pitch = width * 2;
-        raw_info.frame_size = raw_info.height * raw_info.pitch;
-
-        raw_info.active_area.x1 = left_margin;
-        raw_info.active_area.x2 = raw_info.width;
-        raw_info.active_area.y1 = top_margin;
-        raw_info.active_area.y2 = raw_info.height;
-        raw_info.jpeg.x = 0;
-        raw_info.jpeg.y = 0;
-        raw_info.jpeg.width = raw_info.width - left_margin;
-        raw_info.jpeg.height = raw_info.height - top_margin;
-        
-        dng_set_thumbnail_size(384, 252);
+/* batch mode: convert up to "jobs" files at the same time, each one in a child process
+ * (all the processing steps use global state, e.g. raw_info, so they can't share an address space);
+ * the children report their result and black/white levels through a pipe, and their log
+ * goes to a temporary file, printed when the child finishes, so the logs are not interleaved */
+static void convert_files_parallel(int argc, char** argv, int total_files, int* converted, int* blacks, int* whites)
+{
+    struct { pid_t pid; int fd; FILE* log; int k; } * slots = calloc(jobs, sizeof(slots[0]));
+    int running = 0;
+    int done = 0;
+    int k = 1;
 
-        if (hdr_check())
+    while (1)
+    {
+        /* start new jobs while we have free slots */
+        while (running < jobs && k < argc)
         {
-            if (!black_subtract(left_margin, top_margin))
-                printf("Black subtract didn't work\n");
-
-            if (hdr_interpolate())
+            if (argv[k][0] == '-')
             {
-                reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
-
-                /* This option doesn't really work, since Canon WB is broken with Dual ISO. */
-                if (exif_wb)
-                {
-                    float red_balance = -1, blue_balance = -1;
-                    read_white_balance(filename, &red_balance, &blue_balance);
-                    if ((red_balance > 0) && (blue_balance > 0))
-                    {
-                        dng_set_wbgain(1000000, red_balance*1000000, 1, 1, 1000000, blue_balance*1000000);
-                        printf("AsShotNeutral   : %.2f 1 %.2f\n", 1/red_balance, 1/blue_balance);
-                    }
-                    else
-                    {
-                        printf("AsShotNeutral   : (using default values)\n");
-                    }
-                }
-                
-                char renamed_filename[1000];
-                char* old_filename = 0;
-                if (strcasecmp(filename, out_filename) == 0)
-                {
-                    /* if the filesystem is not case-sensitive, we will overwrite the input file */
-                    /* I don't know how to detect this in a portable way, so I'll rename the input file just in case */
-                    /* if no overwriting takes place, the renaming will be undone */
-                    //~ printf("Might overwrite input file.\n");
-                    snprintf(renamed_filename, sizeof(renamed_filename), "%s", filename);
-                    int len = strlen(renamed_filename);
-                    renamed_filename[len-1] = '6';
-                    rename(filename, renamed_filename);
-                    old_filename = filename;
-                    filename = renamed_filename;
-                }
+                k++;
+                continue;
+            }
 
-                if (orig_filename[0])
+            int fds[2];
+            pid_t pid = -1;
+            FILE* log = tmpfile();
+            fflush(stdout);
+            if (log && pipe(fds) == 0)
+            {
+                pid = fork();
+                if (pid < 0)
                 {
-                    dng_backup_metadata(out_filename);
+                    close(fds[0]);
+                    close(fds[1]);
                 }
+            }
 
-                printf("Output file     : %s %s\n", out_filename, is_file(out_filename) ? "(already exists, overwriting)" : "");
-                save_dng(out_filename);
+            if (pid == 0)
+            {
+                /* child: everything printed from here goes to the log file (including exiftool output) */
+                dup2(fileno(log), STDOUT_FILENO);
+                close(fds[0]);
+
+                int result[3] = {0, 0, 0};
+                result[0] = convert_file(argv[k], &result[1], &result[2]);
+                fflush(stdout);
+                if (write(fds[1], result, sizeof(result)) != sizeof(result))
+                    _exit(1);
+                _exit(0);
+            }
 
-                copy_tags_from_source(filename, out_filename);
+            if (pid < 0)
+            {
+                /* could not start a new process; convert this one right here */
+                if (log) fclose(log);
+                converted[k] = convert_file(argv[k], &blacks[k], &whites[k]);
+                show_progress(++done, total_files);
+                k++;
+                continue;
+            }
 
-                if (orig_filename[0])
-                {
-                    dng_restore_metadata(out_filename);
-                }
-                
-                if (compress)
-                {
-                    dng_compress(out_filename, compress-1);
-                }
-                
-                if (embed_original || orig_filename[0])
+            close(fds[1]);
+            for (int i = 0; i < jobs; i++)
+            {
+                if (!slots[i].pid)
                 {
-                    /* this will move the input file into the DNG (and maybe delete the original) */
-                    int delete_original = (embed_original != 2);
-                    embed_original_raw(out_filename, filename, delete_original);
+                    slots[i].pid = pid;
+                    slots[i].fd = fds[0];
+                    slots[i].log = log;
+                    slots[i].k = k;
+                    break;
                 }
+            }
+            running++;
+            k++;
+        }
 
-                if (old_filename && is_file(renamed_filename))
-                {
-                    if (!is_file(old_filename))
-                    {
-                        /* input file not overwritten, undo renaming */
-                        rename(renamed_filename, old_filename);
-                    }
-                    else
-                    {
-                        /* output file would overwrite the input file */
-                        unlink(renamed_filename);
-                    }
-                }
+        if (!running)
+            break;
 
-                /* record black and white levels */
-                file_indices[num_files] = k;
-                blacks[num_files] = raw_info.black_level;
-                whites[num_files] = raw_info.white_level;
-                num_files++;
-            }
-            else
+        /* wait for any of the children to finish */
+        pid_t pid = wait(0);
+        if (pid < 0)
+            break;
+
+        for (int i = 0; i < jobs; i++)
+        {
+            if (slots[i].pid == pid)
             {
-                printf("ISO blending didn't work\n");
+                int result[3] = {0, 0, 0};
+                if (read(slots[i].fd, result, sizeof(result)) == sizeof(result) && result[0])
+                {
+                    converted[slots[i].k] = 1;
+                    blacks[slots[i].k] = result[1];
+                    whites[slots[i].k] = result[2];
+                }
+                close(slots[i].fd);
+
+                /* print the log of this file */
+                char buf[4096];
+                int n;
+                rewind(slots[i].log);
+                while ((n = fread(buf, 1, sizeof(buf), slots[i].log)) > 0)
+                    fwrite(buf, 1, n, stdout);
+                fclose(slots[i].log);
+
+                slots[i].pid = 0;
+                running--;
+                show_progress(++done, total_files);
+                break;
             }
         }
-        else
+    }
+
+    free(slots);
+}
+#else
+static void convert_files_parallel(int argc, char** argv, int total_files, int* converted, int* blacks, int* whites)
+{
+    /* not available on Windows (solve_commandline_deps resets jobs to 1) */
+}
+#endif
+
+int main(int argc, char** argv)
+{
+    printf("cr2hdr: a post processing tool for Dual ISO images\n\n");
+    printf("Last update: %s\n", module_get_string(dual_iso_strings, "Last update"));
+
+    fast_randn_init();
+
+    if (argc == 1)
+    {
+        printf("No input files.\n\n");
+        printf("GUI usage: drag some CR2 or DNG files over cr2hdr.exe.\n\n");
+        show_commandline_help(argv[0]);
+        return 0;
+    }
+    
+    /* parse all command-line options */
+    for (int k = 1; k < argc; k++)
+        if (argv[k][0] == '-')
+            parse_commandline_option(argv[k]);
+    
+    solve_commandline_deps();
+    show_active_options();
+    
+    /* keep track of black and white levels (useful for deflicker) */
+    /* (we will not have more than "argc" files) */
+    int* file_indices = malloc(argc * sizeof(file_indices[0]));
+    int* blacks = malloc(argc * sizeof(blacks[0]));
+    int* whites = malloc(argc * sizeof(whites[0]));
+    int num_files = 0;
+    
+    /* all other arguments are input files */
+    int total_files = 0;
+    for (int k = 1; k < argc; k++)
+        if (argv[k][0] != '-')
+            total_files++;
+
+    /* results are indexed like argv; converted[k] is 1 if argv[k] was turned into a DNG */
+    int* converted = calloc(argc, sizeof(converted[0]));
+
+    if (total_files > 1)
+        tic();
+
+    if (jobs > 1 && total_files > 1)
+    {
+        convert_files_parallel(argc, argv, total_files, converted, blacks, whites);
+    }
+    else
+    {
+        int done = 0;
+        for (int k = 1; k < argc; k++)
         {
-            printf("Doesn't look like interlaced ISO\n");
+            if (argv[k][0] == '-')
+                continue;
+            
+            converted[k] = convert_file(argv[k], &blacks[k], &whites[k]);
+
+            if (total_files > 1)
+                show_progress(++done, total_files);
         }
+    }
 
-        free(buf);
+    /* keep only the files that were converted (in the same order as on the command line) */
+    for (int k = 1; k < argc; k++)
+    {
+        if (converted[k])
+        {
+            file_indices[num_files] = k;
+            blacks[num_files] = blacks[k];
+            whites[num_files] = whites[k];
+            num_files++;
+        }
     }
+    free(converted);
     
     if (same_levels && num_files > 1)
     {
@@ -1134,8 +1295,7 @@ static int black_subtract(int left_margin, int top_margin)
         int orig_white = raw_info.white_level;
         raw_info.black_level = black_black;
         raw_info.white_level = black_white;
-        reverse_bytes_order(raw_info.buffer, raw_info.frame_size);
-        save_dng("black.dng");
+        save_dng_native("black.dng");
         raw_info.buffer = old_buffer;
         raw_info.black_level = orig_black;
         raw_info.white_level = orig_white;
@@ -1824,34 +1984,14 @@ static int mean3(int a, int b, int c, int white, int* err)
     return m;
 }
 
-/* various chroma smooth filters */
-/* (trick to avoid duplicate code) */
-
-#define CHROMA_SMOOTH_2X2
-#include "chroma_smooth.c"
-#undef CHROMA_SMOOTH_2X2
-
-#define CHROMA_SMOOTH_3X3
-#include "chroma_smooth.c"
-#undef CHROMA_SMOOTH_3X3
-
-#define CHROMA_SMOOTH_5X5
-#include "chroma_smooth.c"
-#undef CHROMA_SMOOTH_5X5
-
+/* various chroma smooth filters (shared with mlv_dump, see chroma_smooth.c) */
 static void chroma_smooth(uint32_t * inp, uint32_t * out, int* raw2ev, int* ev2raw)
 {
-    switch (chroma_smooth_method)
+    static struct chroma_smooth_work work;
+
+    if (chroma_smooth_run(chroma_smooth_method, raw_info.width, raw_info.height, inp, out, raw2ev, ev2raw, EV_RESOLUTION, &work))
     {
-        case 2:
-            chroma_smooth_2x2(inp, out, raw2ev, ev2raw);
-            break;
-        case 3:
-            chroma_smooth_3x3(inp, out, raw2ev, ev2raw);
-            break;
-        case 5:
-            chroma_smooth_5x5(inp, out, raw2ev, ev2raw);
-            break;
+        printf("Chroma smoothing: out of memory\n");
     }
 }
 
@@ -2297,10 +2437,11 @@ static int hdr_interpolate()
             float** green,      /* the interpolated green plane */
             float** blue,       /* the interpolated blue plane */
             int winx, int winy, /* crop window for demosaicing */
-            int winw, int winh
+            int winw, int winh,
+            int threads
         );
 
-        amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h);
+        amaze_demosaic_RT(rawData, red, green, blue, 0, 0, w, h, amaze_threads);
 
         /* undo green channel scaling and clamp the other channels */
         for (int y = 0; y < h; y ++)
@@ -2,9 +2,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include "../../src/raw.h"
 #include "dcraw-bridge.h"
+#include "cr2-decoder.h"
 #include "kelvin.h"
 
 /** Compute the number of entries in a static array */
@@ -168,3 +171,94 @@ int get_raw_info(const char * model, struct raw_info * raw_info)
     
     return 0;
 }
+
+static int startswith(char* str, char* prefix)
+{
+    return strncmp(str, prefix, strlen(prefix)) == 0;
+}
+
+int dcraw_read_raw(const char * filename, struct cr2_raw * raw)
+{
+    memset(raw, 0, sizeof(*raw));
+
+    char dcraw_cmd[1000];
+    snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -v -i -t 0 \"%s\"", filename);
+    FILE* t = popen(dcraw_cmd, "r");
+    if (!t)
+        return 0;
+
+    char line[100];
+    while (fgets(line, sizeof(line), t))
+    {
+        if (startswith(line, "Full size: "))
+        {
+            if (sscanf(line, "Full size: %d x %d\n", &raw->raw_width, &raw->raw_height) != 2)
+                raw->raw_width = 0;
+        }
+        else if (startswith(line, "Output size: "))
+        {
+            if (sscanf(line, "Output size: %d x %d\n", &raw->out_width, &raw->out_height) != 2)
+                raw->raw_width = 0;
+        }
+    }
+    pclose(t);
+
+    if (raw->raw_width <= 0 || raw->raw_height <= 0)
+    {
+        printf("dcraw could not open this file\n");
+        return 0;
+    }
+
+    snprintf(dcraw_cmd, sizeof(dcraw_cmd), "dcraw -4 -E -c -t 0 \"%s\"", filename);
+    FILE* fp = popen(dcraw_cmd, "r");
+    if (!fp)
+        return 0;
+    #ifdef _O_BINARY
+    _setmode(_fileno(fp), _O_BINARY);
+    #endif
+
+    /* PGM read code from dcraw */
+      int dim[3]={0,0,0}, comment=0, number=0, error=0, nd=0, c;
+
+      if (fgetc(fp) != 'P' || fgetc(fp) != '5') error = 1;
+      while (!error && nd < 3 && (c = fgetc(fp)) != EOF) {
+        if (c == '#')  comment = 1;
+        if (c == '\n') comment = 0;
+        if (comment) continue;
+        if (isdigit(c)) number = 1;
+        if (number) {
+          if (isdigit(c)) dim[nd] = dim[nd]*10 + c -'0';
+          else if (isspace(c)) {
+        number = 0;  nd++;
+          } else error = 1;
+        }
+      }
+
+    if (error || nd < 3 || dim[0] != raw->raw_width || dim[1] != raw->raw_height)
+    {
+        pclose(fp);
+        printf("dcraw output is not a valid PGM file\n");
+        return 0;
+    }
+
+    int size = raw->raw_width * raw->raw_height * 2;
+    raw->buffer = malloc(size + raw->raw_width * 2); /* 1 extra line for handling GBRG easier */
+    if (!raw->buffer || (int) fread(raw->buffer, 1, size, fp) != size)
+    {
+        pclose(fp);
+        free(raw->buffer);
+        raw->buffer = 0;
+        printf("Could not read the dcraw output\n");
+        return 0;
+    }
+    pclose(fp);
+
+    /* PGM is big endian, need to reverse it */
+    uint8_t* buf8 = (uint8_t*) raw->buffer;
+    for (int i = 0; i < size/2; i++)
+    {
+        raw->buffer[i] = (buf8[2*i] << 8) | buf8[2*i+1];
+    }
+
+    return 1;
+}
@@ -3,4 +3,8 @@
 
 int get_raw_info(const char * model, struct raw_info* orig);
 
+/* read the raw data of any file dcraw understands (dcraw -4 -E), for the files cr2_read_raw can't decode. returns 1 on success */
+struct cr2_raw;
+int dcraw_read_raw(const char * filename, struct cr2_raw * raw);
+
 #endif
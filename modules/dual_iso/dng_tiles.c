@@ -0,0 +1,129 @@
+/*
+ * Lossless JPEG tiles for compressed DNG output (see dng_tiles.h)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dng_tiles.h"
+#include "../mlv_rec/lj92.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifndef MIN
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#endif
+
+/* copy one tile, repeating the last column and row where it sticks out of the image */
+static void tile_copy(uint16_t * tile, int tile_size, const uint16_t * image, int width, int height, int x0, int y0)
+{
+    int w = MIN(tile_size, width - x0);
+    int h = MIN(tile_size, height - y0);
+
+    for (int y = 0; y < tile_size; y++)
+    {
+        const uint16_t * src = image + (size_t)(y0 + MIN(y, h - 1)) * width + x0;
+        uint16_t * dst = tile + y * tile_size;
+        memcpy(dst, src, w * sizeof(uint16_t));
+
+        /* keep the bayer pattern: repeat the last two columns */
+        for (int x = w; x < tile_size; x++)
+        {
+            dst[x] = (w >= 2) ? dst[w - 2 + ((x - w) & 1)] : dst[0];
+        }
+    }
+}
+
+int dng_tiles_encode(struct dng_tiles * tiles, const uint16_t * image, int width, int height, int bits, int tile_size, int threads)
+{
+    memset(tiles, 0, sizeof(*tiles));
+    if (tile_size <= 0 || (tile_size % 16) || width < 2 || height < 1)
+    {
+        return -1;
+    }
+
+    int across = (width + tile_size - 1) / tile_size;
+    int down = (height + tile_size - 1) / tile_size;
+    int count = across * down;
+    uint32_t bound = lj92_encode_bound(tile_size, tile_size);
+
+    tiles->data = calloc(count, sizeof(tiles->data[0]));
+    tiles->size = calloc(count, sizeof(tiles->size[0]));
+    if (!tiles->data || !tiles->size)
+    {
+        dng_tiles_free(tiles);
+        return -1;
+    }
+    tiles->tile_width = tiles->tile_length = tile_size;
+    tiles->count = count;
+
+#ifdef _OPENMP
+    if (threads <= 0) threads = omp_get_num_procs();
+#else
+    (void) threads;
+#endif
+
+    int error = 0;
+
+#ifdef _OPENMP
+    #pragma omp parallel num_threads(threads)
+#endif
+    {
+        /* each tile is encoded into a scratch buffer of the worst case size, then copied out at its real size */
+        uint16_t * tile = malloc(tile_size * tile_size * sizeof(uint16_t));
+        uint8_t * scratch = malloc(bound);
+        if (!tile || !scratch)
+        {
+            error = 1;
+        }
+
+#ifdef _OPENMP
+        #pragma omp for schedule(dynamic)
+#endif
+        for (int i = 0; i < count; i++)
+        {
+            if (!tile || !scratch)
+            {
+                continue;
+            }
+
+            tile_copy(tile, tile_size, image, width, height, (i % across) * tile_size, (i / across) * tile_size);
+            uint32_t size = lj92_encode(tile, tile_size, tile_size, 2, bits, scratch, bound);
+            uint8_t * out = size ? malloc(size) : NULL;
+            if (!out)
+            {
+                error = 1;
+                continue;
+            }
+
+            memcpy(out, scratch, size);
+            tiles->data[i] = out;
+            tiles->size[i] = size;
+        }
+
+        free(scratch);
+        free(tile);
+    }
+
+    if (error)
+    {
+        dng_tiles_free(tiles);
+        return -1;
+    }
+    return 0;
+}
+
+void dng_tiles_free(struct dng_tiles * tiles)
+{
+    if (tiles->data)
+    {
+        for (int i = 0; i < tiles->count; i++)
+        {
+            free(tiles->data[i]);
+        }
+    }
+    free(tiles->data);
+    free(tiles->size);
+    memset(tiles, 0, sizeof(*tiles));
+}
@@ -0,0 +1,34 @@
+/*
+ * Lossless JPEG tiles for compressed DNG output (see dng_set_tiles in chdk-dng.h).
+ *
+ * The image is cut into tiles of tile_size x tile_size pixels; each one is compressed
+ * on its own (LJ92, two components, so the prediction uses the nearest pixel of the
+ * same colour), so the tiles are encoded in parallel here and can be decoded in
+ * parallel by DNG readers. Tiles sticking out of the image are padded by repeating
+ * the last column and row.
+ */
+
+#ifndef _dng_tiles_h_
+#define _dng_tiles_h_
+
+#include <stdint.h>
+
+struct dng_tiles
+{
+    int tile_width;
+    int tile_length;
+    int count;              /* left to right, top to bottom */
+    uint8_t ** data;        /* compressed tiles */
+    uint32_t * size;        /* compressed size of each tile */
+};
+
+/**
+ * image: width x height pixels of bits (2-16) each, in native byte order.
+ * tile_size: multiple of 16; threads: 0 = one per CPU core (only with OpenMP).
+ * Returns 0 on success; on error, nothing needs to be freed.
+ */
+int dng_tiles_encode(struct dng_tiles * tiles, const uint16_t * image, int width, int height, int bits, int tile_size, int threads);
+
+void dng_tiles_free(struct dng_tiles * tiles);
+
+#endif
@@ -1,15 +1,29 @@
-#include <time.h>
 #include <stdio.h>
+#include <sys/time.h>
+#include "timing.h"
 
-static int __t0;
+/* wall clock time; clock() would add up the CPU time of all threads */
+static double __t0;
+
+static double wall_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
 
 void tic()
 {
     printf("Timing from here...\n");
-    __t0 = clock();
+    __t0 = wall_time();
 }
 
 void toc()
 {
-    printf("Elapsed time: %.02f s\n", 1.0 * (clock() - __t0) / CLOCKS_PER_SEC);
+    printf("Elapsed time: %.02f s\n", toc_seconds());
+}
+
+double toc_seconds()
+{
+    return wall_time() - __t0;
 }
@@ -1,3 +1,6 @@
 /* for timing various routines */
 void tic();
 void toc();
+
+/* seconds since tic(), without printing anything */
+double toc_seconds();
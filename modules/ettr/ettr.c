@@ -198,8 +198,21 @@ static int auto_ettr_get_correction()
         speed = auto_ettr_ignore ? 4 : 2;
     }
 
-    int ok = raw_hist_get_percentile_levels(percentiles, raw_values, COUNT(percentiles), gray_proj | GRAY_PROJECTION_DARK_ONLY, speed);
-    
+    int ok;
+    if (lv)
+    {
+        /* this runs often in LiveView (also for the histogram display), so refine the previous readings
+         * with a different subset of pixels each time, as long as the exposure stays the same */
+        static int last_exposure = INT_MIN;
+        int exposure = ettr_get_current_raw_shutter() + lens_info.raw_aperture * 256 + lens_info.raw_iso * 65536;
+        ok = raw_hist_get_percentile_levels_progressive(percentiles, raw_values, COUNT(percentiles), gray_proj | GRAY_PROJECTION_DARK_ONLY, speed, exposure != last_exposure);
+        last_exposure = exposure;
+    }
+    else
+    {
+        ok = raw_hist_get_percentile_levels(percentiles, raw_values, COUNT(percentiles), gray_proj | GRAY_PROJECTION_DARK_ONLY, speed);
+    }
+
     if (ok != 1)
     {
         last_value = INT_MIN;
@@ -1602,6 +1615,10 @@ static unsigned int auto_ettr_polling_cbr()
 {
     if (lv && NOT_RECORDING && ((void*)&raw_lv_request != (void*)&ret_0))
         auto_ettr_step_lv();
+    
+    /* the raw histogram (and its progressive samples) is only kept while we stay in LiveView */
+    if (!lv)
+        raw_hist_free_buffer();
     return 0;
 }
 
@@ -74,6 +74,72 @@ static void crypt_lfsr64_clock(lfsr64_ctx_t *ctx, uint32_t clocks)
     ctx->lfsr_state = lfsr;
 }
 
+/* the LFSR is linear over GF(2), so clocking it 64 times per block is a 64x64 bit matrix M.
+   crypt_lfsr64_jump[n] holds M^(2^n) as columns: bit i of the state selects column i.
+   any block key can then be reached with one matrix per set bit of the block distance. */
+#define CRYPT_LFSR64_JUMP_LEVELS 32
+static uint64_t crypt_lfsr64_jump[CRYPT_LFSR64_JUMP_LEVELS][64];
+static uint32_t crypt_lfsr64_jump_ready = 0;
+
+static uint64_t crypt_lfsr64_mul(uint64_t *matrix, uint64_t state)
+{
+    uint64_t result = 0;
+    
+    for(int bit = 0; bit < 64; bit++)
+    {
+        if((state >> bit) & 1)
+        {
+            result ^= matrix[bit];
+        }
+    }
+    
+    return result;
+}
+
+static void crypt_lfsr64_jump_init()
+{
+    if(crypt_lfsr64_jump_ready)
+    {
+        return;
+    }
+    
+    /* one block: clock every single bit 64 times */
+    for(int bit = 0; bit < 64; bit++)
+    {
+        lfsr64_ctx_t unit;
+        unit.lfsr_state = 1ULL << bit;
+        crypt_lfsr64_clock(&unit, 64);
+        crypt_lfsr64_jump[0][bit] = unit.lfsr_state;
+    }
+    
+    /* then square it for 2, 4, 8... blocks */
+    for(int level = 1; level < CRYPT_LFSR64_JUMP_LEVELS; level++)
+    {
+        for(int bit = 0; bit < 64; bit++)
+        {
+            crypt_lfsr64_jump[level][bit] = crypt_lfsr64_mul(crypt_lfsr64_jump[level - 1], crypt_lfsr64_jump[level - 1][bit]);
+        }
+    }
+    
+    crypt_lfsr64_jump_ready = 1;
+}
+
+/* same as clocking the LFSR 64 times per block, for the given number of blocks */
+static void crypt_lfsr64_skip_blocks(lfsr64_ctx_t *ctx, uint32_t blocks)
+{
+    uint64_t lfsr = ctx->lfsr_state;
+    
+    for(int level = 0; blocks; level++, blocks >>= 1)
+    {
+        if(blocks & 1)
+        {
+            lfsr = crypt_lfsr64_mul(crypt_lfsr64_jump[level], lfsr);
+        }
+    }
+    
+    ctx->lfsr_state = lfsr;
+}
+
 /* xor the buffer with 8/64 bit alignment */
 static void crypt_lfsr64_xor_uint8(void *dst_in, void *src_in, lfsr64_ctx_t *ctx, uint32_t offset)
 {
@@ -114,25 +180,22 @@ static void update_key(lfsr64_ctx_t *ctx, uint32_t offset, uint32_t force)
 #define INCREMENTAL
 
 #if defined(INCREMENTAL)
-    if(ctx->current_block < block)
+    if(ctx->current_block + 1 == block)
     {
-        while(ctx->current_block < block)
-        {
-            crypt_lfsr64_clock(ctx, 64);
-            ctx->current_block++;
-        }
+        /* sequential access, just advance to the next block */
+        crypt_lfsr64_clock(ctx, 64);
+    }
+    else if(ctx->current_block < block)
+    {
+        crypt_lfsr64_skip_blocks(ctx, block - ctx->current_block);
     }
     else
     {
+        /* seeking backwards, start again from block 0 */
         ctx->lfsr_state = ctx->lfsr_init;
-        ctx->current_block = 0;
-        
-        while(ctx->current_block < block)
-        {
-            crypt_lfsr64_clock(ctx, 64);
-            ctx->current_block++;
-        }
+        crypt_lfsr64_skip_blocks(ctx, block);
     }
+    ctx->current_block = block;
 #else
     ctx->current_block = block;
     
@@ -362,6 +425,7 @@ void crypt_lfsr64_init(crypt_cipher_t *crypt_ctx, uint64_t password)
     
     /* initialize to default values */
     ctx->password = password;
+    crypt_lfsr64_jump_init();
     
     /* shift the password into the LFSR */
     ctx->lfsr_state = ctx->password;
@@ -24,6 +24,9 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "io_crypt.h"
 #include "crypt_lfsr64.h"
@@ -32,7 +35,8 @@
 #include "hash_password.h"
 
 
-#define BLOCKSIZE (8 * 1024)
+#define BLOCKSIZE (1024 * 1024)    /* per thread */
+#define MAX_THREADS 64
 
 
 static const uint8_t cr2_magic[] = "\x49\x49\x2A\x00";
@@ -120,21 +124,247 @@ static void io_decrypt_test()
     free(buf_dst);
 }
 
+/* everything needed to set up another instance of the file cipher, one for each thread */
+typedef struct
+{
+    uint32_t type;
+    uint64_t key;
+    uint32_t blocksize;     /* LFSR64 only; 0 = cipher default */
+} cipher_setup_t;
+
+#define CIPHER_LFSR64 1
+#define CIPHER_XTEA   2
+
+static void cipher_init(crypt_cipher_t *crypt_ctx, cipher_setup_t *setup)
+{
+    if(setup->type == CIPHER_XTEA)
+    {
+        /* todo: fill it correctly */
+        uint32_t password[4];
+        memset(password, 0x00, sizeof(password));
+        crypt_xtea_init(crypt_ctx, password, setup->key);
+    }
+    else
+    {
+        crypt_lfsr64_init(crypt_ctx, setup->key);
+        if(setup->blocksize && crypt_ctx->priv)
+        {
+            crypt_ctx->set_blocksize(crypt_ctx->priv, setup->blocksize);
+        }
+    }
+}
+
+/* a chunk of the file, decrypted by one thread with its own cipher instance.
+   the ciphers are block-independent (LFSR64 jumps to the key of any block), so chunks can be done in any order */
+typedef struct
+{
+    crypt_cipher_t crypt_ctx;
+    uint8_t *buffer;
+    uint32_t length;
+    uint32_t offset;
+    pthread_t thread;
+} decrypt_job_t;
+
+static void *decrypt_job_run(void *arg)
+{
+    decrypt_job_t *job = (decrypt_job_t *)arg;
+    
+    job->crypt_ctx.decrypt(job->crypt_ctx.priv, job->buffer, job->buffer, job->length, job->offset);
+    return NULL;
+}
+
+/* jobs must be zeroed (calloc, or after decrypt_jobs_free); can be freed again, even if only partly set up */
+static void decrypt_jobs_free(decrypt_job_t *jobs, int threads)
+{
+    for(int thread = 0; thread < threads; thread++)
+    {
+        if(jobs[thread].crypt_ctx.priv)
+        {
+            jobs[thread].crypt_ctx.deinit(jobs[thread].crypt_ctx.priv);
+        }
+        free(jobs[thread].buffer);
+        memset(&jobs[thread], 0x00, sizeof(decrypt_job_t));
+    }
+}
+
+/* on failure, whatever was already set up is freed again */
+static int decrypt_jobs_init(decrypt_job_t *jobs, int threads, cipher_setup_t *setup)
+{
+    for(int thread = 0; thread < threads; thread++)
+    {
+        cipher_init(&jobs[thread].crypt_ctx, setup);
+        jobs[thread].buffer = malloc(BLOCKSIZE);
+        
+        if(!jobs[thread].crypt_ctx.priv || !jobs[thread].buffer)
+        {
+            printf("Out of memory\n");
+            decrypt_jobs_free(jobs, threads);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* decrypt the first 'count' jobs in parallel; the calling thread takes the first one */
+static void decrypt_jobs_run(decrypt_job_t *jobs, int count)
+{
+    int started = 1;
+    
+    for(int job = 1; job < count; job++)
+    {
+        if(pthread_create(&jobs[job].thread, NULL, decrypt_job_run, &jobs[job]))
+        {
+            break;
+        }
+        started++;
+    }
+    
+    decrypt_job_run(&jobs[0]);
+    
+    for(int job = 1; job < count; job++)
+    {
+        if(job < started)
+        {
+            pthread_join(jobs[job].thread, NULL);
+        }
+        else
+        {
+            /* could not start a thread? do it here */
+            decrypt_job_run(&jobs[job]);
+        }
+    }
+}
+
+static int default_threads()
+{
+#ifdef _SC_NPROCESSORS_ONLN
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpus > 0)
+    {
+        return cpus < MAX_THREADS ? cpus : MAX_THREADS;
+    }
+#endif
+    return 4;
+}
+
+static double bench_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* decryption speed of both ciphers, on one thread and on all of them */
+static void io_decrypt_bench(int threads)
+{
+    static const char *names[] = { "", "LFSR64", "XTEA" };
+    uint32_t total = 256 * 1024 * 1024;
+    decrypt_job_t *jobs = calloc(threads, sizeof(decrypt_job_t));
+    decrypt_job_t *reference = calloc(threads, sizeof(decrypt_job_t));
+    
+    printf("Decrypting %d MiB in %d KiB chunks\n", total / 1024 / 1024, BLOCKSIZE / 1024);
+    
+    for(uint32_t type = CIPHER_LFSR64; jobs && reference && type <= CIPHER_XTEA; type++)
+    {
+        cipher_setup_t setup = { type, 0xDEADBEEFDEADBEEFULL, 0x00020000 };
+        
+        if(!decrypt_jobs_init(jobs, threads, &setup) || !decrypt_jobs_init(reference, 1, &setup))
+        {
+            decrypt_jobs_free(jobs, threads);
+            break;
+        }
+        
+        for(int thread = 0; thread < threads; thread++)
+        {
+            rand_fill((uint32_t *)jobs[thread].buffer, BLOCKSIZE / 4);
+            jobs[thread].length = BLOCKSIZE;
+        }
+        
+        int counts[2] = { 1, threads };
+        for(int run = 0; run < (threads > 1 ? 2 : 1); run++)
+        {
+            int count = counts[run];
+            double t0 = bench_time();
+            
+            for(uint32_t offset = 0; offset < total; offset += count * BLOCKSIZE)
+            {
+                for(int job = 0; job < count; job++)
+                {
+                    jobs[job].offset = offset + job * BLOCKSIZE;
+                }
+                decrypt_jobs_run(jobs, count);
+            }
+            
+            double t1 = bench_time();
+            printf("%-8s %2d thread%s %8.1f MiB/s\n", names[type], count, count > 1 ? "s:" : ": ", total / 1024.0 / 1024.0 / (t1 - t0));
+        }
+        
+        /* a chunk done by another thread must decrypt the same as in a single thread */
+        memcpy(reference[0].buffer, jobs[0].buffer, BLOCKSIZE);
+        reference[0].length = BLOCKSIZE;
+        reference[0].offset = 12345 * 8;
+        jobs[threads - 1].offset = reference[0].offset;
+        memcpy(jobs[threads - 1].buffer, jobs[0].buffer, BLOCKSIZE);
+        decrypt_jobs_run(reference, 1);
+        decrypt_jobs_run(jobs, threads);
+        if(memcmp(reference[0].buffer, jobs[threads - 1].buffer, BLOCKSIZE))
+        {
+            printf("%-8s multi-threaded output differs!\n", names[type]);
+        }
+        
+        decrypt_jobs_free(jobs, threads);
+        decrypt_jobs_free(reference, 1);
+    }
+    
+    free(jobs);
+    free(reference);
+}
+
 static crypt_cipher_t iocrypt_rsa_ctx;
 int main(int argc, char *argv[])
 {
     //io_decrypt_test();
     //crypt_rsa_test();
     
+    int threads = default_threads();
+    int bench = 0;
+    int args = 1;
+    
+    /* options first, then the file names and password */
+    for(int arg = 1; arg < argc; arg++)
+    {
+        if(!strcmp(argv[arg], "--bench"))
+        {
+            bench = 1;
+        }
+        else if(!strcmp(argv[arg], "--threads") && arg + 1 < argc)
+        {
+            threads = atoi(argv[++arg]);
+            threads = threads < 1 ? 1 : threads > MAX_THREADS ? MAX_THREADS : threads;
+        }
+        else
+        {
+            argv[args++] = argv[arg];
+        }
+    }
+    argc = args;
+    
+    if(bench)
+    {
+        io_decrypt_bench(threads);
+        return 0;
+    }
+    
     if(argc < 2)
     {
-        printf("Usage: '%s <infile> [outfile] [password]\n", argv[0]);
+        printf("Usage: '%s [--threads N] <infile> [outfile] [password]\n", argv[0]);
+        printf("       '%s [--threads N] --bench\n", argv[0]);
         return -1;
     }
     
     uint64_t key = 0;
     uint32_t lfsr_blocksize = 0x00020000;
-    crypt_cipher_t crypt_ctx;
+    cipher_setup_t setup = { CIPHER_LFSR64, 0, 0 };
     
     char *in_filename = argv[1];
     char *out_filename = malloc(strlen(in_filename) + 9);
@@ -161,7 +391,7 @@ int main(int argc, char *argv[])
         return -1;
     } 
     
-    char *buffer = malloc(BLOCKSIZE);
+    char buffer[4];
     
     
     /* try to detect file type */
@@ -197,8 +427,7 @@ int main(int argc, char *argv[])
         }
         
         fseek(in_file, 0x200, SEEK_SET);
-        crypt_lfsr64_init(&crypt_ctx, key);
-        crypt_ctx.set_blocksize(crypt_ctx.priv, lfsr_blocksize);
+        setup.blocksize = lfsr_blocksize;
     }
     else if(!memcmp(buffer, xtea_magic, 4))
     {
@@ -216,11 +445,7 @@ int main(int argc, char *argv[])
         }
         
         fseek(in_file, 0x200, SEEK_SET);
-        
-        /* todo: fill it correctly */
-        uint32_t password[4];
-        memset(password, 0x00, sizeof(password));
-        crypt_xtea_init(&crypt_ctx, password, key);
+        setup.type = CIPHER_XTEA;
     }
     else if(!memcmp(buffer, rsa_magic, 4))
     {
@@ -287,9 +512,7 @@ int main(int argc, char *argv[])
         
         /* now skip that header and continue with LFSR64 decryption */
         fseek(in_file, aligned_header, SEEK_SET);
-        
-        crypt_lfsr64_init(&crypt_ctx, key);
-        crypt_ctx.set_blocksize(crypt_ctx.priv, lfsr_blocksize);
+        setup.blocksize = lfsr_blocksize;
     }
     else if(!memcmp(buffer, rsaxtea_magic, 4))
     {
@@ -355,18 +578,13 @@ int main(int argc, char *argv[])
         
         /* now skip that header and continue with LFSR113 decryption */
         fseek(in_file, aligned_header, SEEK_SET);
-        
-        /* todo: fill it correctly */
-        uint32_t password[4];
-        memset(password, 0x00, sizeof(password));
-        crypt_xtea_init(&crypt_ctx, password, key);
+        setup.type = CIPHER_XTEA;
     }
     else
     {
         if(key)
         {
             printf("File type: unknown. assuming LFSR64\n");
-            crypt_lfsr64_init(&crypt_ctx, key);
         }
         else
         {
@@ -375,63 +593,96 @@ int main(int argc, char *argv[])
         }
     }
     
-    /* setup cipher with that hash */
+    /* setup ciphers with that hash, one for each thread */
+    setup.key = key;
+    decrypt_job_t *jobs = calloc(threads, sizeof(decrypt_job_t));
+    if(!jobs || !decrypt_jobs_init(jobs, threads, &setup))
+    {
+        free(jobs);
+        return -1;
+    }
+    
     uint32_t first = 1;
     FILE *out_file = NULL;
-    
-    
     uint32_t file_offset = 0;
+    int eof = 0;
     
-    
-    while(!feof(in_file))
+    while(!eof)
     {
-        int ret = fread(buffer, 1, BLOCKSIZE, in_file);
-        
-        if(ret > 0)
+        /* read one chunk for each thread */
+        int count = 0;
+        while(count < threads)
         {
-            crypt_ctx.decrypt(crypt_ctx.priv, (uint8_t *)buffer, (uint8_t *)buffer, ret, file_offset);
+            int ret = fread(jobs[count].buffer, 1, BLOCKSIZE, in_file);
             
-            /* try to detect file type */
-            if(first)
+            if(ret > 0)
             {
-                first = 0;
-                
-                if(!memcmp(buffer, jpg_magic, 4))
-                {
-                    printf("File type: JPEG (decrypted)\n");
-                }
-                else if(!memcmp(buffer, cr2_magic, 4))
-                {
-                    printf("File type: CR2 (decrypted)\n");
-                }
-                else
-                {
-                    printf("File type: unknown. invalid key?\n");
-                    fclose(in_file);
-                    free(out_filename);
-                    return 0;
-                }
-                
-                out_file = fopen(out_filename, "w");
-                if(!out_file)
+                jobs[count].length = ret;
+                jobs[count].offset = file_offset;
+                file_offset += ret;
+                count++;
+            }
+            if(ret < BLOCKSIZE)
+            {
+                if(ferror(in_file))
                 {
-                    printf("Could not open '%s'\n", out_filename);
-                    return -1;
+                    printf("Could not read '%s'\n", in_filename);
                 }
+                eof = 1;
+                break;
             }
-            
-            fwrite(buffer, 1, ret, out_file);
-            file_offset += ret;
         }
-        if(ret < 0)
+        
+        if(!count)
         {
-            printf("Could not read '%s'\n", in_filename);
             break;
         }
+        
+        decrypt_jobs_run(jobs, count);
+        
+        /* try to detect file type */
+        if(first)
+        {
+            first = 0;
+            
+            if(!memcmp(jobs[0].buffer, jpg_magic, 4))
+            {
+                printf("File type: JPEG (decrypted)\n");
+            }
+            else if(!memcmp(jobs[0].buffer, cr2_magic, 4))
+            {
+                printf("File type: CR2 (decrypted)\n");
+            }
+            else
+            {
+                printf("File type: unknown. invalid key?\n");
+                fclose(in_file);
+                free(out_filename);
+                return 0;
+            }
+            
+            out_file = fopen(out_filename, "wb");
+            if(!out_file)
+            {
+                printf("Could not open '%s'\n", out_filename);
+                return -1;
+            }
+        }
+        
+        /* write them back in file order */
+        for(int job = 0; job < count; job++)
+        {
+            fwrite(jobs[job].buffer, 1, jobs[job].length, out_file);
+        }
     }
     
+    decrypt_jobs_free(jobs, threads);
+    free(jobs);
     fclose(in_file);
-    fclose(out_file);
+    if(out_file)
+    {
+        fclose(out_file);
+    }
     free(out_filename);
     return 0;
 }
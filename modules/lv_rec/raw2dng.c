@@ -24,6 +24,7 @@
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include "string.h"
 #include "strings.h"
 #include "math.h"
@@ -33,7 +34,10 @@
 #include "qsort.h"  /* much faster than standard C qsort */
 #include "../dual_iso/optmed.h"
 #include "../dual_iso/wirth.h"
+#include "../dual_iso/chroma_smooth.h"
 #include "../mlv_rec/mlv.h"
+#include "../mlv_rec/mlv_reader.h"
+#include "raw2dng.h"
 
 
 /* useful to clean pink dots, may also help with color aliasing, but it's best turned off if you don't have these problems */
@@ -45,8 +49,6 @@ struct raw_info raw_info;
 #define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
 #define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
 
-void fix_vertical_stripes();
-void find_and_fix_cold_pixels(int force_analysis);
 void chroma_smooth();
 
 #define EV_RESOLUTION 32768
@@ -63,7 +65,7 @@ mlv_rtci_hdr_t rtci_hdr;
 mlv_wbal_hdr_t wbal_hdr;
 mlv_vidf_hdr_t vidf_hdr;
 
-FILE **load_all_chunks(char *base_filename, int *entries);
+mlv_reader_t *load_all_chunks(char *base_filename);
 void set_out_file_name(char *outname, char *inname);
 int parse_sidecar(char *scname);
 void init_mlv_structs();
@@ -77,7 +79,6 @@ void set_rtci_block(char *inname);
 void set_vidf_static_block();
 uint64_t mlv_generate_guid();
 uint64_t mlv_prng_lfsr(uint64_t value);
-uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence);
 
 int main(int argc, char** argv)
 {
@@ -105,34 +106,31 @@ int main(int argc, char** argv)
     uint64_t frame_dur_us;
     
     FILE *out_file = NULL;
-    FILE **in_files = NULL;
-    FILE *in_file = NULL;
+    mlv_reader_t *in_reader = NULL;
     char *in_file_name = argv[1];
     int in_file_count = 0;
     int in_file_num = 0;
+    uint64_t in_file_pos = 0;
     
 
-    in_files = load_all_chunks(in_file_name, &in_file_count);
-    if(!in_files || !in_file_count)
+    in_reader = load_all_chunks(in_file_name);
+    if(!in_reader)
     {
         /* Print this out on RAW chunk opening errors */
         printf(" - Exiting program\n");
         exit(1);
     }
-    else
-    {
-        in_file_num = in_file_count;
-        in_file = in_files[in_file_num-1];
-    }
+    in_file_count = mlv_reader_chunk_count(in_reader);
 
+    /* the footer is at the end of the last chunk */
     if (sizeof(lv_rec_file_footer_t) != 192) FAIL("sizeof(lv_rec_file_footer_t) = %d, should be 192", sizeof(lv_rec_file_footer_t));
-    file_set_pos(in_file, -192, SEEK_END);
-
-    memset(&lv_rec_footer, 0x00, sizeof(lv_rec_file_footer_t));
-    int r = fread(&lv_rec_footer, 1, sizeof(lv_rec_file_footer_t), in_file);
-    CHECK(r == sizeof(lv_rec_file_footer_t), "footer");
+    uint64_t last_size = mlv_reader_chunk_size(in_reader, in_file_count - 1);
+    const lv_rec_file_footer_t *footer = NULL;
+    if (last_size >= sizeof(lv_rec_file_footer_t))
+        footer = mlv_reader_map(in_reader, in_file_count - 1, last_size - sizeof(lv_rec_file_footer_t), sizeof(lv_rec_file_footer_t));
+    CHECK(footer, "footer");
+    lv_rec_footer = *footer;
     raw_info = lv_rec_footer.raw_info;
-    file_set_pos(in_file, 0, SEEK_SET);
 
     if (strncmp((char*)lv_rec_footer.magic, "RAWM", 4))
         FAIL("This ain't a lv_rec RAW file\n");
@@ -268,27 +266,44 @@ int main(int argc, char** argv)
 
     int framenumber;
     in_file_num = 0;
-    in_file = in_files[in_file_num];
+    in_file_pos = 0;
     for (framenumber = 0; framenumber < lv_rec_footer.frameCount; framenumber++)
     {
         printf("\rProcessing frame %d of %d ", framenumber+1, lv_rec_footer.frameCount);
         fflush(stdout);
         
-        unsigned int r = fread(raw, 1, lv_rec_footer.frameSize, in_file);
-        if(r != lv_rec_footer.frameSize && in_file_num < in_file_count)
+        /* frames are used right from the mapped file, unless they are split between two chunks */
+        const void *frame = NULL;
+        uint64_t chunk_left = mlv_reader_chunk_size(in_reader, in_file_num) - in_file_pos;
+        unsigned int r = chunk_left < lv_rec_footer.frameSize ? chunk_left : lv_rec_footer.frameSize;
+        
+        if(r == lv_rec_footer.frameSize)
         {
+            frame = mlv_reader_map(in_reader, in_file_num, in_file_pos, r);
+            in_file_pos += r;
+        }
+        else if(in_file_num < in_file_count - 1)
+        {
+            unsigned int h = lv_rec_footer.frameSize - r;
+            const void *head = r ? mlv_reader_map(in_reader, in_file_num, in_file_pos, r) : NULL;
+            const void *tail = mlv_reader_map(in_reader, in_file_num + 1, 0, h);
+            
+            if(tail && (head || !r))
+            {
+                if(head) memcpy(raw, head, r);
+                memcpy(raw + r, tail, h);
+                frame = raw;
+            }
             in_file_num++;
-            in_file = in_files[in_file_num];
+            in_file_pos = h;
             
-            if(r != 0)
+            if(frame && r != 0)
             {
-                raw += r;
-                unsigned int h = fread(raw, 1, (lv_rec_footer.frameSize - r), in_file);
-                raw -= r;
                 printf("\n\nFrame %d is splitted between neigbour file chunks in a sequence\nReconstructing frame -> %u bytes + %u bytes = %u bytes\n\n", framenumber + 1, r, h, r + h);
             }
         }
-        else if(r != lv_rec_footer.frameSize)
+        
+        if(!frame)
         {
             printf("\nError: last file is corrupted.");
             goto abort;
@@ -297,6 +312,12 @@ int main(int argc, char** argv)
         if (!mlvout)
         {
             printf("writing DNG...");
+            
+            /* the corrections below work in place, so the frame needs a private copy */
+            if(frame != raw)
+            {
+                memcpy(raw, frame, lv_rec_footer.frameSize);
+            }
             raw_info.buffer = raw;
             
             /* uncomment if the raw file is recovered from a DNG with dd */
@@ -326,7 +347,7 @@ int main(int argc, char** argv)
                 printf("Failed writing number %d VIDF block header into .MLV file\n", framenumber+1);
                 goto abort;
             }
-            if(fwrite(raw, lv_rec_footer.frameSize, 1, out_file) != 1)
+            if(fwrite(frame, lv_rec_footer.frameSize, 1, out_file) != 1)
             {
                 printf("Failed writing number %d VIDF block data into .MLV file\n", framenumber+1);
                 goto abort;
@@ -338,12 +359,8 @@ int main(int argc, char** argv)
 
 abort:
 
-    /* Close all opened input files and free list of input files */
-    for(in_file_num = 0; in_file_num < in_file_count; in_file_num++)
-    {
-        fclose(in_files[in_file_num]);
-    }
-    free(in_files);
+    /* Unmap and close all input files */
+    mlv_reader_close(in_reader);
     
     free(raw);
 
@@ -375,18 +392,26 @@ void set_out_file_name(char *outname, char *inname)
     outname[namelen-1] = 'V';
 }
 
+/* copy a block out of the mapped sidecar, limited to the size of our local struct */
+static void copy_sidecar_block(void *dst, const mlv_hdr_t *hdr, uint32_t size)
+{
+    memcpy(dst, hdr, hdr->blockSize < size ? hdr->blockSize : size);
+}
+
 int parse_sidecar(char *scname)
 {
-    FILE* sidecar = fopen(scname, "rb");
+    mlv_reader_t *sidecar = mlv_reader_open(scname, 1);
     CHECK(sidecar, "could not open %s", scname);
     printf("Using sidecar file '%s'\n", scname);
     
-    if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, sidecar) != 1)
+    uint64_t position = 0;
+    const mlv_hdr_t *hdr = mlv_reader_block(sidecar, 0, position);
+    if(!hdr)
     {
         printf(" Error: could not read from %s", scname);
         exit(1);   
     }
-    if(memcmp(mlv_hdr.blockType, "MLVI", 4) != 0 || mlv_hdr.blockSize != sizeof(mlv_file_hdr_t))
+    if(memcmp(hdr->blockType, "MLVI", 4) != 0 || hdr->blockSize != sizeof(mlv_file_hdr_t))
     {
         printf("Error: %s is not a valid MLV", scname);
         exit(1);
@@ -396,87 +421,64 @@ int parse_sidecar(char *scname)
        values from the first matched of each block and leave not matched ones unchanged if any. 
        If at least one info block matched return 1 otherwise 0 */
     int i = 0, nof = 0, idntf = 0, expof = 0, lensf = 0, wbalf = 0;
-    long int mlv_hdr_t_size = sizeof(mlv_hdr_t);
-    file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
+    position += hdr->blockSize;
     for (i = 0; i < 30; ++i)
     {
-        if(fread(&mlv_hdr, sizeof(mlv_hdr_t), 1, sidecar) != 1)
+        hdr = mlv_reader_block(sidecar, 0, position);
+        if(!hdr)
         {
             printf(" Error: could not read from %s", scname);
             exit(1);
         }
+        mlv_hdr = *hdr;
+        position += mlv_hdr.blockSize;
         
         if(!memcmp(mlv_hdr.blockType, "IDNT", 4))
         {
             if(!idntf)
             {
-                file_set_pos(sidecar, -mlv_hdr_t_size, SEEK_CUR);
-                if(fread(&idnt_hdr, mlv_hdr.blockSize, 1, sidecar) != 1)
-                {
-                    printf(" Error: could not read from %s", scname);
-                    exit(1);
-                }
+                copy_sidecar_block(&idnt_hdr, hdr, sizeof(idnt_hdr));
                 idnt_hdr.timestamp = 1.300000 * 1000; // override timestamp
                 printf(" IDNT");
                 idntf = 1;
             }
-            else file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
             nof++;
         }
         else if(!memcmp(mlv_hdr.blockType, "EXPO", 4))
         {
             if(!expof)
             {
-                file_set_pos(sidecar, -mlv_hdr_t_size, SEEK_CUR);
-                if(fread(&expo_hdr, mlv_hdr.blockSize, 1, sidecar) != 1)
-                {
-                    printf(" Error: could not read from %s", scname);
-                    exit(1);
-                }
+                copy_sidecar_block(&expo_hdr, hdr, sizeof(expo_hdr));
                 expo_hdr.timestamp = 1.500000 * 1000; // override timestamp
                 printf(" EXPO");
                 expof = 1;
             }
-            else file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
             nof++;
         }
         else if(!memcmp(mlv_hdr.blockType, "LENS", 4))
         {
             if(!lensf)
             {
-                file_set_pos(sidecar, -mlv_hdr_t_size, SEEK_CUR);
-                if(fread(&lens_hdr, mlv_hdr.blockSize, 1, sidecar) != 1)
-                {
-                    printf(" Error: could not read from %s", scname);
-                    exit(1);
-                }
+                copy_sidecar_block(&lens_hdr, hdr, sizeof(lens_hdr));
                 lens_hdr.timestamp = 1.700000 * 1000; // override timestamp
                 printf(" LENS");
                 lensf = 1;
             }
-            else file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
             nof++;
         }
         else if(!memcmp(mlv_hdr.blockType, "WBAL", 4))
         {
             if(!wbalf)
             {
-                file_set_pos(sidecar, -mlv_hdr_t_size, SEEK_CUR);
-                if(fread(&wbal_hdr, mlv_hdr.blockSize, 1, sidecar) != 1)
-                {
-                    printf(" Error: could not read from %s", scname);
-                    exit(1);
-                }
+                copy_sidecar_block(&wbal_hdr, hdr, sizeof(wbal_hdr));
                 wbal_hdr.timestamp = 1.900000 * 1000; // override timestamp
                 printf(" WBAL");
                 wbalf = 1;
             }
-            else file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
             nof++;
         }
         else
         {
-            file_set_pos(sidecar, mlv_hdr.blockSize - mlv_hdr_t_size, SEEK_CUR);
             if(nof == 0)
             {
                 printf("Found");
@@ -485,7 +487,7 @@ int parse_sidecar(char *scname)
         }
         //printf("\n%c%c%c%c", mlv_hdr.blockType[0], mlv_hdr.blockType[1], mlv_hdr.blockType[2], mlv_hdr.blockType[3]);
     }
-    fclose(sidecar);
+    mlv_reader_close(sidecar);
     if(nof == 1)
     {
         printf(" no required block(s)\n\n");
@@ -686,85 +688,41 @@ void set_vidf_static_block()
     vidf_hdr.frameSpace = 0;
 }
 
-FILE **load_all_chunks(char *base_filename, int *entries)
+mlv_reader_t *load_all_chunks(char *base_filename)
 {
-    int seq_number = 0;
-    int max_name_len = strlen(base_filename) + 16;
-    char *filename = malloc(max_name_len);
-    
-    strncpy(filename, base_filename, max_name_len - 1);
-
     /* get extension and check if it is a .RAW */
-    char *dot = strrchr(filename, '.');
+    char *dot = strrchr(base_filename, '.');
     if(dot)
     {
         dot++;
         if(strcasecmp(dot, "raw"))
         {
-            printf("Not a RAW extension %s", filename);
-            free(filename);
+            printf("Not a RAW extension %s", base_filename);
             return NULL;
         }
     }
     else
     {
-        printf("Incorrect file name %s", filename);
-        free(filename);
+        printf("Incorrect file name %s", base_filename);
         return NULL;
     }
 
-    FILE **files = malloc(sizeof(FILE*));
-
-    files[0] = fopen(filename, "rb");
-    if(!files[0])
+    /* the .RAW file and the chunks R00, R01 etc */
+    mlv_reader_t *reader = mlv_reader_open(base_filename, MLV_READER_MAX_CHUNKS);
+    if(!reader)
     {
-        printf("Failed to open file %s", filename);
-        free(filename);
-        free(files);
+        printf("Failed to open file %s", base_filename);
         return NULL;
     }
 
-    printf("\nFound file %s\n", filename);
-    
-    (*entries)++;
-    while(seq_number < 99)
+    int chunk;
+    for(chunk = 0; chunk < mlv_reader_chunk_count(reader); chunk++)
     {
-        FILE **realloc_files = realloc(files, (*entries + 1) * sizeof(FILE*));
-
-        if(!realloc_files)
-        {
-            printf("Error: can not realloc memory");
-            free(filename);
-            free(files);
-            return NULL;
-        }
-
-        files = realloc_files;
-
-        /* check for the next file R00, R01 etc */
-        char seq_name[8];
-
-        sprintf(seq_name, "%02d", seq_number);
-        seq_number++;
-
-        strcpy(&filename[strlen(filename) - 2], seq_name);
-
-        /* try to open */
-        files[*entries] = fopen(filename, "rb");
-        if(files[*entries])
-        {
-            printf("Found file %s\n", filename);
-            (*entries)++;
-        }
-        else
-        {
-            printf("--- End of sequence ---\n");
-            break;
-        }
+        printf("%sFound file %s\n", chunk ? "" : "\n", mlv_reader_chunk_name(reader, chunk));
     }
+    printf("--- End of sequence ---\n");
 
-    free(filename);
-    return files;
+    return reader;
 }
 
 uint64_t mlv_prng_lfsr(uint64_t value)
@@ -806,19 +764,11 @@ uint64_t mlv_generate_guid()
     /* now run through final prng pass */
     return mlv_prng_lfsr(guid);
 }
-
-uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
-{
-#if defined(__WIN32)
-    return fseeko64(stream, offset, whence);
-#else
-    return fseeko(stream, offset, whence);
-#endif
-}
 #endif
 
-int raw_get_pixel(int x, int y) {
-    struct raw_pixblock * p = (void*)raw_info.buffer + y * raw_info.pitch + (x/8)*14;
+int raw_info_get_pixel(struct raw_info * info, int x, int y)
+{
+    struct raw_pixblock * p = (void*)info->buffer + y * info->pitch + (x/8)*14;
     switch (x%8) {
         case 0: return p->a;
         case 1: return p->b_lo | (p->b_hi << 12);
@@ -832,9 +782,9 @@ int raw_get_pixel(int x, int y) {
     return p->a;
 }
 
-void raw_set_pixel(int x, int y, int value)
+void raw_info_set_pixel(struct raw_info * info, int x, int y, int value)
 {
-    struct raw_pixblock * p = (void*)raw_info.buffer + y * raw_info.pitch + (x/8)*14;
+    struct raw_pixblock * p = (void*)info->buffer + y * info->pitch + (x/8)*14;
     switch (x%8) {
         case 0: p->a = value; break;
         case 1: p->b_lo = value; p->b_hi = value >> 12; break;
@@ -847,6 +797,16 @@ void raw_set_pixel(int x, int y, int value)
     }
 }
 
+int raw_get_pixel(int x, int y)
+{
+    return raw_info_get_pixel(&raw_info, x, y);
+}
+
+void raw_set_pixel(int x, int y, int value)
+{
+    raw_info_set_pixel(&raw_info, x, y, value);
+}
+
 /**
  * Fix vertical stripes (banding) from 5D Mark III (and maybe others).
  * 
@@ -864,9 +824,10 @@ void raw_set_pixel(int x, int y, int value)
 
 #define FIXP_ONE 65536
 #define FIXP_RANGE 65536
+#define MAX_COLD_PIXELS 200000
 
-static int stripes_coeffs[8] = {0};
-static int stripes_correction_needed = 0;
+/* correction state used by the legacy interface (global raw_info) */
+static struct raw_fix_state global_fix_state = RAW_FIX_STATE_INIT;
 
 /* do not use typeof in macros, use __typeof__ instead.
    see: http://gcc.gnu.org/onlinedocs/gcc-4.1.2/gcc/Alternate-Keywords.html#Alternate-Keywords
@@ -907,11 +868,18 @@ static int stripes_correction_needed = 0;
 #define SET_PG(x) { int v = (x); p->g_lo = v; p->g_hi = v >> 2; }
 #define SET_PH(x) { int v = (x); p->h = v; }
 
-#define RAW_MUL(p, x) ((((int)(p) - raw_info.black_level) * (int)(x) / FIXP_ONE) + raw_info.black_level)
+#define RAW_MUL(p, x) ((((int)(p) - black) * (int)(x) / FIXP_ONE) + black)
 #define F2H(ev) COERCE((int)(FIXP_RANGE/2 + ev * FIXP_RANGE/2), 0, FIXP_RANGE-1)
 #define H2F(x) ((double)((x) - FIXP_RANGE/2) / (FIXP_RANGE/2))
 
-static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, int pb)
+/* rand() keeps a hidden global state; each detection uses its own sequence, so it's reentrant and repeatable */
+static inline int stripes_rand(unsigned int * seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return (*seed >> 16) & 0x7FFF;
+}
+
+static void add_pixel(int hist[8][FIXP_RANGE], int num[8], unsigned int * seed, int offset, int pa, int pb, int white_level)
 {
     int a = pa;
     int b = pb;
@@ -919,7 +887,7 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
     if (MIN(a,b) < 32)
         return; /* too noisy */
 
-    if (MAX(a,b) > raw_info.white_level / 1.1)
+    if (MAX(a,b) > white_level / 1.1)
         return; /* too bright */
         
     /**
@@ -932,8 +900,8 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
      * 
      * this removes spikes on the histogram, thus canceling bias towards "round" values
      */
-    double af = a + (rand() % 1024) / 1024.0 - 0.5;
-    double bf = b + (rand() % 1024) / 1024.0 - 0.5;
+    double af = a + (stripes_rand(seed) % 1024) / 1024.0 - 0.5;
+    double bf = b + (stripes_rand(seed) % 1024) / 1024.0 - 0.5;
     double factor = af / bf;
     double ev = log2(factor);
     
@@ -946,47 +914,53 @@ static void add_pixel(int hist[8][FIXP_RANGE], int num[8], int offset, int pa, i
 }
 
 
-static void detect_vertical_stripes_coeffs()
+static void detect_vertical_stripes_coeffs(struct raw_info * info, struct raw_fix_state * state)
 {
-    static int hist[8][FIXP_RANGE];
-    static int num[8];
+    /* 2 MB, too large for the stack of a worker thread */
+    int (*hist)[FIXP_RANGE] = calloc(8, sizeof(*hist));
+    int num[8] = {0};
+    unsigned int seed = 1;
+    int * stripes_coeffs = state->stripes_coeffs;
     
-    memset(hist, 0, sizeof(hist));
-    memset(num, 0, sizeof(num));
+    /* start over, a re-estimation must not keep coefficients from the previous one */
+    memset(stripes_coeffs, 0, sizeof(state->stripes_coeffs));
+
+    CHECK(hist, "malloc");
 
     /* compute 7 histograms: b./a, c./a ... h./a */
     /* that is, adjust all columns to make them as bright as a */
     /* process green pixels only, assuming the image is RGGB */
+    int white_level = info->white_level;
     struct raw_pixblock * row;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += 2 * raw_info.pitch / sizeof(struct raw_pixblock))
+    for (row = info->buffer; (void*)row < (void*)info->buffer + info->pitch * info->height; row += 2 * info->pitch / sizeof(struct raw_pixblock))
     {
         /* first line is RG */
         struct raw_pixblock * rg;
-        for (rg = row; (void*)rg < (void*)row + raw_info.pitch - sizeof(struct raw_pixblock); rg++)
+        for (rg = row; (void*)rg < (void*)row + info->pitch - sizeof(struct raw_pixblock); rg++)
         {
             /* next line is GB */
-            struct raw_pixblock * gb = rg + raw_info.pitch / sizeof(struct raw_pixblock);
+            struct raw_pixblock * gb = rg + info->pitch / sizeof(struct raw_pixblock);
 
             struct raw_pixblock * p = rg;
-            int pb = PB - raw_info.black_level;
-            int pd = PD - raw_info.black_level;
-            int pf = PF - raw_info.black_level;
-            int ph = PH - raw_info.black_level;
+            int pb = PB - info->black_level;
+            int pd = PD - info->black_level;
+            int pf = PF - info->black_level;
+            int ph = PH - info->black_level;
             p++;
-            int pb2 = PB - raw_info.black_level;
-            int pd2 = PD - raw_info.black_level;
-            int pf2 = PF - raw_info.black_level;
-            int ph2 = PH - raw_info.black_level;
+            int pb2 = PB - info->black_level;
+            int pd2 = PD - info->black_level;
+            int pf2 = PF - info->black_level;
+            int ph2 = PH - info->black_level;
             p = gb;
-            //int pa = PA - raw_info.black_level;
-            int pc = PC - raw_info.black_level;
-            int pe = PE - raw_info.black_level;
-            int pg = PG - raw_info.black_level;
+            //int pa = PA - info->black_level;
+            int pc = PC - info->black_level;
+            int pe = PE - info->black_level;
+            int pg = PG - info->black_level;
             p++;
-            int pa2 = PA - raw_info.black_level;
-            int pc2 = PC - raw_info.black_level;
-            int pe2 = PE - raw_info.black_level;
-            int pg2 = PG - raw_info.black_level;
+            int pa2 = PA - info->black_level;
+            int pc2 = PC - info->black_level;
+            int pe2 = PE - info->black_level;
+            int pg2 = PG - info->black_level;
             
             /**
              * verification: introducing strong banding in one column
@@ -1004,13 +978,13 @@ static void detect_vertical_stripes_coeffs()
              * and so on, to avoid getting tricked by smooth gradients.
              */
 
-            add_pixel(hist, num, 1, pa2, (pb * 1 + pb2 * 7) / 8);
-            add_pixel(hist, num, 2, pa2, (pc * 2 + pc2 * 6) / 8);
-            add_pixel(hist, num, 3, pa2, (pd * 3 + pd2 * 5) / 8);
-            add_pixel(hist, num, 4, pa2, (pe * 4 + pe2 * 4) / 8);
-            add_pixel(hist, num, 5, pa2, (pf * 5 + pf2 * 3) / 8);
-            add_pixel(hist, num, 6, pa2, (pg * 6 + pg2 * 2) / 8);
-            add_pixel(hist, num, 7, pa2, (ph * 7 + ph2 * 1) / 8);
+            add_pixel(hist, num, &seed, 1, pa2, (pb * 1 + pb2 * 7) / 8, white_level);
+            add_pixel(hist, num, &seed, 2, pa2, (pc * 2 + pc2 * 6) / 8, white_level);
+            add_pixel(hist, num, &seed, 3, pa2, (pd * 3 + pd2 * 5) / 8, white_level);
+            add_pixel(hist, num, &seed, 4, pa2, (pe * 4 + pe2 * 4) / 8, white_level);
+            add_pixel(hist, num, &seed, 5, pa2, (pf * 5 + pf2 * 3) / 8, white_level);
+            add_pixel(hist, num, &seed, 6, pa2, (pg * 6 + pg2 * 2) / 8, white_level);
+            add_pixel(hist, num, &seed, 7, pa2, (ph * 7 + ph2 * 1) / 8, white_level);
         }
     }
 
@@ -1024,7 +998,7 @@ static void detect_vertical_stripes_coeffs()
     /* compute the median correction factor (this will reject outliers) */
     for (j = 0; j < 8; j++)
     {
-        if (num[j] < raw_info.frame_size / 128) continue;
+        if (num[j] < info->frame_size / 128) continue;
         int t = 0;
         for (k = 0; k < FIXP_RANGE; k++)
         {
@@ -1065,18 +1039,20 @@ static void detect_vertical_stripes_coeffs()
     system("octave-cli --persist raw2dng.m");
 #endif
 
+    free(hist);
+
     stripes_coeffs[0] = FIXP_ONE;
 
     /* do we really need stripe correction, or it won't be noticeable? or maybe it's just computation error? */
-    stripes_correction_needed = 0;
+    state->stripes_correction_needed = 0;
     for (j = 0; j < 8; j++)
     {
         double c = (double)stripes_coeffs[j] / FIXP_ONE;
         if (c < 0.998 || c > 1.002)
-            stripes_correction_needed = 1;
+            state->stripes_correction_needed = 1;
     }
     
-    if (stripes_correction_needed)
+    if (state->stripes_correction_needed)
     {
         printf("\n\nVertical stripes correction:\n");
         for (j = 0; j < 8; j++)
@@ -1090,28 +1066,29 @@ static void detect_vertical_stripes_coeffs()
     }
 }
 
-static void apply_vertical_stripes_correction()
+/* a band of rows of the stripe correction, for one thread */
+struct stripes_band
 {
-    /**
-     * inexact white level will result in banding in highlights, especially if some channels are clipped
-     * 
-     * so... we'll try to use a better estimation of white level *for this particular purpose*
-     * start with a gross under-estimation, then consider white = max(all pixels)
-     * just in case the exif one is way off
-     * reason: 
-     *   - if there are no pixels above the true white level, it shouldn't hurt;
-     *     worst case, the brightest pixel(s) will be underexposed by 0.1 EV or so
-     *   - if there are, we will choose the true white level
-     */
-     
-    int white = raw_info.white_level * 2 / 3;
+    struct raw_info * info;
+    int * stripes_coeffs;
+    int y0, y1;
+    int white;
+    pthread_t thread;
+};
+
+/* brightest pixel of the band, starting from band->white */
+static void * stripes_band_white(void * arg)
+{
+    struct stripes_band * band = arg;
+    struct raw_info * info = band->info;
+    int white = band->white;
     
     struct raw_pixblock * row;
     
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    for (row = info->buffer + info->pitch * band->y0; (void*)row < (void*)info->buffer + info->pitch * band->y1; row += info->pitch / sizeof(struct raw_pixblock))
     {
         struct raw_pixblock * p;
-        for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
+        for (p = row; (void*)p < (void*)row + info->pitch; p++)
         {
             white = MAX(white, PA);
             white = MAX(white, PB);
@@ -1124,11 +1101,24 @@ static void apply_vertical_stripes_correction()
         }
     }
     
-    int black = raw_info.black_level;
-    for (row = raw_info.buffer; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.height; row += raw_info.pitch / sizeof(struct raw_pixblock))
+    band->white = white;
+    return NULL;
+}
+
+static void * stripes_band_apply(void * arg)
+{
+    struct stripes_band * band = arg;
+    struct raw_info * info = band->info;
+    int * stripes_coeffs = band->stripes_coeffs;
+    int white = band->white;
+    int black = info->black_level;
+    
+    struct raw_pixblock * row;
+    
+    for (row = info->buffer + info->pitch * band->y0; (void*)row < (void*)info->buffer + info->pitch * band->y1; row += info->pitch / sizeof(struct raw_pixblock))
     {
         struct raw_pixblock * p;
-        for (p = row; (void*)p < (void*)row + raw_info.pitch; p++)
+        for (p = row; (void*)p < (void*)row + info->pitch; p++)
         {
             int pa = PA;
             int pb = PB;
@@ -1156,23 +1146,228 @@ static void apply_vertical_stripes_correction()
             if (stripes_coeffs[7] && ph && ph < white && pa > black + 64) SET_PH(MIN(white, RAW_MUL(ph, stripes_coeffs[7])));
         }
     }
+    
+    return NULL;
 }
 
-void fix_vertical_stripes()
+/* run func on all bands: band 0 in the caller's thread, the others in their own threads */
+static void stripes_bands_run(struct stripes_band * bands, int count, void * (*func)(void *))
+{
+    int started[count];
+    
+    for (int i = 1; i < count; i++)
+    {
+        /* if a thread can't be started, do its band right here */
+        started[i] = !pthread_create(&bands[i].thread, NULL, func, &bands[i]);
+        if (!started[i])
+        {
+            func(&bands[i]);
+        }
+    }
+    
+    func(&bands[0]);
+    
+    for (int i = 1; i < count; i++)
+    {
+        if (started[i])
+        {
+            pthread_join(bands[i].thread, NULL);
+        }
+    }
+}
+
+static void apply_vertical_stripes_correction(struct raw_info * info, struct raw_fix_state * state)
 {
-    /* for speed: only detect correction factors from the first frame */
-    static int first_time = 1;
-    if (first_time)
+    /**
+     * inexact white level will result in banding in highlights, especially if some channels are clipped
+     * 
+     * so... we'll try to use a better estimation of white level *for this particular purpose*
+     * start with a gross under-estimation, then consider white = max(all pixels)
+     * just in case the exif one is way off
+     * reason: 
+     *   - if there are no pixels above the true white level, it shouldn't hurt;
+     *     worst case, the brightest pixel(s) will be underexposed by 0.1 EV or so
+     *   - if there are, we will choose the true white level
+     */
+    
+    /* rows are independent, so both passes can be split into bands; the white level is the max of all bands */
+    int count = COERCE(state->threads, 1, 64);
+    count = MIN(count, MAX(1, info->height / 16));
+    struct stripes_band bands[count];
+    
+    for (int i = 0; i < count; i++)
     {
-        detect_vertical_stripes_coeffs();
-        first_time = 0;
+        bands[i].info = info;
+        bands[i].stripes_coeffs = state->stripes_coeffs;
+        bands[i].y0 = info->height * i / count;
+        bands[i].y1 = info->height * (i + 1) / count;
+        bands[i].white = info->white_level * 2 / 3;
     }
     
+    stripes_bands_run(bands, count, stripes_band_white);
+    
+    int white = info->white_level * 2 / 3;
+    for (int i = 0; i < count; i++)
+    {
+        white = MAX(white, bands[i].white);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        bands[i].white = white;
+    }
+    
+    stripes_bands_run(bands, count, stripes_band_apply);
+}
+
+void raw_fix_vertical_stripes(struct raw_info * info, struct raw_fix_state * state)
+{
+    /* for speed: only detect correction factors from the first frame, or once every stripes_interval frames */
+    if (!state->stripes_detected || (state->stripes_interval > 0 && state->stripes_frames >= state->stripes_interval))
+    {
+        detect_vertical_stripes_coeffs(info, state);
+        state->stripes_detected = 1;
+        state->stripes_frames = 0;
+    }
+    state->stripes_frames++;
+    
     /* only apply stripe correction if we need it, since it takes a little CPU time */
-    if (stripes_correction_needed)
+    if (state->stripes_correction_needed)
+    {
+        apply_vertical_stripes_correction(info, state);
+    }
+}
+
+void raw_stripes_cache_init(struct raw_stripes_cache * cache, int interval)
+{
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+    cache->interval = MAX(0, interval);
+    cache->count = 0;
+    cache->estimates = NULL;
+}
+
+void raw_stripes_cache_free(struct raw_stripes_cache * cache)
+{
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->cond);
+    free(cache->estimates);
+    cache->estimates = NULL;
+    cache->count = 0;
+}
+
+/* estimate slot for the interval, allocated on first use. call with the lock held */
+static struct raw_stripes_estimate * raw_stripes_cache_get(struct raw_stripes_cache * cache, int period)
+{
+    if (period >= cache->count)
+    {
+        int count = MAX(period + 1, cache->count * 2);
+        struct raw_stripes_estimate * estimates = realloc(cache->estimates, count * sizeof(cache->estimates[0]));
+        CHECK(estimates, "malloc");
+        memset(estimates + cache->count, 0, (count - cache->count) * sizeof(estimates[0]));
+        cache->estimates = estimates;
+        cache->count = count;
+    }
+    
+    return &cache->estimates[period];
+}
+
+static int raw_stripes_cache_period(struct raw_stripes_cache * cache, int index)
+{
+    return cache->interval > 0 ? index / cache->interval : 0;
+}
+
+void raw_fix_vertical_stripes_cached(struct raw_info * info, struct raw_fix_state * state, struct raw_stripes_cache * cache, int index)
+{
+    int period = raw_stripes_cache_period(cache, index);
+    int first = (index == period * cache->interval);
+    
+    pthread_mutex_lock(&cache->lock);
+    raw_stripes_cache_get(cache, period);
+    
+    if (first)
+    {
+        /* this frame estimates the coefficients for its interval */
+        pthread_mutex_unlock(&cache->lock);
+        
+        detect_vertical_stripes_coeffs(info, state);
+        
+        pthread_mutex_lock(&cache->lock);
+        struct raw_stripes_estimate * estimate = raw_stripes_cache_get(cache, period);
+        estimate->correction_needed = state->stripes_correction_needed;
+        memcpy(estimate->coeffs, state->stripes_coeffs, sizeof(estimate->coeffs));
+        estimate->status = RAW_STRIPES_READY;
+        pthread_cond_broadcast(&cache->cond);
+    }
+    else
+    {
+        /* wait for the estimate of this interval; if its frame was skipped, fall back to an earlier one */
+        state->stripes_correction_needed = 0;
+        for (int p = period; p >= 0; p--)
+        {
+            while (cache->estimates[p].status == RAW_STRIPES_PENDING)
+            {
+                pthread_cond_wait(&cache->cond, &cache->lock);
+            }
+            
+            struct raw_stripes_estimate * estimate = &cache->estimates[p];
+            if (estimate->status == RAW_STRIPES_READY)
+            {
+                state->stripes_correction_needed = estimate->correction_needed;
+                memcpy(state->stripes_coeffs, estimate->coeffs, sizeof(state->stripes_coeffs));
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    
+    state->stripes_detected = 1;
+    
+    if (state->stripes_correction_needed)
+    {
+        apply_vertical_stripes_correction(info, state);
+    }
+}
+
+void raw_stripes_cache_skip(struct raw_stripes_cache * cache, int index)
+{
+    int period = raw_stripes_cache_period(cache, index);
+    
+    if (index != period * cache->interval)
     {
-        apply_vertical_stripes_correction();
+        /* nobody waits for this one */
+        return;
     }
+    
+    pthread_mutex_lock(&cache->lock);
+    struct raw_stripes_estimate * estimate = raw_stripes_cache_get(cache, period);
+    if (estimate->status == RAW_STRIPES_PENDING)
+    {
+        estimate->status = RAW_STRIPES_SKIPPED;
+        pthread_cond_broadcast(&cache->cond);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int raw_fix_cpu_count()
+{
+#if defined(_SC_NPROCESSORS_ONLN)
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+#else
+    /* Windows */
+    char * env = getenv("NUMBER_OF_PROCESSORS");
+    long count = env ? atol(env) : 1;
+#endif
+    return count > 0 ? count : 1;
+}
+
+void fix_vertical_stripes()
+{
+    /* raw2dng converts one frame at a time, so the correction may use all CPUs */
+    if (!global_fix_state.threads)
+    {
+        global_fix_state.threads = raw_fix_cpu_count();
+    }
+    raw_fix_vertical_stripes(&raw_info, &global_fix_state);
 }
 
 static inline int FC(int row, int col)
@@ -1192,32 +1387,32 @@ static inline int FC(int row, int col)
 }
 
 
-void find_and_fix_cold_pixels(int force_analysis)
+void raw_fix_cold_pixels(struct raw_info * info, struct raw_fix_state * state, int force_analysis)
 {
-    #define MAX_COLD_PIXELS 200000
-  
-    struct xy { int x; int y; };
-    
-    static struct xy cold_pixel_list[MAX_COLD_PIXELS];
-    static int cold_pixels = -1;
-    
-    int w = raw_info.width;
-    int h = raw_info.height;
+    int w = info->width;
+    int h = info->height;
     
     /* scan for bad pixels in the first frame only, or on request*/
-    if (cold_pixels < 0 || force_analysis)
+    if (state->cold_pixels < 0 || force_analysis)
     {
-        cold_pixels = 0;
+        if (!state->cold_pixel_list)
+        {
+            state->cold_pixel_list = malloc(MAX_COLD_PIXELS * sizeof(state->cold_pixel_list[0]));
+            CHECK(state->cold_pixel_list, "malloc");
+        }
+
+        struct raw_xy * cold_pixel_list = state->cold_pixel_list;
+        int cold_pixels = 0;
         
         /* at sane ISOs, noise stdev is well less than 50, so 200 should be enough */
-        int cold_thr = MAX(0, raw_info.black_level - 200);
+        int cold_thr = MAX(0, info->black_level - 200);
 
         /* analyse all pixels of the frame */
         for (int y = 0; y < h; y++)
         {
             for (int x = 0; x < w; x++)
             {
-                int p = raw_get_pixel(x, y);
+                int p = raw_info_get_pixel(info, x, y);
                 int is_cold = (p < cold_thr);
 
                 /* create a list containing the cold pixels */
@@ -1230,8 +1425,12 @@ void find_and_fix_cold_pixels(int force_analysis)
             }
         }
         printf("\rCold pixels : %d                             \n", (cold_pixels));
+        state->cold_pixels = cold_pixels;
     }  
 
+    struct raw_xy * cold_pixel_list = state->cold_pixel_list;
+    int cold_pixels = state->cold_pixels;
+
     /* repair the cold pixels */
     for (int p = 0; p < cold_pixels; p++)
     {
@@ -1265,519 +1464,58 @@ void find_and_fix_cold_pixels(int force_analysis)
                     continue;
                 }
 
-                int p = raw_get_pixel(x+j, y+i);
+                int p = raw_info_get_pixel(info, x+j, y+i);
                 neighbours[k++] = -p;
             }
         }
         
         /* replace the cold pixel with the median of the neighbours */
-        raw_set_pixel(x, y, -median_int_wirth(neighbours, k));
+        raw_info_set_pixel(info, x, y, -median_int_wirth(neighbours, k));
     }
     
 }
 
-#ifdef CHROMA_SMOOTH
-
-static void chroma_smooth_3x3(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw)
+void find_and_fix_cold_pixels(int force_analysis)
 {
-    int w = raw_info.width;
-    int h = raw_info.height;
-    int x,y;
-
-    for (y = 4; y < h-5; y += 2)
-    {
-        for (x = 4; x < w-4; x += 2)
-        {
-            /**
-             * for each red pixel, compute the median value of red minus interpolated green at the same location
-             * the median value is then considered the "true" difference between red and green
-             * same for blue vs green
-             * 
-             *
-             * each red pixel has 4 green neighbours, so we may interpolate as follows:
-             * - mean or median(t,b,l,r)
-             * - choose between mean(t,b) and mean(l,r) (idea from AHD)
-             * 
-             * same for blue; note that a RG/GB cell has 6 green pixels that we need to analyze
-             * 2 only for red, 2 only for blue, and 2 shared
-             *    g
-             *   gRg
-             *    gBg
-             *     g
-             *
-             * choosing the interpolation direction seems to give cleaner results
-             * the direction is choosen over the entire filtered area (so we do two passes, one for each direction, 
-             * and at the end choose the one for which total interpolation error is smaller)
-             * 
-             * error = sum(abs(t-b)) or sum(abs(l-r))
-             * 
-             * interpolation in EV space (rather than linear) seems to have less color artifacts in high-contrast areas
-             * 
-             * we can use this filter for 3x3 RG/GB cells or 5x5
-             */
-            int i,j;
-            int k = 0;
-            int med_r[9];
-            int med_b[9];
-            
-            /* first try to interpolate in horizontal direction */
-            int eh = 0;
-            for (i = -2; i <= 2; i += 2)
-            {
-                for (j = -2; j <= 2; j += 2)
-                {
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                    int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                  //int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                    int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                  //int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                    g3 = raw2ev[g3];
-                  //g4 = raw2ev[g4];
-                    g5 = raw2ev[g5];
-                  //g6 = raw2ev[g6];
-                    
-                    int gr = (g1+g3)/2;
-                    int gb = (g2+g5)/2;
-                    eh += ABS(g1-g3) + ABS(g2-g5);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with horizontal interpolation */
-            int drh = opt_med9(med_r);
-            int dbh = opt_med9(med_b);
-            
-            /* next, try to interpolate in vertical direction */
-            int ev = 0;
-            k = 0;
-            for (i = -2; i <= 2; i += 2)
-            {
-                for (j = -2; j <= 2; j += 2)
-                {
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                  //int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                    int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                  //int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                    int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                  //g3 = raw2ev[g3];
-                    g4 = raw2ev[g4];
-                  //g5 = raw2ev[g5];
-                    g6 = raw2ev[g6];
-                    
-                    int gr = (g2+g4)/2;
-                    int gb = (g1+g6)/2;
-                    ev += ABS(g2-g4) + ABS(g1-g6);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with vertical interpolation */
-            int drv = opt_med9(med_r);
-            int dbv = opt_med9(med_b);
-
-            /* back to our filtered pixels (RG/GB cell) */
-            int g1 = inp[x+1 +     y * w];
-            int g2 = inp[x   + (y+1) * w];
-            int g3 = inp[x-1 +   (y) * w];
-            int g4 = inp[x   + (y-1) * w];
-            int g5 = inp[x+2 + (y+1) * w];
-            int g6 = inp[x+1 + (y+2) * w];
-            
-            g1 = raw2ev[g1];
-            g2 = raw2ev[g2];
-            g3 = raw2ev[g3];
-            g4 = raw2ev[g4];
-            g5 = raw2ev[g5];
-            g6 = raw2ev[g6];
-
-            /* which of the two interpolations will we choose? */
-            int grv = (g2+g4)/2;
-            int grh = (g1+g3)/2;
-            int gbv = (g1+g6)/2;
-            int gbh = (g2+g5)/2;
-            int gr = ev < eh ? grv : grh;
-            int gb = ev < eh ? gbv : gbh;
-            int dr = ev < eh ? drv : drh;
-            int db = ev < eh ? dbv : dbh;
-            
-            int r0 = inp[x   +     y * w];
-            int b0 = inp[x+1 + (y+1) * w];
-
-            /* if we are close to the noise floor, use both directions, beacuse otherwise it will affect the noise structure and introduce false detail */
-            /* todo: smooth transition between the two methods? better thresholding condition? */
-            int thr = 64;
-            if (r0 < raw_info.black_level+thr || b0 < raw_info.black_level+thr || ABS(drv - drh) < thr || ABS(grv-grh) < thr || ABS(gbv-gbh) < thr)
-            {
-                dr = (drv+drh)/2;
-                db = (dbv+dbh)/2;
-                gr = (g1+g2+g3+g4)/4;
-                gb = (g1+g2+g5+g6)/4;
-            }
-
-            /* replace red and blue pixels with filtered values, keep green pixels unchanged */
-            /* don't touch overexposed areas */
-            if (out[x   +     y * w] < raw_info.white_level)
-                out[x   +     y * w] = ev2raw[COERCE(gr + dr, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
-            
-            if (out[x+1  + (y+1)* w] < raw_info.white_level)
-                out[x+1 + (y+1) * w] = ev2raw[COERCE(gb + db, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
-        }
-    }
+    raw_fix_cold_pixels(&raw_info, &global_fix_state, force_analysis);
 }
 
-/* processes top, bottom, left and right neighbours */
-static void chroma_smooth_2x2(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw)
+void raw_fix_init(struct raw_fix_state * state)
 {
-    int w = raw_info.width;
-    int h = raw_info.height;
-    int x,y;
-
-    for (y = 4; y < h-5; y += 2)
-    {
-        for (x = 4; x < w-4; x += 2)
-        {
-            /**
-             * for each red pixel, compute the median value of red minus interpolated green at the same location
-             * the median value is then considered the "true" difference between red and green
-             * same for blue vs green
-             * 
-             *
-             * each red pixel has 4 green neighbours, so we may interpolate as follows:
-             * - mean or median(t,b,l,r)
-             * - choose between mean(t,b) and mean(l,r) (idea from AHD)
-             * 
-             * same for blue; note that a RG/GB cell has 6 green pixels that we need to analyze
-             * 2 only for red, 2 only for blue, and 2 shared
-             *    g
-             *   gRg
-             *    gBg
-             *     g
-             *
-             * choosing the interpolation direction seems to give cleaner results
-             * the direction is choosen over the entire filtered area (so we do two passes, one for each direction, 
-             * and at the end choose the one for which total interpolation error is smaller)
-             * 
-             * error = sum(abs(t-b)) or sum(abs(l-r))
-             * 
-             * interpolation in EV space (rather than linear) seems to have less color artifacts in high-contrast areas
-             * 
-             * we can use this filter for 3x3 RG/GB cells or 5x5
-             */
-            int i,j;
-            int k = 0;
-            int med_r[5];
-            int med_b[5];
-            
-            /* first try to interpolate in horizontal direction */
-            int eh = 0;
-            for (i = -2; i <= 2; i += 2)
-            {
-                for (j = -2; j <= 2; j += 2)
-                {
-                    if (ABS(i) + ABS(j) == 4) continue;
-                    
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                    int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                  //int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                    int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                  //int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                    g3 = raw2ev[g3];
-                  //g4 = raw2ev[g4];
-                    g5 = raw2ev[g5];
-                  //g6 = raw2ev[g6];
-                    
-                    int gr = (g1+g3)/2;
-                    int gb = (g2+g5)/2;
-                    eh += ABS(g1-g3) + ABS(g2-g5);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with horizontal interpolation */
-            int drh = opt_med5(med_r);
-            int dbh = opt_med5(med_b);
-            
-            /* next, try to interpolate in vertical direction */
-            int ev = 0;
-            k = 0;
-            for (i = -2; i <= 2; i += 2)
-            {
-                for (j = -2; j <= 2; j += 2)
-                {
-                    if (ABS(i) + ABS(j) == 4) continue;
-
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                  //int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                    int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                  //int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                    int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                  //g3 = raw2ev[g3];
-                    g4 = raw2ev[g4];
-                  //g5 = raw2ev[g5];
-                    g6 = raw2ev[g6];
-                    
-                    int gr = (g2+g4)/2;
-                    int gb = (g1+g6)/2;
-                    ev += ABS(g2-g4) + ABS(g1-g6);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with vertical interpolation */
-            int drv = opt_med5(med_r);
-            int dbv = opt_med5(med_b);
-
-            /* back to our filtered pixels (RG/GB cell) */
-            int g1 = inp[x+1 +     y * w];
-            int g2 = inp[x   + (y+1) * w];
-            int g3 = inp[x-1 +   (y) * w];
-            int g4 = inp[x   + (y-1) * w];
-            int g5 = inp[x+2 + (y+1) * w];
-            int g6 = inp[x+1 + (y+2) * w];
-            
-            g1 = raw2ev[g1];
-            g2 = raw2ev[g2];
-            g3 = raw2ev[g3];
-            g4 = raw2ev[g4];
-            g5 = raw2ev[g5];
-            g6 = raw2ev[g6];
-
-            /* which of the two interpolations will we choose? */
-            int grv = (g2+g4)/2;
-            int grh = (g1+g3)/2;
-            int gbv = (g1+g6)/2;
-            int gbh = (g2+g5)/2;
-            int gr = ev < eh ? grv : grh;
-            int gb = ev < eh ? gbv : gbh;
-            int dr = ev < eh ? drv : drh;
-            int db = ev < eh ? dbv : dbh;
-            
-            int r0 = inp[x   +     y * w];
-            int b0 = inp[x+1 + (y+1) * w];
-
-            /* if we are close to the noise floor, use both directions, beacuse otherwise it will affect the noise structure and introduce false detail */
-            /* todo: smooth transition between the two methods? better thresholding condition? */
-            int thr = 64;
-            if (r0 < raw_info.black_level+thr || b0 < raw_info.black_level+thr || ABS(drv - drh) < thr || ABS(grv-grh) < thr || ABS(gbv-gbh) < thr)
-            {
-                dr = (drv+drh)/2;
-                db = (dbv+dbh)/2;
-                gr = (g1+g2+g3+g4)/4;
-                gb = (g1+g2+g5+g6)/4;
-            }
+    struct raw_fix_state empty = RAW_FIX_STATE_INIT;
+    *state = empty;
+}
 
-            /* replace red and blue pixels with filtered values, keep green pixels unchanged */
-            /* don't touch overexposed areas */
-            if (out[x   +     y * w] < raw_info.white_level)
-                out[x   +     y * w] = ev2raw[COERCE(gr + dr, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
-            
-            if (out[x+1  + (y+1)* w] < raw_info.white_level)
-                out[x+1 + (y+1) * w] = ev2raw[COERCE(gb + db, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
-        }
-    }
+void raw_fix_free(struct raw_fix_state * state)
+{
+    free(state->cold_pixel_list);
+    raw_fix_init(state);
 }
 
-static void chroma_smooth_5x5(unsigned short * inp, unsigned short * out, int* raw2ev, int* ev2raw)
+void raw_fix_copy(struct raw_fix_state * dst, struct raw_fix_state * src)
 {
-    int w = raw_info.width;
-    int h = raw_info.height;
-    int x,y;
+    struct raw_xy * list = dst->cold_pixel_list;
+    int threads = dst->threads;
 
-    for (y = 6; y < h-7; y += 2)
+    *dst = *src;
+    dst->cold_pixel_list = list;
+    dst->threads = threads;
+
+    /* each state owns its cold pixel list, so it can be re-analysed independently */
+    if (src->cold_pixels > 0)
     {
-        for (x = 6; x < w-6; x += 2)
+        if (!dst->cold_pixel_list)
         {
-            /**
-             * for each red pixel, compute the median value of red minus interpolated green at the same location
-             * the median value is then considered the "true" difference between red and green
-             * same for blue vs green
-             * 
-             *
-             * each red pixel has 4 green neighbours, so we may interpolate as follows:
-             * - mean or median(t,b,l,r)
-             * - choose between mean(t,b) and mean(l,r) (idea from AHD)
-             * 
-             * same for blue; note that a RG/GB cell has 6 green pixels that we need to analyze
-             * 2 only for red, 2 only for blue, and 2 shared
-             *    g
-             *   gRg
-             *    gBg
-             *     g
-             *
-             * choosing the interpolation direction seems to give cleaner results
-             * the direction is choosen over the entire filtered area (so we do two passes, one for each direction, 
-             * and at the end choose the one for which total interpolation error is smaller)
-             * 
-             * error = sum(abs(t-b)) or sum(abs(l-r))
-             * 
-             * interpolation in EV space (rather than linear) seems to have less color artifacts in high-contrast areas
-             * 
-             * we can use this filter for 3x3 RG/GB cells or 5x5
-             */
-            int i,j;
-            int k = 0;
-            int med_r[25];
-            int med_b[25];
-            
-            /* first try to interpolate in horizontal direction */
-            int eh = 0;
-            for (i = -4; i <= 4; i += 2)
-            {
-                for (j = -4; j <= 4; j += 2)
-                {
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                    int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                  //int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                    int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                  //int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                    g3 = raw2ev[g3];
-                  //g4 = raw2ev[g4];
-                    g5 = raw2ev[g5];
-                  //g6 = raw2ev[g6];
-                    
-                    int gr = (g1+g3)/2;
-                    int gb = (g2+g5)/2;
-                    eh += ABS(g1-g3) + ABS(g2-g5);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with horizontal interpolation */
-            int drh = opt_med25(med_r);
-            int dbh = opt_med25(med_b);
-            
-            /* next, try to interpolate in vertical direction */
-            int ev = 0;
-            k = 0;
-            for (i = -4; i <= 4; i += 2)
-            {
-                for (j = -4; j <= 4; j += 2)
-                {
-                    int r  = inp[x+i   +   (y+j) * w];
-                    int b  = inp[x+i+1 + (y+j+1) * w];
-                                                        /*  for R      for B      */
-                    int g1 = inp[x+i+1 +   (y+j) * w];  /*  Right      Top        */
-                    int g2 = inp[x+i   + (y+j+1) * w];  /*  Bottom     Left       */
-                  //int g3 = inp[x+i-1 +   (y+j) * w];  /*  Left                  */ 
-                    int g4 = inp[x+i   + (y+j-1) * w];  /*  Top                   */
-                  //int g5 = inp[x+i+2 + (y+j+1) * w];  /*             Right      */
-                    int g6 = inp[x+i+1 + (y+j+2) * w];  /*             Bottom     */
-                    
-                    g1 = raw2ev[g1];
-                    g2 = raw2ev[g2];
-                  //g3 = raw2ev[g3];
-                    g4 = raw2ev[g4];
-                  //g5 = raw2ev[g5];
-                    g6 = raw2ev[g6];
-                    
-                    int gr = (g2+g4)/2;
-                    int gb = (g1+g6)/2;
-                    ev += ABS(g2-g4) + ABS(g1-g6);
-                    med_r[k] = raw2ev[r] - gr;
-                    med_b[k] = raw2ev[b] - gb;
-                    k++;
-                }
-            }
-
-            /* difference from green, with vertical interpolation */
-            int drv = opt_med25(med_r);
-            int dbv = opt_med25(med_b);
-
-            /* back to our filtered pixels (RG/GB cell) */
-            int g1 = inp[x+1 +     y * w];
-            int g2 = inp[x   + (y+1) * w];
-            int g3 = inp[x-1 +   (y) * w];
-            int g4 = inp[x   + (y-1) * w];
-            int g5 = inp[x+2 + (y+1) * w];
-            int g6 = inp[x+1 + (y+2) * w];
-            
-            g1 = raw2ev[g1];
-            g2 = raw2ev[g2];
-            g3 = raw2ev[g3];
-            g4 = raw2ev[g4];
-            g5 = raw2ev[g5];
-            g6 = raw2ev[g6];
-
-            /* which of the two interpolations will we choose? */
-            int grv = (g2+g4)/2;
-            int grh = (g1+g3)/2;
-            int gbv = (g1+g6)/2;
-            int gbh = (g2+g5)/2;
-            int gr = ev < eh ? grv : grh;
-            int gb = ev < eh ? gbv : gbh;
-            int dr = ev < eh ? drv : drh;
-            int db = ev < eh ? dbv : dbh;
-            
-            int r0 = inp[x   +     y * w];
-            int b0 = inp[x+1 + (y+1) * w];
-
-            /* if we are close to the noise floor, use both directions, beacuse otherwise it will affect the noise structure and introduce false detail */
-            /* todo: smooth transition between the two methods? better thresholding condition? */
-            int thr = 64;
-            if (r0 < raw_info.black_level+thr || b0 < raw_info.black_level+thr || ABS(drv - drh) < thr || ABS(grv-grh) < thr || ABS(gbv-gbh) < thr)
-            {
-                dr = (drv+drh)/2;
-                db = (dbv+dbh)/2;
-                gr = (g1+g2+g3+g4)/4;
-                gb = (g1+g2+g5+g6)/4;
-            }
-            
-            /* replace red and blue pixels with filtered values, keep green pixels unchanged */
-            /* don't touch overexposed areas */
-            if (out[x   +     y * w] < raw_info.white_level)
-                out[x   +     y * w] = ev2raw[COERCE(gr + dr, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
-            
-            if (out[x+1  + (y+1)* w] < raw_info.white_level)
-                out[x+1 + (y+1) * w] = ev2raw[COERCE(gb + db, -10*EV_RESOLUTION, 14*EV_RESOLUTION-1)];
+            dst->cold_pixel_list = malloc(MAX_COLD_PIXELS * sizeof(dst->cold_pixel_list[0]));
+            CHECK(dst->cold_pixel_list, "malloc");
         }
+        memcpy(dst->cold_pixel_list, src->cold_pixel_list, src->cold_pixels * sizeof(src->cold_pixel_list[0]));
     }
 }
 
+#ifdef CHROMA_SMOOTH
+
+/* 2x2 chroma smoothing, shared with cr2hdr and mlv_dump (../dual_iso/chroma_smooth.c) */
 void chroma_smooth()
 {
     int black = raw_info.black_level;
@@ -1799,21 +1537,28 @@ void chroma_smooth()
     int w = raw_info.width;
     int h = raw_info.height;
 
-    unsigned short * aux = malloc(w * h * sizeof(short));
-    unsigned short * aux2 = malloc(w * h * sizeof(short));
+    /* kept for the next frame */
+    static uint32_t * aux = 0;
+    static int aux_size = 0;
+    static struct chroma_smooth_work work;
+    if (aux_size < w * h)
+    {
+        free(aux);
+        aux = malloc(w * h * sizeof(uint32_t));
+        CHECK(aux, "malloc");
+        aux_size = w * h;
+    }
 
     int x,y;
     for (y = 0; y < h; y++)
         for (x = 0; x < w; x++)
-            aux[x + y*w] = aux2[x + y*w] = raw_get_pixel(x, y);
+            aux[x + y*w] = raw_get_pixel(x, y);
     
-    chroma_smooth_2x2(aux, aux2, raw2ev, ev2raw);
+    /* filtered in place */
+    CHECK(!chroma_smooth_run(2, w, h, aux, aux, raw2ev, ev2raw, EV_RESOLUTION, &work), "malloc");
     
     for (y = 0; y < h; y++)
         for (x = 0; x < w; x++)
-            raw_set_pixel(x, y, aux2[x + y*w]);
-
-    free(aux);
-    free(aux2);
+            raw_set_pixel(x, y, aux[x + y*w]);
 }
 #endif
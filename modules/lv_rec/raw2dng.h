@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _raw2dng_h_
+#define _raw2dng_h_
+
+#include <pthread.h>
+#include <raw.h>
+
+struct raw_xy { int x; int y; };
+
+/**
+ * Per-clip state of the raw corrections (vertical stripes, cold pixels).
+ * Correction factors and the cold pixel list are estimated from the first frame
+ * and reused for all following frames; the stripe coefficients can also be
+ * re-estimated every stripes_interval frames. Functions that take an explicit raw_info
+ * and state are reentrant, so different threads may process different frames
+ * as long as each one uses its own state.
+ */
+struct raw_fix_state
+{
+    int stripes_detected;
+    int stripes_correction_needed;
+    int stripes_coeffs[8];
+    int stripes_interval;               /* re-estimate the stripe coefficients every N frames; 0 = first frame only */
+    int stripes_frames;                 /* frames corrected with the current coefficients */
+
+    int cold_pixels;                    /* -1 = not analysed yet */
+    struct raw_xy * cold_pixel_list;    /* allocated on first analysis */
+
+    int threads;                        /* split the stripe correction into this many bands of rows; 0 or 1 = caller's thread only */
+};
+
+#define RAW_FIX_STATE_INIT { 0, 0, {0}, 0, 0, -1, NULL, 0 }
+
+void raw_fix_init(struct raw_fix_state * state);
+void raw_fix_free(struct raw_fix_state * state);
+
+/* copy the estimated corrections from src; dst keeps its own cold pixel list and thread count */
+void raw_fix_copy(struct raw_fix_state * dst, struct raw_fix_state * src);
+
+void raw_fix_vertical_stripes(struct raw_info * info, struct raw_fix_state * state);
+void raw_fix_cold_pixels(struct raw_info * info, struct raw_fix_state * state, int force_analysis);
+
+/**
+ * Per-clip cache of the stripe coefficients, for threads correcting the frames of a clip out of order.
+ * Frames are numbered 0, 1, 2 ... in clip order; the first frame of each interval estimates the coefficients
+ * and the other frames of that interval wait for them, so the result does not depend on the thread count.
+ * Frames must be started in clip order (a frame is only picked up after all earlier frames were).
+ */
+#define RAW_STRIPES_PENDING 0
+#define RAW_STRIPES_READY   1
+#define RAW_STRIPES_SKIPPED 2   /* the frame that should have estimated them was not corrected */
+
+struct raw_stripes_estimate
+{
+    int status;
+    int correction_needed;
+    int coeffs[8];
+};
+
+struct raw_stripes_cache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int interval;                               /* frames per estimate; 0 = first frame only */
+    int count;
+    struct raw_stripes_estimate * estimates;    /* one per interval */
+};
+
+void raw_stripes_cache_init(struct raw_stripes_cache * cache, int interval);
+void raw_stripes_cache_free(struct raw_stripes_cache * cache);
+
+/* like raw_fix_vertical_stripes, for frame number "index" of the clip; state must not be shared with other threads */
+void raw_fix_vertical_stripes_cached(struct raw_info * info, struct raw_fix_state * state, struct raw_stripes_cache * cache, int index);
+
+/* frame "index" will not be corrected (e.g. it could not be decoded); frames waiting for its estimate use the previous one */
+void raw_stripes_cache_skip(struct raw_stripes_cache * cache, int index);
+
+/* number of online CPUs, at least 1 */
+int raw_fix_cpu_count();
+
+/* 14-bit pixel access on an arbitrary raw buffer */
+int raw_info_get_pixel(struct raw_info * info, int x, int y);
+void raw_info_set_pixel(struct raw_info * info, int x, int y, int value);
+
+/* legacy interface: operates on the global raw_info */
+void fix_vertical_stripes();
+void find_and_fix_cold_pixels(int force_analysis);
+
+#endif
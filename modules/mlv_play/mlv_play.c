@@ -42,6 +42,7 @@
 #include "../ime_base/ime_base.h"
 #include "../trace/trace.h"
 #include "../mlv_rec/mlv.h"
+#include "../mlv_rec/mlv_index.h"
 #include "../file_man/file_man.h"
 #include "../lv_rec/lv_rec.h"
 #include "../raw_twk/raw_twk.h"
@@ -109,15 +110,6 @@ static uint32_t mlv_play_info = 1;
 static uint32_t mlv_play_timer_stop = 1;
 static uint32_t mlv_play_frames_skipped = 0;
 
-/* this structure is used to build the mlv_xref_t table */
-typedef struct 
-{
-    uint64_t    frameTime;
-    uint64_t    frameOffset;
-    uint16_t    fileNumber;
-    uint16_t    frameType;
-} frame_xref_t;
-
 typedef struct
 {
     char fullPath[MAX_PATH];
@@ -893,44 +885,6 @@ static void mlv_play_osd_task(void *priv)
 }
 
 
-static void mlv_play_xref_resize(frame_xref_t **table, uint32_t entries, uint32_t *allocated)
-{
-    /* make sure there is no crappy pointer before using */
-    if(*allocated == 0)
-    {
-        *table = NULL;
-    }
-    
-    /* only resize if the buffer is too small */
-    if(entries * sizeof(frame_xref_t) > *allocated)
-    {
-        *allocated += (entries + 1) * sizeof(frame_xref_t);
-        *table = realloc(*table, *allocated);
-    }
-}
-
-static void mlv_play_xref_sort(frame_xref_t *table, uint32_t entries)
-{
-    if (!entries) return;
-    
-    uint32_t n = entries;
-    do
-    {
-        uint32_t newn = 1;
-        for (uint32_t i = 0; i < n-1; ++i)
-        {
-            if (table[i].frameTime > table[i+1].frameTime)
-            {
-                frame_xref_t tmp = table[i+1];
-                table[i+1] = table[i];
-                table[i] = tmp;
-                newn = i + 1;
-            }
-        }
-        n = newn;
-    } while (n > 1);
-}
-
 static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename)
 {
     mlv_xref_hdr_t *block_hdr = NULL;
@@ -990,7 +944,7 @@ static mlv_xref_hdr_t *mlv_play_load_index(char *base_filename)
     return block_hdr;
 }
 
-static void mlv_play_save_index(char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, frame_xref_t *index, int entries)
+static void mlv_play_save_index(char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_index_t *index)
 {
     char filename[128];
     FILE *out_file = NULL;
@@ -1017,47 +971,17 @@ static void mlv_play_save_index(char *base_filename, mlv_file_hdr_t *ref_file_hd
     FIO_WriteFile(out_file, &file_hdr, sizeof(mlv_file_hdr_t));
 
     /* now write XREF block */
-    mlv_xref_hdr_t hdr;
-    
-    memset(&hdr, 0x00, sizeof(mlv_xref_hdr_t));
-    memcpy(hdr.blockType, "XREF", 4);
-    hdr.blockSize = sizeof(mlv_xref_hdr_t) + entries * sizeof(mlv_xref_t);
-    hdr.entryCount = entries;
-    
-    if(FIO_WriteFile(out_file, &hdr, sizeof(mlv_xref_hdr_t)) != sizeof(mlv_xref_hdr_t))
-    {
-        FIO_CloseFile(out_file);
-        return;
-    }
-    
-    uint32_t last_pct = 0;
-    mlv_play_progressbar(0, "");
+    mlv_xref_hdr_t *hdr = mlv_index_get_xref(index);
     
-    /* and then the single entries */
-    for(int entry = 0; entry < entries; entry++)
+    if(hdr)
     {
-        mlv_xref_t field;
-        uint32_t pct = (entry*100)/entries;
-        
-        if(last_pct != pct)
-        {
-            char msg[100];
-            
-            snprintf(msg, sizeof(msg), "Saving index (%d entries)...", entries);
-            mlv_play_progressbar(pct, msg);
-            last_pct = pct;
-        }
-        memset(&field, 0x00, sizeof(mlv_xref_t));
+        char msg[100];
         
-        field.frameOffset = index[entry].frameOffset;
-        field.fileNumber = index[entry].fileNumber;
-        field.frameType = index[entry].frameType;
+        snprintf(msg, sizeof(msg), "Saving index (%d entries)...", hdr->entryCount);
+        mlv_play_progressbar(0, msg);
         
-        if(FIO_WriteFile(out_file, &field, sizeof(mlv_xref_t)) != sizeof(mlv_xref_t))
-        {
-            FIO_CloseFile(out_file);
-            return;
-        }
+        FIO_WriteFile(out_file, hdr, hdr->blockSize);
+        free(hdr);
     }
     
     FIO_CloseFile(out_file);
@@ -1065,11 +989,11 @@ static void mlv_play_save_index(char *base_filename, mlv_file_hdr_t *ref_file_hd
 
 static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t chunk_count)
 {
-    frame_xref_t *frame_xref_table = NULL;
-    uint32_t frame_xref_entries = 0;
-    uint32_t frame_xref_allocated = 0;
+    mlv_index_t index;
     mlv_file_hdr_t main_header;
     
+    mlv_index_init(&index);
+    
     for(uint32_t chunk = 0; chunk < chunk_count; chunk++)
     {
         uint32_t last_pct = 0;
@@ -1088,8 +1012,10 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                 break;
             }
             
+            /* large enough for the frame number of VIDF/AUDF blocks */
+            mlv_vidf_hdr_t frame_hdr;
+            mlv_hdr_t *buf_hdr = (mlv_hdr_t *)&frame_hdr;
             mlv_hdr_t buf;
-            uint64_t timestamp = 0;
             
             uint32_t pct = ((position / 10) / (size / 1000));
             
@@ -1115,6 +1041,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                     bmp_printf(FONT_MED, 30, 190, "File #%d ends prematurely, %d bytes read", chunk, read);
                     beep();
                     msleep(2000);
+                    mlv_index_free(&index);
                     return;
                 }
             }
@@ -1125,6 +1052,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                 bmp_printf(FONT_MED, 30, 190, "Invalid header size: %d bytes at 0x%08X", buf.blockSize, position);
                 beep();
                 msleep(2000);
+                mlv_index_free(&index);
                 return;
             }
 
@@ -1142,6 +1070,7 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                     bmp_printf(FONT_MED, 30, 190, "File ends prematurely during MLVI");
                     beep();
                     msleep(2000);
+                    mlv_index_free(&index);
                     return;
                 }
 
@@ -1158,34 +1087,30 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
                         bmp_printf(FONT_MED, 30, 190, "Error: GUID within the file chunks mismatch!");
                         beep();
                         msleep(2000);
+                        mlv_index_free(&index);
                         return;
                     }
                 }
-                
-                /* emulate timestamp zero (will overwrite version string) */
-                timestamp = 0;
             }
-            else
+            
+            memcpy(buf_hdr, &buf, sizeof(mlv_hdr_t));
+            
+            /* frames also need their frame number for the index */
+            if(!memcmp(buf.blockType, "VIDF", 4) || !memcmp(buf.blockType, "AUDF", 4))
             {
-                /* all other blocks have a timestamp */
-                timestamp = buf.timestamp;
+                uint32_t hdr_size = MIN(sizeof(mlv_vidf_hdr_t), buf.blockSize);
+                
+                FIO_SeekSkipFile(chunk_files[chunk], position, SEEK_SET);
+                FIO_ReadFile(chunk_files[chunk], buf_hdr, hdr_size);
             }
             
-            /* dont index NULL blocks */
-            if(memcmp(buf.blockType, "NULL", 4))
+            if(mlv_index_add(&index, buf_hdr, chunk, position))
             {
-                mlv_play_xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-                
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = chunk;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
-                
-                frame_xref_entries++;
+                bmp_printf(FONT_MED, 30, 190, "Error: Out of memory while building index");
+                beep();
+                msleep(2000);
+                mlv_index_free(&index);
+                return;
             }
             
             position += buf.blockSize;
@@ -1193,8 +1118,11 @@ static void mlv_play_build_index(char *filename, FILE **chunk_files, uint32_t ch
         }
     }
     
-    mlv_play_xref_sort(frame_xref_table, frame_xref_entries);
-    mlv_play_save_index(filename, &main_header, chunk_count, frame_xref_table, frame_xref_entries);
+    if(!mlv_index_sort(&index))
+    {
+        mlv_play_save_index(filename, &main_header, chunk_count, &index);
+    }
+    mlv_index_free(&index);
 }
 
 static mlv_xref_hdr_t *mlv_play_get_index(char *filename, FILE **chunk_files, uint32_t chunk_count)
@@ -0,0 +1,482 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Data layout (see bayer_rice.h):
+ *
+ *   "BR", version, depth, flags, 3 zero bytes, width and height as little endian uint32
+ *   bit stream, MSB first:
+ *     stored frames: every pixel with depth bits
+ *     else for every strip of BR_STRIP_ROWS rows: two bits for the predictor, then the pixels of the strip
+ *     pixel: q = m >> k zero bits and a one bit, then the k low bits of m
+ *            if q reaches BR_ESCAPE: BR_ESCAPE zero bits, a one bit and m with depth bits
+ *     m is the prediction error, wrapped to depth bits and folded to positive values (0, -1, 1, -2, 2 ...)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "bayer_rice.h"
+
+#define BR_VERSION          1
+#define BR_HEADER_SIZE      16
+#define BR_FLAG_STORED      0x01
+
+#define BR_STRIP_ROWS       16      /* has to be even, so every strip starts on the same bayer row */
+#define BR_ESCAPE           24
+#define BR_ACTIVITY_LEVELS  16
+#define BR_CONTEXTS         (4 * BR_ACTIVITY_LEVELS)
+#define BR_RESET            64      /* halve the statistics after that many samples, so they follow the image */
+
+#define BR_PRED_MED         0       /* median edge detector: best for clean images with edges */
+#define BR_PRED_AVG         1       /* mean of left and above: less noise in the prediction */
+#define BR_PRED_FLAT        2       /* half of the range: delta frames of static scenes */
+#define BR_PREDICTORS       3
+#define BR_COST_ROWS        4       /* rows of a strip used to pick its predictor */
+
+#define BR_ABS(a) ((a) < 0 ? -(a) : (a))
+
+typedef struct
+{
+    uint32_t sum;       /* sum of the error magnitudes */
+    uint32_t count;
+} br_context_t;
+
+typedef struct
+{
+    uint8_t *out;
+    uint32_t size;
+    uint32_t pos;
+    uint64_t acc;
+    int bits;
+    int overflow;
+} br_writer_t;
+
+typedef struct
+{
+    const uint8_t *data;
+    uint32_t size;
+    uint32_t pos;
+    uint64_t acc;       /* next bits at the top */
+    int bits;
+} br_reader_t;
+
+static void br_put_bits(br_writer_t *w, uint32_t value, int count)
+{
+    w->acc = (w->acc << count) | value;
+    w->bits += count;
+
+    while(w->bits >= 8)
+    {
+        w->bits -= 8;
+        if(w->pos < w->size)
+        {
+            w->out[w->pos++] = (uint8_t)(w->acc >> w->bits);
+        }
+        else
+        {
+            w->overflow = 1;
+        }
+    }
+}
+
+static void br_flush(br_writer_t *w)
+{
+    if(w->bits)
+    {
+        br_put_bits(w, 0, 8 - w->bits);
+    }
+}
+
+/* keep at least 57 bits in the accumulator. past the end of the data there are zeros */
+static inline void br_refill(br_reader_t *r)
+{
+    while(r->bits <= 56)
+    {
+        uint64_t byte = (r->pos < r->size) ? r->data[r->pos] : 0;
+        r->acc |= byte << (56 - r->bits);
+        r->pos++;
+        r->bits += 8;
+    }
+}
+
+static inline uint32_t br_get_bits(br_reader_t *r, int count)
+{
+    if(!count)
+    {
+        return 0;
+    }
+    br_refill(r);
+    uint32_t value = (uint32_t)(r->acc >> (64 - count));
+    r->acc <<= count;
+    r->bits -= count;
+    return value;
+}
+
+/* number of zero bits before the next one bit, skipping that one. more than BR_ESCAPE is an error */
+static inline int br_get_unary(br_reader_t *r)
+{
+    br_refill(r);
+    if(!r->acc)
+    {
+        return BR_ESCAPE + 1;
+    }
+    int zeros = __builtin_clzll(r->acc);
+    if(zeros > BR_ESCAPE)
+    {
+        return zeros;
+    }
+    r->acc <<= zeros + 1;
+    r->bits -= zeros + 1;
+    return zeros;
+}
+
+/* same colour neighbours: left (a), above (b) and above left (c), two pixels away. up is NULL in the first two rows */
+static inline int br_predict(int mode, const uint16_t *row, const uint16_t *up, int x, int mid, int *activity)
+{
+    if(mode == BR_PRED_FLAT)
+    {
+        int a = (x >= 2) ? row[x - 2] : mid;
+        int b = up ? up[x] : mid;
+        *activity = BR_ABS(a - mid) + BR_ABS(b - mid);
+        return mid;
+    }
+
+    if(!up)
+    {
+        *activity = 0;
+        return (x >= 2) ? row[x - 2] : mid;
+    }
+
+    if(x < 2)
+    {
+        *activity = 0;
+        return up[x];
+    }
+
+    int a = row[x - 2];
+    int b = up[x];
+    int c = up[x - 2];
+
+    if(mode == BR_PRED_AVG)
+    {
+        *activity = BR_ABS(a - b);
+        return (a + b + 1) >> 1;
+    }
+
+    int max = (a > b) ? a : b;
+    int min = (a > b) ? b : a;
+
+    *activity = BR_ABS(a - c) + BR_ABS(b - c);
+
+    if(c >= max)
+    {
+        return min;
+    }
+    if(c <= min)
+    {
+        return max;
+    }
+    return a + b - c;
+}
+
+static inline int br_context(int x, int y, int activity)
+{
+    int level = activity ? 32 - __builtin_clz(activity) : 0;
+    if(level >= BR_ACTIVITY_LEVELS)
+    {
+        level = BR_ACTIVITY_LEVELS - 1;
+    }
+    return (((y & 1) << 1) | (x & 1)) * BR_ACTIVITY_LEVELS + level;
+}
+
+/* smallest k with count << k >= sum */
+static inline int br_rice_k(const br_context_t *ctx)
+{
+    if(ctx->sum <= ctx->count)
+    {
+        return 0;
+    }
+    int k = __builtin_clz(ctx->count) - __builtin_clz(ctx->sum);
+    if((ctx->count << k) < ctx->sum)
+    {
+        k++;
+    }
+    return (k < 16) ? k : 16;
+}
+
+static inline void br_update(br_context_t *ctx, uint32_t m)
+{
+    /* the magnitude of the error, as in LOCO-I: the folded value would pick k one too high */
+    ctx->sum += (m + 1) >> 1;
+    if(++ctx->count >= BR_RESET)
+    {
+        ctx->sum >>= 1;
+        ctx->count >>= 1;
+    }
+}
+
+static void br_init_contexts(br_context_t *contexts, int depth)
+{
+    /* start with k near depth / 2, the statistics take over after a few pixels */
+    for(int i = 0; i < BR_CONTEXTS; i++)
+    {
+        contexts[i].sum = 1 << (depth / 2);
+        contexts[i].count = 1;
+    }
+}
+
+/* prediction error wrapped to depth bits, as a signed value */
+static inline int br_wrap(int error, int depth)
+{
+    int half = 1 << (depth - 1);
+    return ((error + half) & ((1 << depth) - 1)) - half;
+}
+
+/* sum of the absolute prediction errors of a strip with the given predictor */
+static uint64_t br_strip_cost(const uint16_t *image, int width, int y0, int y1, int depth, int mode)
+{
+    int mid = 1 << (depth - 1);
+    uint64_t cost = 0;
+
+    for(int y = y0; y < y1; y++)
+    {
+        const uint16_t *row = image + (size_t)y * width;
+        const uint16_t *up = (y >= 2) ? row - 2 * width : NULL;
+        for(int x = 0; x < width; x++)
+        {
+            int activity;
+            int error = br_wrap(row[x] - br_predict(mode, row, up, x, mid, &activity), depth);
+            cost += BR_ABS(error);
+        }
+    }
+    return cost;
+}
+
+static void br_write_header(uint8_t *out, int width, int height, int depth, int flags)
+{
+    memset(out, 0, BR_HEADER_SIZE);
+    out[0] = 'B';
+    out[1] = 'R';
+    out[2] = BR_VERSION;
+    out[3] = depth;
+    out[4] = flags;
+    for(int i = 0; i < 4; i++)
+    {
+        out[8 + i] = (uint32_t)width >> (8 * i);
+        out[12 + i] = (uint32_t)height >> (8 * i);
+    }
+}
+
+int bayer_rice_read_info(const uint8_t *data, uint32_t size, bayer_rice_info_t *info)
+{
+    if(size < BR_HEADER_SIZE || data[0] != 'B' || data[1] != 'R' || data[2] != BR_VERSION)
+    {
+        return 1;
+    }
+
+    info->depth = data[3];
+    info->width = data[8] | (data[9] << 8) | (data[10] << 16) | ((uint32_t)data[11] << 24);
+    info->height = data[12] | (data[13] << 8) | (data[14] << 16) | ((uint32_t)data[15] << 24);
+
+    if(info->depth < 1 || info->depth > 16 || info->width <= 0 || info->height <= 0)
+    {
+        return 1;
+    }
+    return 0;
+}
+
+uint32_t bayer_rice_encode_bound(int width, int height, int depth)
+{
+    /* stored frames are the worst case. some slack for the bits in flight */
+    return BR_HEADER_SIZE + (uint32_t)(((uint64_t)width * height * depth + 7) / 8) + 8;
+}
+
+static uint32_t br_encode_stored(const uint16_t *image, int width, int height, int depth, uint8_t *out, uint32_t out_size)
+{
+    br_writer_t w = { out, out_size, BR_HEADER_SIZE, 0, 0, 0 };
+    size_t pixels = (size_t)width * height;
+
+    br_write_header(out, width, height, depth, BR_FLAG_STORED);
+    for(size_t i = 0; i < pixels; i++)
+    {
+        br_put_bits(&w, image[i], depth);
+    }
+    br_flush(&w);
+
+    return w.overflow ? 0 : w.pos;
+}
+
+uint32_t bayer_rice_encode(const uint16_t *image, int width, int height, int depth, uint8_t *out, uint32_t out_size)
+{
+    if(depth < 1 || depth > 16 || width <= 0 || height <= 0 || out_size < bayer_rice_encode_bound(width, height, depth))
+    {
+        return 0;
+    }
+
+    /* anything beyond the stored size is not worth it */
+    br_writer_t w = { out, bayer_rice_encode_bound(width, height, depth) - 8, BR_HEADER_SIZE, 0, 0, 0 };
+    br_context_t contexts[BR_CONTEXTS];
+    int mid = 1 << (depth - 1);
+
+    br_write_header(out, width, height, depth, 0);
+    br_init_contexts(contexts, depth);
+
+    for(int y0 = 0; y0 < height && !w.overflow; y0 += BR_STRIP_ROWS)
+    {
+        int y1 = (y0 + BR_STRIP_ROWS < height) ? y0 + BR_STRIP_ROWS : height;
+        /* the predictor with the smallest errors in the first rows */
+        int mode = BR_PRED_MED;
+        uint64_t best_cost = UINT64_MAX;
+        for(int pred = 0; pred < BR_PREDICTORS; pred++)
+        {
+            uint64_t cost = br_strip_cost(image, width, y0, (y0 + BR_COST_ROWS < y1) ? y0 + BR_COST_ROWS : y1, depth, pred);
+            if(cost < best_cost)
+            {
+                best_cost = cost;
+                mode = pred;
+            }
+        }
+
+        br_put_bits(&w, mode, 2);
+
+        for(int y = y0; y < y1; y++)
+        {
+            const uint16_t *row = image + (size_t)y * width;
+            const uint16_t *up = (y >= 2) ? row - 2 * width : NULL;
+
+            for(int x = 0; x < width; x++)
+            {
+                int activity;
+                int error = br_wrap(row[x] - br_predict(mode, row, up, x, mid, &activity), depth);
+                uint32_t m = (error >= 0) ? 2 * error : -2 * error - 1;
+                br_context_t *ctx = &contexts[br_context(x, y, activity)];
+                int k = br_rice_k(ctx);
+                uint32_t q = m >> k;
+
+                if(q < BR_ESCAPE)
+                {
+                    br_put_bits(&w, 1, q + 1);
+                    br_put_bits(&w, m & ((1 << k) - 1), k);
+                }
+                else
+                {
+                    br_put_bits(&w, 1, BR_ESCAPE + 1);
+                    br_put_bits(&w, m, depth);
+                }
+
+                br_update(ctx, m);
+            }
+        }
+    }
+    br_flush(&w);
+
+    if(w.overflow)
+    {
+        return br_encode_stored(image, width, height, depth, out, out_size);
+    }
+    return w.pos;
+}
+
+int bayer_rice_decode(const uint8_t *data, uint32_t size, uint16_t *image, uint32_t image_size)
+{
+    bayer_rice_info_t info;
+
+    if(bayer_rice_read_info(data, size, &info) || (uint64_t)info.width * info.height > image_size)
+    {
+        return 1;
+    }
+
+    int width = info.width;
+    int height = info.height;
+    int depth = info.depth;
+    int mask = (1 << depth) - 1;
+    int mid = 1 << (depth - 1);
+    br_reader_t r = { data, size, BR_HEADER_SIZE, 0, 0 };
+
+    if(data[4] & BR_FLAG_STORED)
+    {
+        size_t pixels = (size_t)width * height;
+        for(size_t i = 0; i < pixels; i++)
+        {
+            image[i] = br_get_bits(&r, depth);
+        }
+    }
+    else
+    {
+        br_context_t contexts[BR_CONTEXTS];
+        br_init_contexts(contexts, depth);
+
+        for(int y0 = 0; y0 < height; y0 += BR_STRIP_ROWS)
+        {
+            int y1 = (y0 + BR_STRIP_ROWS < height) ? y0 + BR_STRIP_ROWS : height;
+            int mode = br_get_bits(&r, 2);
+            if(mode >= BR_PREDICTORS)
+            {
+                return 1;
+            }
+
+            for(int y = y0; y < y1; y++)
+            {
+                uint16_t *row = image + (size_t)y * width;
+                const uint16_t *up = (y >= 2) ? row - 2 * width : NULL;
+
+                for(int x = 0; x < width; x++)
+                {
+                    int activity;
+                    int prediction = br_predict(mode, row, up, x, mid, &activity);
+                    br_context_t *ctx = &contexts[br_context(x, y, activity)];
+                    int k = br_rice_k(ctx);
+                    int q = br_get_unary(&r);
+                    uint32_t m;
+
+                    if(q < BR_ESCAPE)
+                    {
+                        m = ((uint32_t)q << k) | br_get_bits(&r, k);
+                    }
+                    else if(q == BR_ESCAPE)
+                    {
+                        m = br_get_bits(&r, depth);
+                    }
+                    else
+                    {
+                        return 1;
+                    }
+
+                    int error = (int)(m >> 1) ^ -(int)(m & 1);
+                    row[x] = (prediction + error) & mask;
+                    br_update(ctx, m);
+                }
+            }
+
+            /* ran past the end of the data */
+            if((uint64_t)r.pos * 8 - r.bits > (uint64_t)size * 8)
+            {
+                return 1;
+            }
+        }
+    }
+
+    if((uint64_t)r.pos * 8 - r.bits > (uint64_t)size * 8)
+    {
+        return 1;
+    }
+    return 0;
+}
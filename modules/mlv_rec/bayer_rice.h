@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _bayer_rice_h_
+#define _bayer_rice_h_
+
+#include <stdint.h>
+
+/**
+ * Lossless codec for bayer raw frames (MLV_VIDEO_CLASS_FLAG_RICE).
+ * Images are plain arrays of uint16_t samples, height rows of width samples each.
+ *
+ * Every pixel is predicted from the nearest pixels of the same colour (left, above and above left),
+ * the residual is coded with an adaptive Rice code. The code parameter is tracked separately for
+ * each of the four bayer channels and 16 levels of local activity.
+ * For every strip of 16 rows the encoder picks the predictor: LOCO-I median edge detector for clean
+ * images, the mean of left and above for noisy ones, or a flat prediction (half of the value range)
+ * for delta frames (mlv_dump -e) of static scenes, where the neighbours carry only noise.
+ * Frames that would get larger than the packed raw data are stored packed.
+ */
+
+typedef struct
+{
+    int width;
+    int height;
+    int depth;          /* bits per sample */
+} bayer_rice_info_t;
+
+/* parse the header in front of the compressed data. returns 0 on success */
+int bayer_rice_read_info(const uint8_t *data, uint32_t size, bayer_rice_info_t *info);
+
+/* decode into image, which holds image_size samples. returns 0 on success */
+int bayer_rice_decode(const uint8_t *data, uint32_t size, uint16_t *image, uint32_t image_size);
+
+/* maximum number of bytes bayer_rice_encode() will write */
+uint32_t bayer_rice_encode_bound(int width, int height, int depth);
+
+/* encode an image, all values have to fit into depth (1-16) bits. returns the encoded size, 0 on error */
+uint32_t bayer_rice_encode(const uint16_t *image, int width, int height, int depth, uint8_t *out, uint32_t out_size);
+
+#endif
@@ -0,0 +1,854 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* system includes */
+#include <stdint.h>
+#include <string.h>
+
+#include "lj92.h"
+
+/* JPEG markers */
+#define LJ92_SOF0   0xC0
+#define LJ92_SOF3   0xC3
+#define LJ92_DHT    0xC4
+#define LJ92_JPG    0xC8
+#define LJ92_DAC    0xCC
+#define LJ92_SOF15  0xCF
+#define LJ92_RST0   0xD0
+#define LJ92_SOI    0xD8
+#define LJ92_EOI    0xD9
+#define LJ92_SOS    0xDA
+#define LJ92_DRI    0xDD
+
+/* codes up to this length are decoded with a single table lookup */
+#define LJ92_LOOKUP_BITS 10
+
+/* the symbols are the number of bits of the difference (SSSS), 0 to 16 */
+#define LJ92_SYMBOLS 17
+
+typedef struct
+{
+    /* code length << 8 | symbol for every code up to LJ92_LOOKUP_BITS long, 0 for longer codes */
+    uint16_t lookup[1 << LJ92_LOOKUP_BITS];
+
+    /* canonical decoding of the longer ones: highest code of each length and the offset of its symbols in values */
+    int32_t maxcode[17];
+    int32_t offset[17];
+    uint8_t values[256];
+    int valid;
+} lj92_table_t;
+
+typedef struct
+{
+    /* frame header */
+    int precision;
+    int height;
+    int columns;
+    int components;
+    int ids[4];
+
+    /* scan header */
+    int scan_index[4];
+    int scan_table[4];
+    int predictor;
+    int point_transform;
+    int restart_interval;
+
+    lj92_table_t tables[4];
+
+    /* entropy coded data */
+    const uint8_t *data;
+    const uint8_t *end;
+} lj92_decoder_t;
+
+typedef struct
+{
+    const uint8_t *pos;
+    const uint8_t *end;
+
+    /* not consumed bits, MSB aligned */
+    uint64_t bits;
+    int count;
+
+    /* zero bytes that were fed because a marker or the end of data was reached */
+    int pad;
+} lj92_reader_t;
+
+typedef struct
+{
+    uint8_t *pos;
+    uint8_t *end;
+    uint64_t bits;
+    int count;
+    int overflow;
+} lj92_writer_t;
+
+static int lj92_build_table(lj92_table_t *table, const uint8_t *bits, const uint8_t *values, int value_count)
+{
+    uint32_t code = 0;
+    int value = 0;
+
+    memset(table, 0x00, sizeof(lj92_table_t));
+    memcpy(table->values, values, value_count);
+
+    for(int len = 1; len <= 16; len++)
+    {
+        table->offset[len] = value - code;
+
+        for(int num = 0; num < bits[len - 1]; num++, value++, code++)
+        {
+            if(values[value] >= LJ92_SYMBOLS)
+            {
+                return 1;
+            }
+
+            if(len <= LJ92_LOOKUP_BITS)
+            {
+                int shift = LJ92_LOOKUP_BITS - len;
+                for(uint32_t pos = 0; pos < (1U << shift); pos++)
+                {
+                    table->lookup[(code << shift) | pos] = (len << 8) | values[value];
+                }
+            }
+        }
+
+        table->maxcode[len] = bits[len - 1] ? (int32_t)code - 1 : -1;
+
+        /* more codes than this length can hold */
+        if(code > (1U << len))
+        {
+            return 1;
+        }
+        code <<= 1;
+    }
+
+    table->valid = 1;
+    return 0;
+}
+
+static int lj92_parse(lj92_decoder_t *dec, const uint8_t *data, uint32_t size)
+{
+    const uint8_t *pos = data;
+    const uint8_t *end = data + size;
+    int have_frame = 0;
+
+    memset(dec, 0x00, sizeof(lj92_decoder_t));
+
+    if(size < 2 || pos[0] != 0xFF || pos[1] != LJ92_SOI)
+    {
+        return 1;
+    }
+    pos += 2;
+
+    while(1)
+    {
+        /* markers may be preceded by any number of fill bytes */
+        if(pos >= end || *pos != 0xFF)
+        {
+            return 1;
+        }
+        while(pos < end && *pos == 0xFF)
+        {
+            pos++;
+        }
+        if(end - pos < 3)
+        {
+            return 1;
+        }
+
+        int marker = *pos++;
+        int length = (pos[0] << 8) | pos[1];
+        const uint8_t *seg = pos + 2;
+        int seg_len = length - 2;
+
+        if(length < 2 || length > end - pos)
+        {
+            return 1;
+        }
+
+        if(marker == LJ92_SOF3)
+        {
+            if(seg_len < 6)
+            {
+                return 1;
+            }
+
+            dec->precision = seg[0];
+            dec->height = (seg[1] << 8) | seg[2];
+            dec->columns = (seg[3] << 8) | seg[4];
+            dec->components = seg[5];
+
+            if(dec->precision < 2 || dec->precision > 16 || !dec->height || !dec->columns || dec->components < 1 || dec->components > 4 || seg_len < 6 + 3 * dec->components)
+            {
+                return 1;
+            }
+
+            for(int comp = 0; comp < dec->components; comp++)
+            {
+                dec->ids[comp] = seg[6 + 3 * comp];
+
+                /* no subsampling */
+                if(seg[7 + 3 * comp] != 0x11)
+                {
+                    return 1;
+                }
+            }
+            have_frame = 1;
+        }
+        else if(marker >= LJ92_SOF0 && marker <= LJ92_SOF15 && marker != LJ92_DHT && marker != LJ92_JPG && marker != LJ92_DAC)
+        {
+            /* any other coding process */
+            return 1;
+        }
+        else if(marker == LJ92_DHT)
+        {
+            const uint8_t *table = seg;
+            const uint8_t *table_end = seg + seg_len;
+
+            while(table < table_end)
+            {
+                int value_count = 0;
+
+                if(table_end - table < 17 || (table[0] >> 4) != 0 || (table[0] & 0x0F) > 3)
+                {
+                    return 1;
+                }
+                for(int len = 0; len < 16; len++)
+                {
+                    value_count += table[1 + len];
+                }
+                if(value_count > 256 || table_end - table < 17 + value_count)
+                {
+                    return 1;
+                }
+                if(lj92_build_table(&dec->tables[table[0] & 0x0F], &table[1], &table[17], value_count))
+                {
+                    return 1;
+                }
+                table += 17 + value_count;
+            }
+        }
+        else if(marker == LJ92_DRI)
+        {
+            if(seg_len < 2)
+            {
+                return 1;
+            }
+            dec->restart_interval = (seg[0] << 8) | seg[1];
+        }
+        else if(marker == LJ92_SOS)
+        {
+            int used = 0;
+
+            if(!have_frame || seg_len < 1)
+            {
+                return 1;
+            }
+
+            /* only a single scan with all components interleaved is supported */
+            int scan_components = seg[0];
+            if(scan_components != dec->components || seg_len < 1 + 2 * scan_components + 3)
+            {
+                return 1;
+            }
+
+            for(int comp = 0; comp < scan_components; comp++)
+            {
+                int id = seg[1 + 2 * comp];
+                int index = 0;
+
+                while(index < dec->components && (dec->ids[index] != id || (used & (1 << index))))
+                {
+                    index++;
+                }
+                if(index == dec->components)
+                {
+                    return 1;
+                }
+                used |= 1 << index;
+
+                dec->scan_index[comp] = index;
+                dec->scan_table[comp] = seg[2 + 2 * comp] >> 4;
+
+                if(dec->scan_table[comp] > 3 || !dec->tables[dec->scan_table[comp]].valid)
+                {
+                    return 1;
+                }
+            }
+
+            dec->predictor = seg[1 + 2 * scan_components];
+            dec->point_transform = seg[3 + 2 * scan_components] & 0x0F;
+
+            if(dec->predictor < 1 || dec->predictor > 7 || dec->point_transform >= dec->precision)
+            {
+                return 1;
+            }
+
+            dec->data = seg + seg_len;
+            dec->end = end;
+            return 0;
+        }
+        else if(marker == LJ92_EOI)
+        {
+            return 1;
+        }
+
+        pos += length;
+    }
+}
+
+int lj92_read_info(const uint8_t *data, uint32_t size, lj92_info_t *info)
+{
+    lj92_decoder_t dec;
+
+    if(lj92_parse(&dec, data, size))
+    {
+        return 1;
+    }
+
+    info->width = dec.columns * dec.components;
+    info->height = dec.height;
+    info->components = dec.components;
+    info->precision = dec.precision;
+    return 0;
+}
+
+static inline void lj92_fill(lj92_reader_t *reader)
+{
+    while(reader->count <= 56)
+    {
+        uint32_t byte = 0;
+
+        /* a 0xFF is followed by a stuffed zero, anything else is a marker. stop there and feed zeros */
+        if(reader->pos < reader->end && (reader->pos[0] != 0xFF || (reader->end - reader->pos >= 2 && reader->pos[1] == 0x00)))
+        {
+            byte = reader->pos[0];
+            reader->pos += (byte == 0xFF) ? 2 : 1;
+        }
+        else
+        {
+            reader->pad++;
+        }
+
+        reader->bits |= (uint64_t)byte << (56 - reader->count);
+        reader->count += 8;
+    }
+}
+
+static inline int lj92_decode_diff(lj92_reader_t *reader, const lj92_table_t *table, int *diff)
+{
+    int len = 0;
+    int ssss = 0;
+
+    /* the longest code plus its extra bits are 31 bits */
+    if(reader->count < 32)
+    {
+        lj92_fill(reader);
+    }
+
+    int entry = table->lookup[reader->bits >> (64 - LJ92_LOOKUP_BITS)];
+    if(entry)
+    {
+        len = entry >> 8;
+        ssss = entry & 0xFF;
+    }
+    else
+    {
+        for(len = LJ92_LOOKUP_BITS + 1; len <= 16; len++)
+        {
+            int32_t code = reader->bits >> (64 - len);
+            if(code <= table->maxcode[len])
+            {
+                ssss = table->values[table->offset[len] + code];
+                break;
+            }
+        }
+        if(len > 16)
+        {
+            return 1;
+        }
+    }
+
+    reader->bits <<= len;
+    reader->count -= len;
+
+    if(ssss == 0)
+    {
+        *diff = 0;
+    }
+    else if(ssss == 16)
+    {
+        *diff = 32768;
+    }
+    else
+    {
+        int value = reader->bits >> (64 - ssss);
+
+        reader->bits <<= ssss;
+        reader->count -= ssss;
+
+        /* negative differences are stored as one's complement */
+        if(value < (1 << (ssss - 1)))
+        {
+            value -= (1 << ssss) - 1;
+        }
+        *diff = value;
+    }
+
+    return 0;
+}
+
+/* skip the restart marker at the end of an interval. returns 0 on success */
+static int lj92_restart(lj92_reader_t *reader)
+{
+    /* the data ended before the marker */
+    if(reader->pad * 8 > reader->count)
+    {
+        return 1;
+    }
+
+    /* whatever is left in the bit buffer is padding of the last byte */
+    reader->bits = 0;
+    reader->count = 0;
+    reader->pad = 0;
+
+    while(reader->end - reader->pos >= 2 && reader->pos[0] == 0xFF && reader->pos[1] == 0xFF)
+    {
+        reader->pos++;
+    }
+    if(reader->end - reader->pos < 2 || reader->pos[0] != 0xFF || (reader->pos[1] & 0xF8) != LJ92_RST0)
+    {
+        return 1;
+    }
+    reader->pos += 2;
+    return 0;
+}
+
+static inline int lj92_predict(int predictor, int ra, int rb, int rc)
+{
+    switch(predictor)
+    {
+        case 1:
+            return ra;
+        case 2:
+            return rb;
+        case 3:
+            return rc;
+        case 4:
+            return ra + rb - rc;
+        case 5:
+            return ra + ((rb - rc) >> 1);
+        case 6:
+            return rb + ((ra - rc) >> 1);
+        default:
+            return (ra + rb) >> 1;
+    }
+}
+
+int lj92_decode(const uint8_t *data, uint32_t size, uint16_t *image, uint32_t image_size)
+{
+    lj92_decoder_t dec;
+
+    if(lj92_parse(&dec, data, size))
+    {
+        return 1;
+    }
+
+    int components = dec.components;
+    int width = dec.columns * components;
+    int pt = dec.point_transform;
+    int initial = 1 << (dec.precision - pt - 1);
+    int restart_left = dec.restart_interval;
+
+    /* the first line and the first line of every restart interval are predicted from the left only */
+    int first_line = 1;
+    int first_mcu = 1;
+
+    if((uint64_t)width * dec.height > image_size)
+    {
+        return 1;
+    }
+
+    lj92_reader_t reader;
+    memset(&reader, 0x00, sizeof(lj92_reader_t));
+    reader.pos = dec.data;
+    reader.end = dec.end;
+
+    for(int y = 0; y < dec.height; y++)
+    {
+        uint16_t *row = &image[y * width];
+        uint16_t *prev = row - width;
+
+        for(int col = 0; col < dec.columns; col++)
+        {
+            if(dec.restart_interval)
+            {
+                if(!restart_left)
+                {
+                    if(lj92_restart(&reader))
+                    {
+                        return 1;
+                    }
+                    restart_left = dec.restart_interval;
+                    first_line = 1;
+                    first_mcu = 1;
+                }
+                restart_left--;
+            }
+
+            for(int comp = 0; comp < components; comp++)
+            {
+                int pos = col * components + dec.scan_index[comp];
+                int pred = 0;
+                int diff = 0;
+
+                if(first_mcu)
+                {
+                    pred = initial;
+                }
+                else if(first_line)
+                {
+                    pred = row[pos - components] >> pt;
+                }
+                else if(!col)
+                {
+                    pred = prev[pos] >> pt;
+                }
+                else
+                {
+                    pred = lj92_predict(dec.predictor, row[pos - components] >> pt, prev[pos] >> pt, prev[pos - components] >> pt);
+                }
+
+                if(lj92_decode_diff(&reader, &dec.tables[dec.scan_table[comp]], &diff))
+                {
+                    return 1;
+                }
+
+                row[pos] = ((pred + diff) & 0xFFFF) << pt;
+            }
+            first_mcu = 0;
+        }
+        first_line = 0;
+    }
+
+    /* more bits were used than the data had */
+    if(reader.pad * 8 > reader.count)
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+/* optimal code lengths for the symbol counts, limited to 16 bits (ITU T.81 annex K.2). returns the number of symbols */
+static int lj92_build_lengths(const uint32_t *counts, uint8_t *bits, uint8_t *values)
+{
+    /* one more symbol that is never used, so no code consists of 1-bits only */
+    uint64_t freq[LJ92_SYMBOLS + 1];
+    int codesize[LJ92_SYMBOLS + 1];
+    int others[LJ92_SYMBOLS + 1];
+    int lengths[33];
+    int value_count = 0;
+
+    for(int sym = 0; sym <= LJ92_SYMBOLS; sym++)
+    {
+        freq[sym] = (sym < LJ92_SYMBOLS) ? counts[sym] : 1;
+        codesize[sym] = 0;
+        others[sym] = -1;
+    }
+
+    while(1)
+    {
+        int v1 = -1;
+        int v2 = -1;
+
+        /* the two least frequent symbols, on ties the higher one */
+        for(int sym = 0; sym <= LJ92_SYMBOLS; sym++)
+        {
+            if(freq[sym] && (v1 < 0 || freq[sym] <= freq[v1]))
+            {
+                v1 = sym;
+            }
+        }
+        for(int sym = 0; sym <= LJ92_SYMBOLS; sym++)
+        {
+            if(freq[sym] && sym != v1 && (v2 < 0 || freq[sym] <= freq[v2]))
+            {
+                v2 = sym;
+            }
+        }
+        if(v2 < 0)
+        {
+            break;
+        }
+
+        freq[v1] += freq[v2];
+        freq[v2] = 0;
+
+        codesize[v1]++;
+        while(others[v1] >= 0)
+        {
+            v1 = others[v1];
+            codesize[v1]++;
+        }
+        others[v1] = v2;
+
+        codesize[v2]++;
+        while(others[v2] >= 0)
+        {
+            v2 = others[v2];
+            codesize[v2]++;
+        }
+    }
+
+    memset(lengths, 0x00, sizeof(lengths));
+    for(int sym = 0; sym <= LJ92_SYMBOLS; sym++)
+    {
+        if(codesize[sym])
+        {
+            lengths[codesize[sym]]++;
+        }
+    }
+
+    /* move codes longer than 16 bits up the tree */
+    for(int len = 32; len > 16; len--)
+    {
+        while(lengths[len] > 0)
+        {
+            int shorter = len - 2;
+            while(!lengths[shorter])
+            {
+                shorter--;
+            }
+            lengths[len] -= 2;
+            lengths[len - 1]++;
+            lengths[shorter + 1] += 2;
+            lengths[shorter]--;
+        }
+    }
+
+    /* drop the reserved symbol, it has one of the longest codes */
+    int longest = 16;
+    while(!lengths[longest])
+    {
+        longest--;
+    }
+    lengths[longest]--;
+
+    for(int len = 1; len <= 16; len++)
+    {
+        bits[len - 1] = lengths[len];
+    }
+
+    for(int len = 1; len <= 32; len++)
+    {
+        for(int sym = 0; sym < LJ92_SYMBOLS; sym++)
+        {
+            if(codesize[sym] == len)
+            {
+                values[value_count++] = sym;
+            }
+        }
+    }
+
+    return value_count;
+}
+
+static inline void lj92_put(lj92_writer_t *writer, uint32_t value, int len)
+{
+    writer->bits = (writer->bits << len) | value;
+    writer->count += len;
+
+    while(writer->count >= 8)
+    {
+        writer->count -= 8;
+        uint8_t byte = writer->bits >> writer->count;
+
+        if(writer->end - writer->pos < 2)
+        {
+            writer->overflow = 1;
+            continue;
+        }
+
+        /* 0xFF bytes get a zero byte stuffed behind, so they can't be taken for a marker */
+        *writer->pos++ = byte;
+        if(byte == 0xFF)
+        {
+            *writer->pos++ = 0x00;
+        }
+    }
+}
+
+static inline int lj92_diff(int value, int pred)
+{
+    /* differences are modulo 2^16 */
+    int diff = (value - pred) & 0xFFFF;
+    return (diff >= 32768) ? diff - 65536 : diff;
+}
+
+static inline int lj92_ssss(int diff)
+{
+    return diff ? 32 - __builtin_clz(diff < 0 ? -diff : diff) : 0;
+}
+
+uint32_t lj92_encode_bound(int width, int height)
+{
+    /* up to 31 bits per sample, every byte might need stuffing, plus the headers */
+    return (uint32_t)width * height * 8 + 256;
+}
+
+uint32_t lj92_encode(const uint16_t *image, int width, int height, int components, int precision, uint8_t *out, uint32_t out_size)
+{
+    uint32_t counts[LJ92_SYMBOLS];
+    uint8_t bits[16];
+    uint8_t values[LJ92_SYMBOLS];
+    uint16_t codes[LJ92_SYMBOLS];
+    uint8_t code_len[LJ92_SYMBOLS];
+    int initial = 1 << (precision - 1);
+
+    if(precision < 2 || precision > 16 || components < 1 || components > 4 || width <= 0 || height <= 0 || (width % components) || width / components > 0xFFFF || height > 0xFFFF || out_size < 256)
+    {
+        return 0;
+    }
+
+    /* first pass: count how often each difference size occurs */
+    memset(counts, 0x00, sizeof(counts));
+    for(int y = 0; y < height; y++)
+    {
+        const uint16_t *row = &image[y * width];
+        const uint16_t *prev = row - width;
+
+        for(int x = 0; x < components; x++)
+        {
+            counts[lj92_ssss(lj92_diff(row[x], y ? prev[x] : initial))]++;
+        }
+        for(int x = components; x < width; x++)
+        {
+            counts[lj92_ssss(lj92_diff(row[x], row[x - components]))]++;
+        }
+    }
+
+    int value_count = lj92_build_lengths(counts, bits, values);
+
+    /* canonical codes */
+    uint32_t code = 0;
+    int value = 0;
+    for(int len = 1; len <= 16; len++)
+    {
+        for(int num = 0; num < bits[len - 1]; num++, value++)
+        {
+            codes[values[value]] = code++;
+            code_len[values[value]] = len;
+        }
+        code <<= 1;
+    }
+
+    /* headers */
+    uint8_t *pos = out;
+    int columns = width / components;
+
+    *pos++ = 0xFF;
+    *pos++ = LJ92_SOI;
+
+    *pos++ = 0xFF;
+    *pos++ = LJ92_SOF3;
+    *pos++ = 0;
+    *pos++ = 8 + 3 * components;
+    *pos++ = precision;
+    *pos++ = height >> 8;
+    *pos++ = height;
+    *pos++ = columns >> 8;
+    *pos++ = columns;
+    *pos++ = components;
+    for(int comp = 0; comp < components; comp++)
+    {
+        *pos++ = comp;
+        *pos++ = 0x11;
+        *pos++ = 0;
+    }
+
+    *pos++ = 0xFF;
+    *pos++ = LJ92_DHT;
+    *pos++ = 0;
+    *pos++ = 2 + 17 + value_count;
+    *pos++ = 0x00;
+    memcpy(pos, bits, 16);
+    pos += 16;
+    memcpy(pos, values, value_count);
+    pos += value_count;
+
+    *pos++ = 0xFF;
+    *pos++ = LJ92_SOS;
+    *pos++ = 0;
+    *pos++ = 6 + 2 * components;
+    *pos++ = components;
+    for(int comp = 0; comp < components; comp++)
+    {
+        *pos++ = comp;
+        *pos++ = 0x00;
+    }
+    *pos++ = 1;     /* predictor: left neighbour */
+    *pos++ = 0;
+    *pos++ = 0;     /* no point transform */
+
+    /* second pass: write the differences, leaving room for EOI */
+    lj92_writer_t writer;
+    memset(&writer, 0x00, sizeof(lj92_writer_t));
+    writer.pos = pos;
+    writer.end = out + out_size - 2;
+
+    for(int y = 0; y < height && !writer.overflow; y++)
+    {
+        const uint16_t *row = &image[y * width];
+        const uint16_t *prev = row - width;
+
+        for(int x = 0; x < width; x++)
+        {
+            int pred = (x >= components) ? row[x - components] : (y ? prev[x] : initial);
+            int diff = lj92_diff(row[x], pred);
+            int ssss = lj92_ssss(diff);
+
+            lj92_put(&writer, codes[ssss], code_len[ssss]);
+
+            /* negative differences are stored as one's complement, 32768 needs no extra bits */
+            if(ssss && ssss < 16)
+            {
+                lj92_put(&writer, (diff < 0 ? diff - 1 : diff) & ((1 << ssss) - 1), ssss);
+            }
+        }
+    }
+
+    /* fill the last byte with 1-bits */
+    if(writer.count)
+    {
+        lj92_put(&writer, (1 << (8 - writer.count)) - 1, 8 - writer.count);
+    }
+
+    if(writer.overflow)
+    {
+        return 0;
+    }
+
+    pos = writer.pos;
+    *pos++ = 0xFF;
+    *pos++ = LJ92_EOI;
+
+    return pos - out;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _lj92_h_
+#define _lj92_h_
+
+#include <stdint.h>
+
+/**
+ * Lossless JPEG (ITU T.81 process 14, "LJ92"), the compression used for raw data in DNG and CR2 files.
+ *
+ * Images are plain arrays of uint16_t samples, height rows of width samples each. The JPEG frame
+ * splits every row into interleaved components, so it is width / components columns wide.
+ * Raw data usually uses two components, then each one holds one colour of the bayer row and
+ * the prediction uses the nearest pixel of the same colour.
+ *
+ * The decoder handles all seven predictors, up to four components, point transform and restart
+ * intervals, but no subsampled components. The encoder uses predictor 1 (left neighbour) and
+ * builds an optimal Huffman table for every image.
+ */
+
+typedef struct
+{
+    int width;          /* samples per row, all components together */
+    int height;
+    int components;
+    int precision;      /* bits per sample */
+} lj92_info_t;
+
+/* parse the headers in front of the compressed data. returns 0 on success */
+int lj92_read_info(const uint8_t *data, uint32_t size, lj92_info_t *info);
+
+/* decode into image, which holds image_size samples. returns 0 on success */
+int lj92_decode(const uint8_t *data, uint32_t size, uint16_t *image, uint32_t image_size);
+
+/* maximum number of bytes lj92_encode() will write */
+uint32_t lj92_encode_bound(int width, int height);
+
+/* encode an image, all values have to fit into precision (2-16) bits. returns the encoded size, 0 on error */
+uint32_t lj92_encode(const uint16_t *image, int width, int height, int components, int precision, uint8_t *out, uint32_t out_size);
+
+#endif
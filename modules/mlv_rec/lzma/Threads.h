@@ -10,6 +10,8 @@
 extern "C" {
 #endif
 
+#ifdef _WIN32
+
 WRes HandlePtr_Close(HANDLE *h);
 WRes Handle_WaitObject(HANDLE h);
 
@@ -52,6 +54,77 @@ WRes CriticalSection_Init(CCriticalSection *p);
 #define CriticalSection_Enter(p) EnterCriticalSection(p)
 #define CriticalSection_Leave(p) LeaveCriticalSection(p)
 
+#else
+
+/* POSIX threads (host builds), same interface as the Windows version above */
+
+#include <pthread.h>
+
+typedef void * LPVOID;
+
+typedef unsigned THREAD_FUNC_RET_TYPE;
+#define THREAD_FUNC_CALL_TYPE MY_STD_CALL
+#define THREAD_FUNC_DECL THREAD_FUNC_RET_TYPE THREAD_FUNC_CALL_TYPE
+typedef THREAD_FUNC_RET_TYPE (THREAD_FUNC_CALL_TYPE * THREAD_FUNC_TYPE)(void *);
+
+typedef struct
+{
+  pthread_t thread;
+  THREAD_FUNC_TYPE func;
+  LPVOID param;
+  int created;
+  int joined;
+} CThread;
+#define Thread_Construct(p) (p)->created = 0
+#define Thread_WasCreated(p) ((p)->created != 0)
+WRes Thread_Create(CThread *p, THREAD_FUNC_TYPE func, LPVOID param);
+WRes Thread_Wait(CThread *p);
+WRes Thread_Close(CThread *p);
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int state;
+  int manualReset;
+  int created;
+} CEvent;
+typedef CEvent CAutoResetEvent;
+typedef CEvent CManualResetEvent;
+#define Event_Construct(p) (p)->created = 0
+#define Event_IsCreated(p) ((p)->created != 0)
+WRes Event_Close(CEvent *p);
+WRes Event_Wait(CEvent *p);
+WRes Event_Set(CEvent *p);
+WRes Event_Reset(CEvent *p);
+WRes ManualResetEvent_Create(CManualResetEvent *p, int signaled);
+WRes ManualResetEvent_CreateNotSignaled(CManualResetEvent *p);
+WRes AutoResetEvent_Create(CAutoResetEvent *p, int signaled);
+WRes AutoResetEvent_CreateNotSignaled(CAutoResetEvent *p);
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  UInt32 count;
+  UInt32 maxCount;
+  int created;
+} CSemaphore;
+#define Semaphore_Construct(p) (p)->created = 0
+WRes Semaphore_Close(CSemaphore *p);
+WRes Semaphore_Wait(CSemaphore *p);
+WRes Semaphore_Create(CSemaphore *p, UInt32 initCount, UInt32 maxCount);
+WRes Semaphore_ReleaseN(CSemaphore *p, UInt32 num);
+WRes Semaphore_Release1(CSemaphore *p);
+
+typedef pthread_mutex_t CCriticalSection;
+WRes CriticalSection_Init(CCriticalSection *p);
+#define CriticalSection_Delete(p) pthread_mutex_destroy(p)
+#define CriticalSection_Enter(p) pthread_mutex_lock(p)
+#define CriticalSection_Leave(p) pthread_mutex_unlock(p)
+
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,9 @@
 
 #define MLV_VIDEO_CLASS_FLAG_LZMA    0x80
 #define MLV_VIDEO_CLASS_FLAG_DELTA   0x40
+#define MLV_VIDEO_CLASS_FLAG_LJ92    0x20
+#define MLV_VIDEO_CLASS_FLAG_LZMA2   0x10
+#define MLV_VIDEO_CLASS_FLAG_RICE    0x100   /* above the low byte: videoClass is 16 bits wide */
 
 #define MLV_AUDIO_CLASS_FLAG_LZMA    0x80
 
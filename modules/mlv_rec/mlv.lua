@@ -57,6 +57,18 @@ function handle_VIDF_data_write_mlv(hdr, data)
     print("  --  handle VIDF before write as MLV. hdr ("..#hdr.." byte) and data ("..#data.." byte)");
 end
 
+--
+-- subscribed hooks get views into mlv_dump's buffers instead of string copies,
+-- fields are read and written in place (see "block views for Lua hooks" in mlv_dump.c)
+--
+mlv.subscribe("VIDF", "data_read", function(hdr, data)
+    print("  --  VIDF #"..hdr.frameNumber.." after read ("..#data.." byte, first word "..data:u16(0)..")");
+end)
+
+mlv.subscribe("EXPO", function(hdr)
+    print("  --  EXPO: ISO "..hdr.isoValue..", shutter "..hdr.shutterValue.." us");
+end)
+
 function handle_RTCI(hdr)
     print("  --  handle RTCI ("..#hdr.." byte)");
     
@@ -22,6 +22,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
@@ -29,11 +30,14 @@
 #include <getopt.h>
 #include <inttypes.h>
 #include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
 
 /* dng related headers */
 #include <chdk-dng.h>
 #include "../dual_iso/wirth.h"  /* fast median, generic implementation (also kth_smallest) */
 #include "../dual_iso/optmed.h" /* fast median for small common array sizes (3, 7, 9...) */
+#include "../dual_iso/chroma_smooth.h"
 
 #ifdef __WIN32
 #define FMT_SIZE "%u"
@@ -89,14 +93,26 @@ char *strdup(const char *s);
 
 #ifdef MLV_USE_LZMA
 #include <LzmaLib.h>
+#include <LzmaEnc.h>
+#include <Lzma2Enc.h>
+#include <Lzma2Dec.h>
 #endif
 
 /* project includes */
 #include "../lv_rec/lv_rec.h"
+#include "../lv_rec/raw2dng.h"
 #include "../../src/raw.h"
 #include "mlv.h"
+#include "mlv_reader.h"
+#include "mlv_index.h"
+#include "raw_pack.h"
+#include "lj92.h"
+#include "bayer_rice.h"
 #include "camera_id.h"
 
+/* any of the video frame compression flags */
+#define MLV_VIDEO_CLASS_FLAG_COMPRESSED (MLV_VIDEO_CLASS_FLAG_LZMA | MLV_VIDEO_CLASS_FLAG_LJ92 | MLV_VIDEO_CLASS_FLAG_LZMA2 | MLV_VIDEO_CLASS_FLAG_RICE)
+
 enum bug_id
 {
     BUG_ID_NONE = 0,
@@ -180,7 +196,13 @@ int32_t lua_call_va(lua_State *L, const char *func, const char *sig, ...)
 #if defined(USE_LUA)
     int narg, nres;  /* number of arguments and results */
     int verbose = 0;
-    
+
+    if(!L)
+    {
+        va_end(vl);
+        return 0;
+    }
+
     lua_getglobal(L, func);  /* get function */
 
     /* push arguments */
@@ -353,6 +375,462 @@ int32_t lua_call_va(lua_State *L, const char *func, const char *sig, ...)
 }
 
 
+#if defined(USE_LUA)
+/*
+    block views for Lua hooks
+
+    a script subscribes to single block types:
+
+        mlv.subscribe("VIDF", "data_read", function(hdr, data) ... end)
+        mlv.subscribe("RTCI", function(hdr) hdr.tm_sec = 0 end)
+
+    and its function gets the block header and payload as views into mlv_dump's own buffers
+    instead of strings (handle_<type><suffix> functions), so nothing is copied unless the script
+    asks for it. fields are read and written in place:
+
+        hdr.frameNumber, hdr.timestamp, ...     named fields of the known block types
+        data:u16(offset), data:set_u16(offset, value)
+                                                u8/u16/u32/u64/i8/i16/i32/i64 at a byte offset (little endian)
+        data:bytes(offset, length)              copy of a range as string
+        #data, hdr:type()
+
+    the views are only valid during the call. blocks no function subscribed to don't enter Lua at all.
+*/
+
+#define LUA_VIEW_META           "mlv_dump.view"
+#define LUA_MAX_SUBSCRIPTIONS   64
+
+typedef struct
+{
+    uint8_t *ptr;
+    size_t size;
+    char type[4];
+    int valid;
+} lua_view_t;
+
+typedef struct
+{
+    char type[4];
+    char suffix[32];        /* without the leading underscore, "" for the header hook */
+    int ref;                /* the function, in the registry */
+} lua_subscription_t;
+
+static lua_subscription_t lua_subscriptions[LUA_MAX_SUBSCRIPTIONS];
+static int lua_subscription_count = 0;
+
+/* the two views (header and payload) passed to every hook, in the registry */
+static int lua_view_refs[2] = { LUA_NOREF, LUA_NOREF };
+
+typedef struct
+{
+    const char *type;       /* NULL: header fields every block has (but MLVI) */
+    const char *name;
+    uint16_t offset;
+    uint8_t size;
+    char kind;              /* 'u' unsigned, 'i' signed, 's' string */
+} lua_field_t;
+
+#define LUA_FIELD(type, hdr_t, field, kind) { type, #field, offsetof(hdr_t, field), sizeof(((hdr_t *)0)->field), kind }
+
+static const lua_field_t lua_fields[] =
+{
+    LUA_FIELD(NULL,   mlv_hdr_t,      blockSize,        'u'),
+    LUA_FIELD(NULL,   mlv_hdr_t,      timestamp,        'u'),
+
+    LUA_FIELD("MLVI", mlv_file_hdr_t, blockSize,        'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, versionString,    's'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, fileGuid,         'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, fileNum,          'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, fileCount,        'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, fileFlags,        'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, videoClass,       'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, audioClass,       'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, videoFrameCount,  'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, audioFrameCount,  'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, sourceFpsNom,     'u'),
+    LUA_FIELD("MLVI", mlv_file_hdr_t, sourceFpsDenom,   'u'),
+
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, frameNumber,      'u'),
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, cropPosX,         'u'),
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, cropPosY,         'u'),
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, panPosX,          'u'),
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, panPosY,          'u'),
+    LUA_FIELD("VIDF", mlv_vidf_hdr_t, frameSpace,       'u'),
+
+    LUA_FIELD("AUDF", mlv_audf_hdr_t, frameNumber,      'u'),
+    LUA_FIELD("AUDF", mlv_audf_hdr_t, frameSpace,       'u'),
+
+    LUA_FIELD("RAWI", mlv_rawi_hdr_t, xRes,             'u'),
+    LUA_FIELD("RAWI", mlv_rawi_hdr_t, yRes,             'u'),
+
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, format,           'u'),
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, channels,         'u'),
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, samplingRate,     'u'),
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, bytesPerSecond,   'u'),
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, blockAlign,       'u'),
+    LUA_FIELD("WAVI", mlv_wavi_hdr_t, bitsPerSample,    'u'),
+
+    LUA_FIELD("EXPO", mlv_expo_hdr_t, isoMode,          'u'),
+    LUA_FIELD("EXPO", mlv_expo_hdr_t, isoValue,         'u'),
+    LUA_FIELD("EXPO", mlv_expo_hdr_t, isoAnalog,        'u'),
+    LUA_FIELD("EXPO", mlv_expo_hdr_t, digitalGain,      'u'),
+    LUA_FIELD("EXPO", mlv_expo_hdr_t, shutterValue,     'u'),
+
+    LUA_FIELD("LENS", mlv_lens_hdr_t, focalLength,      'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, focalDist,        'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, aperture,         'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, stabilizerMode,   'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, autofocusMode,    'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, flags,            'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, lensID,           'u'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, lensName,         's'),
+    LUA_FIELD("LENS", mlv_lens_hdr_t, lensSerial,       's'),
+
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_sec,           'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_min,           'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_hour,          'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_mday,          'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_mon,           'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_year,          'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_wday,          'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_yday,          'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_isdst,         'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_gmtoff,        'u'),
+    LUA_FIELD("RTCI", mlv_rtci_hdr_t, tm_zone,          's'),
+
+    LUA_FIELD("IDNT", mlv_idnt_hdr_t, cameraName,       's'),
+    LUA_FIELD("IDNT", mlv_idnt_hdr_t, cameraModel,      'u'),
+    LUA_FIELD("IDNT", mlv_idnt_hdr_t, cameraSerial,     's'),
+
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wb_mode,          'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, kelvin,           'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wbgain_r,         'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wbgain_g,         'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wbgain_b,         'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wbs_gm,           'u'),
+    LUA_FIELD("WBAL", mlv_wbal_hdr_t, wbs_ba,           'u'),
+
+    LUA_FIELD("DISO", mlv_diso_hdr_t, dualMode,         'u'),
+    LUA_FIELD("DISO", mlv_diso_hdr_t, isoValue,         'u'),
+
+    LUA_FIELD("MARK", mlv_mark_hdr_t, type,             'u'),
+
+    LUA_FIELD("STYL", mlv_styl_hdr_t, picStyleId,       'u'),
+    LUA_FIELD("STYL", mlv_styl_hdr_t, contrast,         'i'),
+    LUA_FIELD("STYL", mlv_styl_hdr_t, sharpness,        'i'),
+    LUA_FIELD("STYL", mlv_styl_hdr_t, saturation,       'i'),
+    LUA_FIELD("STYL", mlv_styl_hdr_t, colortone,        'i'),
+    LUA_FIELD("STYL", mlv_styl_hdr_t, picStyleName,     's'),
+
+    LUA_FIELD("ELVL", mlv_elvl_hdr_t, roll,             'u'),
+    LUA_FIELD("ELVL", mlv_elvl_hdr_t, pitch,            'u'),
+};
+
+static lua_view_t *lua_view_check(lua_State *L, int idx)
+{
+    lua_view_t *view = luaL_checkudata(L, idx, LUA_VIEW_META);
+    if(!view->valid)
+    {
+        luaL_error(L, "block view used outside of its hook");
+    }
+    return view;
+}
+
+/* pointer to size bytes at the offset given as argument idx, raises an error if that's not within the view */
+static uint8_t *lua_view_at(lua_State *L, lua_view_t *view, int idx, size_t size)
+{
+    lua_Integer offset = luaL_checkinteger(L, idx);
+    if(offset < 0 || (size_t)offset > view->size || view->size - (size_t)offset < size)
+    {
+        luaL_error(L, "offset %d out of range (%d byte view)", (int)offset, (int)view->size);
+    }
+    return view->ptr + offset;
+}
+
+#define LUA_VIEW_ACCESSORS(name, ctype) \
+static int lua_view_get_##name(lua_State *L) \
+{ \
+    lua_view_t *view = lua_view_check(L, 1); \
+    ctype value; \
+    memcpy(&value, lua_view_at(L, view, 2, sizeof(value)), sizeof(value)); \
+    lua_pushinteger(L, (lua_Integer)value); \
+    return 1; \
+} \
+static int lua_view_set_##name(lua_State *L) \
+{ \
+    lua_view_t *view = lua_view_check(L, 1); \
+    ctype value = (ctype)luaL_checkinteger(L, 3); \
+    memcpy(lua_view_at(L, view, 2, sizeof(value)), &value, sizeof(value)); \
+    return 0; \
+}
+
+LUA_VIEW_ACCESSORS(u8, uint8_t)
+LUA_VIEW_ACCESSORS(u16, uint16_t)
+LUA_VIEW_ACCESSORS(u32, uint32_t)
+LUA_VIEW_ACCESSORS(u64, uint64_t)
+LUA_VIEW_ACCESSORS(i8, int8_t)
+LUA_VIEW_ACCESSORS(i16, int16_t)
+LUA_VIEW_ACCESSORS(i32, int32_t)
+LUA_VIEW_ACCESSORS(i64, int64_t)
+
+static int lua_view_bytes(lua_State *L)
+{
+    lua_view_t *view = lua_view_check(L, 1);
+    lua_Integer offset = luaL_optinteger(L, 2, 0);
+    lua_Integer length = luaL_optinteger(L, 3, (lua_Integer)view->size - offset);
+
+    if(offset < 0 || length < 0 || (size_t)offset > view->size || view->size - (size_t)offset < (size_t)length)
+    {
+        return luaL_error(L, "range %d+%d out of range (%d byte view)", (int)offset, (int)length, (int)view->size);
+    }
+    lua_pushlstring(L, (const char *)view->ptr + offset, (size_t)length);
+    return 1;
+}
+
+static int lua_view_type(lua_State *L)
+{
+    lua_view_t *view = lua_view_check(L, 1);
+    lua_pushlstring(L, view->type, 4);
+    return 1;
+}
+
+static int lua_view_len(lua_State *L)
+{
+    lua_view_t *view = lua_view_check(L, 1);
+    lua_pushinteger(L, (lua_Integer)view->size);
+    return 1;
+}
+
+static const luaL_Reg lua_view_methods[] =
+{
+    { "u8", lua_view_get_u8 },   { "set_u8", lua_view_set_u8 },
+    { "u16", lua_view_get_u16 }, { "set_u16", lua_view_set_u16 },
+    { "u32", lua_view_get_u32 }, { "set_u32", lua_view_set_u32 },
+    { "u64", lua_view_get_u64 }, { "set_u64", lua_view_set_u64 },
+    { "i8", lua_view_get_i8 },   { "set_i8", lua_view_set_i8 },
+    { "i16", lua_view_get_i16 }, { "set_i16", lua_view_set_i16 },
+    { "i32", lua_view_get_i32 }, { "set_i32", lua_view_set_i32 },
+    { "i64", lua_view_get_i64 }, { "set_i64", lua_view_set_i64 },
+    { "bytes", lua_view_bytes },
+    { "type", lua_view_type },
+    { NULL, NULL }
+};
+
+/* named field of the block type in this view, NULL if there is none or the view is too small for it */
+static const lua_field_t *lua_view_field(lua_view_t *view, const char *name)
+{
+    const lua_field_t *generic = NULL;
+
+    for(int i = 0; i < COUNT(lua_fields); i++)
+    {
+        const lua_field_t *field = &lua_fields[i];
+        if(strcmp(field->name, name))
+        {
+            continue;
+        }
+        if(field->type && !memcmp(field->type, view->type, 4))
+        {
+            return (field->offset + field->size <= view->size) ? field : NULL;
+        }
+        if(!field->type && memcmp(view->type, "MLVI", 4))
+        {
+            generic = field;
+        }
+    }
+
+    return (generic && generic->offset + generic->size <= view->size) ? generic : NULL;
+}
+
+/* __index: methods first (upvalue 1), then the named fields */
+static int lua_view_index(lua_State *L)
+{
+    lua_view_t *view = lua_view_check(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+
+    lua_getfield(L, lua_upvalueindex(1), name);
+    if(!lua_isnil(L, -1))
+    {
+        return 1;
+    }
+
+    const lua_field_t *field = lua_view_field(view, name);
+    if(!field)
+    {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    const uint8_t *ptr = view->ptr + field->offset;
+    if(field->kind == 's')
+    {
+        size_t length = 0;
+        while(length < field->size && ptr[length])
+        {
+            length++;
+        }
+        lua_pushlstring(L, (const char *)ptr, length);
+        return 1;
+    }
+
+    uint64_t value = 0;
+    memcpy(&value, ptr, field->size);
+    if(field->kind == 'i' && field->size < 8 && (value >> (field->size * 8 - 1)))
+    {
+        value |= ~0ULL << (field->size * 8);
+    }
+    lua_pushinteger(L, (lua_Integer)value);
+    return 1;
+}
+
+static int lua_view_newindex(lua_State *L)
+{
+    lua_view_t *view = lua_view_check(L, 1);
+    const char *name = luaL_checkstring(L, 2);
+    const lua_field_t *field = lua_view_field(view, name);
+
+    if(!field)
+    {
+        return luaL_error(L, "%.4s has no field '%s'", view->type, name);
+    }
+
+    uint8_t *ptr = view->ptr + field->offset;
+    if(field->kind == 's')
+    {
+        size_t length = 0;
+        const char *str = luaL_checklstring(L, 3, &length);
+        memset(ptr, 0, field->size);
+        memcpy(ptr, str, MIN(length, field->size));
+        return 0;
+    }
+
+    uint64_t value = (uint64_t)luaL_checkinteger(L, 3);
+    memcpy(ptr, &value, field->size);
+    return 0;
+}
+
+/* mlv.subscribe(type, [suffix,] function) */
+static int lua_mlv_subscribe(lua_State *L)
+{
+    size_t type_len = 0;
+    const char *type = luaL_checklstring(L, 1, &type_len);
+    const char *suffix = "";
+    int func = 2;
+
+    if(lua_type(L, 2) == LUA_TSTRING)
+    {
+        suffix = lua_tostring(L, 2);
+        func = 3;
+    }
+    luaL_checktype(L, func, LUA_TFUNCTION);
+
+    if(type_len != 4)
+    {
+        return luaL_error(L, "block type must have four characters, not '%s'", type);
+    }
+    if(*suffix == '_')
+    {
+        suffix++;
+    }
+    if(strlen(suffix) >= sizeof(lua_subscriptions[0].suffix))
+    {
+        return luaL_error(L, "unknown hook '%s'", suffix);
+    }
+    if(lua_subscription_count >= LUA_MAX_SUBSCRIPTIONS)
+    {
+        return luaL_error(L, "too many subscriptions");
+    }
+
+    lua_subscription_t *sub = &lua_subscriptions[lua_subscription_count++];
+    memcpy(sub->type, type, 4);
+    strcpy(sub->suffix, suffix);
+    lua_pushvalue(L, func);
+    sub->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+static int lua_new_view(lua_State *L)
+{
+    lua_view_t *view = lua_newuserdata(L, sizeof(lua_view_t));
+    memset(view, 0, sizeof(lua_view_t));
+    luaL_setmetatable(L, LUA_VIEW_META);
+    return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* register the mlv table and the view type, before the script is loaded */
+void lua_init_views(lua_State *L)
+{
+    luaL_newmetatable(L, LUA_VIEW_META);
+    luaL_newlib(L, lua_view_methods);
+    lua_pushcclosure(L, lua_view_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, lua_view_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, lua_view_len);
+    lua_setfield(L, -2, "__len");
+    lua_pop(L, 1);
+
+    lua_newtable(L);
+    lua_pushcfunction(L, lua_mlv_subscribe);
+    lua_setfield(L, -2, "subscribe");
+    lua_setglobal(L, "mlv");
+
+    lua_view_refs[0] = lua_new_view(L);
+    lua_view_refs[1] = lua_new_view(L);
+}
+
+/* point view number idx at a buffer and push it */
+static void lua_push_view(lua_State *L, int idx, uint8_t *type, void *ptr, int size)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, lua_view_refs[idx]);
+    lua_view_t *view = lua_touserdata(L, -1);
+    view->ptr = ptr;
+    view->size = size;
+    memcpy(view->type, type, 4);
+    view->valid = 1;
+}
+
+/* call the functions subscribed to this block type and hook with views of hdr and data */
+static void lua_call_subscriptions(lua_State *L, uint8_t *type, char *suffix, void *hdr, int hdr_len, void *data, int data_len)
+{
+    if(*suffix == '_')
+    {
+        suffix++;
+    }
+
+    for(int i = 0; i < lua_subscription_count; i++)
+    {
+        lua_subscription_t *sub = &lua_subscriptions[i];
+        if(memcmp(sub->type, type, 4) || strcmp(sub->suffix, suffix))
+        {
+            continue;
+        }
+
+        lua_rawgeti(L, LUA_REGISTRYINDEX, sub->ref);
+        lua_push_view(L, 0, type, hdr, hdr_len);
+        int narg = 1;
+        if(data)
+        {
+            lua_push_view(L, 1, type, data, data_len);
+            narg++;
+        }
+
+        if(lua_pcall(L, narg, 0, 0) != 0)
+        {
+            print_msg(MSG_INFO, "LUA: Error in %.4s %s hook: '%s'\n", type, suffix, lua_tostring(L, -1));
+            lua_pop(L, 1);
+        }
+
+        /* scripts might keep a view, make sure it can't reach the buffer later */
+        for(int v = 0; v < 2; v++)
+        {
+            lua_rawgeti(L, LUA_REGISTRYINDEX, lua_view_refs[v]);
+            ((lua_view_t *)lua_touserdata(L, -1))->valid = 0;
+            lua_pop(L, 1);
+        }
+    }
+}
+#endif
+
 int32_t lua_handle_hdr_suffix(lua_State *lua_state, uint8_t *type, char *suffix, void *hdr, int hdr_len, void *data, int data_len)
 {
 #if defined(USE_LUA)
@@ -362,7 +840,22 @@ int32_t lua_handle_hdr_suffix(lua_State *lua_state, uint8_t *type, char *suffix,
     int ret_data_len = 0;
     char func[128];
 
+    if(!lua_state)
+    {
+        return 0;
+    }
+
+    lua_call_subscriptions(lua_state, type, suffix, hdr, hdr_len, data, data_len);
+
+    /* handle_<type><suffix> functions get copies as strings, only call them if the script has one */
     snprintf(func, sizeof(func), "handle_%.4s%s", type, suffix);
+    lua_getglobal(lua_state, func);
+    int defined = lua_isfunction(lua_state, -1);
+    lua_pop(lua_state, 1);
+    if(!defined)
+    {
+        return 0;
+    }
 
     if(data)
     {
@@ -436,235 +929,117 @@ uint32_t file_set_pos(FILE *stream, uint64_t offset, int whence)
 }
 
 
-/* this structure is used to build the mlv_xref_t table */
-typedef struct
+const mlv_hdr_t *xref_read_block(void *ctx, uint16_t file_number, uint64_t offset)
 {
-    uint64_t    frameTime;
-    uint64_t    frameOffset;
-    uint16_t    fileNumber;
-    uint16_t    frameType;
-} frame_xref_t;
+    return mlv_reader_block((mlv_reader_t *)ctx, file_number, offset);
+}
 
-void xref_resize(frame_xref_t **table, int entries, int *allocated)
+void xref_dump(mlv_xref_hdr_t *xref, mlv_reader_t *reader)
 {
-    /* make sure there is no crappy pointer before using */
-    if(*allocated == 0)
-    {
-        *table = NULL;
-    }
+    mlv_index_t index;
 
-    /* only resize if the buffer is too small */
-    if(entries * sizeof(frame_xref_t) > (uint32_t)(*allocated))
+    /* the .IDX file has no timestamps and frame numbers, get them from the blocks */
+    mlv_index_init(&index);
+    if(mlv_index_load_xref(&index, xref, xref_read_block, reader))
     {
-        *allocated += (entries + 1) * sizeof(frame_xref_t);
-        *table = realloc(*table, *allocated);
+        print_msg(MSG_ERROR, "XREF table does not match the file\n");
+        mlv_index_free(&index);
+        return;
     }
-}
 
-void xref_dump(mlv_xref_hdr_t *xref)
-{
-    mlv_xref_t *xrefs = (mlv_xref_t*)&(((unsigned char *)xref)[sizeof(mlv_xref_hdr_t)]);
-
-    for(uint32_t pos = 0; pos < xref->entryCount; pos++)
+    for(uint32_t pos = 0; pos < index.entry_count; pos++)
     {
-        print_msg(MSG_INFO, "Entry %d/%d\n", pos + 1, xref->entryCount);
-        print_msg(MSG_INFO, "    File   #%d\n", xrefs[pos].fileNumber);
-        print_msg(MSG_INFO, "    Offset 0x%08X\n", xrefs[pos].frameOffset);
-        switch (xrefs[pos].frameType)
+        frame_xref_t *entry = &index.entries[pos];
+
+        print_msg(MSG_INFO, "Entry %d/%d\n", pos + 1, index.entry_count);
+        print_msg(MSG_INFO, "    File   #%d\n", entry->fileNumber);
+        print_msg(MSG_INFO, "    Offset 0x%08" PRIX64 "\n", entry->frameOffset);
+        print_msg(MSG_INFO, "    Time   %f ms\n", (double)entry->frameTime / 1000.0f);
+        switch (entry->frameType)
         {
             case MLV_FRAME_VIDF:
-                print_msg(MSG_INFO, "    Type   VIDF\n");
+                print_msg(MSG_INFO, "    Type   VIDF #%d\n", entry->frameNumber);
                 break;
             case MLV_FRAME_AUDF:
-                print_msg(MSG_INFO, "    Type   AUDF\n");
+                print_msg(MSG_INFO, "    Type   AUDF #%d\n", entry->frameNumber);
                 break;
             default:
                 break;
         }
     }
-}
-
-
-void xref_sort(frame_xref_t *table, int entries)
-{
-    int n = entries;
-    do
-    {
-        int newn = 1;
-        for (int i = 0; i < n-1; ++i)
-        {
-            if (table[i].frameTime > table[i+1].frameTime)
-            {
-                frame_xref_t tmp = table[i+1];
-                table[i+1] = table[i];
-                table[i] = tmp;
-                newn = i + 1;
-            }
-        }
-        n = newn;
-    } while (n > 1);
-}
-
-void bitinsert(uint16_t *dst, int position, int depth, uint16_t new_value)
-{
-    uint16_t old_value = 0;
-    int dst_pos = position * depth / 16;
-    int bits_to_left = ((depth * position) - (16 * dst_pos)) % 16;
-    int shift_right = 16 - depth - bits_to_left;
-
-    old_value = dst[dst_pos];
-    if(shift_right >= 0)
-    {
-        /* this case is a bit simpler. the word fits into this uint16_t */
-        uint16_t mask = ((1<<depth)-1) << shift_right;
-
-        /* shift and mask out */
-        new_value <<= shift_right;
-        new_value &= mask;
-        old_value &= ~mask;
-
-        /* now combine */
-        new_value |= old_value;
-        dst[dst_pos] = new_value;
-    }
-    else
-    {
-        /* here we need two operations as the bits are split over two words */
-        uint16_t mask1 = ((1<<(depth + shift_right))-1);
-        uint16_t mask2 = ((1<<(-shift_right))-1) << (16+shift_right);
-
-        /* write the upper bits */
-        old_value &= ~mask1;
-        old_value |= (new_value >> (-shift_right)) & mask1;
-        dst[dst_pos] = old_value;
-
-        /* write the lower bits */
-        old_value = dst[dst_pos + 1];
-        old_value &= ~mask2;
-        old_value |= (new_value << (16+shift_right)) & mask2;
-        dst[dst_pos + 1] = old_value;
-    }
-}
-
-uint16_t bitextract(uint16_t *src, int position, int depth)
-{
-    uint16_t value = 0;
-    int src_pos = position * depth / 16;
-    int bits_to_left = ((depth * position) - (16 * src_pos)) % 16;
-    int shift_right = 16 - depth - bits_to_left;
-
-    value = src[src_pos];
-
-    if(shift_right >= 0)
-    {
-        value >>= shift_right;
-    }
-    else
-    {
-        value <<= -shift_right;
-        value |= src[src_pos + 1] >> (16 + shift_right);
-    }
-    value &= (1<<depth) - 1;
 
-    return value;
+    mlv_index_free(&index);
 }
 
 int load_frame(char *filename, uint8_t **frame_buffer, uint32_t *frame_buffer_size)
 {
-    FILE *in_file = NULL;
-    int ret = 0;
+    mlv_reader_t *reader = mlv_reader_open(filename, 1);
+    uint64_t position = 0;
+    int ret = 2;
 
-    /* open files */
-    in_file = fopen(filename, "rb");
-    if(!in_file)
+    if(!reader)
     {
         print_msg(MSG_ERROR, "Failed to open file '%s'\n", filename);
         return 1;
     }
 
-    do
+    while(position < mlv_reader_chunk_size(reader, 0))
     {
-        mlv_hdr_t buf;
-        uint64_t position = 0;
+        const mlv_hdr_t *buf = mlv_reader_block(reader, 0, position);
 
-        position = file_get_pos(in_file);
-
-        if(fread(&buf, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        if(!buf)
         {
-            print_msg(MSG_ERROR, "Failed to read from file '%s'\n", filename);
-            ret = 2;
-            goto load_frame_finish;
+            print_msg(MSG_ERROR, "File '%s' ends in the middle of a block\n", filename);
+            ret = 3;
+            break;
         }
 
-        print_msg(MSG_INFO, "Block: %c%c%c%c\n", buf.blockType[0], buf.blockType[1], buf.blockType[2], buf.blockType[3]);
+        print_msg(MSG_INFO, "Block: %c%c%c%c\n", buf->blockType[0], buf->blockType[1], buf->blockType[2], buf->blockType[3]);
         print_msg(MSG_INFO, "  Offset: 0x%08" PRIx64 "\n", position);
-        print_msg(MSG_INFO, "    Size: %d\n", buf.blockSize);
-        
-        /* jump back to the beginning of the block just read */
-        file_set_pos(in_file, position, SEEK_SET);
+        print_msg(MSG_INFO, "    Size: %d\n", buf->blockSize);
 
-        position = file_get_pos(in_file);
-
-        if(!memcmp(buf.blockType, "MLVI", 4))
+        if(!memcmp(buf->blockType, "MLVI", 4))
         {
-            mlv_file_hdr_t file_hdr;
-            uint32_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
+            const mlv_file_hdr_t *file_hdr = (const mlv_file_hdr_t *)buf;
 
-            /* read the whole header block, but limit size to either our local type size or the written block size */
-            if(fread(&file_hdr, hdr_size, 1, in_file) != 1)
-            {
-                print_msg(MSG_ERROR, "File ends in the middle of a block\n");
-                ret = 3;
-                goto load_frame_finish;
-            }
-            file_set_pos(in_file, position + file_hdr.blockSize, SEEK_SET);
-
-            if(file_hdr.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA)
+            if(buf->blockSize >= sizeof(mlv_file_hdr_t) && (file_hdr->videoClass & MLV_VIDEO_CLASS_FLAG_COMPRESSED))
             {
                 print_msg(MSG_ERROR, "Compressed formats not supported for frame extraction\n");
                 ret = 5;
-                goto load_frame_finish;
+                break;
             }
         }
-        else if(!memcmp(buf.blockType, "VIDF", 4))
+        else if(!memcmp(buf->blockType, "VIDF", 4))
         {
-            mlv_vidf_hdr_t block_hdr;
-            uint32_t hdr_size = MIN(sizeof(mlv_vidf_hdr_t), buf.blockSize);
+            const mlv_vidf_hdr_t *block_hdr = (const mlv_vidf_hdr_t *)buf;
 
-            if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+            if(buf->blockSize < sizeof(mlv_vidf_hdr_t) || block_hdr->frameSpace > buf->blockSize - sizeof(mlv_vidf_hdr_t))
             {
                 print_msg(MSG_ERROR, "File '%s' ends in the middle of a block\n", filename);
-                ret = 3;
-                goto load_frame_finish;
+                ret = 4;
+                break;
             }
 
-            int frame_size = block_hdr.blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr.frameSpace;
-        
-            /* loading the first frame. report frame size and allocate memory for that frame */
+            int frame_size = block_hdr->blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr->frameSpace;
+
+            /* loading the first frame. report frame size and copy it out of the mapping */
             *frame_buffer_size = frame_size;
             *frame_buffer = malloc(frame_size);
-
-            file_set_pos(in_file, block_hdr.frameSpace, SEEK_CUR);
-            if(fread(*frame_buffer, frame_size, 1, in_file) != 1)
-            {
-                print_msg(MSG_ERROR, "File '%s' ends in the middle of a block\n", filename);
-                ret = 4;
-                goto load_frame_finish;
-            }
+            memcpy(*frame_buffer, MLV_READER_FRAME_DATA(block_hdr, mlv_vidf_hdr_t), frame_size);
 
             ret = 0;
-            goto load_frame_finish;
-        }
-        else
-        {
-            file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+            break;
         }
+
+        position += buf->blockSize;
     }
-    while(!feof(in_file));
 
-load_frame_finish:
+    if(ret == 2)
+    {
+        print_msg(MSG_ERROR, "Failed to read from file '%s'\n", filename);
+    }
 
-    fclose(in_file);
+    mlv_reader_close(reader);
 
     return ret;
 }
@@ -674,14 +1049,15 @@ mlv_xref_hdr_t *load_index(char *base_filename)
     mlv_xref_hdr_t *block_hdr = NULL;
     int max_name_len = strlen(base_filename) + 16;
     char *filename = malloc(max_name_len);
-    FILE *in_file = NULL;
+    mlv_reader_t *reader = NULL;
+    uint64_t position = 0;
 
     strncpy(filename, base_filename, max_name_len);
     strcpy(&filename[strlen(filename) - 3], "IDX");
 
-    in_file = fopen(filename, "rb");
+    reader = mlv_reader_open(filename, 1);
 
-    if(!in_file)
+    if(!reader)
     {
         free(filename);
         return NULL;
@@ -689,281 +1065,2255 @@ mlv_xref_hdr_t *load_index(char *base_filename)
 
     print_msg(MSG_INFO, "File %s opened (XREF)\n", filename);
 
-    do
+    /* we should check the MLVI header for matching UID value to make sure its the right index... */
+    while(position < mlv_reader_chunk_size(reader, 0))
     {
-        mlv_hdr_t buf;
-        uint64_t position = 0;
-
-        position = file_get_pos(in_file);
+        const mlv_hdr_t *buf = mlv_reader_block(reader, 0, position);
 
-        if(fread(&buf, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        if(!buf)
         {
+            print_msg(MSG_ERROR, "File '%s' has invalid blocks\n", filename);
             break;
         }
 
-        /* jump back to the beginning of the block just read */
-        file_set_pos(in_file, position, SEEK_SET);
-
-        position = file_get_pos(in_file);
-
-        /* we should check the MLVI header for matching UID value to make sure its the right index... */
-        if(!memcmp(buf.blockType, "XREF", 4))
-        {
-            block_hdr = malloc(buf.blockSize);
-
-            if(fread(block_hdr, buf.blockSize, 1, in_file) != 1)
-            {
-                print_msg(MSG_ERROR, "File '%s' ends in the middle of a block\n", filename);
-                free(block_hdr);
-                block_hdr = NULL;
-            }
-        }
-        else
+        if(!memcmp(buf->blockType, "XREF", 4))
         {
-            file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+            block_hdr = malloc(buf->blockSize);
+            memcpy(block_hdr, buf, buf->blockSize);
         }
 
-        /* we are at the same position as before, so abort */
-        if(position == file_get_pos(in_file))
-        {
-            print_msg(MSG_ERROR, "File '%s' has invalid blocks\n", filename);
-            break;
-        }
+        position += buf->blockSize;
     }
-    while(!feof(in_file));
 
-    fclose(in_file);
+    mlv_reader_close(reader);
+
+    free(filename);
+    return block_hdr;
+}
+
+void save_index(char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, mlv_index_t *index)
+{
+    int max_name_len = strlen(base_filename) + 16;
+    char *filename = malloc(max_name_len);
+    FILE *out_file = NULL;
+    mlv_xref_hdr_t *xref = mlv_index_get_xref(index);
+
+    strncpy(filename, base_filename, max_name_len);
+
+    strcpy(&filename[strlen(filename) - 3], "IDX");
+
+    out_file = xref ? fopen(filename, "wb+") : NULL;
+
+    if(!out_file)
+    {
+        free(filename);
+        free(xref);
+        print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
+        return;
+    }
+
+    print_msg(MSG_INFO, "File %s opened for writing\n", filename);
+
+
+    /* first write MLVI header */
+    mlv_file_hdr_t file_hdr = *ref_file_hdr;
+
+    /* update fields */
+    file_hdr.blockSize = sizeof(mlv_file_hdr_t);
+    file_hdr.videoFrameCount = 0;
+    file_hdr.audioFrameCount = 0;
+    file_hdr.fileNum = fileCount + 1;
+
+    /* then the XREF block with all entries at once */
+    if(fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file) != 1 || fwrite(xref, xref->blockSize, 1, out_file) != 1)
+    {
+        print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
+    }
+
+    free(filename);
+    free(xref);
+    fclose(out_file);
+}
+
+
+mlv_reader_t *load_all_chunks(char *base_filename)
+{
+    int max_chunks = 1;
+
+    /* get extension and check if it is a .MLV, only those have M00, M01 etc */
+    char *dot = strrchr(base_filename, '.');
+    if(dot && !strcasecmp(dot + 1, "mlv"))
+    {
+        max_chunks = MLV_READER_MAX_CHUNKS;
+    }
+
+    mlv_reader_t *reader = mlv_reader_open(base_filename, max_chunks);
+    if(!reader)
+    {
+        return NULL;
+    }
+
+    for(int chunk = 0; chunk < mlv_reader_chunk_count(reader); chunk++)
+    {
+        print_msg(MSG_INFO, "File %s opened\n", mlv_reader_chunk_name(reader, chunk));
+    }
+
+    return reader;
+}
+
+
+#define EV_RESOLUTION 32768
+
+/* lookup tables for chroma smoothing. they only depend on the black level, so they are computed once per clip.
+   the buffers are kept for the next frame, so smoothing does not allocate anything after the first frame */
+typedef struct
+{
+    int black;
+    int valid;
+    int raw2ev[16384];
+    int ev2raw[24*EV_RESOLUTION];
+
+    uint32_t *frame;
+    uint16_t *line;
+    int pixels;
+    int width;
+    struct chroma_smooth_work work;
+} chroma_tables_t;
+
+void chroma_tables_free(chroma_tables_t *tables)
+{
+    if(tables)
+    {
+        free(tables->frame);
+        free(tables->line);
+        chroma_smooth_work_free(&tables->work);
+        free(tables);
+    }
+}
+
+void chroma_smooth(int method, struct raw_info *info, chroma_tables_t *tables)
+{
+    int black = info->black_level;
+    int* raw2ev = tables->raw2ev;
+    int* ev2raw = tables->ev2raw + 10*EV_RESOLUTION;
+    
+    if(!method)
+    {
+        return;
+    }
+
+    if(!tables->valid || tables->black != black)
+    {
+        for(int i = 0; i < 16384; i++)
+        {
+            raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
+        }
+
+        for(int i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
+        {
+            ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
+        }
+
+        tables->black = black;
+        tables->valid = 1;
+    }
+
+    int w = info->width;
+    int h = info->height;
+
+    if(tables->pixels < w * h || tables->width < w)
+    {
+        free(tables->frame);
+        free(tables->line);
+        tables->frame = malloc(w * h * sizeof(uint32_t));
+        tables->line = malloc(w * sizeof(uint16_t));
+        tables->pixels = w * h;
+        tables->width = w;
+
+        if(!tables->frame || !tables->line)
+        {
+            print_msg(MSG_ERROR, "Chroma smoothing: failed to allocate "FMT_SIZE" byte\n", w * h * sizeof(uint32_t));
+            free(tables->frame);
+            free(tables->line);
+            tables->frame = NULL;
+            tables->line = NULL;
+            tables->pixels = 0;
+            tables->width = 0;
+            return;
+        }
+    }
+
+    uint32_t *frame = tables->frame;
+    uint16_t *line = tables->line;
+
+    int x,y;
+    for (y = 0; y < h; y++)
+    {
+        raw_unpack_row((uint8_t *)info->buffer + y * info->pitch, line, w, 14);
+        for (x = 0; x < w; x++)
+        {
+            frame[x + y*w] = line[x];
+        }
+    }
+
+    /* filtered in place, no second copy needed */
+    if(chroma_smooth_run(method, w, h, frame, frame, raw2ev, ev2raw, EV_RESOLUTION, &tables->work))
+    {
+        print_msg(MSG_ERROR, "Chroma smoothing: out of memory\n");
+        return;
+    }
+
+    for (y = 0; y < h; y++)
+    {
+        for (x = 0; x < w; x++)
+        {
+            line[x] = frame[x + y*w];
+        }
+        raw_pack_row(line, (uint8_t *)info->buffer + y * info->pitch, w, 14);
+    }
+}
+
+/* everything the per-frame image operations need. read-only while frames are being processed */
+typedef struct
+{
+    int video_xRes;
+    int video_yRes;
+    int black_level;
+    int old_depth;
+    int new_depth;
+    int bit_zap;
+    int verbose;
+
+    /* subtract mode reference frame */
+    uint8_t *sub_buffer;
+    uint32_t sub_size;
+
+    /* flat-field reference frame and its normalization, see flatfield_normalize() */
+    uint8_t *flat_buffer;
+    uint32_t flat_size;
+    int flat_ready;
+    int32_t flat_med[2][2];
+    int32_t flat_adj_num;
+    int32_t flat_adj_den;
+} frame_params_t;
+
+/* make sure the buffer can hold the given number of bytes */
+int frame_buffer_reserve(uint8_t **buffer, uint32_t *buffer_size, uint32_t size)
+{
+    if(size <= *buffer_size)
+    {
+        return 0;
+    }
+
+    uint8_t *new_buffer = realloc(*buffer, size);
+    if(!new_buffer)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed to allocate %d byte\n", size);
+        return 1;
+    }
+
+    *buffer = new_buffer;
+    *buffer_size = size;
+    return 0;
+}
+
+/* unpack a LJ92 compressed frame of frame_size bytes from src into buffer, packed with the bit depth it was encoded with. returns 0 on success */
+int frame_decompress_lj92(const uint8_t *src, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int verbose)
+{
+    lj92_info_t info;
+
+    if(lj92_read_info(src, *frame_size, &info))
+    {
+        print_msg(MSG_INFO, "    LJ92: Invalid frame header\n");
+        return 1;
+    }
+
+    int pixels = info.width * info.height;
+    int out_size = (pixels * info.precision + 7) / 8;
+
+    /* raw_pack_row() writes whole words */
+    int words_size = (pixels * info.precision + 15) / 16 * 2;
+    uint16_t *image = malloc(pixels * sizeof(uint16_t));
+
+    if(!image)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", pixels * sizeof(uint16_t));
+        return 1;
+    }
+
+    if(lj92_decode(src, *frame_size, image, pixels))
+    {
+        print_msg(MSG_INFO, "    LJ92: Failed\n");
+        free(image);
+        return 1;
+    }
+
+    if(frame_buffer_reserve(buffer, buffer_size, words_size))
+    {
+        free(image);
+        return 1;
+    }
+
+    memset(&(*buffer)[words_size - 2], 0x00, 2);
+    raw_pack_row(image, *buffer, pixels, info.precision);
+    free(image);
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LJ92: %d -> %d  (%2.2f%%)\n", *frame_size, out_size, ((float)out_size * 100.0f) / (float)*frame_size);
+    }
+
+    *frame_size = out_size;
+    return 0;
+}
+
+/* compress a frame of width x height pixels with the given bit depth from src into LJ92 data in buffer, which is grown if needed. returns 0 on success */
+int frame_compress_lj92(const uint8_t *src, int width, int height, int depth, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int verbose)
+{
+    int pixels = width * height;
+    int in_size = (pixels * depth + 7) / 8;
+    uint16_t *image = malloc(pixels * sizeof(uint16_t));
+
+    if(!image)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", pixels * sizeof(uint16_t));
+        return 1;
+    }
+
+    if(frame_buffer_reserve(buffer, buffer_size, lj92_encode_bound(width, height)))
+    {
+        free(image);
+        return 1;
+    }
+
+    raw_unpack_row(src, image, pixels, depth);
+
+    /* with two components, each of them holds one color of the bayer row */
+    uint32_t size = lj92_encode(image, width, height, (width % 2) ? 1 : 2, depth, *buffer, *buffer_size);
+    free(image);
+
+    if(!size)
+    {
+        print_msg(MSG_INFO, "    LJ92: Failed\n");
+        return 1;
+    }
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LJ92: %d -> %d  (%2.2f%%)\n", in_size, size, ((float)size * 100.0f) / (float)in_size);
+    }
+
+    *frame_size = size;
+    return 0;
+}
+
+/* unpack a Rice compressed frame of frame_size bytes from src into buffer, packed with the bit depth it was encoded with. returns 0 on success */
+int frame_decompress_rice(const uint8_t *src, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int verbose)
+{
+    bayer_rice_info_t info;
+
+    if(bayer_rice_read_info(src, *frame_size, &info))
+    {
+        print_msg(MSG_INFO, "    Rice: Invalid frame header\n");
+        return 1;
+    }
+
+    int pixels = info.width * info.height;
+    int out_size = (pixels * info.depth + 7) / 8;
+
+    /* raw_pack_row() writes whole words */
+    int words_size = (pixels * info.depth + 15) / 16 * 2;
+    uint16_t *image = malloc(pixels * sizeof(uint16_t));
+
+    if(!image)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", pixels * sizeof(uint16_t));
+        return 1;
+    }
+
+    if(bayer_rice_decode(src, *frame_size, image, pixels))
+    {
+        print_msg(MSG_INFO, "    Rice: Failed\n");
+        free(image);
+        return 1;
+    }
+
+    if(frame_buffer_reserve(buffer, buffer_size, words_size))
+    {
+        free(image);
+        return 1;
+    }
+
+    memset(&(*buffer)[words_size - 2], 0x00, 2);
+    raw_pack_row(image, *buffer, pixels, info.depth);
+    free(image);
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    Rice: %d -> %d  (%2.2f%%)\n", *frame_size, out_size, ((float)out_size * 100.0f) / (float)*frame_size);
+    }
+
+    *frame_size = out_size;
+    return 0;
+}
+
+/* compress a frame of width x height pixels with the given bit depth from src into Rice coded data in buffer, which is grown if needed. returns 0 on success */
+int frame_compress_rice(const uint8_t *src, int width, int height, int depth, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int verbose)
+{
+    int pixels = width * height;
+    int in_size = (pixels * depth + 7) / 8;
+    uint16_t *image = malloc(pixels * sizeof(uint16_t));
+
+    if(!image)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", pixels * sizeof(uint16_t));
+        return 1;
+    }
+
+    if(frame_buffer_reserve(buffer, buffer_size, bayer_rice_encode_bound(width, height, depth)))
+    {
+        free(image);
+        return 1;
+    }
+
+    raw_unpack_row(src, image, pixels, depth);
+
+    uint32_t size = bayer_rice_encode(image, width, height, depth, *buffer, *buffer_size);
+    free(image);
+
+    if(!size)
+    {
+        print_msg(MSG_INFO, "    Rice: Failed\n");
+        return 1;
+    }
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    Rice: %d -> %d  (%2.2f%%)\n", in_size, size, ((float)size * 100.0f) / (float)in_size);
+    }
+
+    *frame_size = size;
+    return 0;
+}
+
+#ifdef MLV_USE_LZMA
+static void *lzma_alloc(void *p, size_t size) { p = p; return malloc(size); }
+static void lzma_free(void *p, void *address) { p = p; free(address); }
+static ISzAlloc lzma_allocator = { lzma_alloc, lzma_free };
+#endif
+
+/* unpack a LZMA2 compressed frame of frame_size bytes from src into buffer, which is grown if needed. returns 0 on success */
+int frame_decompress_lzma2(const uint8_t *src, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int verbose)
+{
+#ifdef MLV_USE_LZMA
+    /* original frame size, the dictionary size property and then the LZMA2 chunks */
+    size_t lzma_out_size = *(uint32_t *)src;
+    size_t lzma_in_size = *frame_size - 4 - 1;
+
+    if(*frame_size < 4 + 1 || frame_buffer_reserve(buffer, buffer_size, lzma_out_size))
+    {
+        return 1;
+    }
+
+    ELzmaStatus status;
+    int ret = Lzma2Decode(
+        *buffer, &lzma_out_size,
+        &src[4 + 1], &lzma_in_size,
+        src[4], LZMA_FINISH_END, &status, &lzma_allocator
+        );
+
+    if(ret != SZ_OK || lzma_out_size != *(uint32_t *)src)
+    {
+        print_msg(MSG_INFO, "    LZMA2: Failed (%d)\n", ret);
+        return 1;
+    }
+
+    *frame_size = lzma_out_size;
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LZMA2: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, lzma_out_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
+    }
+    return 0;
+#else
+    print_msg(MSG_INFO, "    LZMA2: not compiled into this release, aborting.\n");
+    return 1;
+#endif
+}
+
+/* unpack a compressed frame of frame_size bytes from src into buffer, which is grown if needed. video_class has the compression flags. returns 0 on success */
+int frame_decompress_from(const uint8_t *src, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int video_class, int verbose)
+{
+    if(video_class & MLV_VIDEO_CLASS_FLAG_LJ92)
+    {
+        return frame_decompress_lj92(src, buffer, buffer_size, frame_size, verbose);
+    }
+
+    if(video_class & MLV_VIDEO_CLASS_FLAG_RICE)
+    {
+        return frame_decompress_rice(src, buffer, buffer_size, frame_size, verbose);
+    }
+
+    if(video_class & MLV_VIDEO_CLASS_FLAG_LZMA2)
+    {
+        return frame_decompress_lzma2(src, buffer, buffer_size, frame_size, verbose);
+    }
+
+#ifdef MLV_USE_LZMA
+    size_t lzma_out_size = *(uint32_t *)src;
+    size_t lzma_in_size = *frame_size - LZMA_PROPS_SIZE - 4;
+    size_t lzma_props_size = LZMA_PROPS_SIZE;
+
+    if(frame_buffer_reserve(buffer, buffer_size, lzma_out_size))
+    {
+        return 1;
+    }
+
+    int ret = LzmaUncompress(
+        *buffer, &lzma_out_size,
+        &src[4 + LZMA_PROPS_SIZE], &lzma_in_size,
+        &src[4], lzma_props_size
+        );
+
+    if(ret != SZ_OK)
+    {
+        print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
+        return 1;
+    }
+
+    *frame_size = lzma_out_size;
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LZMA: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, lzma_out_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
+    }
+    return 0;
+#else
+    print_msg(MSG_INFO, "    LZMA: not compiled into this release, aborting.\n");
+    return 1;
+#endif
+}
+
+/* unpack a compressed frame in place. returns 0 on success */
+int frame_decompress(uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int video_class, int verbose)
+{
+    uint8_t *lzma_out = NULL;
+    uint32_t lzma_out_size = 0;
+
+    if(frame_decompress_from(*buffer, &lzma_out, &lzma_out_size, frame_size, video_class, verbose))
+    {
+        free(lzma_out);
+        return 1;
+    }
+
+    free(*buffer);
+    *buffer = lzma_out;
+    *buffer_size = lzma_out_size;
+    return 0;
+}
+
+/* LZMA match finders. hash chain is fast, binary tree finds longer matches. the default depends on the level */
+#define LZMA_MF_DEFAULT     0
+#define LZMA_MF_HC4         1
+#define LZMA_MF_BT2         2
+#define LZMA_MF_BT3         3
+#define LZMA_MF_BT4         4
+
+const char *lzma_mf_names[] = { "default", "hc4", "bt2", "bt3", "bt4" };
+
+/* how frames get compressed for MLV output (-c) */
+typedef struct
+{
+    int lj92;
+    int width;
+    int height;
+    int depth;
+
+    int lzma_level;
+    uint32_t lzma_dict;
+    int lzma_mf;
+    int lzma_lc;
+    int lzma_lp;
+    int lzma_pb;
+    int lzma_fb;
+    int lzma_threads;
+
+    /* LZMA2: the frame is cut into chunks of lzma2_chunk bytes (0: one per thread) that get compressed in parallel */
+    int lzma2;
+    uint32_t lzma2_chunk;
+
+    /* bayer prediction and adaptive Rice codes (bayer_rice.h) instead of LZMA */
+    int rice;
+} compress_options_t;
+
+#ifdef MLV_USE_LZMA
+/* encoder properties for a block of in_size bytes */
+static void lzma_props_from_options(CLzmaEncProps *props, const compress_options_t *options, uint32_t in_size)
+{
+    LzmaEncProps_Init(props);
+    props->level = options->lzma_level;
+    props->dictSize = options->lzma_dict;
+    props->lc = options->lzma_lc;
+    props->lp = options->lzma_lp;
+    props->pb = options->lzma_pb;
+    props->fb = options->lzma_fb;
+    props->numThreads = options->lzma_threads;
+
+    /* a dictionary larger than the frame only costs memory, in the encoder as well as in every decoder */
+    props->reduceSize = in_size;
+
+    if(options->lzma_mf != LZMA_MF_DEFAULT)
+    {
+        props->btMode = (options->lzma_mf != LZMA_MF_HC4);
+        props->numHashBytes = (options->lzma_mf == LZMA_MF_BT2) ? 2 : (options->lzma_mf == LZMA_MF_BT3) ? 3 : 4;
+    }
+}
+#endif
+
+/* compress a frame of in_size bytes from src into LZMA data in buffer, which is grown if needed. returns 0 on success */
+int frame_compress_lzma(const uint8_t *src, int in_size, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, const compress_options_t *options, int verbose)
+{
+#ifdef MLV_USE_LZMA
+    /* original frame size, encoder properties and then the LZMA stream */
+    size_t lzma_out_size = 2 * in_size;
+    size_t lzma_props_size = LZMA_PROPS_SIZE;
+
+    if(frame_buffer_reserve(buffer, buffer_size, lzma_out_size + LZMA_PROPS_SIZE + 4))
+    {
+        return 1;
+    }
+
+    CLzmaEncProps props;
+    lzma_props_from_options(&props, options, in_size);
+
+    uint8_t *dst = *buffer;
+    int ret = LzmaEncode(
+        &dst[4 + LZMA_PROPS_SIZE], &lzma_out_size,
+        src, in_size,
+        &props, &dst[4], &lzma_props_size, 0,
+        NULL, &lzma_allocator, &lzma_allocator
+        );
+
+    if(ret != SZ_OK)
+    {
+        print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
+        return 1;
+    }
+
+    *(uint32_t *)dst = in_size;
+    *frame_size = lzma_out_size + LZMA_PROPS_SIZE + 4;
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LZMA: %d -> %d  (%2.2f%%)\n", in_size, *frame_size, ((float)lzma_out_size * 100.0f) / (float)in_size);
+    }
+    return 0;
+#else
+    print_msg(MSG_INFO, "    LZMA: not compiled into this release, aborting.\n");
+    return 1;
+#endif
+}
+
+#ifdef MLV_USE_LZMA
+/* memory streams for the LZMA2 encoder. the input is read in order; the output grows the frame buffer as needed */
+typedef struct
+{
+    ISeqInStream stream;
+    const uint8_t *data;
+    size_t size;
+    size_t pos;
+} lzma2_in_stream_t;
+
+typedef struct
+{
+    ISeqOutStream stream;
+    uint8_t **buffer;
+    uint32_t *buffer_size;
+    size_t pos;
+} lzma2_out_stream_t;
+
+static SRes lzma2_stream_read(void *p, void *buf, size_t *size)
+{
+    lzma2_in_stream_t *in = (lzma2_in_stream_t *)p;
+    *size = MIN(*size, in->size - in->pos);
+    memcpy(buf, in->data + in->pos, *size);
+    in->pos += *size;
+    return SZ_OK;
+}
+
+static size_t lzma2_stream_write(void *p, const void *buf, size_t size)
+{
+    lzma2_out_stream_t *out = (lzma2_out_stream_t *)p;
+    if(out->pos + size > *out->buffer_size)
+    {
+        if(frame_buffer_reserve(out->buffer, out->buffer_size, MAX(out->pos + size, *out->buffer_size + *out->buffer_size / 4)))
+        {
+            return 0;
+        }
+    }
+    memcpy(*out->buffer + out->pos, buf, size);
+    out->pos += size;
+    return size;
+}
+#endif
+
+/* compress a frame of in_size bytes from src into LZMA2 data in buffer, which is grown if needed.
+   the chunks are independent, so a single large frame is spread over up to lzma_threads cores. returns 0 on success */
+int frame_compress_lzma2(const uint8_t *src, int in_size, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, const compress_options_t *options, int verbose)
+{
+#ifdef MLV_USE_LZMA
+    int threads = MAX(1, options->lzma_threads);
+    uint32_t chunk = options->lzma2_chunk;
+    if(!chunk)
+    {
+        /* one chunk per thread, but not so small that every chunk starts with an empty dictionary for nothing */
+        chunk = MAX((uint32_t)1<<20, (in_size + threads - 1) / threads);
+    }
+
+    /* original frame size, the dictionary size property and then the LZMA2 chunks */
+    if(frame_buffer_reserve(buffer, buffer_size, in_size + in_size / 16 + 4 + 1))
+    {
+        return 1;
+    }
+
+    CLzma2EncProps props;
+    Lzma2EncProps_Init(&props);
+    lzma_props_from_options(&props.lzmaProps, options, MIN(chunk, (uint32_t)in_size));
+    props.blockSize = chunk;
+
+    /* the encoder picks the threads for the match finder (two with binary trees), the rest compresses chunks in parallel */
+    props.lzmaProps.numThreads = -1;
+    props.numBlockThreads = -1;
+    props.numTotalThreads = threads;
+
+    CLzma2EncHandle enc = Lzma2Enc_Create(&lzma_allocator, &lzma_allocator);
+    if(!enc)
+    {
+        print_msg(MSG_INFO, "    LZMA2: Failed to allocate the encoder\n");
+        return 1;
+    }
+
+    lzma2_in_stream_t in = { { lzma2_stream_read }, src, in_size, 0 };
+    lzma2_out_stream_t out = { { lzma2_stream_write }, buffer, buffer_size, 4 + 1 };
+
+    int ret = Lzma2Enc_SetProps(enc, &props);
+    if(ret == SZ_OK)
+    {
+        (*buffer)[4] = Lzma2Enc_WriteProperties(enc);
+        ret = Lzma2Enc_Encode(enc, &out.stream, &in.stream, NULL);
+    }
+    Lzma2Enc_Destroy(enc);
+
+    if(ret != SZ_OK)
+    {
+        print_msg(MSG_INFO, "    LZMA2: Failed (%d)\n", ret);
+        return 1;
+    }
+
+    *(uint32_t *)*buffer = in_size;
+    *frame_size = out.pos;
+
+    if(verbose)
+    {
+        print_msg(MSG_INFO, "    LZMA2: %d -> %d  (%2.2f%%)\n", in_size, *frame_size, ((float)*frame_size * 100.0f) / (float)in_size);
+    }
+    return 0;
+#else
+    print_msg(MSG_INFO, "    LZMA2: not compiled into this release, aborting.\n");
+    return 1;
+#endif
+}
+
+/* compress a frame of in_size bytes from src the way the options say into buffer, which is grown if needed. returns 0 on success */
+int frame_compress(const uint8_t *src, int in_size, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, const compress_options_t *options, int verbose)
+{
+    if(options->lj92)
+    {
+        return frame_compress_lj92(src, options->width, options->height, options->depth, buffer, buffer_size, frame_size, verbose);
+    }
+    if(options->rice)
+    {
+        return frame_compress_rice(src, options->width, options->height, options->depth, buffer, buffer_size, frame_size, verbose);
+    }
+    if(options->lzma2)
+    {
+        return frame_compress_lzma2(src, in_size, buffer, buffer_size, frame_size, options, verbose);
+    }
+    return frame_compress_lzma(src, in_size, buffer, buffer_size, frame_size, options, verbose);
+}
+
+/* normalize flat frame on each Bayer channel (median) */
+/* and adjust all medians using green's 5th percentile to prevent whites from clipping */
+int flatfield_normalize(frame_params_t *params)
+{
+    int depth = params->old_depth;
+    int black = params->black_level;
+    int pitch = params->video_xRes * depth / 8;
+    int32_t pr5[2][2] = {{0,0},{0,0}};
+
+    if((int)params->flat_size < pitch * params->video_yRes)
+    {
+        print_msg(MSG_ERROR, "Error: Flat-field frame is too small for %dx%d at %d bpp\n", params->video_xRes, params->video_yRes, depth);
+        return 1;
+    }
+
+    /* normalize using frame center only
+     * (also works on lenses with heavy vignetting) */
+    
+    int* hist[2][2];
+    int total[2][2] = {{0,0},{0,0}};
+    
+    hist[0][0] = calloc(1 << depth, sizeof(int));
+    hist[0][1] = calloc(1 << depth, sizeof(int));
+    hist[1][0] = calloc(1 << depth, sizeof(int));
+    hist[1][1] = calloc(1 << depth, sizeof(int));
+    uint16_t *flat_line = malloc(params->video_xRes * sizeof(uint16_t));
+    
+    for(int y = params->video_yRes/4; y < params->video_yRes*3/4; y++)
+    {
+        raw_unpack_row(&params->flat_buffer[y * pitch], flat_line, params->video_xRes, depth);
+        for(int x = params->video_xRes/4; x < params->video_xRes*3/4; x++)
+        {
+            uint32_t value = flat_line[x];
+            hist[y%2][x%2][value]++;
+            total[y%2][x%2]++;
+        }
+    }
+    
+    for (int dy = 0; dy < 2; dy++)
+    {
+        for (int dx = 0; dx < 2; dx++)
+        {
+            int acc = 0;
+            for (int i = 0; i < (1 << depth); i++)
+            {
+                acc += hist[dy][dx][i];
+                
+                if (acc < total[dy][dx]/20)
+                {
+                    /* 5th percentile */
+                    pr5[dy][dx] = i - black;
+                }
+                
+                if (acc < total[dy][dx]/2)
+                {
+                    /* median */
+                    params->flat_med[dy][dx] = i - black;
+                }
+            }
+        }
+    }
+    
+    free(hist[0][0]);
+    free(hist[0][1]);
+    free(hist[1][0]);
+    free(hist[1][1]);
+    free(flat_line);
+    
+    params->flat_adj_num = (pr5[0][1] + pr5[1][0]) / 2;
+    params->flat_adj_den = (params->flat_med[0][1] + params->flat_med[1][0]) / 2;
+    params->flat_ready = (params->flat_med[0][0] != 0);
+
+    printf("Flat-field median: [%d %d; %d %d], adjusted by %d/%d\n", 
+        params->flat_med[0][0], params->flat_med[0][1],
+        params->flat_med[1][0], params->flat_med[1][1],
+        params->flat_adj_num, params->flat_adj_den
+    );
+
+    return 0;
+}
+
+/* subtract the dark frame and/or divide by the flat-field frame. returns 0 on success */
+int frame_apply_references(frame_params_t *params, uint8_t *frame_buffer, int frame_size)
+{
+    int video_xRes = params->video_xRes;
+    int video_yRes = params->video_yRes;
+    int current_depth = params->old_depth;
+    int black = params->black_level;
+    int pitch = video_xRes * current_depth / 8;
+
+    /* in subtract mode, subtract reference frame. do that before averaging */
+    if(params->sub_buffer)
+    {
+        if((int)params->sub_size != frame_size)
+        {
+            print_msg(MSG_ERROR, "Error: Frame sizes of footage and subtract frame differ (%d, %d)", frame_size, params->sub_size);
+            return 1;
+        }
+
+        uint16_t *src_line = malloc(video_xRes * sizeof(uint16_t));
+        uint16_t *sub_line = malloc(video_xRes * sizeof(uint16_t));
+
+        if(!src_line || !sub_line)
+        {
+            free(src_line);
+            free(sub_line);
+            return 1;
+        }
+
+        for(int y = 0; y < video_yRes; y++)
+        {
+            raw_unpack_row(&frame_buffer[y * pitch], src_line, video_xRes, current_depth);
+            raw_unpack_row(&params->sub_buffer[y * pitch], sub_line, video_xRes, current_depth);
+
+            for(int x = 0; x < video_xRes; x++)
+            {
+                int32_t value = src_line[x];
+                int32_t sub_value = sub_line[x];
+
+                value -= sub_value;
+                value += black; /* should we really add it here? or better subtract it from averaged frame? */
+                value = COERCE(value, 0, (1<<current_depth)-1);
+
+                src_line[x] = value;
+            }
+
+            raw_pack_row(src_line, &frame_buffer[y * pitch], video_xRes, current_depth);
+        }
+
+        free(src_line);
+        free(sub_line);
+    }
+
+    /* in flat-field mode, divide each image by the normalized reference frame */
+    if(params->flat_buffer)
+    {
+        if((int)params->flat_size != frame_size)
+        {
+            print_msg(MSG_ERROR, "Error: Frame sizes of footage and flat-field frame differ (%d, %d)", frame_size, params->flat_size);
+            return 1;
+        }
+
+        uint16_t *src_line = malloc(video_xRes * sizeof(uint16_t));
+        uint16_t *flat_line = malloc(video_xRes * sizeof(uint16_t));
+
+        if(!src_line || !flat_line)
+        {
+            free(src_line);
+            free(flat_line);
+            return 1;
+        }
+
+        for(int y = 0; y < video_yRes; y++)
+        {
+            raw_unpack_row(&frame_buffer[y * pitch], src_line, video_xRes, current_depth);
+            raw_unpack_row(&params->flat_buffer[y * pitch], flat_line, video_xRes, current_depth);
+
+            for(int x = 0; x < video_xRes; x++)
+            {
+                int32_t value = src_line[x];
+                int32_t flat_value = flat_line[x];
+                
+                if (flat_value - black <= 0)
+                {
+                    int left  = flat_line[MAX(x-1,0)];
+                    int right = flat_line[MIN(x+1,video_xRes-1)];
+                    flat_value = MAX(left, right);
+                }
+
+                if (flat_value - black > 0)
+                {
+                    value -= black;
+                    value = (int64_t) value * params->flat_med[y%2][x%2] * params->flat_adj_num / params->flat_adj_den / (flat_value - black);
+                    value += black;
+                    value = COERCE(value, 0, (1<<current_depth)-1);
+                }
+
+                src_line[x] = value;
+            }
+
+            raw_pack_row(src_line, &frame_buffer[y * pitch], video_xRes, current_depth);
+        }
+
+        free(src_line);
+        free(flat_line);
+    }
+
+    return 0;
+}
+
+/* resample bit depth and zero the lowest bits, if requested. returns 0 on success */
+int frame_convert_depth(frame_params_t *params, uint8_t **buffer, uint32_t *buffer_size, int *frame_size, int *current_depth)
+{
+    int video_xRes = params->video_xRes;
+    int video_yRes = params->video_yRes;
+    int old_depth = params->old_depth;
+    int new_depth = params->new_depth;
+
+    if(new_depth && (old_depth != new_depth))
+    {
+        int new_size = (video_xRes * video_yRes * new_depth + 7) / 8;
+
+        if(params->verbose)
+        {
+            print_msg(MSG_INFO, "   depth: %d -> %d, size: %d -> %d (%2.2f%%)\n", old_depth, new_depth, *frame_size, new_size, ((float)new_depth * 100.0f) / (float)old_depth);
+        }
+
+        int calced_size = ((video_xRes * video_yRes * old_depth + 7) / 8);
+        if(calced_size > *frame_size)
+        {
+            print_msg(MSG_INFO, "Error: old frame size is too small for %dx%d at %d bpp. Input data corrupt. (%d < %d)\n", video_xRes, video_yRes, old_depth, *frame_size, calced_size);
+            return 1;
+        }
+
+        unsigned char *new_buffer = malloc(new_size);
+        uint16_t *line = malloc(video_xRes * sizeof(uint16_t));
+        if(!new_buffer || !line || frame_buffer_reserve(buffer, buffer_size, new_size))
+        {
+            free(new_buffer);
+            free(line);
+            return 1;
+        }
+
+        /* packing keeps the unused bits of a partially filled last word, so start with a clean buffer */
+        memset(new_buffer, 0x00, new_size);
+
+        int old_pitch = video_xRes * old_depth / 8;
+        int new_pitch = video_xRes * new_depth / 8;
+
+        for(int y = 0; y < video_yRes; y++)
+        {
+            raw_unpack_row(&(*buffer)[y * old_pitch], line, video_xRes, old_depth);
+
+            for(int x = 0; x < video_xRes; x++)
+            {
+                uint16_t value = line[x];
+
+                /* normalize the old value to 16 bits */
+                value <<= (16-old_depth);
+
+                /* convert the old value to destination depth */
+                value >>= (16-new_depth);
+
+                line[x] = value;
+            }
+
+            raw_pack_row(line, &new_buffer[y * new_pitch], video_xRes, new_depth);
+        }
+
+        *frame_size = new_size;
+        *current_depth = new_depth;
+
+        memcpy(*buffer, new_buffer, *frame_size);
+        free(new_buffer);
+        free(line);
+    }
+
+    if(params->bit_zap)
+    {
+        int depth = *current_depth;
+        int pitch = video_xRes * depth / 8;
+        uint32_t mask = ~((1 << (16 - params->bit_zap)) - 1);
+        uint16_t *line = malloc(video_xRes * sizeof(uint16_t));
+
+        if(!line)
+        {
+            return 1;
+        }
+
+        for(int y = 0; y < video_yRes; y++)
+        {
+            raw_unpack_row(&(*buffer)[y * pitch], line, video_xRes, depth);
+
+            for(int x = 0; x < video_xRes; x++)
+            {
+                int32_t value = line[x];
+
+                /* normalize the old value to 16 bits */
+                value <<= (16-depth);
+
+                value &= mask;
+
+                /* convert the old value to destination depth */
+                value >>= (16-depth);
+
+                line[x] = value;
+            }
+
+            raw_pack_row(line, &(*buffer)[y * pitch], video_xRes, depth);
+        }
+
+        free(line);
+    }
+
+    return 0;
+}
+
+/* DNG processing options, set via command line */
+typedef struct
+{
+    int fix_vert_stripes;
+    int stripes_interval;   /* re-estimate the stripe correction every N frames, 0 = first frame only */
+    int fix_cold_pixels;
+    int chroma_smooth_method;
+
+    /* write LJ92 compressed DNGs. frames from LJ92 footage always stay compressed */
+    int lj92;
+} dng_options_t;
+
+/* one frame on its way into a .dng file, along with the metadata that was valid when it was read */
+typedef struct
+{
+    uint32_t frame_number;
+    uint64_t timestamp;
+
+    uint8_t *frame_buffer;
+    uint32_t frame_buffer_size;
+    int frame_size;
+
+    /* compression flags (MLV_VIDEO_CLASS_FLAG_LZMA/LJ92/LZMA2/RICE) of the frame data as read, 0 if it is uncompressed */
+    int compressed;
+    frame_params_t params;
+
+    /* LJ92 data that is written into the DNG instead of the uncompressed frame, NULL if there is none.
+       either the original frame data or lj92_buffer, which holds the compressed corrected frame */
+    const uint8_t *lj92_data;
+    int lj92_size;
+    uint8_t *lj92_buffer;
+    uint32_t lj92_buffer_size;
+
+    struct raw_info raw_info;
+    uint32_t fps_nom;
+    uint32_t fps_denom;
+    mlv_expo_hdr_t expo_info;
+    mlv_lens_hdr_t lens_info;
+    mlv_rtci_hdr_t rtci_info;
+    char camera_serial[33];
+    char camname[64];
+    char info_string[256];
+} dng_frame_t;
+
+void dng_frame_set_metadata(dng_frame_t *frame, uint32_t frame_number, uint64_t timestamp, mlv_file_hdr_t *main_header, mlv_expo_hdr_t *expo_info, mlv_lens_hdr_t *lens_info, mlv_rtci_hdr_t *rtci_info, mlv_idnt_hdr_t *idnt_info, const char *camname, char *info_string)
+{
+    frame->frame_number = frame_number;
+    frame->timestamp = timestamp;
+    frame->fps_nom = main_header->sourceFpsNom;
+    frame->fps_denom = main_header->sourceFpsDenom;
+    frame->expo_info = *expo_info;
+    frame->lens_info = *lens_info;
+    frame->rtci_info = *rtci_info;
+
+    strncpy(frame->camera_serial, (char*)idnt_info->cameraSerial, sizeof(frame->camera_serial) - 1);
+    frame->camera_serial[sizeof(frame->camera_serial) - 1] = '\000';
+    strncpy(frame->camname, camname, sizeof(frame->camname) - 1);
+    frame->camname[sizeof(frame->camname) - 1] = '\000';
+    strncpy(frame->info_string, info_string, sizeof(frame->info_string) - 1);
+    frame->info_string[sizeof(frame->info_string) - 1] = '\000';
+}
+
+/* build raw_info for a frame buffer, overriding the resolution from raw_info with the one from lv_rec_footer, if they don't match */
+void dng_frame_set_raw_info(dng_frame_t *frame, lv_rec_file_footer_t *footer)
+{
+    struct raw_info *info = &frame->raw_info;
+
+    *info = footer->raw_info;
+    info->frame_size = frame->frame_size;
+    info->buffer = frame->frame_buffer;
+
+    if (footer->xRes != info->width)
+    {
+        info->width = footer->xRes;
+        info->pitch = info->width * 14/8;
+        info->active_area.x1 = 0;
+        info->active_area.x2 = info->width;
+        info->jpeg.x = 0;
+        info->jpeg.width = info->width;
+    }
+
+    if (footer->yRes != info->height)
+    {
+        info->height = footer->yRes;
+        info->active_area.y1 = 0;
+        info->active_area.y2 = info->height;
+        info->jpeg.y = 0;
+        info->jpeg.height = info->height;
+    }
+}
+
+/* run the raw2dng corrections and chroma smoothing on a frame. with a stripes cache, seq is the frame's position in the clip */
+void dng_frame_correct(dng_frame_t *frame, dng_options_t *options, struct raw_fix_state *fix, struct raw_stripes_cache *stripes, uint32_t seq, chroma_tables_t *tables)
+{
+    /* call raw2dng code */
+    if (options->fix_vert_stripes)
+    {
+        if(stripes)
+        {
+            raw_fix_vertical_stripes_cached(&frame->raw_info, fix, stripes, seq);
+        }
+        else
+        {
+            raw_fix_vertical_stripes(&frame->raw_info, fix);
+        }
+    }
+    
+    if (options->fix_cold_pixels)
+    {
+        raw_fix_cold_pixels(&frame->raw_info, fix, options->fix_cold_pixels == 2);
+    }
+
+    /* this is internal again */
+    chroma_smooth(options->chroma_smooth_method, &frame->raw_info, tables);
+}
+
+/* true if neither the options nor the frame parameters change any pixel, so LJ92 frames can go into the DNG as they are */
+int dng_frame_passthrough(frame_params_t *params, dng_options_t *options)
+{
+    if(options->fix_vert_stripes || options->fix_cold_pixels || options->chroma_smooth_method)
+    {
+        return 0;
+    }
+    if(params->sub_buffer || params->flat_buffer || params->bit_zap || (params->new_depth && params->new_depth != params->old_depth))
+    {
+        return 0;
+    }
+    return 1;
+}
+
+/* LJ92 compress the corrected frame for the DNG, if the DNG is compressed and the original frame data isn't used. returns 0 on success */
+int dng_frame_compress(dng_frame_t *frame, dng_options_t *options)
+{
+    struct raw_info *info = &frame->raw_info;
+
+    if(frame->lj92_data || !(options->lj92 || (frame->compressed & MLV_VIDEO_CLASS_FLAG_LJ92)))
+    {
+        return 0;
+    }
+
+    if(frame_compress_lj92(frame->frame_buffer, info->width, info->height, info->bits_per_pixel, &frame->lj92_buffer, &frame->lj92_buffer_size, &frame->lj92_size, frame->params.verbose))
+    {
+        return 1;
+    }
+
+    frame->lj92_data = frame->lj92_buffer;
+    return 0;
+}
+
+/* set MLV metadata into DNG tags and write the file. not thread safe, chdk-dng keeps the tags in global variables */
+int dng_frame_save(dng_frame_t *frame, char *filename)
+{
+    extern struct raw_info raw_info;
+
+    dng_set_framerate_rational(frame->fps_nom, frame->fps_denom);
+    dng_set_shutter(1, (int)(1000000.0f/(float)frame->expo_info.shutterValue));
+    dng_set_aperture(frame->lens_info.aperture, 100);
+    dng_set_camname(frame->camname);
+    dng_set_description(frame->info_string);
+    dng_set_lensmodel((char*)frame->lens_info.lensName);
+    dng_set_focal(frame->lens_info.focalLength, 1);
+    dng_set_iso(frame->expo_info.isoValue);
+
+    //dng_set_wbgain(1024, wbal_info.wbgain_r, 1024, wbal_info.wbgain_g, 1024, wbal_info.wbgain_b);
+
+    /* calculate the time this frame was taken at, i.e., the start time + the current timestamp. this can be off by a second but it's better than nothing */
+    int ms = 0.5 + frame->timestamp / 1000.0;
+    int sec = ms / 1000;
+    ms %= 1000;
+    // FIXME: the struct tm doesn't have tm_gmtoff on Linux so the result might be wrong?
+    struct tm tm;
+    tm.tm_sec = frame->rtci_info.tm_sec + sec;
+    tm.tm_min = frame->rtci_info.tm_min;
+    tm.tm_hour = frame->rtci_info.tm_hour;
+    tm.tm_mday = frame->rtci_info.tm_mday;
+    tm.tm_mon = frame->rtci_info.tm_mon;
+    tm.tm_year = frame->rtci_info.tm_year;
+    tm.tm_wday = frame->rtci_info.tm_wday;
+    tm.tm_yday = frame->rtci_info.tm_yday;
+    tm.tm_isdst = frame->rtci_info.tm_isdst;
+
+    if(mktime(&tm) != -1)
+    {
+        char datetime_str[32];
+        char subsec_str[8];
+        strftime(datetime_str, 20, "%Y:%m:%d %H:%M:%S", &tm);
+        snprintf(subsec_str, sizeof(subsec_str), "%03d", ms);
+        dng_set_datetime(datetime_str, subsec_str);
+    }
+    else
+    {
+        // soemthing went wrong. let's proceed anyway
+        print_msg(MSG_ERROR, "VIDF: [W] Failed calculating the DateTime from the timestamp\n");
+        dng_set_datetime("", "");
+    }
+
+
+    uint64_t serial = 0;
+    char *end;
+    serial = strtoull(frame->camera_serial, &end, 16);
+    if (serial && !*end)
+    {
+        char serial_str[64];
+
+        sprintf(serial_str, "%"PRIu64, serial);
+        dng_set_camserial((char*)serial_str);
+    }
+
+    /* the thumbnail code in chdk-dng reads pixels through the global raw_info */
+    raw_info = frame->raw_info;
+    dng_set_compressed_data((void *)frame->lj92_data, frame->lj92_size);
+
+    /* the packed frame goes into the file as it is, byte swapped on the way, so the frame buffer stays intact */
+    struct dng_image_part image = { frame->frame_buffer, frame->raw_info.frame_size, 1 };
+    if(frame->lj92_data)
+    {
+        image.data = frame->lj92_data;
+        image.size = frame->lj92_size;
+        image.swap16 = 0;
+    }
+
+    /* finally save the DNG */
+    if(!save_dng_parts(filename, &raw_info, &image, 1))
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed writing into .DNG file\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+char *dng_frame_filename(char *output_filename, uint32_t frame_number)
+{
+    int frame_filename_len = strlen(output_filename) + 32;
+    char *frame_filename = malloc(frame_filename_len);
+    snprintf(frame_filename, frame_filename_len, "%s%06d.dng", output_filename, frame_number);
+    return frame_filename;
+}
+
+/* 
+    multi-threaded DNG export
+    
+    the main loop stays the only reader of the input file and queues the frames into a ring of slots.
+    worker threads decompress, correct and smooth the frames in any order, a single writer thread
+    saves them strictly in input order, as chdk-dng is not reentrant.
+    stripe and cold pixel detection run on the first frame before any other frame gets corrected,
+    stripe re-estimations (--stripes-interval) on the first frame of each interval before the rest
+    of that interval, so the output is identical to the single-threaded export.
+*/
+
+#define DNG_SLOT_FREE       0
+#define DNG_SLOT_READ       1
+#define DNG_SLOT_BUSY       2
+#define DNG_SLOT_PROCESSED  3
+
+typedef struct
+{
+    dng_frame_t frame;
+    uint32_t seq;
+    int state;
+    int error;
+} dng_slot_t;
+
+typedef struct dng_pipeline dng_pipeline_t;
+
+typedef struct
+{
+    dng_pipeline_t *pipeline;
+    pthread_t thread;
+    struct raw_fix_state fix;
+    chroma_tables_t *tables;
+    int calibrated;
+} dng_worker_t;
+
+struct dng_pipeline
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    dng_slot_t *slots;
+    int slot_count;
+    uint32_t next_read;
+    uint32_t next_write;
+    int finish;
+    int error;
+
+    /* corrections estimated from the first frame, read-only once calibrated is set */
+    struct raw_fix_state fix;
+    int calibrated;
+
+    /* stripe coefficients of every interval, shared by the workers */
+    struct raw_stripes_cache stripes;
+
+    dng_options_t options;
+    char *output_filename;
+
+    dng_worker_t *workers;
+    int worker_count;
+    pthread_t writer;
+};
+
+/* decompress, subtract/flat-field, convert and correct a frame. returns 0 on success */
+int dng_frame_process(dng_frame_t *frame, dng_options_t *options, struct raw_fix_state *fix, struct raw_stripes_cache *stripes, uint32_t seq, chroma_tables_t *tables)
+{
+    int current_depth = frame->params.old_depth;
+
+    frame->lj92_data = NULL;
+    frame->lj92_size = 0;
+
+    if((frame->compressed & MLV_VIDEO_CLASS_FLAG_LJ92) && dng_frame_passthrough(&frame->params, options))
+    {
+        /* keep the compressed data for the DNG, the decompressed frame is only needed for the thumbnail */
+        uint8_t *buffer = frame->lj92_buffer;
+        uint32_t buffer_size = frame->lj92_buffer_size;
+
+        frame->lj92_buffer = frame->frame_buffer;
+        frame->lj92_buffer_size = frame->frame_buffer_size;
+        frame->lj92_data = frame->lj92_buffer;
+        frame->lj92_size = frame->frame_size;
+        frame->frame_buffer = buffer;
+        frame->frame_buffer_size = buffer_size;
+
+        if(frame_decompress_from(frame->lj92_data, &frame->frame_buffer, &frame->frame_buffer_size, &frame->frame_size, frame->compressed, frame->params.verbose))
+        {
+            return 1;
+        }
+    }
+    else if(frame->compressed && frame_decompress(&frame->frame_buffer, &frame->frame_buffer_size, &frame->frame_size, frame->compressed, frame->params.verbose))
+    {
+        return 1;
+    }
+    if(frame_apply_references(&frame->params, frame->frame_buffer, frame->frame_size))
+    {
+        return 1;
+    }
+    if(frame_convert_depth(&frame->params, &frame->frame_buffer, &frame->frame_buffer_size, &frame->frame_size, &current_depth))
+    {
+        return 1;
+    }
+
+    frame->raw_info.frame_size = frame->frame_size;
+    frame->raw_info.buffer = frame->frame_buffer;
+
+    if(frame->frame_size < frame->raw_info.pitch * frame->raw_info.height)
+    {
+        print_msg(MSG_ERROR, "VIDF: Frame #%d is too small for %dx%d (%d byte)\n", frame->frame_number, frame->raw_info.width, frame->raw_info.height, frame->frame_size);
+        return 1;
+    }
+
+    dng_frame_correct(frame, options, fix, stripes, seq, tables);
+    return dng_frame_compress(frame, options);
+}
+
+void *dng_worker_thread(void *arg)
+{
+    dng_worker_t *worker = (dng_worker_t *)arg;
+    dng_pipeline_t *pipeline = worker->pipeline;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while(1)
+    {
+        /* pick the oldest frame that was not processed yet */
+        dng_slot_t *slot = NULL;
+        for(uint32_t seq = pipeline->next_write; seq != pipeline->next_read; seq++)
+        {
+            dng_slot_t *candidate = &pipeline->slots[seq % pipeline->slot_count];
+            if(candidate->state == DNG_SLOT_READ)
+            {
+                slot = candidate;
+                break;
+            }
+        }
+
+        if(!slot)
+        {
+            if(pipeline->finish || pipeline->error)
+            {
+                break;
+            }
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+
+        slot->state = DNG_SLOT_BUSY;
+
+        /* all frames except the first one have to wait until the corrections are estimated */
+        struct raw_fix_state *fix = &pipeline->fix;
+        if(slot->seq != 0)
+        {
+            while(!pipeline->calibrated)
+            {
+                pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            }
+            if(!worker->calibrated)
+            {
+                raw_fix_copy(&worker->fix, &pipeline->fix);
+                worker->calibrated = 1;
+            }
+            fix = &worker->fix;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int error = dng_frame_process(&slot->frame, &pipeline->options, fix, &pipeline->stripes, slot->seq, worker->tables);
+        if(error)
+        {
+            /* don't let the rest of its interval wait for a stripe estimate that never comes */
+            raw_stripes_cache_skip(&pipeline->stripes, slot->seq);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if(slot->seq == 0)
+        {
+            pipeline->calibrated = 1;
+        }
+        slot->error = error;
+        slot->state = DNG_SLOT_PROCESSED;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+void *dng_writer_thread(void *arg)
+{
+    dng_pipeline_t *pipeline = (dng_pipeline_t *)arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while(1)
+    {
+        if(pipeline->next_write == pipeline->next_read)
+        {
+            if(pipeline->finish || pipeline->error)
+            {
+                break;
+            }
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+
+        /* frames are written in the order they were read */
+        dng_slot_t *slot = &pipeline->slots[pipeline->next_write % pipeline->slot_count];
+        if(slot->state != DNG_SLOT_PROCESSED)
+        {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int error = slot->error;
+        if(!error)
+        {
+            char *frame_filename = dng_frame_filename(pipeline->output_filename, slot->frame.frame_number);
+            error = dng_frame_save(&slot->frame, frame_filename);
+            free(frame_filename);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if(error)
+        {
+            pipeline->error = 1;
+        }
+        slot->state = DNG_SLOT_FREE;
+        pipeline->next_write++;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+dng_pipeline_t *dng_pipeline_start(int threads, dng_options_t *options, char *output_filename)
+{
+    dng_pipeline_t *pipeline = calloc(1, sizeof(dng_pipeline_t));
+    if(!pipeline)
+    {
+        return NULL;
+    }
+
+    /* enough slots to keep all workers busy while the writer and reader are working on theirs */
+    pipeline->slot_count = 2 * threads + 2;
+    pipeline->slots = calloc(pipeline->slot_count, sizeof(dng_slot_t));
+    pipeline->workers = calloc(threads, sizeof(dng_worker_t));
+    pipeline->options = *options;
+    pipeline->output_filename = output_filename;
+    raw_fix_init(&pipeline->fix);
+    /* all other workers wait while the first frame is corrected, so that one may use their CPUs */
+    pipeline->fix.threads = threads;
+
+    if(!pipeline->slots || !pipeline->workers)
+    {
+        free(pipeline->slots);
+        free(pipeline->workers);
+        free(pipeline);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+    raw_stripes_cache_init(&pipeline->stripes, options->stripes_interval);
+
+    for(int pos = 0; pos < threads; pos++)
+    {
+        dng_worker_t *worker = &pipeline->workers[pos];
+
+        worker->pipeline = pipeline;
+        worker->tables = calloc(1, sizeof(chroma_tables_t));
+        raw_fix_init(&worker->fix);
+
+        if(!worker->tables || pthread_create(&worker->thread, NULL, dng_worker_thread, worker))
+        {
+            print_msg(MSG_ERROR, "Failed to start DNG worker thread %d\n", pos);
+            free(worker->tables);
+            break;
+        }
+        pipeline->worker_count++;
+    }
+
+    if(!pipeline->worker_count || pthread_create(&pipeline->writer, NULL, dng_writer_thread, pipeline))
+    {
+        print_msg(MSG_ERROR, "Failed to start DNG writer thread\n");
+        pipeline->error = 1;
+        /* no writer to wait for, so clean up right here */
+        pthread_mutex_lock(&pipeline->lock);
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+        for(int pos = 0; pos < pipeline->worker_count; pos++)
+        {
+            pthread_join(pipeline->workers[pos].thread, NULL);
+            chroma_tables_free(pipeline->workers[pos].tables);
+        }
+        raw_stripes_cache_free(&pipeline->stripes);
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->cond);
+        free(pipeline->slots);
+        free(pipeline->workers);
+        free(pipeline);
+        return NULL;
+    }
+
+    return pipeline;
+}
+
+/* get the next free slot to read a frame into. returns NULL if the export failed */
+dng_frame_t *dng_pipeline_get_frame(dng_pipeline_t *pipeline)
+{
+    dng_slot_t *slot = &pipeline->slots[pipeline->next_read % pipeline->slot_count];
+
+    pthread_mutex_lock(&pipeline->lock);
+    while(slot->state != DNG_SLOT_FREE && !pipeline->error)
+    {
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    int error = pipeline->error;
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return error ? NULL : &slot->frame;
+}
+
+/* queue the frame returned by dng_pipeline_get_frame() for processing */
+void dng_pipeline_submit(dng_pipeline_t *pipeline)
+{
+    dng_slot_t *slot = &pipeline->slots[pipeline->next_read % pipeline->slot_count];
+
+    pthread_mutex_lock(&pipeline->lock);
+    slot->seq = pipeline->next_read;
+    slot->error = 0;
+    slot->state = DNG_SLOT_READ;
+    pipeline->next_read++;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+/* wait until all queued frames are written and stop the threads. returns 0 if all frames were written */
+int dng_pipeline_finish(dng_pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->finish = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    pthread_join(pipeline->writer, NULL);
+
+    /* the writer may have stopped early on errors, make sure no worker keeps waiting */
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->calibrated = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    for(int pos = 0; pos < pipeline->worker_count; pos++)
+    {
+        pthread_join(pipeline->workers[pos].thread, NULL);
+        raw_fix_free(&pipeline->workers[pos].fix);
+        chroma_tables_free(pipeline->workers[pos].tables);
+    }
+
+    int error = pipeline->error;
+
+    for(int pos = 0; pos < pipeline->slot_count; pos++)
+    {
+        free(pipeline->slots[pos].frame.frame_buffer);
+        free(pipeline->slots[pos].frame.lj92_buffer);
+    }
+
+    raw_fix_free(&pipeline->fix);
+    raw_stripes_cache_free(&pipeline->stripes);
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+    free(pipeline->slots);
+    free(pipeline->workers);
+    free(pipeline);
+
+    return error;
+}
+
+/*
+    multi-threaded MLV compression (-c)
+
+    same scheme as the DNG export: the main loop reads and prepares the frames, worker threads
+    compress them in any order and a single writer thread appends the VIDF blocks in input order.
+    all other blocks are written by the main loop, so it has to flush the queue before writing one.
+    every frame is compressed on its own, so the output is identical to the single-threaded one.
+*/
+
+#define COMPRESS_SLOT_FREE        0
+#define COMPRESS_SLOT_READ        1
+#define COMPRESS_SLOT_BUSY        2
+#define COMPRESS_SLOT_COMPRESSED  3
+
+typedef struct
+{
+    mlv_vidf_hdr_t block_hdr;
+
+    /* frame data as prepared by the main loop and the size it had in the input file */
+    uint8_t *frame_buffer;
+    uint32_t frame_buffer_size;
+    int frame_size;
+    int read_size;
+
+    uint8_t *out_buffer;
+    uint32_t out_buffer_size;
+    int out_size;
+
+    int state;
+    int error;
+} compress_slot_t;
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    compress_slot_t *slots;
+    int slot_count;
+    uint32_t next_read;
+    uint32_t next_write;
+    int finish;
+    int error;
+
+    compress_options_t options;
+    int verbose;
+
+    /* NULL to only count the bytes, e.g. for benchmarking */
+    FILE *out_file;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+
+    pthread_t *workers;
+    int worker_count;
+    pthread_t writer;
+} compress_pipeline_t;
+
+void *compress_worker_thread(void *arg)
+{
+    compress_pipeline_t *pipeline = (compress_pipeline_t *)arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while(1)
+    {
+        /* pick the oldest frame that was not compressed yet */
+        compress_slot_t *slot = NULL;
+        for(uint32_t seq = pipeline->next_write; seq != pipeline->next_read; seq++)
+        {
+            compress_slot_t *candidate = &pipeline->slots[seq % pipeline->slot_count];
+            if(candidate->state == COMPRESS_SLOT_READ)
+            {
+                slot = candidate;
+                break;
+            }
+        }
+
+        if(!slot)
+        {
+            if(pipeline->finish || pipeline->error)
+            {
+                break;
+            }
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+
+        slot->state = COMPRESS_SLOT_BUSY;
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int error = frame_compress(slot->frame_buffer, slot->frame_size, &slot->out_buffer, &slot->out_buffer_size, &slot->out_size, &pipeline->options, pipeline->verbose);
+
+        pthread_mutex_lock(&pipeline->lock);
+        slot->error = error;
+        slot->state = COMPRESS_SLOT_COMPRESSED;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+/* append a compressed frame as VIDF block. returns 0 on success */
+int compress_slot_write(compress_pipeline_t *pipeline, compress_slot_t *slot)
+{
+    if(!pipeline->out_file)
+    {
+        return 0;
+    }
+
+    if(slot->out_size != slot->read_size)
+    {
+        print_msg(MSG_INFO, "  saving: %d -> %d  (%2.2f%%)\n", slot->read_size, slot->out_size, ((float)slot->out_size * 100.0f) / (float)slot->read_size);
+    }
+
+    /* delete free space and correct header size */
+    slot->block_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + slot->out_size;
+    slot->block_hdr.frameSpace = 0;
+
+    if(fwrite(&slot->block_hdr, sizeof(mlv_vidf_hdr_t), 1, pipeline->out_file) != 1 || fwrite(slot->out_buffer, slot->out_size, 1, pipeline->out_file) != 1)
+    {
+        print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
+        return 1;
+    }
+    return 0;
+}
+
+void *compress_writer_thread(void *arg)
+{
+    compress_pipeline_t *pipeline = (compress_pipeline_t *)arg;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while(1)
+    {
+        if(pipeline->next_write == pipeline->next_read)
+        {
+            if(pipeline->finish || pipeline->error)
+            {
+                break;
+            }
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+
+        /* frames are written in the order they were read */
+        compress_slot_t *slot = &pipeline->slots[pipeline->next_write % pipeline->slot_count];
+        if(slot->state != COMPRESS_SLOT_COMPRESSED)
+        {
+            pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&pipeline->lock);
+
+        int error = slot->error;
+        if(!error)
+        {
+            error = compress_slot_write(pipeline, slot);
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        if(error)
+        {
+            pipeline->error = 1;
+        }
+        pipeline->bytes_in += slot->frame_size;
+        pipeline->bytes_out += slot->out_size;
+        slot->state = COMPRESS_SLOT_FREE;
+        pipeline->next_write++;
+        pthread_cond_broadcast(&pipeline->cond);
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+compress_pipeline_t *compress_pipeline_start(int threads, compress_options_t *options, FILE *out_file, int verbose)
+{
+    compress_pipeline_t *pipeline = calloc(1, sizeof(compress_pipeline_t));
+    if(!pipeline)
+    {
+        return NULL;
+    }
+
+    pipeline->slot_count = 2 * threads + 2;
+    pipeline->slots = calloc(pipeline->slot_count, sizeof(compress_slot_t));
+    pipeline->workers = calloc(threads, sizeof(pthread_t));
+    pipeline->options = *options;
+    pipeline->out_file = out_file;
+    pipeline->verbose = verbose;
+
+    if(!pipeline->slots || !pipeline->workers)
+    {
+        free(pipeline->slots);
+        free(pipeline->workers);
+        free(pipeline);
+        return NULL;
+    }
+
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->cond, NULL);
+
+    for(int pos = 0; pos < threads; pos++)
+    {
+        if(pthread_create(&pipeline->workers[pos], NULL, compress_worker_thread, pipeline))
+        {
+            print_msg(MSG_ERROR, "Failed to start compression worker thread %d\n", pos);
+            break;
+        }
+        pipeline->worker_count++;
+    }
+
+    if(!pipeline->worker_count || pthread_create(&pipeline->writer, NULL, compress_writer_thread, pipeline))
+    {
+        print_msg(MSG_ERROR, "Failed to start compression writer thread\n");
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->error = 1;
+        pthread_cond_broadcast(&pipeline->cond);
+        pthread_mutex_unlock(&pipeline->lock);
+        for(int pos = 0; pos < pipeline->worker_count; pos++)
+        {
+            pthread_join(pipeline->workers[pos], NULL);
+        }
+        pthread_mutex_destroy(&pipeline->lock);
+        pthread_cond_destroy(&pipeline->cond);
+        free(pipeline->slots);
+        free(pipeline->workers);
+        free(pipeline);
+        return NULL;
+    }
 
-    free(filename);
-    return block_hdr;
+    return pipeline;
 }
 
-void save_index(char *base_filename, mlv_file_hdr_t *ref_file_hdr, int fileCount, frame_xref_t *index, int entries)
+/* get the next free slot to copy a frame into. returns NULL if writing failed */
+compress_slot_t *compress_pipeline_get_frame(compress_pipeline_t *pipeline)
 {
-    int max_name_len = strlen(base_filename) + 16;
-    char *filename = malloc(max_name_len);
-    FILE *out_file = NULL;
+    compress_slot_t *slot = &pipeline->slots[pipeline->next_read % pipeline->slot_count];
 
-    strncpy(filename, base_filename, max_name_len);
+    pthread_mutex_lock(&pipeline->lock);
+    while(slot->state != COMPRESS_SLOT_FREE && !pipeline->error)
+    {
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
+    }
+    int error = pipeline->error;
+    pthread_mutex_unlock(&pipeline->lock);
 
-    strcpy(&filename[strlen(filename) - 3], "IDX");
+    return error ? NULL : slot;
+}
 
-    out_file = fopen(filename, "wb+");
+/* queue the frame returned by compress_pipeline_get_frame() */
+void compress_pipeline_submit(compress_pipeline_t *pipeline)
+{
+    compress_slot_t *slot = &pipeline->slots[pipeline->next_read % pipeline->slot_count];
+
+    pthread_mutex_lock(&pipeline->lock);
+    slot->error = 0;
+    slot->state = COMPRESS_SLOT_READ;
+    pipeline->next_read++;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
+}
 
-    if(!out_file)
+/* wait until all queued frames are written, so the caller can write the next block. returns 0 on success */
+int compress_pipeline_flush(compress_pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    while(pipeline->next_write != pipeline->next_read && !pipeline->error)
     {
-        free(filename);
-        print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
-        return;
+        pthread_cond_wait(&pipeline->cond, &pipeline->lock);
     }
+    int error = pipeline->error;
+    pthread_mutex_unlock(&pipeline->lock);
 
-    print_msg(MSG_INFO, "File %s opened for writing\n", filename);
-
+    return error;
+}
 
-    /* first write MLVI header */
-    mlv_file_hdr_t file_hdr = *ref_file_hdr;
+/* write all queued frames and stop the threads. returns 0 if all frames were written */
+int compress_pipeline_finish(compress_pipeline_t *pipeline)
+{
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->finish = 1;
+    pthread_cond_broadcast(&pipeline->cond);
+    pthread_mutex_unlock(&pipeline->lock);
 
-    /* update fields */
-    file_hdr.blockSize = sizeof(mlv_file_hdr_t);
-    file_hdr.videoFrameCount = 0;
-    file_hdr.audioFrameCount = 0;
-    file_hdr.fileNum = fileCount + 1;
+    pthread_join(pipeline->writer, NULL);
 
-    if(fwrite(&file_hdr, sizeof(mlv_file_hdr_t), 1, out_file) != 1)
+    for(int pos = 0; pos < pipeline->worker_count; pos++)
     {
-        free(filename);
-        print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
-        fclose(out_file);
-        return;
+        pthread_join(pipeline->workers[pos], NULL);
     }
 
-    /* now write XREF block */
-    mlv_xref_hdr_t hdr;
+    int error = pipeline->error;
 
-    memset(&hdr, 0x00, sizeof(mlv_xref_hdr_t));
-    memcpy(hdr.blockType, "XREF", 4);
-    hdr.blockSize = sizeof(mlv_xref_hdr_t) + entries * sizeof(mlv_xref_t);
-    hdr.entryCount = entries;
-
-    if(fwrite(&hdr, sizeof(mlv_xref_hdr_t), 1, out_file) != 1)
+    for(int pos = 0; pos < pipeline->slot_count; pos++)
     {
-        free(filename);
-        print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
-        fclose(out_file);
-        return;
+        free(pipeline->slots[pos].frame_buffer);
+        free(pipeline->slots[pos].out_buffer);
     }
 
-    /* and then the single entries */
-    for(int entry = 0; entry < entries; entry++)
-    {
-        mlv_xref_t field;
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->cond);
+    free(pipeline->slots);
+    free(pipeline->workers);
+    free(pipeline);
+
+    return error;
+}
 
-        memset(&field, 0x00, sizeof(mlv_xref_t));
+static double bench_time()
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
 
-        field.frameOffset = index[entry].frameOffset;
-        field.fileNumber = index[entry].fileNumber;
-        field.frameType = index[entry].frameType;
+/* compress the sample frames with the pipeline and print ratio and throughput. returns 0 on success */
+int bench_compress_run(const char *name, int level, uint8_t **frames, int frame_size, int frame_count, compress_options_t *options, int threads)
+{
+    compress_pipeline_t *pipeline = compress_pipeline_start(threads, options, NULL, 0);
+    if(!pipeline)
+    {
+        return 1;
+    }
 
-        if(fwrite(&field, sizeof(mlv_xref_t), 1, out_file) != 1)
+    double start = bench_time();
+    for(int frame = 0; frame < frame_count; frame++)
+    {
+        compress_slot_t *slot = compress_pipeline_get_frame(pipeline);
+        if(!slot || frame_buffer_reserve(&slot->frame_buffer, &slot->frame_buffer_size, frame_size))
         {
-            free(filename);
-            print_msg(MSG_ERROR, "Failed writing into .IDX file\n");
-            fclose(out_file);
-            return;
+            break;
         }
+        memcpy(slot->frame_buffer, frames[frame], frame_size);
+        slot->frame_size = frame_size;
+        compress_pipeline_submit(pipeline);
     }
+    int error = compress_pipeline_flush(pipeline);
+    double seconds = MAX(bench_time() - start, 0.000001);
 
-    free(filename);
-    fclose(out_file);
-}
-
-
-FILE **load_all_chunks(char *base_filename, int *entries)
-{
-    int seq_number = 0;
-    int max_name_len = strlen(base_filename) + 16;
-    char *filename = malloc(max_name_len);
-
-    strncpy(filename, base_filename, max_name_len - 1);
-    FILE **files = malloc(sizeof(FILE*));
+    uint64_t bytes_in = pipeline->bytes_in;
+    uint64_t bytes_out = pipeline->bytes_out;
+    error |= compress_pipeline_finish(pipeline);
 
-    files[0] = fopen(filename, "rb");
-    if(!files[0])
+    if(error || bytes_in != (uint64_t)frame_size * frame_count)
     {
-        free(filename);
-        free(files);
-        return NULL;
+        print_msg(MSG_ERROR, "%-6s %5d   failed\n", name, level);
+        return 1;
     }
 
-    print_msg(MSG_INFO, "File %s opened\n", filename);
+    char level_str[8];
+    snprintf(level_str, sizeof(level_str), level < 0 ? "-" : "%d", level);
+    print_msg(MSG_INFO, "%-6s %5s %9.2f%% %10.1f %8.1f\n", name, level_str, (double)bytes_out * 100.0 / (double)bytes_in, (double)bytes_in / seconds / 1000000.0, frame_count / seconds);
+    return 0;
+}
+
+/* delta encode a frame against the previous one (-e), both packed with depth bits per pixel. returns 0 on success */
+int frame_delta_encode(uint8_t *frame, const uint8_t *prev, int width, int height, int depth)
+{
+    uint16_t *src_line = malloc(width * sizeof(uint16_t));
+    uint16_t *ref_line = malloc(width * sizeof(uint16_t));
+    int pitch = width * depth / 8;
 
-    /* get extension and check if it is a .MLV */
-    char *dot = strrchr(filename, '.');
-    if(dot)
+    if(!src_line || !ref_line)
     {
-        dot++;
-        if(strcasecmp(dot, "mlv"))
-        {
-            seq_number = 100;
-        }
+        print_msg(MSG_ERROR, "Failed to allocate delta buffers\n");
+        free(src_line);
+        free(ref_line);
+        return 1;
     }
-    
-    (*entries)++;
-    while(seq_number < 99)
+
+    for(int y = 0; y < height; y++)
     {
-        FILE **realloc_files = realloc(files, (*entries + 1) * sizeof(FILE*));
+        int32_t offset = 1 << (depth - 1);
+        int32_t max_val = (1 << depth) - 1;
 
-        if(!realloc_files)
+        raw_unpack_row(&frame[y * pitch], src_line, width, depth);
+        raw_unpack_row(&prev[y * pitch], ref_line, width, depth);
+
+        for(int x = 0; x < width; x++)
         {
-            free(filename);
-            free(files);
-            return NULL;
+            int32_t value = src_line[x];
+            int32_t ref_value = ref_line[x];
+
+            /* when e.g. using 16 bit values:
+                   delta =  1      -> encode to 0x8001
+                   delta =  0      -> encode to 0x8000
+                   delta = -1      -> encode to 0x7FFF
+                   delta = -0xFFFF -> encode to 0x0001
+                   delta =  0xFFFF -> encode to 0x7FFF
+               so this is basically a signed int with overflow and a max/2 offset.
+               this offset makes the frames uniform grey when viewing non-decoded frames and improves compression rate a bit.
+            */
+            int32_t delta = offset + value - ref_value;
+
+            src_line[x] = (uint16_t)(delta & max_val);
         }
 
-        files = realloc_files;
+        raw_pack_row(src_line, &frame[y * pitch], width, depth);
+    }
 
-        /* check for the next file M00, M01 etc */
-        char seq_name[8];
+    free(src_line);
+    free(ref_line);
+    return 0;
+}
 
-        sprintf(seq_name, "%02d", seq_number);
-        seq_number++;
+/* --bench-compress: compress the first video frames of a clip with LJ92, Rice and every LZMA and LZMA2 level, then delta encoded (-e) with LZMA and Rice */
+int bench_compress(char *input_filename, int max_frames, compress_options_t *options, int threads)
+{
+    mlv_reader_t *reader = load_all_chunks(input_filename);
+    uint8_t **frames = calloc(max_frames, sizeof(uint8_t *));
+    uint32_t *frame_sizes = calloc(max_frames, sizeof(uint32_t));
+    int video_class = 0;
+    int frame_size = 0;
+    int frame_count = 0;
+    int error = 0;
+    int lzma_level = options->lzma_level;
+
+    if(!reader || !frames || !frame_sizes)
+    {
+        print_msg(MSG_ERROR, "Failed to open file '%s'\n", input_filename);
+        mlv_reader_close(reader);
+        free(frames);
+        free(frame_sizes);
+        return ERR_FILE;
+    }
 
-        strcpy(&filename[strlen(filename) - 2], seq_name);
+    /* collect the sample frames, decompressed, in the order they are stored */
+    for(int chunk = 0; chunk < mlv_reader_chunk_count(reader) && frame_count < max_frames; chunk++)
+    {
+        uint64_t position = 0;
 
-        /* try to open */
-        files[*entries] = fopen(filename, "rb");
-        if(files[*entries])
-        {
-            print_msg(MSG_INFO, "File %s opened\n", filename);
-            (*entries)++;
-        }
-        else
+        while(position < mlv_reader_chunk_size(reader, chunk) && frame_count < max_frames)
         {
-            print_msg(MSG_INFO, "File %s not existing.\n", filename);
-            break;
-        }
-    }
+            const mlv_hdr_t *buf = mlv_reader_block(reader, chunk, position);
 
-    free(filename);
-    return files;
-}
+            if(!buf || buf->blockSize < sizeof(mlv_hdr_t))
+            {
+                break;
+            }
 
+            if(!memcmp(buf->blockType, "MLVI", 4) && buf->blockSize >= sizeof(mlv_file_hdr_t))
+            {
+                video_class = ((const mlv_file_hdr_t *)buf)->videoClass;
+            }
+            else if(!memcmp(buf->blockType, "RAWI", 4) && buf->blockSize >= sizeof(mlv_rawi_hdr_t))
+            {
+                const mlv_rawi_hdr_t *rawi = (const mlv_rawi_hdr_t *)buf;
 
-#define EV_RESOLUTION 32768
+                options->width = rawi->xRes;
+                options->height = rawi->yRes;
+                options->depth = rawi->raw_info.bits_per_pixel;
+                frame_size = (options->width * options->height * options->depth + 7) / 8;
+            }
+            else if(!memcmp(buf->blockType, "VIDF", 4) && frame_size)
+            {
+                const mlv_vidf_hdr_t *block_hdr = (const mlv_vidf_hdr_t *)buf;
 
-#define CHROMA_SMOOTH_2X2
-#include "../dual_iso/chroma_smooth.c"
-#undef CHROMA_SMOOTH_2X2
+                if(buf->blockSize < sizeof(mlv_vidf_hdr_t) || block_hdr->frameSpace > buf->blockSize - sizeof(mlv_vidf_hdr_t))
+                {
+                    break;
+                }
 
-#define CHROMA_SMOOTH_3X3
-#include "../dual_iso/chroma_smooth.c"
-#undef CHROMA_SMOOTH_3X3
+                int size = block_hdr->blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr->frameSpace;
+                const uint8_t *data = MLV_READER_FRAME_DATA(block_hdr, mlv_vidf_hdr_t);
+                int compressed = video_class & MLV_VIDEO_CLASS_FLAG_COMPRESSED;
 
-#define CHROMA_SMOOTH_5X5
-#include "../dual_iso/chroma_smooth.c"
-#undef CHROMA_SMOOTH_5X5
+                if(compressed)
+                {
+                    if(frame_decompress_from(data, &frames[frame_count], &frame_sizes[frame_count], &size, compressed, 0))
+                    {
+                        break;
+                    }
+                }
+                else if(!frame_buffer_reserve(&frames[frame_count], &frame_sizes[frame_count], size))
+                {
+                    memcpy(frames[frame_count], data, size);
+                }
 
+                if(size >= frame_size && frames[frame_count])
+                {
+                    frame_count++;
+                }
+            }
 
-void chroma_smooth(int method, struct raw_info *info)
-{
-    int black = info->black_level;
-    static int raw2ev[16384];
-    static int _ev2raw[24*EV_RESOLUTION];
-    int* ev2raw = _ev2raw + 10*EV_RESOLUTION;
-    
-    if(!method)
-    {
-        return;
+            position += buf->blockSize;
+        }
     }
 
-    for(int i = 0; i < 16384; i++)
+    if(!frame_count)
     {
-        raw2ev[i] = log2(MAX(1, i - black)) * EV_RESOLUTION;
+        print_msg(MSG_ERROR, "No video frames found in '%s'\n", input_filename);
+        error = ERR_FILE;
     }
-
-    for(int i = -10*EV_RESOLUTION; i < 14*EV_RESOLUTION; i++)
+    else
     {
-        ev2raw[i] = black + pow(2, (float)i / EV_RESOLUTION);
-    }
+        print_msg(MSG_INFO, "Compression benchmark: %d frames of %dx%d at %d bpp, %d thread%s\n", frame_count, options->width, options->height, options->depth, threads, threads == 1 ? "" : "s");
+        print_msg(MSG_INFO, "%-6s %5s %10s %10s %8s\n", "method", "level", "size", "MB/s", "fps");
 
-    int w = info->width;
-    int h = info->height;
+        options->lj92 = 1;
+        error |= bench_compress_run("LJ92", -1, frames, frame_size, frame_count, options, threads);
+        options->lj92 = 0;
 
-    uint32_t * aux = malloc(w * h * sizeof(uint32_t));
-    uint32_t * aux2 = malloc(w * h * sizeof(uint32_t));
+        options->rice = 1;
+        error |= bench_compress_run("Rice", -1, frames, frame_size, frame_count, options, threads);
+        options->rice = 0;
 
-    int x,y;
-    for (y = 0; y < h; y++)
-    {
-        for (x = 0; x < w; x++)
+#ifdef MLV_USE_LZMA
+        options->lzma2 = 0;
+        for(int level = 0; level <= 9; level++)
         {
-            aux[x + y*w] = aux2[x + y*w] = raw_get_pixel(x, y);
+            options->lzma_level = level;
+            error |= bench_compress_run("LZMA", level, frames, frame_size, frame_count, options, threads);
         }
-    }
 
-    switch(method)
-    {
-        case 2:
-            chroma_smooth_2x2(aux, aux2, raw2ev, ev2raw);
-            break;
-        case 3:
-            chroma_smooth_3x3(aux, aux2, raw2ev, ev2raw);
-            break;
-        case 5:
-            chroma_smooth_5x5(aux, aux2, raw2ev, ev2raw);
-            break;
-    }
+        options->lzma2 = 1;
+        for(int level = 0; level <= 9; level++)
+        {
+            options->lzma_level = level;
+            error |= bench_compress_run("LZMA2", level, frames, frame_size, frame_count, options, threads);
+        }
+        options->lzma2 = 0;
+        options->lzma_level = lzma_level;
+#endif
 
-    for (y = 0; y < h; y++)
-    {
-        for (x = 0; x < w; x++)
+        /* the same frames as -e would write them: each one minus the one before, the first one against black */
+        uint8_t *prev = calloc(1, frame_size);
+        uint8_t *current = malloc(frame_size);
+        int delta_error = !prev || !current;
+        for(int frame = 0; frame < frame_count && !delta_error; frame++)
+        {
+            memcpy(current, frames[frame], frame_size);
+            delta_error = frame_delta_encode(frames[frame], prev, options->width, options->height, options->depth);
+            memcpy(prev, current, frame_size);
+        }
+        free(prev);
+        free(current);
+
+        if(delta_error)
+        {
+            error = 1;
+        }
+        else
         {
-            raw_set_pixel(x, y, aux2[x + y*w]);
+#ifdef MLV_USE_LZMA
+            error |= bench_compress_run("LZMA-e", lzma_level, frames, frame_size, frame_count, options, threads);
+#endif
+            options->rice = 1;
+            error |= bench_compress_run("Rice-e", -1, frames, frame_size, frame_count, options, threads);
+            options->rice = 0;
         }
     }
 
-    free(aux);
-    free(aux2);
+    for(int frame = 0; frame < max_frames; frame++)
+    {
+        free(frames[frame]);
+    }
+    free(frames);
+    free(frame_sizes);
+    mlv_reader_close(reader);
+
+    return error;
 }
 
 void show_usage(char *executable)
@@ -984,6 +3334,10 @@ void show_usage(char *executable)
     print_msg(MSG_INFO, " --no-fixcp          do not fix cold pixels\n");
     print_msg(MSG_INFO, " --fixcp2            fix non-static (moving) cold pixels (slow)\n");
     print_msg(MSG_INFO, " --no-stripes        do not fix vertical stripes in highlights\n");
+    print_msg(MSG_INFO, " --stripes-interval N re-estimate the vertical stripes correction every N frames (default: 0 = first frame only)\n");
+    print_msg(MSG_INFO, " --threads N         process N frames in parallel (default: 1)\n");
+    print_msg(MSG_INFO, " --lj92              write lossless JPEG compressed DNGs. LJ92 footage always gives compressed DNGs,\n");
+    print_msg(MSG_INFO, "                     unchanged frames (no fixes or smoothing) are copied without recompression\n");
 
     print_msg(MSG_INFO, "\n");
     print_msg(MSG_INFO, "-- RAW output --\n");
@@ -1017,11 +3371,24 @@ void show_usage(char *executable)
     //print_msg(MSG_INFO, " -u lut_file         look-up table with 4 * xRes * yRes 16-bit words that is applied before bit depth conversion\n");
 #ifdef MLV_USE_LZMA
     print_msg(MSG_INFO, " -c                  (re-)compress video and audio frames using LZMA (set bpp to 16 to improve compression rate)\n");
-    print_msg(MSG_INFO, " -d                  decompress compressed video and audio frames using LZMA\n");
+    print_msg(MSG_INFO, " -d                  decompress compressed video and audio frames (LZMA, LZMA2, LJ92 or Rice)\n");
     print_msg(MSG_INFO, " -l level            set compression level from 0=fastest to 9=best compression\n");
+    print_msg(MSG_INFO, " --lzma-dict=size    LZMA dictionary size in bytes, or with k/m suffix (default: 128m, limited to the frame size)\n");
+    print_msg(MSG_INFO, " --lzma-mf=mf        LZMA match finder: hc4 (fast), bt2, bt3 or bt4 (default: hc4 for levels 0-4, else bt4)\n");
+    print_msg(MSG_INFO, " --lzma2[=chunk]     compress video frames with LZMA2 (-c): chunks of the frame are compressed on several cores\n");
+    print_msg(MSG_INFO, "                     chunk size in bytes or with k/m suffix (default: frame size / threads, at least 1m)\n");
+    print_msg(MSG_INFO, " --lzma-threads N    LZMA threads per frame, including the match finder threads (default: 8)\n");
 #else
-    print_msg(MSG_INFO, " -c, -d, -l          NOT AVAILABLE: compression support was not compiled into this release\n");
+    print_msg(MSG_INFO, " -d                  decompress LJ92 or Rice compressed video frames\n");
+    print_msg(MSG_INFO, " -c, -l              NOT AVAILABLE: LZMA compression support was not compiled into this release\n");
 #endif
+    print_msg(MSG_INFO, " --lj92              compress video frames with lossless JPEG instead of LZMA (-c), much faster\n");
+    print_msg(MSG_INFO, " --rice              compress video frames with bayer prediction and Rice codes instead of LZMA (-c), much faster\n");
+    print_msg(MSG_INFO, "                     with -e, the delta frames get predicted as well\n");
+    print_msg(MSG_INFO, " --threads N         compress N frames in parallel (default: 1)\n");
+    print_msg(MSG_INFO, " --bench-compress[=N] compress the first N (default: 16) frames with LJ92, Rice and every LZMA and LZMA2 level,\n");
+    print_msg(MSG_INFO, "                     then LZMA (-l level) and Rice on delta frames (-e), print size and speed and exit.\n");
+    print_msg(MSG_INFO, "                     uses --threads, --lzma-dict, --lzma-mf, --lzma2 chunk and --lzma-threads\n");
     print_msg(MSG_INFO, "\n");
 
     print_msg(MSG_INFO, "-- bugfixes --\n");
@@ -1093,6 +3460,23 @@ void print_capture_info(mlv_rawc_hdr_t * rawc)
     }
 }
 
+/* size in bytes, or with k/m suffix */
+static uint32_t parse_size(const char *arg)
+{
+    char *suffix = NULL;
+    uint32_t size = strtoul(arg, &suffix, 10);
+
+    if(*suffix == 'k' || *suffix == 'K')
+    {
+        size <<= 10;
+    }
+    else if(*suffix == 'm' || *suffix == 'M')
+    {
+        size <<= 20;
+    }
+    return size;
+}
+
 int main (int argc, char *argv[])
 {
     char *input_filename = NULL;
@@ -1128,6 +3512,8 @@ int main (int argc, char *argv[])
     int bit_zap = 0;
     int compress_output = 0;
     int decompress_output = 0;
+    int lj92_mode = 0;
+    int rice_mode = 0;
     int verbose = 0;
     int lzma_level = 5;
     int alter_fps = 0;
@@ -1136,15 +3522,17 @@ int main (int argc, char *argv[])
     int video_xRes = 0;
     int video_yRes = 0;
 
-#ifdef MLV_USE_LZMA
-    /* this may need some tuning */
-    int lzma_dict = 1<<27;
+    /* this may need some tuning. the dictionary is limited to the frame size anyway */
+    uint32_t lzma_dict = 1<<27;
+    int lzma_mf = LZMA_MF_DEFAULT;
     int lzma_lc = 0;
     int lzma_lp = 1;
     int lzma_pb = 1;
     int lzma_fb = 16;
     int lzma_threads = 8;
-#endif
+    int lzma2_mode = 0;
+    uint32_t lzma2_chunk = 0;
+    int bench_frames = 0;
 
     lua_State *lua_state = NULL;
 
@@ -1158,6 +3546,8 @@ int main (int argc, char *argv[])
     int dump_xrefs = 0;
     int fix_cold_pixels = 1;
     int fix_vert_stripes = 1;
+    int stripes_interval = 0;
+    int frame_threads = 1;
     
     const char * unique_camname = "(unknown)";
 
@@ -1165,9 +3555,17 @@ int main (int argc, char *argv[])
         {"lua",    required_argument, NULL,  'L' },
         {"black-fix",  optional_argument, NULL,  'B' },
         {"fix-bug",  required_argument, NULL,  'F' },
+        {"threads",  required_argument, NULL,  'T' },
+        {"lzma-dict",  required_argument, NULL,  'D' },
+        {"lzma-mf",  required_argument, NULL,  'M' },
+        {"lzma-threads",  required_argument, NULL,  'N' },
+        {"lzma2",  optional_argument, NULL,  'Z' },
+        {"bench-compress",  optional_argument, NULL,  'C' },
         {"batch",  no_argument, &batch_mode,  1 },
         {"dump-xrefs",   no_argument, &dump_xrefs,  1 },
         {"dng",    no_argument, &dng_output,  1 },
+        {"lj92",   no_argument, &lj92_mode,  1 },
+        {"rice",   no_argument, &rice_mode,  1 },
         {"no-cs",  no_argument, &chroma_smooth_method,  0 },
         {"cs2x2",  no_argument, &chroma_smooth_method,  2 },
         {"cs3x3",  no_argument, &chroma_smooth_method,  3 },
@@ -1175,6 +3573,7 @@ int main (int argc, char *argv[])
         {"no-fixcp",  no_argument, &fix_cold_pixels,  0 },
         {"fixcp2",    no_argument, &fix_cold_pixels,  2 },
         {"no-stripes",  no_argument, &fix_vert_stripes,  0 },
+        {"stripes-interval",  required_argument, NULL,  'S' },
         {"avg-vertical",  no_argument, &average_vert,  1 },
         {"avg-horizontal",  no_argument, &average_hor,  1 },
         {0,         0,                 0,  0 }
@@ -1191,7 +3590,7 @@ int main (int argc, char *argv[])
     }
 
     int index = 0;
-    while ((opt = getopt_long(argc, argv, "A:F:B:L:t:xz:emnas:X:I:uvrcdo:l:b:f:", long_options, &index)) != -1)
+    while ((opt = getopt_long(argc, argv, "A:F:B:L:T:t:xz:emnas:X:I:uvrcdo:l:b:f:", long_options, &index)) != -1)
     {
         switch (opt)
         {
@@ -1220,6 +3619,58 @@ int main (int argc, char *argv[])
                 }
                 break;
               
+            case 'D':
+                if(!optarg)
+                {
+                    print_msg(MSG_ERROR, "Error: Missing LZMA dictionary size\n");
+                    return ERR_PARAM;
+                }
+                else
+                {
+                    lzma_dict = MIN((uint32_t)1<<27, MAX((uint32_t)1<<12, parse_size(optarg)));
+                }
+                break;
+
+            case 'Z':
+                lzma2_mode = 1;
+                if(optarg)
+                {
+                    lzma2_chunk = MIN((uint32_t)1<<28, MAX((uint32_t)1<<16, parse_size(optarg)));
+                }
+                break;
+
+            case 'N':
+                if(!optarg)
+                {
+                    print_msg(MSG_ERROR, "Error: Missing number of LZMA threads\n");
+                    return ERR_PARAM;
+                }
+                else
+                {
+                    lzma_threads = MIN(32, MAX(1, atoi(optarg)));
+                }
+                break;
+
+            case 'M':
+                lzma_mf = -1;
+                for(int mf = 0; mf < COUNT(lzma_mf_names); mf++)
+                {
+                    if(optarg && !strcasecmp(optarg, lzma_mf_names[mf]))
+                    {
+                        lzma_mf = mf;
+                    }
+                }
+                if(lzma_mf < 0)
+                {
+                    print_msg(MSG_ERROR, "Error: Unknown match finder '%s', use hc4, bt2, bt3 or bt4\n", optarg ? optarg : "");
+                    return ERR_PARAM;
+                }
+                break;
+
+            case 'C':
+                bench_frames = optarg ? MIN(1000, MAX(1, atoi(optarg))) : 16;
+                break;
+
             case 'B':
                 if(!optarg)
                 {
@@ -1231,6 +3682,30 @@ int main (int argc, char *argv[])
                 }
                 break;
                 
+            case 'T':
+                if(!optarg)
+                {
+                    print_msg(MSG_ERROR, "Error: Missing number of threads\n");
+                    return ERR_PARAM;
+                }
+                else
+                {
+                    frame_threads = MIN(64, MAX(1, atoi(optarg)));
+                }
+                break;
+                
+            case 'S':
+                if(!optarg)
+                {
+                    print_msg(MSG_ERROR, "Error: Missing stripes interval\n");
+                    return ERR_PARAM;
+                }
+                else
+                {
+                    stripes_interval = MAX(0, atoi(optarg));
+                }
+                break;
+                
             case 'A':
                 if(!optarg)
                 {
@@ -1258,6 +3733,7 @@ int main (int argc, char *argv[])
                 }
 
                 luaL_openlibs(lua_state);
+                lua_init_views(lua_state);
 
                 if(luaL_loadfile(lua_state, optarg) != 0 || lua_pcall(lua_state, 0, 0, 0) != 0)
                 {
@@ -1355,21 +3831,11 @@ int main (int argc, char *argv[])
                 break;
 
             case 'c':
-#ifdef MLV_USE_LZMA
                 compress_output = 1;
-#else
-                print_msg(MSG_ERROR, "Error: Compression support was not compiled into this release\n");
-                return ERR_PARAM;
-#endif
                 break;
 
             case 'd':
-#ifdef MLV_USE_LZMA
                 decompress_output = 1;
-#else
-                print_msg(MSG_ERROR, "Error: Compression support was not compiled into this release\n");
-                return ERR_PARAM;
-#endif
                 break;
 
             case 'o':
@@ -1441,6 +3907,21 @@ int main (int argc, char *argv[])
         return ERR_PARAM;
     }
 
+#ifndef MLV_USE_LZMA
+    /* LJ92 and Rice are always available */
+    if(compress_output && !lj92_mode && !rice_mode)
+    {
+        print_msg(MSG_ERROR, "Error: LZMA compression support was not compiled into this release, use --lj92 or --rice\n");
+        return ERR_PARAM;
+    }
+#endif
+
+    if(lj92_mode + lzma2_mode + rice_mode > 1)
+    {
+        print_msg(MSG_ERROR, "Error: only one of --lj92, --lzma2 and --rice can be used\n");
+        return ERR_PARAM;
+    }
+
 
 
     print_msg(MSG_INFO, "\n");
@@ -1451,6 +3932,27 @@ int main (int argc, char *argv[])
     /* get first file */
     input_filename = argv[optind];
 
+    /* frame size and bit depth are known when the first frame arrives */
+    compress_options_t compress_options;
+    memset(&compress_options, 0x00, sizeof(compress_options));
+    compress_options.lj92 = lj92_mode;
+    compress_options.lzma_level = lzma_level;
+    compress_options.lzma_dict = lzma_dict;
+    compress_options.lzma_mf = lzma_mf;
+    compress_options.lzma_lc = lzma_lc;
+    compress_options.lzma_lp = lzma_lp;
+    compress_options.lzma_pb = lzma_pb;
+    compress_options.lzma_fb = lzma_fb;
+    compress_options.lzma_threads = lzma_threads;
+    compress_options.lzma2 = lzma2_mode;
+    compress_options.lzma2_chunk = lzma2_chunk;
+    compress_options.rice = rice_mode;
+
+    if(bench_frames)
+    {
+        return bench_compress(input_filename, bench_frames, &compress_options, frame_threads);
+    }
+
     print_msg(MSG_INFO, "Mode of operation:\n");
     print_msg(MSG_INFO, "   - Input MLV file: '%s'\n", input_filename);
 
@@ -1492,6 +3994,14 @@ int main (int argc, char *argv[])
         if(dng_output)
         {
             print_msg(MSG_INFO, "   - Convert to DNG frames\n");
+            if(frame_threads > 1)
+            {
+                print_msg(MSG_INFO, "   - Using %d threads\n", frame_threads);
+            }
+            if(lj92_mode)
+            {
+                print_msg(MSG_INFO, "   - Compress DNG frames using LJ92\n");
+            }
 
             delta_encode_mode = 0;
             compress_output = 0;
@@ -1533,7 +4043,19 @@ int main (int argc, char *argv[])
             }
             if(compress_output)
             {
-                print_msg(MSG_INFO, "   - Compress frame data\n");
+                print_msg(MSG_INFO, "   - Compress frame data using %s\n", lj92_mode ? "LJ92" : rice_mode ? "Rice" : lzma2_mode ? "LZMA2" : "LZMA");
+                if(lzma2_mode)
+                {
+                    print_msg(MSG_INFO, "   - Using up to %d LZMA threads per frame\n", lzma_threads);
+                }
+                if(!lj92_mode && !rice_mode && lzma_mf != LZMA_MF_DEFAULT)
+                {
+                    print_msg(MSG_INFO, "   - Using the %s match finder\n", lzma_mf_names[lzma_mf]);
+                }
+                if(frame_threads > 1)
+                {
+                    print_msg(MSG_INFO, "   - Using %d threads\n", frame_threads);
+                }
             }
             if(average_mode)
             {
@@ -1609,6 +4131,9 @@ int main (int argc, char *argv[])
 
     char info_string[256] = "(MLV Video without INFO blocks)";
 
+    /* video class flags of the written file, they differ from main_header when (de)compressing or delta encoding */
+    uint16_t output_video_class = 0;
+
     /* this table contains the XREF chunk read from idx file, if existing */
     mlv_xref_hdr_t *block_xref = NULL;
     mlv_xref_t *xrefs = NULL;
@@ -1623,11 +4148,11 @@ int main (int argc, char *argv[])
     uint8_t *frame_flat_buffer = NULL;
     uint8_t *frame_buffer = NULL;
     uint8_t *prev_frame_buffer = NULL;
+    uint32_t prev_frame_buffer_size = 0;
 
     FILE *out_file = NULL;
     FILE *out_file_wav = NULL;
-    FILE **in_files = NULL;
-    FILE *in_file = NULL;
+    mlv_reader_t *in_reader = NULL;
 
     int in_file_count = 0;
     int in_file_num = 0;
@@ -1636,24 +4161,45 @@ int main (int argc, char *argv[])
     uint32_t wav_header_size = 0;
 
     /* this is for our generated XREF table */
-    frame_xref_t *frame_xref_table = NULL;
-    int frame_xref_allocated = 0;
-    int frame_xref_entries = 0;
+    mlv_index_t frame_index;
+    mlv_index_init(&frame_index);
 
     int total_vidf_count = 0;
     int total_audf_count = 0;
 
+    /* settings for the per-frame image operations, updated with every VIDF */
+    frame_params_t frame_params;
+    memset(&frame_params, 0x00, sizeof(frame_params_t));
+
+    /* DNG export. in single-threaded mode the corrections are done right in the main loop */
+    dng_options_t dng_options;
+    dng_options.fix_vert_stripes = fix_vert_stripes;
+    dng_options.stripes_interval = stripes_interval;
+    dng_options.fix_cold_pixels = fix_cold_pixels;
+    dng_options.chroma_smooth_method = chroma_smooth_method;
+    dng_options.lj92 = lj92_mode;
+
+    struct raw_fix_state dng_fix;
+    raw_fix_init(&dng_fix);
+    dng_fix.stripes_interval = stripes_interval;
+    chroma_tables_t *dng_tables = NULL;
+    uint8_t *dng_lj92_buffer = NULL;
+    uint32_t dng_lj92_buffer_size = 0;
+    dng_pipeline_t *dng_pipeline = NULL;
+    compress_pipeline_t *compress_pipeline = NULL;
+
     /* open files */
-    in_files = load_all_chunks(input_filename, &in_file_count);
-    if(!in_files || !in_file_count)
+    in_reader = load_all_chunks(input_filename);
+    if(!in_reader)
     {
         print_msg(MSG_ERROR, "Failed to open file '%s'\n", input_filename);
         return ERR_FILE;
     }
     else
     {
+        in_file_count = mlv_reader_chunk_count(in_reader);
         in_file_num = 0;
-        in_file = in_files[in_file_num];
+        mlv_reader_select(in_reader, in_file_num);
     }
 
     if(!xref_mode)
@@ -1667,7 +4213,7 @@ int main (int argc, char *argv[])
 
             if(dump_xrefs)
             {
-                xref_dump(block_xref);
+                xref_dump(block_xref, in_reader);
             }
         }
         else
@@ -1729,6 +4275,7 @@ int main (int argc, char *argv[])
             return ERR_MALLOC;
         }
         memset(prev_frame_buffer, 0x00, frame_buffer_size);
+        prev_frame_buffer_size = frame_buffer_size;
     }
 
     if(output_filename || lua_state)
@@ -1770,13 +4317,13 @@ read_headers:
             position = xrefs[block_xref_pos].frameOffset;
 
             /* select file and seek to the right position */
-            in_file = in_files[in_file_num];
-            file_set_pos(in_file, position, SEEK_SET);
+            mlv_reader_select(in_reader, in_file_num);
+            mlv_reader_seek(in_reader, position, SEEK_SET);
         }
 
-        position = file_get_pos(in_file);
+        position = mlv_reader_tell(in_reader);
 
-        if(fread(&buf, sizeof(mlv_hdr_t), 1, in_file) != 1)
+        if(mlv_reader_read(in_reader, &buf, sizeof(mlv_hdr_t)) != 1)
         {
             if(block_xref)
             {
@@ -1788,7 +4335,7 @@ read_headers:
             if(in_file_num < (in_file_count - 1))
             {
                 in_file_num++;
-                in_file = in_files[in_file_num];
+                mlv_reader_select(in_reader, in_file_num);
             }
             else
             {
@@ -1801,9 +4348,9 @@ read_headers:
         }
 
         /* jump back to the beginning of the block just read */
-        file_set_pos(in_file, position, SEEK_SET);
+        mlv_reader_seek(in_reader, position, SEEK_SET);
 
-        position = file_get_pos(in_file);
+        position = mlv_reader_tell(in_reader);
 
         /* unexpected block header size? */
         if(buf.blockSize < sizeof(mlv_hdr_t) || buf.blockSize > 50 * 1024 * 1024)
@@ -1815,6 +4362,15 @@ read_headers:
             }
         }
 
+        /* all queued frames have to be written before the next block gets written */
+        if(compress_pipeline && memcmp(buf.blockType, "VIDF", 4) && memcmp(buf.blockType, "NULL", 4) && memcmp(buf.blockType, "BKUP", 4))
+        {
+            if(compress_pipeline_flush(compress_pipeline))
+            {
+                goto abort;
+            }
+        }
+
         /* file header */
         if(!memcmp(buf.blockType, "MLVI", 4))
         {
@@ -1822,12 +4378,12 @@ read_headers:
             uint32_t hdr_size = MIN(sizeof(mlv_file_hdr_t), buf.blockSize);
 
             /* read the whole header block, but limit size to either our local type size or the written block size */
-            if(fread(&file_hdr, hdr_size, 1, in_file) != 1)
+            if(mlv_reader_read(in_reader, &file_hdr, hdr_size) != 1)
             {
                 print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                 goto abort;
             }
-            file_set_pos(in_file, position + file_hdr.blockSize, SEEK_SET);
+            mlv_reader_seek(in_reader, position + file_hdr.blockSize, SEEK_SET);
 
             lua_handle_hdr(lua_state, buf.blockType, &file_hdr, sizeof(file_hdr));
 
@@ -1850,17 +4406,10 @@ read_headers:
             }
 
             /* in xref mode, use every block and get its timestamp etc */
-            if(xref_mode)
+            if(xref_mode && mlv_index_add(&frame_index, &buf, in_file_num, position))
             {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = 0;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = in_file_num;
-                frame_xref_table[frame_xref_entries].frameType = MLV_FRAME_UNSPECIFIED;
-
-                frame_xref_entries++;
+                print_msg(MSG_ERROR, "Failed to allocate index entry\n");
+                goto abort;
             }
 
             /* is this the first file? */
@@ -1882,13 +4431,10 @@ read_headers:
                     }
 
                     /* set the output compression flag */
+                    file_hdr.videoClass &= ~MLV_VIDEO_CLASS_FLAG_COMPRESSED;
                     if(compress_output)
                     {
-                        file_hdr.videoClass |= MLV_VIDEO_CLASS_FLAG_LZMA;
-                    }
-                    else
-                    {
-                        file_hdr.videoClass &= ~MLV_VIDEO_CLASS_FLAG_LZMA;
+                        file_hdr.videoClass |= lj92_mode ? MLV_VIDEO_CLASS_FLAG_LJ92 : rice_mode ? MLV_VIDEO_CLASS_FLAG_RICE : lzma2_mode ? MLV_VIDEO_CLASS_FLAG_LZMA2 : MLV_VIDEO_CLASS_FLAG_LZMA;
                     }
 
                     if(delta_encode_mode)
@@ -1899,6 +4445,7 @@ read_headers:
                     {
                         file_hdr.videoClass &= ~MLV_VIDEO_CLASS_FLAG_DELTA;
                     }
+                    output_video_class = file_hdr.videoClass;
 
                     if(!extract_block || !strncasecmp(extract_block, (char*)file_hdr.fileMagic, 4))
                     {
@@ -1971,20 +4518,16 @@ read_headers:
         else
         {
             /* in xref mode, use every block and get its timestamp etc */
-            if(xref_mode && memcmp(buf.blockType, "NULL", 4) && memcmp(buf.blockType, "BKUP", 4))
+            if(xref_mode)
             {
-                xref_resize(&frame_xref_table, frame_xref_entries + 1, &frame_xref_allocated);
-
-                /* add xref data */
-                frame_xref_table[frame_xref_entries].frameTime = buf.timestamp;
-                frame_xref_table[frame_xref_entries].frameOffset = position;
-                frame_xref_table[frame_xref_entries].fileNumber = in_file_num;
-                frame_xref_table[frame_xref_entries].frameType =
-                    !memcmp(buf.blockType, "VIDF", 4) ? MLV_FRAME_VIDF :
-                    !memcmp(buf.blockType, "AUDF", 4) ? MLV_FRAME_AUDF :
-                    MLV_FRAME_UNSPECIFIED;
+                /* frame blocks are indexed with their frame number, so pass the whole header */
+                const mlv_hdr_t *block = mlv_reader_block(in_reader, in_file_num, position);
 
-                frame_xref_entries++;
+                if(!block || mlv_index_add(&frame_index, block, in_file_num, position))
+                {
+                    print_msg(MSG_ERROR, "Failed to index block at 0x%08" PRIx64 "\n", position);
+                    goto abort;
+                }
             }
 
             if(main_header.blockSize == 0)
@@ -2011,7 +4554,7 @@ read_headers:
                 mlv_audf_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_audf_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "AUDF: File ends in the middle of a block\n");
                     goto abort;
@@ -2035,20 +4578,15 @@ read_headers:
                 if(!skip_block)
                 {
                     /* skip frame space */
-                    file_set_pos(in_file, block_hdr.frameSpace, SEEK_CUR);
+                    mlv_reader_seek(in_reader, block_hdr.frameSpace, SEEK_CUR);
 
                     int frame_size = block_hdr.blockSize - sizeof(mlv_audf_hdr_t) - block_hdr.frameSpace;
-                    void *buf = malloc(frame_size);
+
+                    /* audio data is written straight out of the mapped file */
+                    const void *buf = mlv_reader_get(in_reader, frame_size);
 
                     if(!buf)
                     {
-                        print_msg(MSG_ERROR, "AUDF: Failed to allocate buffer\n");
-                        goto abort;
-                    }
-                    
-                    if(fread(buf, frame_size, 1, in_file) != 1)
-                    {
-                        free(buf);
                         print_msg(MSG_ERROR, "AUDF: File ends in the middle of a block\n");
                         goto abort;
                     }
@@ -2091,7 +4629,6 @@ read_headers:
                         
                         wav_file_size += frame_size;
                     }
-                    free(buf);
                 }
                 audf_frames_processed++;
             }
@@ -2100,7 +4637,7 @@ read_headers:
                 mlv_vidf_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_vidf_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "VIDF: File ends in the middle of a block\n");
                     goto abort;
@@ -2132,10 +4669,84 @@ read_headers:
                     skip_block = 1;
                 }
 
-                if((raw_output || mlv_output || dng_output || lua_state) && !skip_block)
+                frame_params.video_xRes = video_xRes;
+                frame_params.video_yRes = video_yRes;
+                frame_params.black_level = lv_rec_footer.raw_info.black_level;
+                frame_params.old_depth = lv_rec_footer.raw_info.bits_per_pixel;
+                frame_params.new_depth = bit_depth;
+                frame_params.bit_zap = bit_zap;
+                frame_params.verbose = verbose;
+                frame_params.sub_buffer = subtract_mode ? frame_sub_buffer : NULL;
+                frame_params.sub_size = subtract_frame_buffer_size;
+                frame_params.flat_buffer = flatfield_mode ? frame_flat_buffer : NULL;
+                frame_params.flat_size = flatfield_frame_buffer_size;
+
+                /* start the DNG worker threads with the first frame, when the file header is known */
+                if(dng_output && frame_threads > 1)
+                {
+                    if(lua_state || average_mode || fix_bug != BUG_ID_NONE || (main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA))
+                    {
+                        print_msg(MSG_INFO, "Multi-threaded DNG export is not possible with these options, using one thread\n");
+                    }
+                    else
+                    {
+                        dng_pipeline = dng_pipeline_start(frame_threads, &dng_options, output_filename);
+                        if(!dng_pipeline)
+                        {
+                            print_msg(MSG_ERROR, "Failed to start DNG threads, using one thread\n");
+                        }
+                    }
+                    frame_threads = 1;
+                }
+
+                if(dng_pipeline && !skip_block)
+                {
+                    int frame_size = block_hdr.blockSize - sizeof(mlv_vidf_hdr_t) - block_hdr.frameSpace;
+
+                    /* when no end was specified, save all frames */
+                    uint32_t frame_selected = (!extract_frames) || ((block_hdr.frameNumber >= frame_start) && (block_hdr.frameNumber <= frame_end));
+
+                    if(frame_selected)
+                    {
+                        if(flatfield_mode && !frame_params.flat_ready && flatfield_normalize(&frame_params))
+                        {
+                            goto abort;
+                        }
+
+                        dng_frame_t *frame = dng_pipeline_get_frame(dng_pipeline);
+                        if(!frame)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: DNG export failed\n");
+                            goto abort;
+                        }
+
+                        if(frame_buffer_reserve(&frame->frame_buffer, &frame->frame_buffer_size, frame_size))
+                        {
+                            goto abort;
+                        }
+
+                        mlv_reader_seek(in_reader, block_hdr.frameSpace, SEEK_CUR);
+                        if(mlv_reader_read(in_reader, frame->frame_buffer, frame_size) != 1)
+                        {
+                            print_msg(MSG_ERROR, "VIDF: File ends in the middle of a block\n");
+                            goto abort;
+                        }
+
+                        frame->frame_size = frame_size;
+                        frame->compressed = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_COMPRESSED;
+                        frame->params = frame_params;
+                        dng_frame_set_metadata(frame, block_hdr.frameNumber, buf.timestamp, &main_header, &expo_info, &lens_info, &rtci_info, &idnt_info, unique_camname, info_string);
+                        dng_frame_set_raw_info(frame, &lv_rec_footer);
+
+                        dng_pipeline_submit(dng_pipeline);
+                    }
+
+                    mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
+                }
+                else if((raw_output || mlv_output || dng_output || lua_state) && !skip_block)
                 {
                     /* if already compressed, we have to decompress it first */
-                    int compressed = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_LZMA;
+                    int compressed = main_header.videoClass & MLV_VIDEO_CLASS_FLAG_COMPRESSED;
                     int recompress = compressed && compress_output;
                     int decompress = compressed && decompress_output;
 
@@ -2148,13 +4759,13 @@ read_headers:
                         print_msg(MSG_INFO, "BUG_ID_FRAMEDATA_MISALIGN: Offset frame data by %d byte\n", fix_bug_2_offset);
                         skipSize -= fix_bug_2_offset;
                     }
-                    file_set_pos(in_file, skipSize, SEEK_CUR);
+                    mlv_reader_seek(in_reader, skipSize, SEEK_CUR);
                     
                     /* we can correct that frame by fixing frame space */
                     if(fix_bug == BUG_ID_BLOCKSIZE_WRONG && fix_bug_1_offset != 0)
                     {
                         print_msg(MSG_INFO, "BUG_ID_BLOCKSIZE_WRONG: Seeking %d byte\n", fix_bug_1_offset);
-                        file_set_pos(in_file, fix_bug_1_offset, SEEK_CUR);
+                        mlv_reader_seek(in_reader, fix_bug_1_offset, SEEK_CUR);
                         block_hdr.frameSpace += fix_bug_1_offset;
                         fix_bug_1_offset = 0;
                     }
@@ -2202,10 +4813,13 @@ read_headers:
                                 print_msg(MSG_ERROR, "VIDF: Failed to allocate %d byte\n", frame_buffer_size);
                                 goto abort;
                             }
+                            prev_frame_buffer_size = frame_buffer_size;
                         }
                     }
                     
-                    if(fread(frame_buffer, frame_size, 1, in_file) != 1)
+                    /* frame data as stored in the file, it gets copied or unpacked into frame_buffer */
+                    const uint8_t *frame_data = mlv_reader_get(in_reader, frame_size);
+                    if(!frame_data)
                     {
                         print_msg(MSG_ERROR, "VIDF: File ends in the middle of a block\n");
                         goto abort;
@@ -2213,286 +4827,81 @@ read_headers:
 
                     if(fix_bug == BUG_ID_FRAMEDATA_MISALIGN && (int)block_hdr.frameSpace >= fix_bug_2_offset)
                     {
-                        file_set_pos(in_file, fix_bug_2_offset, SEEK_CUR);
+                        mlv_reader_seek(in_reader, fix_bug_2_offset, SEEK_CUR);
                     }
                     
-                    lua_handle_hdr_data(lua_state, buf.blockType, "_data_read", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
+                    lua_handle_hdr_data(lua_state, buf.blockType, "_data_read", &block_hdr, sizeof(block_hdr), (void *)frame_data, frame_size);
 
                     if(recompress || decompress || ((raw_output || dng_output) && compressed))
                     {
-#ifdef MLV_USE_LZMA
-                        size_t lzma_out_size = *(uint32_t *)frame_buffer;
-                        size_t lzma_in_size = frame_size - LZMA_PROPS_SIZE - 4;
-                        size_t lzma_props_size = LZMA_PROPS_SIZE;
-                        unsigned char *lzma_out = malloc(lzma_out_size);
-
-                        int ret = LzmaUncompress(
-                            lzma_out, &lzma_out_size,
-                            (unsigned char *)&frame_buffer[4 + LZMA_PROPS_SIZE], &lzma_in_size,
-                            (unsigned char *)&frame_buffer[4], lzma_props_size
-                            );
-
-                        if(ret == SZ_OK)
-                        {
-                            frame_size = lzma_out_size;
-                            memcpy(frame_buffer, lzma_out, frame_size);
-                            if(verbose)
-                            {
-                                print_msg(MSG_INFO, "    LZMA: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, lzma_out_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
-                            }
-                        }
-                        else
+                        if(frame_decompress_from(frame_data, &frame_buffer, &frame_buffer_size, &frame_size, compressed, verbose))
                         {
-                            print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
                             goto abort;
                         }
-#else
-                        print_msg(MSG_INFO, "    LZMA: not compiled into this release, aborting.\n");
-                        goto abort;
-#endif
+                    }
+                    else
+                    {
+                        memcpy(frame_buffer, frame_data, frame_size);
                     }
 
                     int old_depth = lv_rec_footer.raw_info.bits_per_pixel;
-                    int new_depth = bit_depth;
 
                     /* this value changes in this context */
                     int current_depth = old_depth;
 
-                    /* in subtract mode, subtract reference frame. do that before averaging */
-                    if(subtract_mode)
+                    if(flatfield_mode && !frame_params.flat_ready && flatfield_normalize(&frame_params))
                     {
-                        if((int)subtract_frame_buffer_size != frame_size)
-                        {
-                            print_msg(MSG_ERROR, "Error: Frame sizes of footage and subtract frame differ (%d, %d)", frame_size, subtract_frame_buffer_size);
-                            break;
-                        }
-                        
-                        int pitch = video_xRes * current_depth / 8;
-
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                            uint16_t *sub_line = (uint16_t *)&frame_sub_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int32_t value = bitextract(src_line, x, current_depth);
-                                int32_t sub_value = bitextract(sub_line, x, current_depth);
-
-                                value -= sub_value;
-                                value += lv_rec_footer.raw_info.black_level; /* should we really add it here? or better subtract it from averaged frame? */
-                                value = COERCE(value, 0, (1<<current_depth)-1);
-
-                                bitinsert(src_line, x, current_depth, value);
-                            }
-                        }
+                        break;
                     }
 
-                    /* in flat-field mode, divide each image by the normalized reference frame */
-                    if(flatfield_mode)
+                    /* subtract and flat-field before averaging */
+                    if(frame_apply_references(&frame_params, frame_buffer, frame_size))
                     {
-                        if((int)flatfield_frame_buffer_size != frame_size)
-                        {
-                            print_msg(MSG_ERROR, "Error: Frame sizes of footage and flat-field frame differ (%d, %d)", frame_size, flatfield_frame_buffer_size);
-                            break;
-                        }
-                        
-                        int pitch = video_xRes * current_depth / 8;
-
-                        /* normalize flat frame on each Bayer channel (median) */
-                        /* and adjust all medians using green's 5th percentile to prevent whites from clipping */
-                        static int32_t med[2][2] = {{0,0},{0,0}};
-                        static int32_t pr5[2][2] = {{0,0},{0,0}};
-                        static int32_t adj_num = 0;
-                        static int32_t adj_den = 0;
-
-                        int black = lv_rec_footer.raw_info.black_level;
-                        
-                        if (!med[0][0])
-                        {
-                            /* normalize using frame center only
-                             * (also works on lenses with heavy vignetting) */
-                            
-                            int* hist[2][2];
-                            int total[2][2] = {{0,0},{0,0}};
-                            
-                            hist[0][0] = calloc(1 << current_depth, sizeof(int));
-                            hist[0][1] = calloc(1 << current_depth, sizeof(int));
-                            hist[1][0] = calloc(1 << current_depth, sizeof(int));
-                            hist[1][1] = calloc(1 << current_depth, sizeof(int));
-                            
-                            for(int y = video_yRes/4; y < video_yRes*3/4; y++)
-                            {
-                                uint16_t *flat_line = (uint16_t *)&frame_flat_buffer[y * pitch];
-                                for(int x = video_xRes/4; x < video_xRes*3/4; x++)
-                                {
-                                    uint32_t value = bitextract(flat_line, x, current_depth);
-                                    hist[y%2][x%2][value]++;
-                                    total[y%2][x%2]++;
-                                }
-                            }
-                            
-                            for (int dy = 0; dy < 2; dy++)
-                            {
-                                for (int dx = 0; dx < 2; dx++)
-                                {
-                                    int acc = 0;
-                                    for (int i = 0; i < (1 << current_depth); i++)
-                                    {
-                                        acc += hist[dy][dx][i];
-                                        
-                                        if (acc < total[dy][dx]/20)
-                                        {
-                                            /* 5th percentile */
-                                            pr5[dy][dx] = i - black;
-                                        }
-                                        
-                                        if (acc < total[dy][dx]/2)
-                                        {
-                                            /* median */
-                                            med[dy][dx] = i - black;
-                                        }
-                                    }
-                                }
-                            }
-                            
-                            free(hist[0][0]);
-                            free(hist[0][1]);
-                            free(hist[1][0]);
-                            free(hist[1][1]);
-                            
-                            adj_num = (pr5[0][1] + pr5[1][0]) / 2;
-                            adj_den = (med[0][1] + med[1][0]) / 2;
-
-                            printf("Flat-field median: [%d %d; %d %d], adjusted by %d/%d\n", 
-                                med[0][0], med[0][1],
-                                med[1][0], med[1][1],
-                                adj_num, adj_den
-                            );
-                        }
-                        
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                            uint16_t *flat_line = (uint16_t *)&frame_flat_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int32_t value = bitextract(src_line, x, current_depth);
-                                int32_t flat_value = bitextract(flat_line, x, current_depth);
-                                
-                                if (flat_value - black <= 0)
-                                {
-                                    int left  = bitextract(flat_line, MAX(x-1,0), current_depth);
-                                    int right = bitextract(flat_line, MIN(x+1,video_xRes-1), current_depth);
-                                    flat_value = MAX(left, right);
-                                }
-
-                                if (flat_value - black > 0)
-                                {
-                                    value -= black;
-                                    value = (int64_t) value * med[y%2][x%2] * adj_num / adj_den / (flat_value - black);
-                                    value += black;
-                                    value = COERCE(value, 0, (1<<current_depth)-1);
-                                }
-
-                                bitinsert(src_line, x, current_depth, value);
-                            }
-                        }
+                        break;
                     }
 
                     /* in average mode, sum up all pixel values of a pixel position */
                     if(average_mode)
                     {
                         int pitch = video_xRes * current_depth / 8;
+                        uint16_t *src_line = malloc(video_xRes * sizeof(uint16_t));
 
-                        for(int y = 0; y < video_yRes; y++)
-                        {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                uint16_t value = bitextract(src_line, x, current_depth);
-
-                                frame_arith_buffer[y * video_xRes + x] += value;
-                            }
-                        }
-
-                        average_samples++;
-                    }
-
-                    /* now resample bit depth if requested */
-                    if(new_depth && (old_depth != new_depth))
-                    {
-                        int new_size = (video_xRes * video_yRes * new_depth + 7) / 8;
-                        unsigned char *new_buffer = malloc(new_size);
-
-                        if(verbose)
-                        {
-                            print_msg(MSG_INFO, "   depth: %d -> %d, size: %d -> %d (%2.2f%%)\n", old_depth, new_depth, frame_size, new_size, ((float)new_depth * 100.0f) / (float)old_depth);
-                        }
-
-                        int calced_size = ((video_xRes * video_yRes * old_depth + 7) / 8);
-                        if(calced_size > frame_size)
+                        if(!src_line)
                         {
-                            print_msg(MSG_INFO, "Error: old frame size is too small for %dx%d at %d bpp. Input data corrupt. (%d < %d)\n", video_xRes, video_yRes, old_depth, frame_size, calced_size);
+                            print_msg(MSG_ERROR, "Failed to allocate line buffer\n");
                             break;
                         }
 
-                        int old_pitch = video_xRes * old_depth / 8;
-                        int new_pitch = video_xRes * new_depth / 8;
-
                         for(int y = 0; y < video_yRes; y++)
                         {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * old_pitch];
-                            uint16_t *dst_line = (uint16_t *)&new_buffer[y * new_pitch];
+                            raw_unpack_row(&frame_buffer[y * pitch], src_line, video_xRes, current_depth);
 
                             for(int x = 0; x < video_xRes; x++)
                             {
-                                uint16_t value = bitextract(src_line, x, old_depth);
-
-                                /* normalize the old value to 16 bits */
-                                value <<= (16-old_depth);
-
-                                /* convert the old value to destination depth */
-                                value >>= (16-new_depth);
-
-                                bitinsert(dst_line, x, new_depth, value);
+                                frame_arith_buffer[y * video_xRes + x] += src_line[x];
                             }
                         }
 
-                        frame_size = new_size;
-                        current_depth = new_depth;
+                        free(src_line);
 
-                        memcpy(frame_buffer, new_buffer, frame_size);
-                        free(new_buffer);
+                        average_samples++;
                     }
 
-                    if(bit_zap)
+                    /* now resample bit depth if requested */
+                    if(frame_convert_depth(&frame_params, &frame_buffer, &frame_buffer_size, &frame_size, &current_depth))
                     {
-                        int pitch = video_xRes * current_depth / 8;
-                        uint32_t mask = ~((1 << (16 - bit_zap)) - 1);
+                        break;
+                    }
 
-                        for(int y = 0; y < video_yRes; y++)
+                    /* frames of compressed input are larger than the data in the file the buffers were sized for */
+                    if(prev_frame_buffer_size < (uint32_t)frame_size)
+                    {
+                        uint32_t old_size = prev_frame_buffer_size;
+                        if(frame_buffer_reserve(&prev_frame_buffer, &prev_frame_buffer_size, frame_size))
                         {
-                            uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-
-                            for(int x = 0; x < video_xRes; x++)
-                            {
-                                int32_t value = bitextract(src_line, x, current_depth);
-
-                                /* normalize the old value to 16 bits */
-                                value <<= (16-current_depth);
-
-                                value &= mask;
-
-                                /* convert the old value to destination depth */
-                                value >>= (16-current_depth);
-
-
-                                bitinsert(src_line, x, current_depth, value);
-                            }
+                            break;
                         }
+                        memset(&prev_frame_buffer[old_size], 0x00, prev_frame_buffer_size - old_size);
                     }
 
                     if(delta_encode_mode)
@@ -2501,38 +4910,20 @@ read_headers:
                         if(!(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA))
                         {
                             uint8_t *current_frame_buffer = malloc(frame_size);
-                            int pitch = video_xRes * current_depth / 8;
+
+                            if(!current_frame_buffer)
+                            {
+                                print_msg(MSG_ERROR, "Failed to allocate delta buffers\n");
+                                break;
+                            }
 
                             /* backup current frame for later */
                             memcpy(current_frame_buffer, frame_buffer, frame_size);
 
-                            for(int y = 0; y < video_yRes; y++)
+                            if(frame_delta_encode(frame_buffer, prev_frame_buffer, video_xRes, video_yRes, current_depth))
                             {
-                                uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                                uint16_t *ref_line = (uint16_t *)&prev_frame_buffer[y * pitch];
-                                int32_t offset = 1 << (current_depth - 1);
-                                int32_t max_val = (1 << current_depth) - 1;
-
-                                for(int x = 0; x < video_xRes; x++)
-                                {
-                                    int32_t value = bitextract(src_line, x, current_depth);
-                                    int32_t ref_value = bitextract(ref_line, x, current_depth);
-
-                                    /* when e.g. using 16 bit values:
-                                           delta =  1      -> encode to 0x8001
-                                           delta =  0      -> encode to 0x8000
-                                           delta = -1      -> encode to 0x7FFF
-                                           delta = -0xFFFF -> encode to 0x0001
-                                           delta =  0xFFFF -> encode to 0x7FFF
-                                       so this is basically a signed int with overflow and a max/2 offset.
-                                       this offset makes the frames uniform grey when viewing non-decoded frames and improves compression rate a bit.
-                                    */
-                                    int32_t delta = offset + value - ref_value;
-
-                                    uint16_t new_value = (uint16_t)(delta & max_val);
-
-                                    bitinsert(src_line, x, current_depth, new_value);
-                                }
+                                free(current_frame_buffer);
+                                break;
                             }
 
                             /* save current original frame to prev buffer */
@@ -2546,18 +4937,29 @@ read_headers:
                         if(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA)
                         {
                             int pitch = video_xRes * current_depth / 8;
+                            uint16_t *src_line = malloc(video_xRes * sizeof(uint16_t));
+                            uint16_t *ref_line = malloc(video_xRes * sizeof(uint16_t));
+
+                            if(!src_line || !ref_line)
+                            {
+                                print_msg(MSG_ERROR, "Failed to allocate delta buffers\n");
+                                free(src_line);
+                                free(ref_line);
+                                break;
+                            }
 
                             for(int y = 0; y < video_yRes; y++)
                             {
-                                uint16_t *src_line = (uint16_t *)&frame_buffer[y * pitch];
-                                uint16_t *ref_line = (uint16_t *)&prev_frame_buffer[y * pitch];
                                 int32_t offset = 1 << (current_depth - 1);
                                 int32_t max_val = (1 << current_depth) - 1;
 
+                                raw_unpack_row(&frame_buffer[y * pitch], src_line, video_xRes, current_depth);
+                                raw_unpack_row(&prev_frame_buffer[y * pitch], ref_line, video_xRes, current_depth);
+
                                 for(int x = 0; x < video_xRes; x++)
                                 {
-                                    int32_t value = bitextract(src_line, x, current_depth);
-                                    int32_t ref_value = bitextract(ref_line, x, current_depth);
+                                    int32_t value = src_line[x];
+                                    int32_t ref_value = ref_line[x];
 
                                     /* when e.g. using 16 bit values:
                                            delta =  1      -> encode to 0x8001
@@ -2570,14 +4972,16 @@ read_headers:
                                     */
                                     int32_t delta = offset + value + ref_value;
 
-                                    uint16_t new_value = (uint16_t)(delta & max_val);
-
-                                    bitinsert(src_line, x, current_depth, new_value);
+                                    src_line[x] = (uint16_t)(delta & max_val);
                                 }
+
+                                raw_pack_row(src_line, &frame_buffer[y * pitch], video_xRes, current_depth);
                             }
 
                             /* save current original frame to prev buffer */
                             memcpy(prev_frame_buffer, frame_buffer, frame_size);
+                            free(src_line);
+                            free(ref_line);
                         }
                     }
 
@@ -2607,113 +5011,53 @@ read_headers:
 
                         if(dng_output)
                         {
-                            void fix_vertical_stripes();
-                            void find_and_fix_cold_pixels(int force_analysis);
-                            extern struct raw_info raw_info;
-
-                            int frame_filename_len = strlen(output_filename) + 32;
-                            char *frame_filename = malloc(frame_filename_len);
-                            snprintf(frame_filename, frame_filename_len, "%s%06d.dng", output_filename, block_hdr.frameNumber);
+                            char *frame_filename = dng_frame_filename(output_filename, block_hdr.frameNumber);
 
                             lua_handle_hdr_data(lua_state, buf.blockType, "_data_write_dng", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
 
-                            raw_info = lv_rec_footer.raw_info;
-                            raw_info.frame_size = frame_size;
-                            raw_info.buffer = frame_buffer;
-
-                            /* override the resolution from raw_info with the one from lv_rec_footer, if they don't match */
-                            if (lv_rec_footer.xRes != raw_info.width)
-                            {
-                                raw_info.width = lv_rec_footer.xRes;
-                                raw_info.pitch = raw_info.width * 14/8;
-                                raw_info.active_area.x1 = 0;
-                                raw_info.active_area.x2 = raw_info.width;
-                                raw_info.jpeg.x = 0;
-                                raw_info.jpeg.width = raw_info.width;
-                            }
-
-                            if (lv_rec_footer.yRes != raw_info.height)
-                            {
-                                raw_info.height = lv_rec_footer.yRes;
-                                raw_info.active_area.y1 = 0;
-                                raw_info.active_area.y2 = raw_info.height;
-                                raw_info.jpeg.y = 0;
-                                raw_info.jpeg.height = raw_info.height;
-                            }
-
-                            /* call raw2dng code */
-                            if (fix_vert_stripes)
-                            {
-                                fix_vertical_stripes();
-                            }
-                            
-                            if (fix_cold_pixels)
+                            if(!dng_tables)
                             {
-                                find_and_fix_cold_pixels(fix_cold_pixels == 2);
+                                dng_tables = calloc(1, sizeof(chroma_tables_t));
+                                if(!dng_tables)
+                                {
+                                    print_msg(MSG_ERROR, "VIDF: Failed to allocate "FMT_SIZE" byte\n", sizeof(chroma_tables_t));
+                                    goto abort;
+                                }
                             }
 
-                            /* this is internal again */
-                            chroma_smooth(chroma_smooth_method, &raw_info);
-
-                            /* set MLV metadata into DNG tags */
-                            dng_set_framerate_rational(main_header.sourceFpsNom, main_header.sourceFpsDenom);
-                            dng_set_shutter(1, (int)(1000000.0f/(float)expo_info.shutterValue));
-                            dng_set_aperture(lens_info.aperture, 100);
-                            dng_set_camname((char*)unique_camname);
-                            dng_set_description((char*)info_string);
-                            dng_set_lensmodel((char*)lens_info.lensName);
-                            dng_set_focal(lens_info.focalLength, 1);
-                            dng_set_iso(expo_info.isoValue);
-
-                            //dng_set_wbgain(1024, wbal_info.wbgain_r, 1024, wbal_info.wbgain_g, 1024, wbal_info.wbgain_b);
-
-                            /* calculate the time this frame was taken at, i.e., the start time + the current timestamp. this can be off by a second but it's better than nothing */
-                            int ms = 0.5 + buf.timestamp / 1000.0;
-                            int sec = ms / 1000;
-                            ms %= 1000;
-                            // FIXME: the struct tm doesn't have tm_gmtoff on Linux so the result might be wrong?
-                            struct tm tm;
-                            tm.tm_sec = rtci_info.tm_sec + sec;
-                            tm.tm_min = rtci_info.tm_min;
-                            tm.tm_hour = rtci_info.tm_hour;
-                            tm.tm_mday = rtci_info.tm_mday;
-                            tm.tm_mon = rtci_info.tm_mon;
-                            tm.tm_year = rtci_info.tm_year;
-                            tm.tm_wday = rtci_info.tm_wday;
-                            tm.tm_yday = rtci_info.tm_yday;
-                            tm.tm_isdst = rtci_info.tm_isdst;
-
-                            if(mktime(&tm) != -1)
-                            {
-                                char datetime_str[32];
-                                char subsec_str[8];
-                                strftime(datetime_str, 20, "%Y:%m:%d %H:%M:%S", &tm);
-                                snprintf(subsec_str, sizeof(subsec_str), "%03d", ms);
-                                dng_set_datetime(datetime_str, subsec_str);
-                            }
-                            else
+                            dng_frame_t frame;
+                            frame.frame_buffer = frame_buffer;
+                            frame.frame_buffer_size = frame_buffer_size;
+                            frame.frame_size = frame_size;
+                            dng_frame_set_metadata(&frame, block_hdr.frameNumber, buf.timestamp, &main_header, &expo_info, &lens_info, &rtci_info, &idnt_info, unique_camname, info_string);
+                            dng_frame_set_raw_info(&frame, &lv_rec_footer);
+                            frame.compressed = compressed;
+                            frame.params = frame_params;
+                            frame.lj92_data = NULL;
+                            frame.lj92_size = 0;
+                            frame.lj92_buffer = dng_lj92_buffer;
+                            frame.lj92_buffer_size = dng_lj92_buffer_size;
+
+                            /* untouched LJ92 frames go into the DNG as they were read */
+                            if((compressed & MLV_VIDEO_CLASS_FLAG_LJ92) && !(main_header.videoClass & MLV_VIDEO_CLASS_FLAG_DELTA) && dng_frame_passthrough(&frame_params, &dng_options))
                             {
-                                // soemthing went wrong. let's proceed anyway
-                                print_msg(MSG_ERROR, "VIDF: [W] Failed calculating the DateTime from the timestamp\n");
-                                dng_set_datetime("", "");
+                                frame.lj92_data = frame_data;
+                                frame.lj92_size = prev_frame_size;
                             }
 
+                            dng_frame_correct(&frame, &dng_options, &dng_fix, NULL, 0, dng_tables);
 
-                            uint64_t serial = 0;
-                            char *end;
-                            serial = strtoull((char *)idnt_info.cameraSerial, &end, 16);
-                            if (serial && !*end)
+                            int lj92_error = dng_frame_compress(&frame, &dng_options);
+                            dng_lj92_buffer = frame.lj92_buffer;
+                            dng_lj92_buffer_size = frame.lj92_buffer_size;
+                            if(lj92_error)
                             {
-                                char serial_str[64];
-
-                                sprintf(serial_str, "%"PRIu64, serial);
-                                dng_set_camserial((char*)serial_str);
+                                goto abort;
                             }
 
                             /* finally save the DNG */
-                            if(!save_dng(frame_filename, &raw_info))
+                            if(dng_frame_save(&frame, frame_filename))
                             {
-                                print_msg(MSG_ERROR, "VIDF: Failed writing into .DNG file\n");
                                 goto abort;
                             }
 
@@ -2725,81 +5069,105 @@ read_headers:
 
                         if(mlv_output && !only_metadata_mode && !average_mode && (!extract_block || !strncasecmp(extract_block, (char*)block_hdr.blockType, 4)))
                         {
-                            if(compress_output)
+                            /* start the compression threads with the first frame, when the output depth is known */
+                            if(compress_output && frame_threads > 1)
                             {
-#ifdef MLV_USE_LZMA
-                                size_t lzma_out_size = 2 * frame_size;
-                                size_t lzma_in_size = frame_size;
-                                size_t lzma_props_size = LZMA_PROPS_SIZE;
-                                unsigned char *lzma_out = malloc(lzma_out_size + LZMA_PROPS_SIZE);
-
-                                int ret = LzmaCompress(
-                                    &lzma_out[LZMA_PROPS_SIZE], &lzma_out_size,
-                                    (unsigned char *)frame_buffer, lzma_in_size,
-                                    &lzma_out[0], &lzma_props_size,
-                                    lzma_level, lzma_dict, lzma_lc, lzma_lp, lzma_pb, lzma_fb, lzma_threads
-                                    );
-
-                                if(ret == SZ_OK)
+                                if(lua_state)
                                 {
-                                    /* store original frame size */
-                                    *(uint32_t *)frame_buffer = frame_size;
-
-                                    /* set new compressed size and copy buffers */
-                                    frame_size = lzma_out_size + LZMA_PROPS_SIZE + 4;
-                                    memcpy(&frame_buffer[4], lzma_out, frame_size - 4);
+                                    print_msg(MSG_INFO, "Multi-threaded compression is not possible with Lua scripts, using one thread\n");
+                                }
+                                else
+                                {
+                                    compress_options.width = video_xRes;
+                                    compress_options.height = video_yRes;
+                                    compress_options.depth = current_depth;
 
-                                    if(verbose)
+                                    compress_pipeline = compress_pipeline_start(frame_threads, &compress_options, out_file, verbose);
+                                    if(!compress_pipeline)
                                     {
-                                        print_msg(MSG_INFO, "    LZMA: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", lzma_in_size, frame_size, ((float)lzma_out_size * 100.0f) / (float)lzma_in_size);
+                                        print_msg(MSG_ERROR, "Failed to start compression threads, using one thread\n");
                                     }
                                 }
-                                else
+                                frame_threads = 1;
+                            }
+
+                            if(compress_pipeline)
+                            {
+                                /* the writer thread appends the block once the frame is compressed */
+                                compress_slot_t *slot = compress_pipeline_get_frame(compress_pipeline);
+
+                                if(!slot || frame_buffer_reserve(&slot->frame_buffer, &slot->frame_buffer_size, frame_size))
                                 {
-                                    print_msg(MSG_INFO, "    LZMA: Failed (%d)\n", ret);
                                     goto abort;
                                 }
-                                free(lzma_out);
-#else
-                                print_msg(MSG_INFO, "    LZMA: not compiled into this release, aborting.\n");
-                                goto abort;
-#endif
+                                memcpy(slot->frame_buffer, frame_buffer, frame_size);
+                                slot->frame_size = frame_size;
+                                slot->read_size = prev_frame_size;
+                                slot->block_hdr = block_hdr;
+                                slot->block_hdr.frameNumber -= frame_start;
+                                compress_pipeline_submit(compress_pipeline);
                             }
-
-                            if(frame_size != prev_frame_size)
+                            else
                             {
-                                print_msg(MSG_INFO, "  saving: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", prev_frame_size, frame_size, ((float)frame_size * 100.0f) / (float)prev_frame_size);
-                            }
+                                if(compress_output)
+                                {
+                                    uint8_t *compressed = NULL;
+                                    uint32_t compressed_size = 0;
 
-                            lua_handle_hdr_data(lua_state, buf.blockType, "_data_write_mlv", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
+                                    compress_options.width = video_xRes;
+                                    compress_options.height = video_yRes;
+                                    compress_options.depth = current_depth;
 
-                            /* delete free space and correct header size if needed */
-                            block_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size;
-                            block_hdr.frameSpace = 0;
-                            block_hdr.frameNumber -= frame_start;
+                                    if(frame_compress(frame_buffer, frame_size, &compressed, &compressed_size, &frame_size, &compress_options, verbose))
+                                    {
+                                        free(compressed);
+                                        goto abort;
+                                    }
 
-                            if(fwrite(&block_hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1)
-                            {
-                                print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
-                                goto abort;
-                            }
-                            if(fwrite(frame_buffer, frame_size, 1, out_file) != 1)
-                            {
-                                print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
-                                goto abort;
+                                    if(frame_buffer_reserve(&frame_buffer, &frame_buffer_size, frame_size))
+                                    {
+                                        free(compressed);
+                                        goto abort;
+                                    }
+                                    memcpy(frame_buffer, compressed, frame_size);
+                                    free(compressed);
+                                }
+
+                                if(frame_size != prev_frame_size)
+                                {
+                                    print_msg(MSG_INFO, "  saving: "FMT_SIZE" -> "FMT_SIZE"  (%2.2f%%)\n", prev_frame_size, frame_size, ((float)frame_size * 100.0f) / (float)prev_frame_size);
+                                }
+
+                                lua_handle_hdr_data(lua_state, buf.blockType, "_data_write_mlv", &block_hdr, sizeof(block_hdr), frame_buffer, frame_size);
+
+                                /* delete free space and correct header size if needed */
+                                block_hdr.blockSize = sizeof(mlv_vidf_hdr_t) + frame_size;
+                                block_hdr.frameSpace = 0;
+                                block_hdr.frameNumber -= frame_start;
+
+                                if(fwrite(&block_hdr, sizeof(mlv_vidf_hdr_t), 1, out_file) != 1)
+                                {
+                                    print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
+                                    goto abort;
+                                }
+                                if(fwrite(frame_buffer, frame_size, 1, out_file) != 1)
+                                {
+                                    print_msg(MSG_ERROR, "VIDF: Failed writing into .MLV file\n");
+                                    goto abort;
+                                }
                             }
                         }
                     }
                 }
                 else
                 {
-                    file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                    mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
                     
                     /* we can correct that frame by fixing frame space */
                     if(fix_bug == BUG_ID_BLOCKSIZE_WRONG && fix_bug_1_offset != 0)
                     {
                         print_msg(MSG_INFO, "BUG_ID_BLOCKSIZE_WRONG: Seeking %d byte\n", fix_bug_1_offset);
-                        file_set_pos(in_file, fix_bug_1_offset, SEEK_CUR);
+                        mlv_reader_seek(in_reader, fix_bug_1_offset, SEEK_CUR);
                         fix_bug_1_offset = 0;
                     }
                 }
@@ -2812,14 +5180,14 @@ read_headers:
             {
                 uint32_t hdr_size = MIN(sizeof(mlv_lens_hdr_t), buf.blockSize);
 
-                if(fread(&lens_info, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &lens_info, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + lens_info.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + lens_info.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &lens_info, sizeof(lens_info));
 
@@ -2852,7 +5220,7 @@ read_headers:
                 mlv_info_hdr_t block_hdr;
                 int32_t hdr_size = MIN(sizeof(mlv_info_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
@@ -2867,7 +5235,7 @@ read_headers:
                 {
                     char *buf = malloc(str_length + 1);
 
-                    if(fread(buf, str_length, 1, in_file) != 1)
+                    if(mlv_reader_read(in_reader, buf, str_length) != 1)
                     {
                         free(buf);
                         print_msg(MSG_ERROR, "File ends in the middle of a block\n");
@@ -2909,7 +5277,7 @@ read_headers:
                 mlv_debg_hdr_t block_hdr;
                 int32_t hdr_size = MIN(sizeof(mlv_debg_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
@@ -2924,7 +5292,7 @@ read_headers:
                 {
                     char *buf = malloc(str_length + 1);
 
-                    if(fread(buf, str_length, 1, in_file) != 1)
+                    if(mlv_reader_read(in_reader, buf, str_length) != 1)
                     {
                         free(buf);
                         print_msg(MSG_ERROR, "File ends in the middle of a block\n");
@@ -2972,7 +5340,7 @@ read_headers:
                 mlv_vers_hdr_t block_hdr;
                 int32_t hdr_size = MIN(sizeof(mlv_vers_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
@@ -2987,7 +5355,7 @@ read_headers:
                 {
                     char *buf = malloc(str_length + 1);
 
-                    if(fread(buf, str_length, 1, in_file) != 1)
+                    if(mlv_reader_read(in_reader, buf, str_length) != 1)
                     {
                         free(buf);
                         print_msg(MSG_ERROR, "File ends in the middle of a block\n");
@@ -3027,14 +5395,14 @@ read_headers:
                 mlv_elvl_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_elvl_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &block_hdr, sizeof(block_hdr));
 
@@ -3060,14 +5428,14 @@ read_headers:
                 mlv_styl_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_styl_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &block_hdr, sizeof(block_hdr));
 
@@ -3095,14 +5463,14 @@ read_headers:
             {
                 uint32_t hdr_size = MIN(sizeof(mlv_wbal_hdr_t), buf.blockSize);
 
-                if(fread(&wbal_info, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &wbal_info, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + wbal_info.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + wbal_info.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &wbal_info, sizeof(wbal_info));
 
@@ -3132,14 +5500,14 @@ read_headers:
             {
                 uint32_t hdr_size = MIN(sizeof(mlv_idnt_hdr_t), buf.blockSize);
 
-                if(fread(&idnt_info, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &idnt_info, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + idnt_info.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + idnt_info.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &idnt_info, sizeof(idnt_info));
 
@@ -3171,14 +5539,14 @@ read_headers:
             {
                 uint32_t hdr_size = MIN(sizeof(mlv_rtci_hdr_t), buf.blockSize);
 
-                if(fread(&rtci_info, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &rtci_info, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + rtci_info.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + rtci_info.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &rtci_info, sizeof(rtci_info));
 
@@ -3208,14 +5576,14 @@ read_headers:
                 mlv_mark_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_mark_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &block_hdr, sizeof(block_hdr));
 
@@ -3239,14 +5607,14 @@ read_headers:
             {
                 uint32_t hdr_size = MIN(sizeof(mlv_expo_hdr_t), buf.blockSize);
 
-                if(fread(&expo_info, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &expo_info, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + expo_info.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + expo_info.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &expo_info, sizeof(expo_info));
 
@@ -3275,14 +5643,14 @@ read_headers:
                 mlv_rawi_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_rawi_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
                 
                 if(black_fix)
                 {
@@ -3346,14 +5714,14 @@ read_headers:
                 mlv_rawc_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_rawc_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
                 
                 lua_handle_hdr(lua_state, buf.blockType, &block_hdr, sizeof(block_hdr));
 
@@ -3367,14 +5735,14 @@ read_headers:
                 mlv_wavi_hdr_t block_hdr;
                 uint32_t hdr_size = MIN(sizeof(mlv_wavi_hdr_t), buf.blockSize);
 
-                if(fread(&block_hdr, hdr_size, 1, in_file) != 1)
+                if(mlv_reader_read(in_reader, &block_hdr, hdr_size) != 1)
                 {
                     print_msg(MSG_ERROR, "File ends in the middle of a block\n");
                     goto abort;
                 }
 
                 /* skip remaining data, if there is any */
-                file_set_pos(in_file, position + block_hdr.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + block_hdr.blockSize, SEEK_SET);
 
                 lua_handle_hdr(lua_state, buf.blockType, &block_hdr, sizeof(block_hdr));
 
@@ -3460,11 +5828,11 @@ read_headers:
             }
             else if(!memcmp(buf.blockType, "NULL", 4))
             {
-                file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + buf.blockSize, SEEK_SET);
             }
             else if(!memcmp(buf.blockType, "BKUP", 4))
             {
-                file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+                mlv_reader_seek(in_reader, position + buf.blockSize, SEEK_SET);
             }
             else
             {
@@ -3481,9 +5849,9 @@ read_headers:
                     
                     for(uint32_t offset = 0; offset < range; offset++)
                     {
-                        file_set_pos(in_file, position, SEEK_SET);
+                        mlv_reader_seek(in_reader, position, SEEK_SET);
                         
-                        if(fread(&type, 4, 1, in_file) != 1)
+                        if(mlv_reader_read(in_reader, &type, 4) != 1)
                         {
                             print_msg(MSG_ERROR, "BUG_ID_BLOCKSIZE_WRONG: Failed to read from source file\n");
                             goto abort;
@@ -3493,7 +5861,7 @@ read_headers:
                         {
                             fix_bug_1_offset = -(offset - range / 2);
                             print_msg(MSG_INFO, "BUG_ID_BLOCKSIZE_WRONG: Success, offset: %d bytes.\n", fix_bug_1_offset);
-                            file_set_pos(in_file, position_previous, SEEK_SET);
+                            mlv_reader_seek(in_reader, position_previous, SEEK_SET);
                             position = position_previous;
                             break;
                         }
@@ -3507,7 +5875,7 @@ read_headers:
                 }
                 else
                 {
-                    file_set_pos(in_file, position + buf.blockSize, SEEK_SET);
+                    mlv_reader_seek(in_reader, position + buf.blockSize, SEEK_SET);
 
                     lua_handle_hdr(lua_state, buf.blockType, "", 0);
                 }
@@ -3530,19 +5898,37 @@ read_headers:
         
         position_previous = position;
     }
-    while(!feof(in_file));
+    while(!mlv_reader_eof(in_reader));
 
 abort:
 
+    /* wait for the DNG threads to write all queued frames */
+    if(dng_pipeline && dng_pipeline_finish(dng_pipeline))
+    {
+        print_msg(MSG_ERROR, "Failed to export all DNG frames\n");
+    }
+
+    /* same for the compression threads, the frame count and header are written below */
+    if(compress_pipeline && compress_pipeline_finish(compress_pipeline))
+    {
+        print_msg(MSG_ERROR, "Failed to write all compressed frames\n");
+    }
+
     print_msg(MSG_INFO, "Processed %d video frames\n", vidf_frames_processed);
 
     /* in average mode, finalize average calculation and output the resulting average */
     if(average_mode)
     {
+        uint16_t *dst_line = malloc(video_xRes * sizeof(uint16_t));
+
         if(!average_samples)
         {
             print_msg(MSG_ERROR, "Number of averaged frames is zero. Cannot continue.\n");
         }
+        else if(!dst_line)
+        {
+            print_msg(MSG_ERROR, "Failed to allocate line buffer\n");
+        }
         else
         {
             int new_pitch = video_xRes * lv_rec_footer.raw_info.bits_per_pixel / 8;
@@ -3586,14 +5972,14 @@ abort:
             
             for(int y = 0; y < video_yRes; y++)
             {
-                uint16_t *dst_line = (uint16_t *)&frame_buffer[y * new_pitch];
                 for(int x = 0; x < video_xRes; x++)
                 {
                     uint32_t value = frame_arith_buffer[y * video_xRes + x];
 
                     value /= average_samples;
-                    bitinsert(dst_line, x, lv_rec_footer.raw_info.bits_per_pixel, value);
+                    dst_line[x] = value;
                 }
+                raw_pack_row(dst_line, &frame_buffer[y * new_pitch], video_xRes, lv_rec_footer.raw_info.bits_per_pixel);
             }
             
 
@@ -3616,6 +6002,8 @@ abort:
                 print_msg(MSG_ERROR, "Failed writing average frame data into .MLV file\n");
             }
         }
+
+        free(dst_line);
     }
 
     if(raw_output)
@@ -3632,9 +6020,15 @@ abort:
 
     if(xref_mode)
     {
-        print_msg(MSG_INFO, "XREF table contains %d entries\n", frame_xref_entries);
-        xref_sort(frame_xref_table, frame_xref_entries);
-        save_index(input_filename, &main_header, in_file_count, frame_xref_table, frame_xref_entries);
+        print_msg(MSG_INFO, "XREF table contains %d entries\n", frame_index.entry_count);
+        if(mlv_index_sort(&frame_index))
+        {
+            print_msg(MSG_ERROR, "Failed to sort XREF table\n");
+        }
+        else
+        {
+            save_index(input_filename, &main_header, in_file_count, &frame_index);
+        }
     }
 
     /* fix frame count */
@@ -3654,6 +6048,7 @@ abort:
         
         main_header.videoFrameCount = vidf_frames_processed;
         main_header.audioFrameCount = audf_frames_processed;
+        main_header.videoClass = output_video_class;
 
         fseek(out_file, 0L, SEEK_SET);
         
@@ -3664,12 +6059,9 @@ abort:
     }
     
     
-    /* free list of input files */
-    for(in_file_num = 0; in_file_num < in_file_count; in_file_num++)
-    {
-        fclose(in_files[in_file_num]);
-    }
-    free(in_files);
+    /* unmap and close input files */
+    mlv_reader_close(in_reader);
+    mlv_index_free(&frame_index);
 
     if(out_file)
     {
@@ -3702,6 +6094,15 @@ abort:
     free(prev_frame_buffer);
     free(frame_arith_buffer);
     free(block_xref);
+    chroma_tables_free(dng_tables);
+    free(dng_lj92_buffer);
+    raw_fix_free(&dng_fix);
+#ifdef USE_LUA
+    if(lua_state)
+    {
+        lua_close(lua_state);
+    }
+#endif
 
     print_msg(MSG_INFO, "Done\n");
     print_msg(MSG_INFO, "\n");
@@ -0,0 +1,322 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef MODULE
+
+#include <dryos.h>
+
+#else
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#endif
+
+/* common includes */
+#include <string.h>
+#include <raw.h>
+
+#include "mlv.h"
+#include "mlv_index.h"
+
+void mlv_index_init(mlv_index_t *index)
+{
+    memset(index, 0x00, sizeof(mlv_index_t));
+}
+
+void mlv_index_free(mlv_index_t *index)
+{
+    free(index->entries);
+    free(index->vidf);
+    mlv_index_init(index);
+}
+
+static int mlv_index_append(mlv_index_t *index, frame_xref_t *entry)
+{
+    /* grow geometrically, so building the index stays linear */
+    if(index->entry_count >= index->allocated)
+    {
+        uint32_t allocated = index->allocated ? index->allocated * 2 : 1024;
+        frame_xref_t *entries = realloc(index->entries, allocated * sizeof(frame_xref_t));
+
+        if(!entries)
+        {
+            return 1;
+        }
+        index->entries = entries;
+        index->allocated = allocated;
+    }
+
+    /* as long as blocks come in timestamp order, there is nothing to sort */
+    if(index->sorted_count == index->entry_count && (!index->entry_count || index->entries[index->entry_count - 1].frameTime <= entry->frameTime))
+    {
+        index->sorted_count++;
+    }
+
+    index->entries[index->entry_count++] = *entry;
+    return 0;
+}
+
+int mlv_index_add(mlv_index_t *index, const mlv_hdr_t *hdr, uint16_t file_number, uint64_t offset)
+{
+    frame_xref_t entry;
+
+    /* dont index NULL blocks and backups */
+    if(!memcmp(hdr->blockType, "NULL", 4) || !memcmp(hdr->blockType, "BKUP", 4))
+    {
+        return 0;
+    }
+
+    memset(&entry, 0x00, sizeof(frame_xref_t));
+    entry.frameOffset = offset;
+    entry.fileNumber = file_number;
+    entry.frameType = MLV_FRAME_UNSPECIFIED;
+
+    /* file headers have no timestamp (the field holds the version string), so they sort to the beginning */
+    if(memcmp(hdr->blockType, "MLVI", 4))
+    {
+        entry.frameTime = hdr->timestamp;
+    }
+
+    if(!memcmp(hdr->blockType, "VIDF", 4))
+    {
+        entry.frameType = MLV_FRAME_VIDF;
+    }
+    else if(!memcmp(hdr->blockType, "AUDF", 4))
+    {
+        entry.frameType = MLV_FRAME_AUDF;
+    }
+
+    /* VIDF and AUDF both have the frame number right behind the common header */
+    if(entry.frameType != MLV_FRAME_UNSPECIFIED && hdr->blockSize >= sizeof(mlv_hdr_t) + sizeof(uint32_t))
+    {
+        entry.frameNumber = ((const mlv_vidf_hdr_t *)hdr)->frameNumber;
+    }
+
+    return mlv_index_append(index, &entry);
+}
+
+/* returns the end of the ascending run that starts at pos */
+static uint32_t mlv_index_run_end(frame_xref_t *table, uint32_t pos, uint32_t count)
+{
+    pos++;
+    while(pos < count && table[pos - 1].frameTime <= table[pos].frameTime)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+/* stable merge, on equal timestamps the entry from the first run goes first */
+static void mlv_index_merge(frame_xref_t *dst, frame_xref_t *a, uint32_t a_count, frame_xref_t *b, uint32_t b_count)
+{
+    while(a_count && b_count)
+    {
+        if(b->frameTime < a->frameTime)
+        {
+            *dst++ = *b++;
+            b_count--;
+        }
+        else
+        {
+            *dst++ = *a++;
+            a_count--;
+        }
+    }
+    memcpy(dst, a, a_count * sizeof(frame_xref_t));
+    memcpy(dst + a_count, b, b_count * sizeof(frame_xref_t));
+}
+
+static int mlv_index_update_vidf(mlv_index_t *index)
+{
+    uint32_t *vidf = realloc(index->vidf, (index->entry_count + 1) * sizeof(uint32_t));
+
+    if(!vidf)
+    {
+        return 1;
+    }
+
+    index->vidf = vidf;
+    index->vidf_count = 0;
+
+    for(uint32_t entry = 0; entry < index->entry_count; entry++)
+    {
+        if(index->entries[entry].frameType == MLV_FRAME_VIDF)
+        {
+            index->vidf[index->vidf_count++] = entry;
+        }
+    }
+
+    return 0;
+}
+
+int mlv_index_sort(mlv_index_t *index)
+{
+    uint32_t count = index->entry_count;
+
+    if(index->sorted_count < count)
+    {
+        /* natural merge sort: the sorted part is the first run, appended blocks are mostly in order too */
+        frame_xref_t *tmp = malloc(count * sizeof(frame_xref_t));
+        frame_xref_t *src = index->entries;
+        frame_xref_t *dst = tmp;
+
+        if(!tmp)
+        {
+            return 1;
+        }
+
+        while(1)
+        {
+            uint32_t runs = 0;
+            uint32_t pos = 0;
+
+            while(pos < count)
+            {
+                uint32_t mid = mlv_index_run_end(src, pos, count);
+                uint32_t end = mid < count ? mlv_index_run_end(src, mid, count) : count;
+
+                mlv_index_merge(&dst[pos], &src[pos], mid - pos, &src[mid], end - mid);
+                pos = end;
+                runs++;
+            }
+
+            frame_xref_t *swap = src;
+            src = dst;
+            dst = swap;
+
+            if(runs <= 1)
+            {
+                break;
+            }
+        }
+
+        if(src != index->entries)
+        {
+            memcpy(index->entries, src, count * sizeof(frame_xref_t));
+        }
+        free(tmp);
+
+        index->sorted_count = count;
+    }
+
+    return mlv_index_update_vidf(index);
+}
+
+int32_t mlv_index_find_frame(mlv_index_t *index, uint32_t frame_number)
+{
+    /* usually frame n is the n-th video frame, unless some were skipped */
+    if(frame_number < index->vidf_count && index->entries[index->vidf[frame_number]].frameNumber == frame_number)
+    {
+        return index->vidf[frame_number];
+    }
+
+    /* frame numbers increase with time, so search for it */
+    uint32_t low = 0;
+    uint32_t high = index->vidf_count;
+
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if(index->entries[index->vidf[mid]].frameNumber < frame_number)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if(low < index->vidf_count && index->entries[index->vidf[low]].frameNumber == frame_number)
+    {
+        return index->vidf[low];
+    }
+
+    return -1;
+}
+
+int32_t mlv_index_find_time(mlv_index_t *index, uint64_t timestamp)
+{
+    uint32_t low = 0;
+    uint32_t high = index->sorted_count;
+
+    while(low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if(index->entries[mid].frameTime < timestamp)
+        {
+            low = mid + 1;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low < index->sorted_count ? (int32_t)low : -1;
+}
+
+mlv_xref_hdr_t *mlv_index_get_xref(mlv_index_t *index)
+{
+    uint32_t size = sizeof(mlv_xref_hdr_t) + index->entry_count * sizeof(mlv_xref_t);
+    mlv_xref_hdr_t *hdr = malloc(size);
+
+    if(!hdr)
+    {
+        return NULL;
+    }
+
+    memset(hdr, 0x00, size);
+    memcpy(hdr->blockType, "XREF", 4);
+    hdr->blockSize = size;
+    hdr->entryCount = index->entry_count;
+
+    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t *)hdr)[sizeof(mlv_xref_hdr_t)]);
+
+    for(uint32_t entry = 0; entry < index->entry_count; entry++)
+    {
+        xrefs[entry].frameOffset = index->entries[entry].frameOffset;
+        xrefs[entry].fileNumber = index->entries[entry].fileNumber;
+        xrefs[entry].frameType = index->entries[entry].frameType;
+    }
+
+    return hdr;
+}
+
+int mlv_index_load_xref(mlv_index_t *index, mlv_xref_hdr_t *xref, mlv_index_read_t read_block, void *ctx)
+{
+    mlv_xref_t *xrefs = (mlv_xref_t *)&(((uint8_t *)xref)[sizeof(mlv_xref_hdr_t)]);
+
+    for(uint32_t entry = 0; entry < xref->entryCount; entry++)
+    {
+        const mlv_hdr_t *hdr = read_block(ctx, xrefs[entry].fileNumber, xrefs[entry].frameOffset);
+
+        if(!hdr || mlv_index_add(index, hdr, xrefs[entry].fileNumber, xrefs[entry].frameOffset))
+        {
+            return 1;
+        }
+    }
+
+    return mlv_index_sort(index);
+}
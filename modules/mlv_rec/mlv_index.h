@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_index_h_
+#define _mlv_index_h_
+
+/**
+ * Block index of a (multi-chunk) MLV recording, as stored in the .IDX file (MLVI + XREF block).
+ * Used by mlv_dump on the host and by mlv_play in camera, so it does no file I/O on its own.
+ *
+ * Blocks are added in a single pass over the chunks, in any order. mlv_index_sort() puts them
+ * in timestamp order; it only sorts what was appended since the last call and merges that into
+ * the already sorted part, so more blocks (e.g. another chunk) can be added later on.
+ * Blocks with the same timestamp keep the order they were added in, so the file headers stay
+ * in front. After sorting, video frames can be looked up by frame number or timestamp.
+ */
+
+/* this structure is used to build the mlv_xref_t table */
+typedef struct
+{
+    uint64_t    frameTime;
+    uint64_t    frameOffset;
+    uint16_t    fileNumber;
+    uint16_t    frameType;
+    uint32_t    frameNumber;    /* only valid for VIDF/AUDF */
+} frame_xref_t;
+
+typedef struct
+{
+    frame_xref_t *entries;
+    uint32_t entry_count;
+    uint32_t allocated;
+
+    /* entries[0..sorted_count) are in timestamp order */
+    uint32_t sorted_count;
+
+    /* entry numbers of all VIDF blocks in timestamp order, updated by mlv_index_sort() */
+    uint32_t *vidf;
+    uint32_t vidf_count;
+} mlv_index_t;
+
+/* returns the header of the block at offset in the given chunk (for VIDF/AUDF including the frame number), NULL on error */
+typedef const mlv_hdr_t *(*mlv_index_read_t)(void *ctx, uint16_t file_number, uint64_t offset);
+
+void mlv_index_init(mlv_index_t *index);
+void mlv_index_free(mlv_index_t *index);
+
+/* add the block hdr stored at offset of chunk file_number. NULL and BKUP blocks are not indexed.
+   for VIDF/AUDF blocks, hdr must contain the frame number that follows the common header. returns 0 on success */
+int mlv_index_add(mlv_index_t *index, const mlv_hdr_t *hdr, uint16_t file_number, uint64_t offset);
+
+/* sort the blocks added since the last call into the index. returns 0 on success */
+int mlv_index_sort(mlv_index_t *index);
+
+/* entry number of the video frame with given number or of the first block at or after timestamp, -1 if there is none */
+int32_t mlv_index_find_frame(mlv_index_t *index, uint32_t frame_number);
+int32_t mlv_index_find_time(mlv_index_t *index, uint64_t timestamp);
+
+/* build the XREF block for the .IDX file from the sorted index. the caller has to free it */
+mlv_xref_hdr_t *mlv_index_get_xref(mlv_index_t *index);
+
+/* fill the index from a XREF block loaded from a .IDX file. those don't store timestamps or frame numbers, so read_block is used to get them */
+int mlv_index_load_xref(mlv_index_t *index, mlv_xref_hdr_t *xref, mlv_index_read_t read_block, void *ctx);
+
+#endif
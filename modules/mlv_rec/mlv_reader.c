@@ -0,0 +1,436 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* system includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__WIN32)
+#include <windows.h>
+#else
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "mlv_reader.h"
+
+/* helper macros */
+#define MAX(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/* on 32 bit hosts only a window of every chunk is mapped, as the address space is too small for whole chunks */
+/* both can be overridden, e.g. to test the windowed mapping on a 64 bit host (contrib/mlv_reader_test) */
+#ifndef MLV_READER_WINDOWED
+#define MLV_READER_WINDOWED (sizeof(void *) < 8)
+#endif
+
+#ifndef MLV_READER_WINDOW
+#define MLV_READER_WINDOW (64 * 1024 * 1024)
+#endif
+
+typedef struct
+{
+    char *name;
+    uint64_t size;
+#if defined(__WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+
+    /* currently mapped range */
+    uint8_t *view;
+    uint64_t view_offset;
+    uint64_t view_size;
+} mlv_reader_chunk_t;
+
+struct mlv_reader
+{
+    int chunk_count;
+    mlv_reader_chunk_t *chunks;
+    uint64_t granularity;
+
+    /* cursor */
+    int chunk;
+    uint64_t offset;
+    int eof;
+};
+
+static void mlv_reader_unmap(mlv_reader_chunk_t *chunk)
+{
+    if(!chunk->view)
+    {
+        return;
+    }
+
+#if defined(__WIN32)
+    UnmapViewOfFile(chunk->view);
+#else
+    munmap(chunk->view, chunk->view_size);
+#endif
+
+    chunk->view = NULL;
+    chunk->view_offset = 0;
+    chunk->view_size = 0;
+}
+
+static int mlv_reader_open_chunk(mlv_reader_chunk_t *chunk, const char *filename)
+{
+    memset(chunk, 0x00, sizeof(mlv_reader_chunk_t));
+
+#if defined(__WIN32)
+    LARGE_INTEGER size;
+
+    chunk->file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if(chunk->file == INVALID_HANDLE_VALUE)
+    {
+        return 1;
+    }
+
+    if(!GetFileSizeEx(chunk->file, &size))
+    {
+        CloseHandle(chunk->file);
+        return 1;
+    }
+    chunk->size = size.QuadPart;
+
+    /* empty files can't be mapped, but they are valid chunks without any data */
+    if(chunk->size)
+    {
+        chunk->mapping = CreateFileMapping(chunk->file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(!chunk->mapping)
+        {
+            CloseHandle(chunk->file);
+            return 1;
+        }
+    }
+#else
+    struct stat st;
+
+    chunk->fd = open(filename, O_RDONLY);
+    if(chunk->fd < 0)
+    {
+        return 1;
+    }
+
+    if(fstat(chunk->fd, &st))
+    {
+        close(chunk->fd);
+        return 1;
+    }
+    chunk->size = st.st_size;
+#endif
+
+    chunk->name = malloc(strlen(filename) + 1);
+    strcpy(chunk->name, filename);
+
+    return 0;
+}
+
+static void mlv_reader_close_chunk(mlv_reader_chunk_t *chunk)
+{
+    mlv_reader_unmap(chunk);
+
+#if defined(__WIN32)
+    if(chunk->mapping)
+    {
+        CloseHandle(chunk->mapping);
+    }
+    CloseHandle(chunk->file);
+#else
+    close(chunk->fd);
+#endif
+
+    free(chunk->name);
+}
+
+mlv_reader_t *mlv_reader_open(const char *filename, int max_chunks)
+{
+    int max_name_len = strlen(filename) + 16;
+    char *chunk_name = malloc(max_name_len);
+    mlv_reader_t *reader = calloc(1, sizeof(mlv_reader_t));
+
+    max_chunks = MAX(1, MIN(max_chunks, MLV_READER_MAX_CHUNKS));
+
+    if(!chunk_name || !reader)
+    {
+        free(chunk_name);
+        free(reader);
+        return NULL;
+    }
+
+    reader->chunks = calloc(max_chunks, sizeof(mlv_reader_chunk_t));
+    if(!reader->chunks)
+    {
+        free(chunk_name);
+        free(reader);
+        return NULL;
+    }
+
+    /* views have to start on a multiple of the allocation granularity */
+#if defined(__WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    reader->granularity = info.dwAllocationGranularity;
+#else
+    reader->granularity = sysconf(_SC_PAGESIZE);
+#endif
+
+    strcpy(chunk_name, filename);
+
+    while(reader->chunk_count < max_chunks)
+    {
+        /* the first chunk is the file itself, then try M00, M01 etc */
+        if(reader->chunk_count > 0)
+        {
+            if(strlen(chunk_name) < 2)
+            {
+                break;
+            }
+            sprintf(&chunk_name[strlen(chunk_name) - 2], "%02d", reader->chunk_count - 1);
+        }
+
+        if(mlv_reader_open_chunk(&reader->chunks[reader->chunk_count], chunk_name))
+        {
+            break;
+        }
+        reader->chunk_count++;
+    }
+
+    free(chunk_name);
+
+    if(!reader->chunk_count)
+    {
+        free(reader->chunks);
+        free(reader);
+        return NULL;
+    }
+
+    return reader;
+}
+
+void mlv_reader_close(mlv_reader_t *reader)
+{
+    if(!reader)
+    {
+        return;
+    }
+
+    for(int chunk = 0; chunk < reader->chunk_count; chunk++)
+    {
+        mlv_reader_close_chunk(&reader->chunks[chunk]);
+    }
+
+    free(reader->chunks);
+    free(reader);
+}
+
+int mlv_reader_chunk_count(mlv_reader_t *reader)
+{
+    return reader->chunk_count;
+}
+
+const char *mlv_reader_chunk_name(mlv_reader_t *reader, int chunk)
+{
+    if(chunk < 0 || chunk >= reader->chunk_count)
+    {
+        return NULL;
+    }
+    return reader->chunks[chunk].name;
+}
+
+uint64_t mlv_reader_chunk_size(mlv_reader_t *reader, int chunk)
+{
+    if(chunk < 0 || chunk >= reader->chunk_count)
+    {
+        return 0;
+    }
+    return reader->chunks[chunk].size;
+}
+
+const void *mlv_reader_map(mlv_reader_t *reader, int chunk_num, uint64_t offset, uint32_t size)
+{
+    if(chunk_num < 0 || chunk_num >= reader->chunk_count)
+    {
+        return NULL;
+    }
+
+    mlv_reader_chunk_t *chunk = &reader->chunks[chunk_num];
+
+    /* zero sized requests still need a valid pointer, so they must point into the file */
+    if(offset >= chunk->size || size > chunk->size - offset)
+    {
+        return NULL;
+    }
+
+    /* already mapped? */
+    if(chunk->view && offset >= chunk->view_offset && offset + size <= chunk->view_offset + chunk->view_size)
+    {
+        return chunk->view + (offset - chunk->view_offset);
+    }
+
+    mlv_reader_unmap(chunk);
+
+    /* either map the whole file or a window starting at the requested position */
+    uint64_t view_offset = 0;
+    uint64_t view_size = chunk->size;
+
+    if(MLV_READER_WINDOWED)
+    {
+        view_offset = offset - (offset % reader->granularity);
+        view_size = MAX((uint64_t)MLV_READER_WINDOW, offset - view_offset + size);
+        view_size = MIN(view_size, chunk->size - view_offset);
+    }
+
+#if defined(__WIN32)
+    chunk->view = MapViewOfFile(chunk->mapping, FILE_MAP_READ, (DWORD)(view_offset >> 32), (DWORD)view_offset, (SIZE_T)view_size);
+    if(!chunk->view)
+    {
+        return NULL;
+    }
+#else
+    void *view = mmap(NULL, view_size, PROT_READ, MAP_SHARED, chunk->fd, view_offset);
+    if(view == MAP_FAILED)
+    {
+        return NULL;
+    }
+    chunk->view = view;
+#endif
+
+    chunk->view_offset = view_offset;
+    chunk->view_size = view_size;
+
+    return chunk->view + (offset - chunk->view_offset);
+}
+
+const mlv_hdr_t *mlv_reader_block(mlv_reader_t *reader, int chunk, uint64_t offset)
+{
+    const mlv_hdr_t *hdr = mlv_reader_map(reader, chunk, offset, sizeof(mlv_hdr_t));
+
+    if(!hdr || hdr->blockSize < sizeof(mlv_hdr_t))
+    {
+        return NULL;
+    }
+
+    /* remapping may move the block, so map again with the full size */
+    return mlv_reader_map(reader, chunk, offset, hdr->blockSize);
+}
+
+int mlv_reader_select(mlv_reader_t *reader, int chunk)
+{
+    if(chunk < 0 || chunk >= reader->chunk_count)
+    {
+        return -1;
+    }
+
+    reader->chunk = chunk;
+    reader->offset = 0;
+    reader->eof = 0;
+
+    return 0;
+}
+
+int mlv_reader_seek(mlv_reader_t *reader, int64_t offset, int whence)
+{
+    uint64_t base = 0;
+
+    switch(whence)
+    {
+        case SEEK_SET:
+            base = 0;
+            break;
+        case SEEK_CUR:
+            base = reader->offset;
+            break;
+        case SEEK_END:
+            base = reader->chunks[reader->chunk].size;
+            break;
+        default:
+            return -1;
+    }
+
+    if(offset < 0 && (uint64_t)-offset > base)
+    {
+        return -1;
+    }
+
+    reader->offset = base + offset;
+    reader->eof = 0;
+
+    return 0;
+}
+
+uint64_t mlv_reader_tell(mlv_reader_t *reader)
+{
+    return reader->offset;
+}
+
+int mlv_reader_eof(mlv_reader_t *reader)
+{
+    return reader->eof;
+}
+
+const void *mlv_reader_get(mlv_reader_t *reader, uint32_t size)
+{
+    uint64_t chunk_size = reader->chunks[reader->chunk].size;
+    const void *data = NULL;
+
+    if(reader->offset < chunk_size && size <= chunk_size - reader->offset)
+    {
+        data = mlv_reader_map(reader, reader->chunk, reader->offset, size);
+    }
+
+    if(!data)
+    {
+        /* like fread, a short read leaves the position at the end of the file */
+        reader->offset = MAX(reader->offset, chunk_size);
+        reader->eof = 1;
+        return NULL;
+    }
+
+    reader->offset += size;
+    return data;
+}
+
+int mlv_reader_read(mlv_reader_t *reader, void *dst, uint32_t size)
+{
+    const void *data = mlv_reader_get(reader, size);
+
+    if(!data)
+    {
+        return 0;
+    }
+
+    memcpy(dst, data, size);
+    return 1;
+}
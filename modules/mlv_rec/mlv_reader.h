@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _mlv_reader_h_
+#define _mlv_reader_h_
+
+#include <stdint.h>
+#include <raw.h>
+#include "mlv.h"
+
+/**
+ * Read-only, memory mapped access to the chunks of a recording (.MLV, .M00, .M01 ... or .RAW, .R00 ...).
+ *
+ * Blocks are not copied out of the file, the reader hands out pointers into the mapping instead.
+ * On 64 bit hosts every chunk is mapped once as a whole. 32 bit hosts can't map multi-gigabyte
+ * files, so there every chunk maps a sliding window around the requested range.
+ * A pointer returned by mlv_reader_map(), mlv_reader_block() or mlv_reader_get() is valid until
+ * the next of these calls on the same chunk, or until the reader is closed.
+ *
+ * For code that walks through the headers sequentially, the reader also has a cursor with
+ * the semantics of fread/fseek/ftell/feof on the currently selected chunk.
+ */
+
+/* the main file and up to 100 numbered chunks */
+#define MLV_READER_MAX_CHUNKS 101
+
+typedef struct mlv_reader mlv_reader_t;
+
+/* open filename and, if max_chunks > 1, the chunks following it. their names are built by replacing the last two characters with 00, 01 etc. */
+mlv_reader_t *mlv_reader_open(const char *filename, int max_chunks);
+void mlv_reader_close(mlv_reader_t *reader);
+
+int mlv_reader_chunk_count(mlv_reader_t *reader);
+const char *mlv_reader_chunk_name(mlv_reader_t *reader, int chunk);
+uint64_t mlv_reader_chunk_size(mlv_reader_t *reader, int chunk);
+
+/* map size bytes at offset of the chunk. returns NULL if the range is outside of the chunk or mapping failed */
+const void *mlv_reader_map(mlv_reader_t *reader, int chunk, uint64_t offset, uint32_t size);
+
+/* map the complete block at offset. returns NULL if there is no valid block header or the block is truncated */
+const mlv_hdr_t *mlv_reader_block(mlv_reader_t *reader, int chunk, uint64_t offset);
+
+/* typed views into a mapped block, e.g. MLV_READER_FRAME_DATA(vidf, mlv_vidf_hdr_t) */
+#define MLV_READER_PAYLOAD(hdr, type)    ((const uint8_t *)(hdr) + sizeof(type))
+#define MLV_READER_FRAME_DATA(hdr, type) (MLV_READER_PAYLOAD(hdr, type) + ((const type *)(hdr))->frameSpace)
+
+/* cursor functions. selecting a chunk moves the cursor to its start and clears the EOF flag */
+int mlv_reader_select(mlv_reader_t *reader, int chunk);
+int mlv_reader_seek(mlv_reader_t *reader, int64_t offset, int whence);
+uint64_t mlv_reader_tell(mlv_reader_t *reader);
+int mlv_reader_eof(mlv_reader_t *reader);
+
+/* copy size bytes at the cursor and advance it. returns 1 on success, 0 and sets EOF if the chunk ends before */
+int mlv_reader_read(mlv_reader_t *reader, void *dst, uint32_t size);
+
+/* same as mlv_reader_read, but returns a pointer into the mapping instead of copying */
+const void *mlv_reader_get(mlv_reader_t *reader, uint32_t size);
+
+#endif
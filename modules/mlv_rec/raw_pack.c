@@ -0,0 +1,479 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/* system includes */
+#include <stdint.h>
+#include <string.h>
+
+/* SIMD kernels are compiled with function specific target flags, so the rest of the tool still runs on any x86 */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define RAW_PACK_X86
+#include <immintrin.h>
+#endif
+
+#include "raw_pack.h"
+
+static int raw_pack_kernel = RAW_PACK_AUTO;
+
+/*
+ * Scalar kernels. The bit buffer holds the not yet consumed bits in its lowest positions,
+ * reading (or writing) one 16 bit word whenever there are not enough bits left for the next pixel.
+ */
+static inline __attribute__((always_inline)) void raw_unpack_scalar(const uint8_t *src, uint16_t *dst, int width, int depth)
+{
+    const uint16_t *in = (const uint16_t *)src;
+    uint32_t mask = (1 << depth) - 1;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for(int x = 0; x < width; x++)
+    {
+        if(bits < depth)
+        {
+            acc = (acc << 16) | *in++;
+            bits += 16;
+        }
+        bits -= depth;
+        dst[x] = (acc >> bits) & mask;
+    }
+}
+
+static inline __attribute__((always_inline)) void raw_pack_scalar(const uint16_t *src, uint8_t *dst, int width, int depth)
+{
+    uint16_t *out = (uint16_t *)dst;
+    uint32_t mask = (1 << depth) - 1;
+    uint32_t acc = 0;
+    int bits = 0;
+
+    for(int x = 0; x < width; x++)
+    {
+        acc = (acc << depth) | (src[x] & mask);
+        bits += depth;
+
+        if(bits >= 16)
+        {
+            bits -= 16;
+            *out++ = acc >> bits;
+        }
+    }
+
+    /* last word is only partially used, keep the other bits */
+    if(bits)
+    {
+        uint16_t keep = (1 << (16 - bits)) - 1;
+        *out = (*out & keep) | (acc << (16 - bits));
+    }
+}
+
+/* let the compiler build a specialized loop for the common depths */
+static void raw_unpack_row_scalar(const uint8_t *src, uint16_t *dst, int width, int depth)
+{
+    switch(depth)
+    {
+        case 10: raw_unpack_scalar(src, dst, width, 10); break;
+        case 12: raw_unpack_scalar(src, dst, width, 12); break;
+        case 14: raw_unpack_scalar(src, dst, width, 14); break;
+        case 16: raw_unpack_scalar(src, dst, width, 16); break;
+        default: raw_unpack_scalar(src, dst, width, depth); break;
+    }
+}
+
+static void raw_pack_row_scalar(const uint16_t *src, uint8_t *dst, int width, int depth)
+{
+    switch(depth)
+    {
+        case 10: raw_pack_scalar(src, dst, width, 10); break;
+        case 12: raw_pack_scalar(src, dst, width, 12); break;
+        case 14: raw_pack_scalar(src, dst, width, 14); break;
+        case 16: raw_pack_scalar(src, dst, width, 16); break;
+        default: raw_pack_scalar(src, dst, width, depth); break;
+    }
+}
+
+#ifdef RAW_PACK_X86
+
+/*
+ * SIMD kernels work on blocks of 16 pixels, which take depth words and always start on a word boundary.
+ * Each half of 8 pixels fits into 16 bytes (for depths of 8 to 16 bits), so a byte shuffle moves the
+ * words every pixel is split across into its lane. Shifting by a different amount in every lane is
+ * done with multiplications: mullo(x, 1 << n) is x << n and mulhi(x, 1 << (16 - n)) is x >> n.
+ */
+
+/* unpack: pixel = ((a << 16 | b) << bit) >> (32 - depth), with a/b being the first/second word the pixel touches */
+typedef struct
+{
+    uint8_t shuf_a[2][16];
+    uint8_t shuf_b[2][16];
+    uint16_t mul[2][8];
+} raw_unpack_tables_t;
+
+/* pack: every output word is the OR of up to three shifted pixels */
+#define RAW_PACK_SLOTS 3
+
+typedef struct
+{
+    uint8_t shuf[RAW_PACK_SLOTS][2][2][16];    /* [slot][input half][output half] */
+    uint16_t mul_lo[RAW_PACK_SLOTS][2][8];     /* [slot][output half], shift left */
+    uint16_t mul_hi[RAW_PACK_SLOTS][2][8];     /* [slot][output half], shift right */
+} raw_pack_tables_t;
+
+/* byte offset of the second half in a block. with odd depths it starts in the middle of a word */
+static inline int raw_unpack_half_offset(int depth)
+{
+    return (depth / 2) * 2;
+}
+
+static void raw_unpack_tables(raw_unpack_tables_t *t, int depth)
+{
+    for(int half = 0; half < 2; half++)
+    {
+        for(int lane = 0; lane < 8; lane++)
+        {
+            /* bit position relative to the word the loaded 16 bytes start with */
+            int bit = (half * 8 + lane) * depth - raw_unpack_half_offset(depth) * 8 * half;
+            int word = bit / 16;
+
+            t->mul[half][lane] = 1 << (bit % 16);
+            t->shuf_a[half][2 * lane + 0] = 2 * word + 0;
+            t->shuf_a[half][2 * lane + 1] = 2 * word + 1;
+
+            /* if there is no next word in range, the pixel doesn't need it */
+            t->shuf_b[half][2 * lane + 0] = (word + 1 < 8) ? 2 * word + 2 : 0x80;
+            t->shuf_b[half][2 * lane + 1] = (word + 1 < 8) ? 2 * word + 3 : 0x80;
+        }
+    }
+}
+
+static void raw_pack_tables(raw_pack_tables_t *t, int depth)
+{
+    memset(t->shuf, 0x80, sizeof(t->shuf));
+    memset(t->mul_lo, 0x00, sizeof(t->mul_lo));
+    memset(t->mul_hi, 0x00, sizeof(t->mul_hi));
+
+    for(int word = 0; word < depth; word++)
+    {
+        int out_half = word / 8;
+        int lane = word % 8;
+        int first = (16 * word) / depth;
+
+        for(int slot = 0; slot < RAW_PACK_SLOTS; slot++)
+        {
+            int pixel = first + slot;
+
+            if(pixel >= 16 || pixel * depth >= 16 * (word + 1))
+            {
+                break;
+            }
+
+            /* distance between the pixel's last bit and the word's last bit */
+            int shift = 16 * (word + 1) - depth * (pixel + 1);
+
+            t->shuf[slot][pixel / 8][out_half][2 * lane + 0] = 2 * (pixel % 8) + 0;
+            t->shuf[slot][pixel / 8][out_half][2 * lane + 1] = 2 * (pixel % 8) + 1;
+
+            if(shift >= 0)
+            {
+                t->mul_lo[slot][out_half][lane] = 1 << shift;
+            }
+            else
+            {
+                t->mul_hi[slot][out_half][lane] = 1 << (16 + shift);
+            }
+        }
+    }
+}
+
+/* bytes of a packed row that contain pixel data */
+static inline int raw_row_bytes(int width, int depth)
+{
+    return (width * depth + 15) / 16 * 2;
+}
+
+/* completely used words of a packed row */
+static inline int raw_row_full_bytes(int width, int depth)
+{
+    return (width * depth) / 16 * 2;
+}
+
+/* the SIMD kernels return the number of pixels done, the rest is left to the scalar code */
+static int __attribute__((target("ssse3"))) raw_unpack_row_ssse3(const uint8_t *src, uint16_t *dst, int width, int depth)
+{
+    raw_unpack_tables_t t;
+    raw_unpack_tables(&t, depth);
+
+    __m128i shuf_a0 = _mm_loadu_si128((const __m128i *)t.shuf_a[0]);
+    __m128i shuf_a1 = _mm_loadu_si128((const __m128i *)t.shuf_a[1]);
+    __m128i shuf_b0 = _mm_loadu_si128((const __m128i *)t.shuf_b[0]);
+    __m128i shuf_b1 = _mm_loadu_si128((const __m128i *)t.shuf_b[1]);
+    __m128i mul0 = _mm_loadu_si128((const __m128i *)t.mul[0]);
+    __m128i mul1 = _mm_loadu_si128((const __m128i *)t.mul[1]);
+    __m128i shift = _mm_cvtsi32_si128(16 - depth);
+
+    int half_offset = raw_unpack_half_offset(depth);
+    int row_bytes = raw_row_bytes(width, depth);
+    int x = 0;
+
+    for(int pos = 0; x + 16 <= width && pos + half_offset + 16 <= row_bytes; x += 16, pos += 2 * depth)
+    {
+        __m128i in0 = _mm_loadu_si128((const __m128i *)&src[pos]);
+        __m128i in1 = _mm_loadu_si128((const __m128i *)&src[pos + half_offset]);
+
+        __m128i v0 = _mm_or_si128(_mm_mullo_epi16(_mm_shuffle_epi8(in0, shuf_a0), mul0), _mm_mulhi_epu16(_mm_shuffle_epi8(in0, shuf_b0), mul0));
+        __m128i v1 = _mm_or_si128(_mm_mullo_epi16(_mm_shuffle_epi8(in1, shuf_a1), mul1), _mm_mulhi_epu16(_mm_shuffle_epi8(in1, shuf_b1), mul1));
+
+        _mm_storeu_si128((__m128i *)&dst[x + 0], _mm_srl_epi16(v0, shift));
+        _mm_storeu_si128((__m128i *)&dst[x + 8], _mm_srl_epi16(v1, shift));
+    }
+
+    return x;
+}
+
+static int __attribute__((target("avx2"))) raw_unpack_row_avx2(const uint8_t *src, uint16_t *dst, int width, int depth)
+{
+    raw_unpack_tables_t t;
+    raw_unpack_tables(&t, depth);
+
+    /* lane 0 works on the first, lane 1 on the second half of a block */
+    __m256i shuf_a = _mm256_loadu_si256((const __m256i *)t.shuf_a);
+    __m256i shuf_b = _mm256_loadu_si256((const __m256i *)t.shuf_b);
+    __m256i mul = _mm256_loadu_si256((const __m256i *)t.mul);
+    __m128i shift = _mm_cvtsi32_si128(16 - depth);
+
+    int half_offset = raw_unpack_half_offset(depth);
+    int row_bytes = raw_row_bytes(width, depth);
+    int x = 0;
+
+    for(int pos = 0; x + 16 <= width && pos + half_offset + 16 <= row_bytes; x += 16, pos += 2 * depth)
+    {
+        __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)&src[pos])), _mm_loadu_si128((const __m128i *)&src[pos + half_offset]), 1);
+        __m256i v = _mm256_or_si256(_mm256_mullo_epi16(_mm256_shuffle_epi8(in, shuf_a), mul), _mm256_mulhi_epu16(_mm256_shuffle_epi8(in, shuf_b), mul));
+
+        _mm256_storeu_si256((__m256i *)&dst[x], _mm256_srl_epi16(v, shift));
+    }
+
+    return x;
+}
+
+/*
+ * The pack kernels always store 32 bytes per block, the bytes behind the block's depth words are
+ * zero and get overwritten by the next block. So the last block must end before the last full word.
+ */
+static int __attribute__((target("ssse3"))) raw_pack_row_ssse3(const uint16_t *src, uint8_t *dst, int width, int depth)
+{
+    raw_pack_tables_t t;
+    raw_pack_tables(&t, depth);
+
+    __m128i mask = _mm_set1_epi16((1 << depth) - 1);
+    int row_bytes = raw_row_full_bytes(width, depth);
+    int x = 0;
+
+    for(int pos = 0; x + 16 <= width && pos + 32 <= row_bytes; x += 16, pos += 2 * depth)
+    {
+        __m128i in0 = _mm_and_si128(_mm_loadu_si128((const __m128i *)&src[x + 0]), mask);
+        __m128i in1 = _mm_and_si128(_mm_loadu_si128((const __m128i *)&src[x + 8]), mask);
+        __m128i out[2];
+
+        for(int half = 0; half < 2; half++)
+        {
+            __m128i v = _mm_setzero_si128();
+
+            for(int slot = 0; slot < RAW_PACK_SLOTS; slot++)
+            {
+                __m128i p = _mm_or_si128(_mm_shuffle_epi8(in0, _mm_loadu_si128((const __m128i *)t.shuf[slot][0][half])), _mm_shuffle_epi8(in1, _mm_loadu_si128((const __m128i *)t.shuf[slot][1][half])));
+
+                v = _mm_or_si128(v, _mm_mullo_epi16(p, _mm_loadu_si128((const __m128i *)t.mul_lo[slot][half])));
+                v = _mm_or_si128(v, _mm_mulhi_epu16(p, _mm_loadu_si128((const __m128i *)t.mul_hi[slot][half])));
+            }
+            out[half] = v;
+        }
+
+        _mm_storeu_si128((__m128i *)&dst[pos + 0], out[0]);
+        _mm_storeu_si128((__m128i *)&dst[pos + 16], out[1]);
+    }
+
+    return x;
+}
+
+static int __attribute__((target("avx2"))) raw_pack_row_avx2(const uint16_t *src, uint8_t *dst, int width, int depth)
+{
+    raw_pack_tables_t t;
+    raw_pack_tables(&t, depth);
+
+    __m256i mask = _mm256_set1_epi16((1 << depth) - 1);
+    __m256i shuf[RAW_PACK_SLOTS][2];
+    __m256i mul_lo[RAW_PACK_SLOTS];
+    __m256i mul_hi[RAW_PACK_SLOTS];
+
+    for(int slot = 0; slot < RAW_PACK_SLOTS; slot++)
+    {
+        shuf[slot][0] = _mm256_loadu_si256((const __m256i *)t.shuf[slot][0]);
+        shuf[slot][1] = _mm256_loadu_si256((const __m256i *)t.shuf[slot][1]);
+        mul_lo[slot] = _mm256_loadu_si256((const __m256i *)t.mul_lo[slot]);
+        mul_hi[slot] = _mm256_loadu_si256((const __m256i *)t.mul_hi[slot]);
+    }
+
+    int row_bytes = raw_row_full_bytes(width, depth);
+    int x = 0;
+
+    for(int pos = 0; x + 16 <= width && pos + 32 <= row_bytes; x += 16, pos += 2 * depth)
+    {
+        __m256i in = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)&src[x]), mask);
+
+        /* the byte shuffle can't cross lanes, so provide both input halves in both lanes */
+        __m256i in0 = _mm256_permute2x128_si256(in, in, 0x00);
+        __m256i in1 = _mm256_permute2x128_si256(in, in, 0x11);
+        __m256i v = _mm256_setzero_si256();
+
+        for(int slot = 0; slot < RAW_PACK_SLOTS; slot++)
+        {
+            __m256i p = _mm256_or_si256(_mm256_shuffle_epi8(in0, shuf[slot][0]), _mm256_shuffle_epi8(in1, shuf[slot][1]));
+
+            v = _mm256_or_si256(v, _mm256_mullo_epi16(p, mul_lo[slot]));
+            v = _mm256_or_si256(v, _mm256_mulhi_epu16(p, mul_hi[slot]));
+        }
+
+        _mm256_storeu_si256((__m256i *)&dst[pos], v);
+    }
+
+    return x;
+}
+
+#endif
+
+static int raw_pack_supported(int kernel)
+{
+    switch(kernel)
+    {
+        case RAW_PACK_SCALAR:
+            return 1;
+#ifdef RAW_PACK_X86
+        case RAW_PACK_SSSE3:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("ssse3");
+        case RAW_PACK_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return 0;
+    }
+}
+
+int raw_pack_set_kernel(int kernel)
+{
+    if(kernel == RAW_PACK_AUTO)
+    {
+        kernel = RAW_PACK_KERNELS - 1;
+        while(!raw_pack_supported(kernel))
+        {
+            kernel--;
+        }
+    }
+    else if(!raw_pack_supported(kernel))
+    {
+        return 1;
+    }
+
+    raw_pack_kernel = kernel;
+    return 0;
+}
+
+int raw_pack_get_kernel()
+{
+    /* all threads come to the same result, so there is no need to lock */
+    if(raw_pack_kernel == RAW_PACK_AUTO)
+    {
+        raw_pack_set_kernel(RAW_PACK_AUTO);
+    }
+    return raw_pack_kernel;
+}
+
+const char *raw_pack_kernel_name(int kernel)
+{
+    switch(kernel)
+    {
+        case RAW_PACK_SCALAR:
+            return "scalar";
+        case RAW_PACK_SSSE3:
+            return "SSSE3";
+        case RAW_PACK_AVX2:
+            return "AVX2";
+        default:
+            return "auto";
+    }
+}
+
+void raw_unpack_row(const void *src, uint16_t *dst, int width, int depth)
+{
+    int x = 0;
+
+    /* 16 bit rows are plain words already */
+    if(depth == 16)
+    {
+        memcpy(dst, src, width * sizeof(uint16_t));
+        return;
+    }
+
+#ifdef RAW_PACK_X86
+    if(depth >= 8)
+    {
+        switch(raw_pack_get_kernel())
+        {
+            case RAW_PACK_AVX2:
+                x = raw_unpack_row_avx2(src, dst, width, depth);
+                break;
+            case RAW_PACK_SSSE3:
+                x = raw_unpack_row_ssse3(src, dst, width, depth);
+                break;
+        }
+    }
+#endif
+
+    /* SIMD kernels stop on a block boundary, which is a word boundary too */
+    raw_unpack_row_scalar((const uint8_t *)src + x / 16 * depth * 2, dst + x, width - x, depth);
+}
+
+void raw_pack_row(const uint16_t *src, void *dst, int width, int depth)
+{
+    int x = 0;
+
+    if(depth == 16)
+    {
+        memcpy(dst, src, width * sizeof(uint16_t));
+        return;
+    }
+
+#ifdef RAW_PACK_X86
+    if(depth >= 8)
+    {
+        switch(raw_pack_get_kernel())
+        {
+            case RAW_PACK_AVX2:
+                x = raw_pack_row_avx2(src, dst, width, depth);
+                break;
+            case RAW_PACK_SSSE3:
+                x = raw_pack_row_ssse3(src, dst, width, depth);
+                break;
+        }
+    }
+#endif
+
+    raw_pack_row_scalar(src + x, (uint8_t *)dst + x / 16 * depth * 2, width - x, depth);
+}
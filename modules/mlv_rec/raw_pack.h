@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef _raw_pack_h_
+#define _raw_pack_h_
+
+#include <stdint.h>
+
+/**
+ * Whole-row conversion between packed raw data and one uint16_t per pixel.
+ *
+ * Packed rows are a stream of little endian 16 bit words, with the pixels stored MSB first
+ * (for 14 bits that's the struct raw_pixblock layout). Rows have to start on a word boundary.
+ * Any bit depth from 1 to 16 is supported. On x86 hosts SSSE3 or AVX2 kernels are picked at
+ * runtime for depths of 8 bits and above, everything else uses the portable scalar code.
+ */
+
+enum raw_pack_kernel
+{
+    RAW_PACK_AUTO = -1,
+    RAW_PACK_SCALAR = 0,
+    RAW_PACK_SSSE3,
+    RAW_PACK_AVX2,
+    RAW_PACK_KERNELS
+};
+
+/* unpack width pixels of the given depth from src to dst */
+void raw_unpack_row(const void *src, uint16_t *dst, int width, int depth);
+
+/* pack width pixels into dst. values are truncated to depth bits, bits behind the last pixel in its word are kept */
+void raw_pack_row(const uint16_t *src, void *dst, int width, int depth);
+
+/* select the kernel to use, RAW_PACK_AUTO picks the fastest one. returns 0 on success, 1 if the CPU doesn't support it */
+int raw_pack_set_kernel(int kernel);
+int raw_pack_get_kernel();
+const char *raw_pack_kernel_name(int kernel);
+
+#endif
@@ -0,0 +1,222 @@
+/*
+ * Copyright (C) 2013 Magic Lantern Team
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Host benchmark for the raw_pack kernels.
+ * Checks every available kernel against the per-pixel reference and prints the throughput in MPix/s.
+ *
+ *   raw_pack_bench [width] [height] [iterations]
+ */
+
+/* system includes */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "raw_pack.h"
+
+/* per-pixel reference, the way mlv_dump used to do it */
+static uint16_t ref_extract(uint16_t *src, int position, int depth)
+{
+    uint16_t value = 0;
+    int src_pos = position * depth / 16;
+    int bits_to_left = ((depth * position) - (16 * src_pos)) % 16;
+    int shift_right = 16 - depth - bits_to_left;
+
+    value = src[src_pos];
+
+    if(shift_right >= 0)
+    {
+        value >>= shift_right;
+    }
+    else
+    {
+        value <<= -shift_right;
+        value |= src[src_pos + 1] >> (16 + shift_right);
+    }
+    value &= (1<<depth) - 1;
+
+    return value;
+}
+
+static void ref_insert(uint16_t *dst, int position, int depth, uint16_t new_value)
+{
+    uint16_t old_value = 0;
+    int dst_pos = position * depth / 16;
+    int bits_to_left = ((depth * position) - (16 * dst_pos)) % 16;
+    int shift_right = 16 - depth - bits_to_left;
+
+    old_value = dst[dst_pos];
+    if(shift_right >= 0)
+    {
+        uint16_t mask = ((1<<depth)-1) << shift_right;
+
+        new_value <<= shift_right;
+        new_value &= mask;
+        old_value &= ~mask;
+        dst[dst_pos] = new_value | old_value;
+    }
+    else
+    {
+        uint16_t mask1 = ((1<<(depth + shift_right))-1);
+        uint16_t mask2 = ((1<<(-shift_right))-1) << (16+shift_right);
+
+        old_value &= ~mask1;
+        old_value |= (new_value >> (-shift_right)) & mask1;
+        dst[dst_pos] = old_value;
+
+        old_value = dst[dst_pos + 1];
+        old_value &= ~mask2;
+        old_value |= (new_value << (16+shift_right)) & mask2;
+        dst[dst_pos + 1] = old_value;
+    }
+}
+
+static double mpix_per_sec(clock_t start, int pixels, int iterations)
+{
+    double seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    if(seconds <= 0)
+    {
+        return 0;
+    }
+    return (double)pixels * iterations / seconds / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    int width = (argc > 1) ? atoi(argv[1]) : 1920;
+    int height = (argc > 2) ? atoi(argv[2]) : 1080;
+    int iterations = (argc > 3) ? atoi(argv[3]) : 20;
+    int failed = 0;
+
+    if(width <= 0 || height <= 0 || iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [width] [height] [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    /* rows are padded to full words, like the recorded frames are */
+    int pitch = (width * 16 + 15) / 16 * 2;
+    int pixels = width * height;
+    uint16_t *values = malloc(pixels * sizeof(uint16_t));
+    uint16_t *unpacked = malloc(pixels * sizeof(uint16_t));
+    uint8_t *ref_packed = malloc(pitch * height);
+    uint8_t *packed = malloc(pitch * height);
+
+    if(!values || !unpacked || !ref_packed || !packed)
+    {
+        fprintf(stderr, "Failed to allocate buffers\n");
+        return 1;
+    }
+
+    srand(1);
+    for(int pos = 0; pos < pixels; pos++)
+    {
+        values[pos] = rand();
+    }
+
+    printf("%dx%d, %d iterations\n", width, height, iterations);
+    printf("%-5s %-10s %12s %12s\n", "depth", "kernel", "unpack", "pack");
+
+    for(int depth = 10; depth <= 16; depth++)
+    {
+        int row_bytes = (width * depth + 15) / 16 * 2;
+        uint16_t mask = (1 << depth) - 1;
+
+        /* reference data */
+        memset(ref_packed, 0x00, pitch * height);
+        clock_t start = clock();
+        for(int iteration = 0; iteration < iterations; iteration++)
+        {
+            for(int y = 0; y < height; y++)
+            {
+                for(int x = 0; x < width; x++)
+                {
+                    ref_insert((uint16_t *)&ref_packed[y * row_bytes], x, depth, values[y * width + x]);
+                }
+            }
+        }
+        double ref_pack = mpix_per_sec(start, pixels, iterations);
+
+        start = clock();
+        for(int iteration = 0; iteration < iterations; iteration++)
+        {
+            for(int y = 0; y < height; y++)
+            {
+                for(int x = 0; x < width; x++)
+                {
+                    unpacked[y * width + x] = ref_extract((uint16_t *)&ref_packed[y * row_bytes], x, depth);
+                }
+            }
+        }
+        double ref_unpack = mpix_per_sec(start, pixels, iterations);
+
+        printf("%-5d %-10s %12.1f %12.1f\n", depth, "per-pixel", ref_unpack, ref_pack);
+
+        for(int kernel = RAW_PACK_SCALAR; kernel < RAW_PACK_KERNELS; kernel++)
+        {
+            if(raw_pack_set_kernel(kernel))
+            {
+                continue;
+            }
+
+            memset(packed, 0x00, pitch * height);
+            start = clock();
+            for(int iteration = 0; iteration < iterations; iteration++)
+            {
+                for(int y = 0; y < height; y++)
+                {
+                    raw_pack_row(&values[y * width], &packed[y * row_bytes], width, depth);
+                }
+            }
+            double pack = mpix_per_sec(start, pixels, iterations);
+
+            memset(unpacked, 0x00, pixels * sizeof(uint16_t));
+            start = clock();
+            for(int iteration = 0; iteration < iterations; iteration++)
+            {
+                for(int y = 0; y < height; y++)
+                {
+                    raw_unpack_row(&packed[y * row_bytes], &unpacked[y * width], width, depth);
+                }
+            }
+            double unpack = mpix_per_sec(start, pixels, iterations);
+
+            int ok = !memcmp(packed, ref_packed, row_bytes * height);
+            for(int pos = 0; ok && pos < pixels; pos++)
+            {
+                ok = (unpacked[pos] == (values[pos] & mask));
+            }
+            failed |= !ok;
+
+            printf("%-5d %-10s %12.1f %12.1f%s\n", depth, raw_pack_kernel_name(kernel), unpack, pack, ok ? "" : "  MISMATCH");
+        }
+    }
+
+    free(values);
+    free(unpacked);
+    free(ref_packed);
+    free(packed);
+
+    return failed;
+}
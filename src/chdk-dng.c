@@ -40,13 +40,20 @@
 static int get_tick_count() { return get_ms_clock(); }
 
 #else // if we compile it for desktop
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L     // fileno and writev are not declared with -std=c99 (mlv_dump)
+#endif
 #include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
 #include "unistd.h"
 #include "string.h"
 #include "math.h"
+#include "errno.h"
 #include <sys/types.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
 #define FAST
 #define UNCACHEABLE(x) (x)
 #define umalloc malloc
@@ -172,7 +179,7 @@ void dng_set_thumbnail_size(int width, int height)
     dng_th_height = height;
 }
 
-struct dir_entry{unsigned short tag; unsigned short type; unsigned int count; unsigned int offset;};
+struct dir_entry{unsigned short tag; unsigned short type; unsigned int count; uintptr_t offset;};
 
 #define T_BYTE      1
 #define T_ASCII     2
@@ -269,30 +276,32 @@ static int find_tag_index(struct dir_entry * ifd, int num, unsigned short tag)
 }
 
 // Index of specific entries in ifd0 below.
-#define CAMERA_NAME_INDEX           find_tag_index(ifd0, DIR_SIZE(ifd0), 0x110)
-#define THUMB_DATA_INDEX            find_tag_index(ifd0, DIR_SIZE(ifd0), 0x111)
-#define ORIENTATION_INDEX           find_tag_index(ifd0, DIR_SIZE(ifd0), 0x112)
-#define CHDK_VER_INDEX              find_tag_index(ifd0, DIR_SIZE(ifd0), 0x131)
-#define ARTIST_NAME_INDEX           find_tag_index(ifd0, DIR_SIZE(ifd0), 0x13B)
-#define SUBIFDS_INDEX               find_tag_index(ifd0, DIR_SIZE(ifd0), 0x14A)
-#define COPYRIGHT_INDEX             find_tag_index(ifd0, DIR_SIZE(ifd0), 0x8298)
-#define EXIF_IFD_INDEX              find_tag_index(ifd0, DIR_SIZE(ifd0), 0x8769)
-#define DNG_VERSION_INDEX           find_tag_index(ifd0, DIR_SIZE(ifd0), 0xC612)
-#define UNIQUE_CAMERA_MODEL_INDEX   find_tag_index(ifd0, DIR_SIZE(ifd0), 0xC614)
+#define CAMERA_NAME_INDEX           find_tag_index(ifd0, ifd0_count, 0x110)
+#define THUMB_DATA_INDEX            find_tag_index(ifd0, ifd0_count, 0x111)
+#define ORIENTATION_INDEX           find_tag_index(ifd0, ifd0_count, 0x112)
+#define CHDK_VER_INDEX              find_tag_index(ifd0, ifd0_count, 0x131)
+#define ARTIST_NAME_INDEX           find_tag_index(ifd0, ifd0_count, 0x13B)
+#define SUBIFDS_INDEX               find_tag_index(ifd0, ifd0_count, 0x14A)
+#define COPYRIGHT_INDEX             find_tag_index(ifd0, ifd0_count, 0x8298)
+#define EXIF_IFD_INDEX              find_tag_index(ifd0, ifd0_count, 0x8769)
+#define DNG_VERSION_INDEX           find_tag_index(ifd0, ifd0_count, 0xC612)
+#define UNIQUE_CAMERA_MODEL_INDEX   find_tag_index(ifd0, ifd0_count, 0xC614)
 
 #define CAM_MAKE                    "Canon"
 
 
 // Index of specific entries in ifd1 below.
+#define RAW_COMPRESSION_INDEX       find_tag_index(ifd1, DIR_SIZE(ifd1), 0x103)
 #define RAW_DATA_INDEX              find_tag_index(ifd1, DIR_SIZE(ifd1), 0x111)
+#define RAW_SIZE_INDEX              find_tag_index(ifd1, DIR_SIZE(ifd1), 0x117)
 #define BADPIXEL_OPCODE_INDEX       find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC740)
 
 // Index of specific entries in exif_ifd below.
-#define EXPOSURE_PROGRAM_INDEX      find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x8822)
-#define METERING_MODE_INDEX         find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x9207)
-#define FLASH_MODE_INDEX            find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x9209)
-#define SSTIME_INDEX                find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x9290)
-#define SSTIME_ORIG_INDEX           find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x9291)
+#define EXPOSURE_PROGRAM_INDEX      find_tag_index(exif_ifd, exif_count, 0x8822)
+#define METERING_MODE_INDEX         find_tag_index(exif_ifd, exif_count, 0x9207)
+#define FLASH_MODE_INDEX            find_tag_index(exif_ifd, exif_count, 0x9209)
+#define SSTIME_INDEX                find_tag_index(exif_ifd, exif_count, 0x9290)
+#define SSTIME_ORIG_INDEX           find_tag_index(exif_ifd, exif_count, 0x9291)
 
 static int get_type_size(int type)
 {
@@ -406,22 +415,214 @@ void dng_set_datetime(char *datetime, char *subsectime)
     strncpy(cam_subsectime, subsectime, sizeof(cam_subsectime));
 }
 
+// lossless JPEG compressed image data, if set
+static void *dng_compressed_data = 0;
+static int dng_compressed_size = 0;
+
+void dng_set_compressed_data(void *data, int size)
+{
+    dng_compressed_data = data;
+    dng_compressed_size = data ? size : 0;
+}
+
+#ifndef CONFIG_MAGICLANTERN
+// extra tags copied from another file (e.g. EXIF from the source CR2), see dng_set_extra_tag
+#define DNG_MAX_EXTRA_TAGS 128
+static struct
+{
+    int ifd;                        // DNG_IFD0, DNG_EXIF_IFD, DNG_GPS_IFD or DNG_INTEROP_IFD
+    struct dir_entry entry;         // offset points to a private copy of the data
+} dng_extra_tags[DNG_MAX_EXTRA_TAGS];
+static int dng_extra_tags_count = 0;
+
+// tags describing the image data or pointing inside the source file; these can't be copied
+static int dng_tag_is_structural(int tag)
+{
+    switch (tag)
+    {
+    case 0xFE:  case 0xFF:                                  // (New)SubfileType
+    case 0x100: case 0x101: case 0x102: case 0x103:         // ImageWidth, ImageLength, BitsPerSample, Compression
+    case 0x106: case 0x111: case 0x115: case 0x116:         // PhotometricInterpretation, StripOffsets, SamplesPerPixel, RowsPerStrip
+    case 0x117: case 0x11A: case 0x11B: case 0x11C:         // StripByteCounts, X/YResolution, PlanarConfiguration
+    case 0x128: case 0x14A: case 0x201: case 0x202:         // ResolutionUnit, SubIFDs, JPEGInterchangeFormat(Length)
+    case 0x142: case 0x143: case 0x144: case 0x145:         // TileWidth, TileLength, TileOffsets, TileByteCounts
+    case 0x8769: case 0x8825: case 0xA005:                  // EXIF, GPS and Interoperability IFD offsets
+    case 0x927C:                                            // MakerNote (Canon's uses offsets from the start of the file)
+    case 0xA002: case 0xA003:                               // PixelX/YDimension (of the source image)
+        return 1;
+    }
+    return 0;
+}
+
+int dng_set_extra_tag(int ifd, int tag, int type, int count, const void* data)
+{
+    int size = get_type_size(type) * count;
+    if (size <= 0 || dng_tag_is_structural(tag))
+        return 0;
+
+    // keep the list sorted by IFD and tag; a tag that was already set is replaced
+    int i;
+    for (i = 0; i < dng_extra_tags_count; i++)
+    {
+        if (dng_extra_tags[i].ifd > ifd || (dng_extra_tags[i].ifd == ifd && dng_extra_tags[i].entry.tag >= tag))
+            break;
+    }
+
+    int replace = i < dng_extra_tags_count && dng_extra_tags[i].ifd == ifd && dng_extra_tags[i].entry.tag == tag;
+    if (!replace && dng_extra_tags_count >= DNG_MAX_EXTRA_TAGS)
+        return 0;
+
+    // values up to 4 bytes are stored in the IFD entry itself (T_PTR copies 4 bytes, so pad the copy)
+    void* copy = calloc(MAX(size, 4), 1);
+    if (!copy) return 0;
+    memcpy(copy, data, size);
+
+    if (replace)
+    {
+        free((void*)dng_extra_tags[i].entry.offset);
+    }
+    else
+    {
+        memmove(&dng_extra_tags[i+1], &dng_extra_tags[i], (dng_extra_tags_count - i) * sizeof(dng_extra_tags[0]));
+        dng_extra_tags_count++;
+    }
+
+    dng_extra_tags[i].ifd = ifd;
+    dng_extra_tags[i].entry.tag = tag;
+    dng_extra_tags[i].entry.type = (type & 0xFF) | (size <= 4 ? T_PTR : 0);
+    dng_extra_tags[i].entry.count = count;
+    dng_extra_tags[i].entry.offset = (uintptr_t)copy;
+    return 1;
+}
+
+void dng_clear_extra_tags()
+{
+    int i;
+    for (i = 0; i < dng_extra_tags_count; i++)
+        free((void*)dng_extra_tags[i].entry.offset);
+    dng_extra_tags_count = 0;
+}
+
+// tiled image data, see dng_set_tiles
+static int dng_tile_width = 0;
+static int dng_tile_length = 0;
+static int dng_tile_count = 0;
+static unsigned int * dng_tile_sizes = 0;
+static unsigned int * dng_tile_offsets = 0;
+
+int dng_set_tiles(int tile_width, int tile_length, int count, const uint32_t * sizes)
+{
+    free(dng_tile_sizes);
+    free(dng_tile_offsets);
+    dng_tile_sizes = dng_tile_offsets = 0;
+    dng_tile_count = 0;
+
+    if (!count) return 1;
+    if (tile_width <= 0 || tile_length <= 0 || (tile_width % 16) || (tile_length % 16)) return 0;
+
+    dng_tile_sizes = malloc(count * sizeof(dng_tile_sizes[0]));
+    dng_tile_offsets = malloc(count * sizeof(dng_tile_offsets[0]));
+    if (!dng_tile_sizes || !dng_tile_offsets)
+    {
+        free(dng_tile_sizes);
+        free(dng_tile_offsets);
+        dng_tile_sizes = dng_tile_offsets = 0;
+        return 0;
+    }
+
+    int i;
+    for (i = 0; i < count; i++)
+        dng_tile_sizes[i] = sizes[i];
+    dng_tile_width = tile_width;
+    dng_tile_length = tile_length;
+    dng_tile_count = count;
+    return 1;
+}
+
+// copy the raw IFD for a tiled image: StripOffsets, RowsPerStrip and StripByteCounts
+// are replaced by the tile tags, compression is lossless JPEG. Returns the number of entries in out.
+static int make_tiled_ifd(struct dir_entry * out, struct dir_entry * ifd, int count)
+{
+    // offsets and sizes are arrays, but a single value has to be stored in the entry itself
+    int ptr = (dng_tile_count == 1) ? T_PTR : 0;
+    struct dir_entry tile_tags[] = {
+        {0x142,  T_LONG,       1,  dng_tile_width},                    // TileWidth
+        {0x143,  T_LONG,       1,  dng_tile_length},                   // TileLength
+        {0x144,  T_LONG|ptr,   dng_tile_count, (uintptr_t)dng_tile_offsets},   // TileOffsets
+        {0x145,  T_LONG|ptr,   dng_tile_count, (uintptr_t)dng_tile_sizes},     // TileByteCounts
+    };
+
+    int tile_count = DIR_SIZE(tile_tags);
+    int n = 0, i, j = 0;
+    for (i = 0; i < count; i++)
+    {
+        if (ifd[i].tag == 0x111 || ifd[i].tag == 0x116 || ifd[i].tag == 0x117)
+            continue;
+        while (j < tile_count && tile_tags[j].tag < ifd[i].tag)
+            out[n++] = tile_tags[j++];
+        out[n] = ifd[i];
+        if (out[n].tag == 0x103)
+            out[n].offset = 7;                                          // Compression: lossless JPEG
+        n++;
+    }
+    while (j < tile_count)
+        out[n++] = tile_tags[j++];
+    return n;
+}
+
+// merge the extra tags for this IFD into a copy of the built-in entries (both sorted by tag);
+// an extra tag replaces the built-in one with the same tag. Returns the number of entries in out.
+static int merge_extra_tags(struct dir_entry * out, struct dir_entry * ifd, int count, int which)
+{
+    int n = 0, i = 0, j;
+    for (j = 0; j < dng_extra_tags_count; j++)
+    {
+        struct dir_entry * extra = &dng_extra_tags[j].entry;
+        if (dng_extra_tags[j].ifd != which) continue;
+        while (i < count && ifd[i].tag < extra->tag)
+            out[n++] = ifd[i++];
+        if (i < count && ifd[i].tag == extra->tag)
+            i++;
+        out[n++] = *extra;
+    }
+    while (i < count)
+        out[n++] = ifd[i++];
+    return n;
+}
+
+// add a pointer to a sub-IFD (value filled in later) to a sorted IFD with room for one more entry; returns the new count
+static int insert_ifd_pointer(struct dir_entry * ifd, int count, int tag)
+{
+    int i = count;
+    while (i > 0 && ifd[i-1].tag > tag)
+    {
+        ifd[i] = ifd[i-1];
+        i--;
+    }
+    ifd[i].tag = tag;
+    ifd[i].type = T_LONG;
+    ifd[i].count = 1;
+    ifd[i].offset = 0;
+    return count + 1;
+}
+#endif
+
 
 static void create_dng_header(struct raw_info * raw_info){
     int i,j;
     int extra_offset;
     int raw_offset;
 
-    struct dir_entry ifd0[]={
+    struct dir_entry ifd0_tags[]={
         {0xFE,   T_LONG,       1,  1},                                 // NewSubFileType: Preview Image
         {0x100,  T_LONG,       1,  dng_th_width},                      // ImageWidth
         {0x101,  T_LONG,       1,  dng_th_height},                     // ImageLength
-        {0x102,  T_SHORT,      3,  (int)cam_PreviewBitsPerSample},     // BitsPerSample: 8,8,8
+        {0x102,  T_SHORT,      3,  (uintptr_t)cam_PreviewBitsPerSample},     // BitsPerSample: 8,8,8
         {0x103,  T_SHORT,      1,  1},                                 // Compression: Uncompressed
         {0x106,  T_SHORT,      1,  2},                                 // PhotometricInterpretation: RGB
-        {0x10E,  T_ASCII,      sizeof(dng_image_desc), (int)dng_image_desc},               // ImageDescription
-        {0x10F,  T_ASCII,      sizeof(CAM_MAKE), (int)CAM_MAKE},       // Make
-        {0x110,  T_ASCII,      32, (int)cam_name},                     // Model: Filled at header generation.
+        {0x10E,  T_ASCII,      sizeof(dng_image_desc), (uintptr_t)dng_image_desc},               // ImageDescription
+        {0x10F,  T_ASCII,      sizeof(CAM_MAKE), (uintptr_t)CAM_MAKE},       // Make
+        {0x110,  T_ASCII,      32, (uintptr_t)cam_name},                     // Model: Filled at header generation.
         {0x111,  T_LONG,       1,  0},                                 // StripOffsets: Offset
         {0x112,  T_SHORT,      1,  1},                                 // Orientation: 1 - 0th row is top, 0th column is left
         {0x115,  T_SHORT,      1,  3},                                 // SamplesPerPixel: 3
@@ -429,84 +630,92 @@ static void create_dng_header(struct raw_info * raw_info){
         {0x117,  T_LONG,       1,  dng_th_width*dng_th_height*3},      // StripByteCounts = preview size
         {0x11C,  T_SHORT,      1,  1},                                 // PlanarConfiguration: 1
         {0x131,  T_ASCII|T_PTR,32, 0},                                 // Software
-        {0x132,  T_ASCII,      20, (int)cam_datetime},                 // DateTime
-        {0x13B,  T_ASCII|T_PTR,64, (int)dng_artist_name},              // Artist: Filled at header generation.
+        {0x132,  T_ASCII,      20, (uintptr_t)cam_datetime},                 // DateTime
+        {0x13B,  T_ASCII|T_PTR,64, (uintptr_t)dng_artist_name},              // Artist: Filled at header generation.
         {0x14A,  T_LONG,       1,  0},                                 // SubIFDs offset
-        {0x8298, T_ASCII|T_PTR,64, (int)dng_copyright},                // Copyright
+        {0x8298, T_ASCII|T_PTR,64, (uintptr_t)dng_copyright},                // Copyright
         {0x8769, T_LONG,       1,  0},                                 // EXIF_IFD offset
         {0x9216, T_BYTE,       4,  0x00000001},                        // TIFF/EPStandardID: 1.0.0.0
-        {0xA431, T_ASCII,      sizeof(cam_serial), (int)cam_serial},         // Exif.Photo.BodySerialNumber
-        {0xA434, T_ASCII,      sizeof(dng_lens_model), (int)dng_lens_model}, // Exif.Photo.LensModel
+        {0xA431, T_ASCII,      sizeof(cam_serial), (uintptr_t)cam_serial},         // Exif.Photo.BodySerialNumber
+        {0xA434, T_ASCII,      sizeof(dng_lens_model), (uintptr_t)dng_lens_model}, // Exif.Photo.LensModel
         {0xC612, T_BYTE,       4,  0x00000301},                        // DNGVersion: 1.3.0.0
         {0xC613, T_BYTE,       4,  0x00000301},                        // DNGBackwardVersion: 1.1.0.0
-        {0xC614, T_ASCII,      32, (int)cam_name},                     // UniqueCameraModel. Filled at header generation.
-        {0xC621, T_SRATIONAL,  9,  (int)&camera_sensor.color_matrix1},
-        {0xC627, T_RATIONAL,   3,  (int)cam_AnalogBalance},
-        {0xC628, T_RATIONAL,   3,  (int)cam_AsShotNeutral},
-        {0xC62A, T_SRATIONAL,  1,  (int)&camera_sensor.exposure_bias},
-        {0xC62B, T_RATIONAL,   1,  (int)cam_BaselineNoise},
-        {0xC62C, T_RATIONAL,   1,  (int)cam_BaselineSharpness},
-        {0xC62E, T_RATIONAL,   1,  (int)cam_LinearResponseLimit},
+        {0xC614, T_ASCII,      32, (uintptr_t)cam_name},                     // UniqueCameraModel. Filled at header generation.
+        {0xC621, T_SRATIONAL,  9,  (uintptr_t)&camera_sensor.color_matrix1},
+        {0xC627, T_RATIONAL,   3,  (uintptr_t)cam_AnalogBalance},
+        {0xC628, T_RATIONAL,   3,  (uintptr_t)cam_AsShotNeutral},
+        {0xC62A, T_SRATIONAL,  1,  (uintptr_t)&camera_sensor.exposure_bias},
+        {0xC62B, T_RATIONAL,   1,  (uintptr_t)cam_BaselineNoise},
+        {0xC62C, T_RATIONAL,   1,  (uintptr_t)cam_BaselineSharpness},
+        {0xC62E, T_RATIONAL,   1,  (uintptr_t)cam_LinearResponseLimit},
         {0xC65A, T_SHORT,      1, 21},                                 // CalibrationIlluminant1 D65
         // {0xC65B, T_SHORT,      1, 21},                                 // CalibrationIlluminant2 D65 (change this if ColorMatrix2 is added); see issue #2343
-        {0xC764, T_SRATIONAL,  1,  (int)cam_FrameRate},
+        {0xC764, T_SRATIONAL,  1,  (uintptr_t)cam_FrameRate},
     };
 
     struct dir_entry ifd1[]={
         {0xFE,   T_LONG,       1,  0},                                 // NewSubFileType: Main Image
-        {0x100,  T_LONG|T_PTR, 1,  (int)&camera_sensor.raw_rowpix},    // ImageWidth
-        {0x101,  T_LONG|T_PTR, 1,  (int)&camera_sensor.raw_rows},      // ImageLength
-        {0x102,  T_SHORT|T_PTR,1,  (int)&camera_sensor.bits_per_pixel},// BitsPerSample
+        {0x100,  T_LONG|T_PTR, 1,  (uintptr_t)&camera_sensor.raw_rowpix},    // ImageWidth
+        {0x101,  T_LONG|T_PTR, 1,  (uintptr_t)&camera_sensor.raw_rows},      // ImageLength
+        {0x102,  T_SHORT|T_PTR,1,  (uintptr_t)&camera_sensor.bits_per_pixel},// BitsPerSample
         {0x103,  T_SHORT,      1,  1},                                 // Compression: Uncompressed
         {0x106,  T_SHORT,      1,  0x8023},                            // PhotometricInterpretation: CFA
         {0x111,  T_LONG,       1,  0},                                 // StripOffsets: Offset
         {0x115,  T_SHORT,      1,  1},                                 // SamplesPerPixel: 1
-        {0x116,  T_SHORT|T_PTR,1,  (int)&camera_sensor.raw_rows},      // RowsPerStrip
-        {0x117,  T_LONG|T_PTR, 1,  (int)&camera_sensor.raw_size},      // StripByteCounts = CHDK RAW size
-        {0x11A,  T_RATIONAL,   1,  (int)cam_Resolution},               // XResolution
-        {0x11B,  T_RATIONAL,   1,  (int)cam_Resolution},               // YResolution
+        {0x116,  T_SHORT|T_PTR,1,  (uintptr_t)&camera_sensor.raw_rows},      // RowsPerStrip
+        {0x117,  T_LONG|T_PTR, 1,  (uintptr_t)&camera_sensor.raw_size},      // StripByteCounts = CHDK RAW size
+        {0x11A,  T_RATIONAL,   1,  (uintptr_t)cam_Resolution},               // XResolution
+        {0x11B,  T_RATIONAL,   1,  (uintptr_t)cam_Resolution},               // YResolution
         {0x11C,  T_SHORT,      1,  1},                                 // PlanarConfiguration: 1
         {0x128,  T_SHORT,      1,  2},                                 // ResolutionUnit: inch
         {0x828D, T_SHORT,      2,  0x00020002},                        // CFARepeatPatternDim: Rows = 2, Cols = 2
-        {0x828E, T_BYTE|T_PTR, 4,  (int)&camera_sensor.cfa_pattern},
-        {0xC61A, T_LONG|T_PTR, 1,  (int)&camera_sensor.black_level},   // BlackLevel
-        {0xC61D, T_LONG|T_PTR, 1,  (int)&camera_sensor.white_level},   // WhiteLevel
-        {0xC61F, T_LONG,       2,  (int)&camera_sensor.crop.origin},
-        {0xC620, T_LONG,       2,  (int)&camera_sensor.crop.size},
-        {0xC68D, T_LONG,       4,  (int)&camera_sensor.dng_active_area},
-        {0xC740, T_UNDEFINED|T_PTR, sizeof(badpixel_opcode),  (int)&badpixel_opcode},
+        {0x828E, T_BYTE|T_PTR, 4,  (uintptr_t)&camera_sensor.cfa_pattern},
+        {0xC61A, T_LONG|T_PTR, 1,  (uintptr_t)&camera_sensor.black_level},   // BlackLevel
+        {0xC61D, T_LONG|T_PTR, 1,  (uintptr_t)&camera_sensor.white_level},   // WhiteLevel
+        {0xC61F, T_LONG,       2,  (uintptr_t)&camera_sensor.crop.origin},
+        {0xC620, T_LONG,       2,  (uintptr_t)&camera_sensor.crop.size},
+        {0xC68D, T_LONG,       4,  (uintptr_t)&camera_sensor.dng_active_area},
+        {0xC740, T_UNDEFINED|T_PTR, sizeof(badpixel_opcode),  (uintptr_t)&badpixel_opcode},
     };
 
-    struct dir_entry exif_ifd[]={
-        {0x829A, T_RATIONAL,   1,  (int)cam_shutter},          // Shutter speed
-        {0x829D, T_RATIONAL,   1,  (int)cam_aperture},         // Aperture
+    struct dir_entry exif_tags[]={
+        {0x829A, T_RATIONAL,   1,  (uintptr_t)cam_shutter},          // Shutter speed
+        {0x829D, T_RATIONAL,   1,  (uintptr_t)cam_aperture},         // Aperture
         {0x8822, T_SHORT,      1,  0},                         // ExposureProgram
-        {0x8827, T_SHORT|T_PTR,1,  (int)&exif_data.iso},       // ISOSpeedRatings
+        {0x8827, T_SHORT|T_PTR,1,  (uintptr_t)&exif_data.iso},       // ISOSpeedRatings
         {0x9000, T_UNDEFINED,  4,  0x31323230},                // ExifVersion: 2.21
-        {0x9003, T_ASCII,      20, (int)cam_datetime},         // DateTimeOriginal
-        {0x9201, T_SRATIONAL,  1,  (int)cam_apex_shutter},     // ShutterSpeedValue (APEX units)
-        {0x9202, T_RATIONAL,   1,  (int)cam_apex_aperture},    // ApertureValue (APEX units)
-        {0x9204, T_SRATIONAL,  1,  (int)cam_exp_bias},         // ExposureBias
-        {0x9205, T_RATIONAL,   1,  (int)cam_max_av},           // MaxApertureValue
+        {0x9003, T_ASCII,      20, (uintptr_t)cam_datetime},         // DateTimeOriginal
+        {0x9201, T_SRATIONAL,  1,  (uintptr_t)cam_apex_shutter},     // ShutterSpeedValue (APEX units)
+        {0x9202, T_RATIONAL,   1,  (uintptr_t)cam_apex_aperture},    // ApertureValue (APEX units)
+        {0x9204, T_SRATIONAL,  1,  (uintptr_t)cam_exp_bias},         // ExposureBias
+        {0x9205, T_RATIONAL,   1,  (uintptr_t)cam_max_av},           // MaxApertureValue
         {0x9207, T_SHORT,      1,  0},                         // Metering mode
         {0x9209, T_SHORT,      1,  0},                         // Flash mode
-        {0x920A, T_RATIONAL,   1,  (int)cam_focal_length},     // FocalLength
-        {0x9290, T_ASCII|T_PTR,4,  (int)cam_subsectime},       // DateTime milliseconds
-        {0x9291, T_ASCII|T_PTR,4,  (int)cam_subsectime},       // DateTimeOriginal milliseconds
-        {0xA405, T_SHORT|T_PTR,1,  (int)&exif_data.effective_focal_length},    // FocalLengthIn35mmFilm
+        {0x920A, T_RATIONAL,   1,  (uintptr_t)cam_focal_length},     // FocalLength
+        {0x9290, T_ASCII|T_PTR,4,  (uintptr_t)cam_subsectime},       // DateTime milliseconds
+        {0x9291, T_ASCII|T_PTR,4,  (uintptr_t)cam_subsectime},       // DateTimeOriginal milliseconds
+        {0xA405, T_SHORT|T_PTR,1,  (uintptr_t)&exif_data.effective_focal_length},    // FocalLengthIn35mmFilm
     };
 
+    // these may be switched to a copy that also includes the extra tags (see merge_extra_tags)
+    struct dir_entry * ifd0 = ifd0_tags;
+    struct dir_entry * exif_ifd = exif_tags;
+    int ifd0_count = DIR_SIZE(ifd0_tags);
+    int exif_count = DIR_SIZE(exif_tags);
+
     struct
     {
         struct dir_entry* entry;
         int count;                  // Number of entries to be saved
         int entry_count;            // Total number of entries
-    } ifd_list[] = 
+    } ifd_list[5] = 
     {
-        {ifd0,      DIR_SIZE(ifd0),     DIR_SIZE(ifd0)}, 
+        {ifd0,      ifd0_count,         ifd0_count}, 
         {ifd1,      DIR_SIZE(ifd1),     DIR_SIZE(ifd1)}, 
-        {exif_ifd,  DIR_SIZE(exif_ifd), DIR_SIZE(exif_ifd)}, 
+        {exif_ifd,  exif_count,         exif_count}, 
+        // desktop only: GPS and Interoperability IFDs, if there are extra tags for them
     };
+    int ifd_count = 3;
 
     ifd0[DNG_VERSION_INDEX].offset = BE(0x01030000);
     
@@ -529,14 +738,20 @@ static void create_dng_header(struct raw_info * raw_info){
         }
 
     // filling EXIF fields
-    int ifd_count = DIR_SIZE(ifd_list);
 
     // Fix the counts and offsets where needed
     ifd0[CAMERA_NAME_INDEX].count = ifd0[UNIQUE_CAMERA_MODEL_INDEX].count = strlen(cam_name) + 1;
-    ifd0[CHDK_VER_INDEX].offset = (int)software_ver;
+    ifd0[CHDK_VER_INDEX].offset = (uintptr_t)software_ver;
     ifd0[CHDK_VER_INDEX].count = strlen(software_ver) + 1;
     ifd0[ARTIST_NAME_INDEX].count = strlen(dng_artist_name) + 1;
     ifd0[COPYRIGHT_INDEX].count = strlen(dng_copyright) + 1;
+
+    if (dng_compressed_data)
+    {
+        ifd1[RAW_COMPRESSION_INDEX].offset = 7;                         // Compression: lossless JPEG
+        ifd1[RAW_SIZE_INDEX].type = T_LONG;
+        ifd1[RAW_SIZE_INDEX].offset = dng_compressed_size;              // StripByteCounts = compressed size
+    }
     //~ ifd0[ORIENTATION_INDEX].offset = get_orientation_for_exif(exif_data.orientation);
 
     //~ exif_ifd[EXPOSURE_PROGRAM_INDEX].offset = get_exp_program_for_exif(exif_data.exp_program);
@@ -544,6 +759,53 @@ static void create_dng_header(struct raw_info * raw_info){
     //~ exif_ifd[FLASH_MODE_INDEX].offset = get_flash_mode_for_exif(exif_data.flash_mode, exif_data.flash_fired);
     //~ exif_ifd[SSTIME_INDEX].count = exif_ifd[SSTIME_ORIG_INDEX].count = strlen(cam_subsectime)+1;
 
+#ifndef CONFIG_MAGICLANTERN
+    // add the extra tags, e.g. EXIF copied from the source file
+    struct dir_entry ifd0_all[DIR_SIZE(ifd0_tags) + DNG_MAX_EXTRA_TAGS + 1];
+    struct dir_entry exif_all[DIR_SIZE(exif_tags) + DNG_MAX_EXTRA_TAGS + 1];
+    struct dir_entry gps_all[DNG_MAX_EXTRA_TAGS];
+    struct dir_entry interop_all[DNG_MAX_EXTRA_TAGS];
+    int gps_index = -1;
+    int interop_index = -1;
+    if (dng_extra_tags_count)
+    {
+        ifd0_count = merge_extra_tags(ifd0_all, ifd0_tags, DIR_SIZE(ifd0_tags), DNG_IFD0);
+        exif_count = merge_extra_tags(exif_all, exif_tags, DIR_SIZE(exif_tags), DNG_EXIF_IFD);
+
+        // GPS and Interoperability IFDs are written after the EXIF IFD
+        int gps_count = merge_extra_tags(gps_all, 0, 0, DNG_GPS_IFD);
+        if (gps_count)
+        {
+            ifd0_count = insert_ifd_pointer(ifd0_all, ifd0_count, 0x8825);
+            gps_index = ifd_count++;
+            ifd_list[gps_index].entry = gps_all;
+            ifd_list[gps_index].count = ifd_list[gps_index].entry_count = gps_count;
+        }
+
+        int interop_count = merge_extra_tags(interop_all, 0, 0, DNG_INTEROP_IFD);
+        if (interop_count)
+        {
+            exif_count = insert_ifd_pointer(exif_all, exif_count, 0xA005);
+            interop_index = ifd_count++;
+            ifd_list[interop_index].entry = interop_all;
+            ifd_list[interop_index].count = ifd_list[interop_index].entry_count = interop_count;
+        }
+
+        ifd0 = ifd_list[0].entry = ifd0_all;
+        ifd_list[0].count = ifd_list[0].entry_count = ifd0_count;
+        exif_ifd = ifd_list[2].entry = exif_all;
+        ifd_list[2].count = ifd_list[2].entry_count = exif_count;
+    }
+
+    // tiled image instead of a single strip
+    struct dir_entry ifd1_tiled[DIR_SIZE(ifd1) + 1];
+    if (dng_tile_count)
+    {
+        ifd_list[1].entry = ifd1_tiled;
+        ifd_list[1].count = ifd_list[1].entry_count = make_tiled_ifd(ifd1_tiled, ifd1, DIR_SIZE(ifd1));
+    }
+#endif
+
     // calculating offset of RAW data and count of entries for each IFD
     raw_offset=TIFF_HDR_SIZE;
 
@@ -585,6 +847,17 @@ static void create_dng_header(struct raw_info * raw_info){
     ifd0[EXIF_IFD_INDEX].offset = TIFF_HDR_SIZE + (ifd_list[0].count + ifd_list[1].count) * 12 + 6 + 6; // EXIF IFD offset
     ifd0[THUMB_DATA_INDEX].offset = raw_offset;                                     //StripOffsets for thumbnail
     ifd1[RAW_DATA_INDEX].offset = raw_offset + dng_th_width * dng_th_height * 3;    //StripOffsets for main image
+#ifndef CONFIG_MAGICLANTERN
+    for (i = 0; i < dng_tile_count; i++)                                            //TileOffsets: tiles follow each other
+        dng_tile_offsets[i] = (i ? dng_tile_offsets[i-1] + dng_tile_sizes[i-1] : ifd1[RAW_DATA_INDEX].offset);
+
+    for (j = 0, i = TIFF_HDR_SIZE; j < ifd_count; j++)                              //GPS and Interoperability IFD offsets
+    {
+        if (j == gps_index)     ifd0[find_tag_index(ifd0, ifd0_count, 0x8825)].offset = i;
+        if (j == interop_index) exif_ifd[find_tag_index(exif_ifd, exif_count, 0xA005)].offset = i;
+        i += 6 + ifd_list[j].count * 12;
+    }
+#endif
 
     for (j=0;j<ifd_count;j++)
     {
@@ -672,9 +945,10 @@ static void free_dng_header(void)
 //-------------------------------------------------------------------
 // Functions for creating DNG thumbnail image
 
-static inline int raw_to_8bit(int raw, int wb, struct raw_info * raw_info)
+/* swapped16: 16-bit buffers hold big endian values (as save_dng expects them) */
+static inline int raw_to_8bit(int raw, int wb, struct raw_info * raw_info, int swapped16)
 {
-    if (raw_info->bits_per_pixel == 16) /* big endian */
+    if (raw_info->bits_per_pixel == 16 && swapped16) /* big endian */
     {
         raw = ((raw & 0xFF00) >> 8) | ((raw & 0xFF) << 8);
     }
@@ -686,7 +960,7 @@ static inline int raw_to_8bit(int raw, int wb, struct raw_info * raw_info)
     return COERCE(out, 0, 255);
 }
 
-static void create_thumbnail(struct raw_info * raw_info)
+static void create_thumbnail(struct raw_info * raw_info, int swapped16)
 {
     register int i, j, x, y, yadj, xadj;
     register char *buf = thumbnail_buf;
@@ -707,15 +981,17 @@ static void create_thumbnail(struct raw_info * raw_info)
             x = camera_sensor.active_area.x1 + ((camera_sensor.jpeg.x + (camera_sensor.jpeg.width  * j) / dng_th_width)  & 0xFFFFFFFE) + xadj;
             y = camera_sensor.active_area.y1 + ((camera_sensor.jpeg.y + (camera_sensor.jpeg.height * i) / dng_th_height) & 0xFFFFFFFE) + yadj;
 
-            *buf++ = raw_to_8bit(get_raw_pixel(x,y), 0, raw_info);        // red pixel
-            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y), -1, raw_info);      // green pixel
-            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y+1), 0, raw_info);    // blue pixel
+            *buf++ = raw_to_8bit(get_raw_pixel(x,y), 0, raw_info, swapped16);        // red pixel
+            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y), -1, raw_info, swapped16);      // green pixel
+            *buf++ = raw_to_8bit(get_raw_pixel(x+1,y+1), 0, raw_info, swapped16);    // blue pixel
         }
 }
 
 //-------------------------------------------------------------------
 // Write DNG header, thumbnail and data to file
 
+#ifdef CONFIG_MAGICLANTERN
+
 static int write_dng(FILE* fd, struct raw_info * raw_info) 
 {
     create_dng_header(raw_info);
@@ -723,18 +999,200 @@ static int write_dng(FILE* fd, struct raw_info * raw_info)
 
     if (dng_header_buf)
     {
-        create_thumbnail(raw_info);
+        create_thumbnail(raw_info, 1);
         if (write(fd, dng_header_buf, dng_header_buf_size) != dng_header_buf_size) return 0;
         if (write(fd, thumbnail_buf, dng_th_width*dng_th_height*3) != dng_th_width*dng_th_height*3) return 0;
 
-        reverse_bytes_order(UNCACHEABLE(rawadr), camera_sensor.raw_size);
-        if (write(fd, UNCACHEABLE(rawadr), camera_sensor.raw_size) != camera_sensor.raw_size) return 0;
+        if (dng_compressed_data)
+        {
+            if (write(fd, dng_compressed_data, dng_compressed_size) != dng_compressed_size) return 0;
+        }
+        else
+        {
+            reverse_bytes_order(UNCACHEABLE(rawadr), camera_sensor.raw_size);
+            if (write(fd, UNCACHEABLE(rawadr), camera_sensor.raw_size) != camera_sensor.raw_size) return 0;
+        }
 
         free_dng_header();
     }
     return 1;
 }
 
+#else
+
+/*
+ * Desktop version: header, thumbnail and image parts are queued as an iovec list and written
+ * with writev. Parts that need byte swapping are swapped in slices into a small buffer that
+ * stays in cache, so the caller's image is never modified and never copied as a whole.
+ */
+
+#ifdef _WIN32
+struct iovec
+{
+    void * iov_base;
+    size_t iov_len;
+};
+#endif
+
+#define DNG_IOV_MAX         16
+#define DNG_SWAP_SLICE      (128 * 1024)
+
+struct dng_writer
+{
+    FILE* fd;
+    struct iovec iov[DNG_IOV_MAX];
+    int count;
+};
+
+static uint32_t dng_swap_buf[DNG_SWAP_SLICE / 4];
+
+static int dng_writer_flush(struct dng_writer * w)
+{
+    struct iovec * iov = w->iov;
+    int count = w->count;
+    w->count = 0;
+
+#ifdef _WIN32
+    for (int i = 0; i < count; i++)
+    {
+        if (fwrite(iov[i].iov_base, 1, iov[i].iov_len, w->fd) != iov[i].iov_len) return 0;
+    }
+#else
+    while (count > 0)
+    {
+        ssize_t done = writev(fileno(w->fd), iov, count);
+        if (done < 0 && errno == EINTR) continue;
+        if (done <= 0) return 0;
+
+        /* partial write: skip what was written and retry with the rest */
+        while (count > 0 && (size_t)done >= iov->iov_len)
+        {
+            done -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char*)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+#endif
+    return 1;
+}
+
+static int dng_writer_add(struct dng_writer * w, const void * data, size_t size)
+{
+    if (!size) return 1;
+    if (w->count == DNG_IOV_MAX && !dng_writer_flush(w)) return 0;
+    w->iov[w->count].iov_base = (void*)data;
+    w->iov[w->count].iov_len = size;
+    w->count++;
+    return 1;
+}
+
+/* same result as reverse_bytes_order on a copy: the bytes of each 16-bit word swapped, an odd last byte kept */
+static void copy_reverse_bytes_order(void * dst, const void * src, size_t count)
+{
+    uint32_t * d = dst;
+    const uint8_t * s = src;
+    size_t words = count / 4;
+    for (size_t i = 0; i < words; i++)
+    {
+        uint32_t x;
+        memcpy(&x, s + 4*i, 4);
+        d[i] = ((x & 0x00FF00FF) << 8) | ((x >> 8) & 0x00FF00FF);
+    }
+
+    uint8_t * d8 = dst;
+    for (size_t i = words * 4; i + 1 < count; i += 2)
+    {
+        d8[i] = s[i+1];
+        d8[i+1] = s[i];
+    }
+    if (count & 1)
+    {
+        d8[count-1] = s[count-1];
+    }
+}
+
+static int dng_writer_add_swapped(struct dng_writer * w, const void * data, size_t size)
+{
+    const char * src = data;
+    while (size)
+    {
+        /* the slice buffer is reused, so everything queued so far has to go out with it */
+        size_t slice = MIN(size, DNG_SWAP_SLICE);
+        copy_reverse_bytes_order(dng_swap_buf, src, slice);
+        if (!dng_writer_add(w, dng_swap_buf, slice)) return 0;
+        if (!dng_writer_flush(w)) return 0;
+        src += slice;
+        size -= slice;
+    }
+    return 1;
+}
+
+static int write_dng_parts(FILE* fd, struct raw_info * raw_info, const struct dng_image_part * parts, int count, int swapped16)
+{
+    /* the header announces this many bytes of image data */
+    int expected = dng_compressed_data ? dng_compressed_size : camera_sensor.raw_size;
+    if (dng_tile_count)
+    {
+        expected = 0;
+        for (int i = 0; i < dng_tile_count; i++)
+        {
+            expected += dng_tile_sizes[i];
+        }
+    }
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += parts[i].size;
+    }
+    if (total != expected) return 0;
+
+    create_dng_header(raw_info);
+    if (!dng_header_buf) return 0;
+
+    create_thumbnail(raw_info, swapped16);
+
+    struct dng_writer w = { fd, {{0}}, 0 };
+    int ok = dng_writer_add(&w, dng_header_buf, dng_header_buf_size) &&
+             dng_writer_add(&w, thumbnail_buf, dng_th_width*dng_th_height*3);
+
+    for (int i = 0; ok && i < count; i++)
+    {
+        ok = parts[i].swap16
+            ? dng_writer_add_swapped(&w, parts[i].data, parts[i].size)
+            : dng_writer_add(&w, parts[i].data, parts[i].size);
+    }
+    ok = ok && dng_writer_flush(&w);
+
+    free_dng_header();
+    return ok;
+}
+
+static int save_dng_file(char* filename, struct raw_info * raw_info, const struct dng_image_part * parts, int count, int swapped16)
+{
+    FILE* f = FIO_CreateFile(filename);
+    if (!f) return 0;
+    int ok = write_dng_parts(f, raw_info, parts, count, swapped16);
+    if (FIO_CloseFile(f)) ok = 0;
+    if (!ok)
+    {
+        FIO_RemoveFile(filename);
+        return 0;
+    }
+    return 1;
+}
+
+int save_dng_parts(char* filename, struct raw_info * raw_info, const struct dng_image_part * parts, int count)
+{
+    return save_dng_file(filename, raw_info, parts, count, 0);
+}
+
+#endif
+
 #ifdef CONFIG_MAGICLANTERN
 PROP_HANDLER(PROP_CAM_MODEL)
 {
@@ -756,6 +1214,7 @@ int save_dng(char* filename, struct raw_info * raw_info)
     raw_info->jpeg.height = raw_info->height;
     #endif
     
+#ifdef CONFIG_MAGICLANTERN
     FILE* f = FIO_CreateFile(filename);
     if (!f) return 0;
     int ok = write_dng(f, raw_info);
@@ -766,4 +1225,15 @@ int save_dng(char* filename, struct raw_info * raw_info)
         return 0;
     }
     return 1;
+#else
+    /* same file as on the camera, but the raw buffer is left as it was */
+    struct dng_image_part part = { raw_info->buffer, raw_info->frame_size, 1 };
+    if (dng_compressed_data)
+    {
+        part.data = dng_compressed_data;
+        part.size = dng_compressed_size;
+        part.swap16 = 0;
+    }
+    return save_dng_file(filename, raw_info, &part, 1, 1);
+#endif
 }
@@ -16,4 +16,40 @@ void dng_set_iso(int value);
 void dng_set_wbgain(int gain_r_n, int gain_r_d, int gain_g_n, int gain_g_d, int gain_b_n, int gain_b_d);
 void dng_set_datetime(char *datetime, char *subsectime);
 
+/* write this lossless JPEG data as image instead of the uncompressed raw buffer (which is still used for the thumbnail). NULL switches back */
+void dng_set_compressed_data(void *data, int size);
+
+/* extra tags written to the next DNGs, e.g. EXIF copied from the source file (not available in camera) */
+/* an extra tag replaces the built-in one with the same tag; tags that describe the image data are refused (returns 0) */
+/* tags for the GPS and Interoperability IFDs add these IFDs to the DNG (pointed to from IFD0 and from the EXIF IFD) */
+#define DNG_IFD0        0
+#define DNG_EXIF_IFD    1
+#define DNG_GPS_IFD     2
+#define DNG_INTEROP_IFD 3
+int dng_set_extra_tag(int ifd, int tag, int type, int count, const void* data);
+void dng_clear_extra_tags();
+
+#ifndef CONFIG_MAGICLANTERN
+#include <stdint.h>
+
+/* desktop only: the image data of a DNG as a list of parts, written after the header and thumbnail */
+struct raw_info;
+struct dng_image_part
+{
+    const void * data;
+    int size;
+    int swap16;         /* swap the bytes of each 16-bit word on the way out (ML packed raw -> DNG), the data itself is not touched */
+};
+
+/* write the image as tiles of lossless JPEG data (compression 7) instead of one strip: count tiles of tile_width x tile_length */
+/* pixels (multiples of 16), left to right and top to bottom, with these compressed sizes; the data itself is passed to */
+/* save_dng_parts, one part per tile. count = 0 switches back to one strip. returns 1 on success, 0 on error */
+int dng_set_tiles(int tile_width, int tile_length, int count, const uint32_t * sizes);
+
+/* save_dng without modifying raw_info->buffer; the parts must add up to raw_info->frame_size, the dng_set_compressed_data size or the tile sizes */
+/* the thumbnail is still read from raw_info->buffer, with 16-bit pixels in native byte order (save_dng wants them big endian) */
+/* returns 1 on success, 0 on error */
+int save_dng_parts(char* filename, struct raw_info * raw_info, const struct dng_image_part * parts, int count);
+#endif
+
 #endif // __CHDK_DNG_H_
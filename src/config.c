@@ -48,6 +48,161 @@ extern struct config_var _config_vars_start[];
 extern struct config_var _config_vars_end[];
 static struct semaphore *config_save_sem = 0;
 
+/* name -> config_var and value pointer -> config_var lookup tables (open addressing) */
+/* built from _config_vars_start.._config_vars_end in config_load, extended with module config vars as they are loaded */
+#define CONFIG_INDEX_BITS 10
+#define CONFIG_INDEX_SIZE (1 << CONFIG_INDEX_BITS)  /* at least twice the number of config vars */
+
+static struct config_var * config_index_by_name[CONFIG_INDEX_SIZE];
+static struct config_var * config_index_by_ptr[CONFIG_INDEX_SIZE];
+static int config_index_ready = 0;      /* until then, lookups scan the config vars */
+static int config_index_complete = 1;   /* cleared if some config var didn't fit; lookup misses will scan the config vars */
+
+static unsigned config_index_hash_name(const char * name)
+{
+    /* FNV-1a */
+    uint32_t hash = 2166136261u;
+    while (*name)
+    {
+        hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    }
+    return (hash * 0x9E3779B1u) >> (32 - CONFIG_INDEX_BITS);
+}
+
+static unsigned config_index_hash_ptr(int * ptr)
+{
+    return (((uint32_t) ptr >> 2) * 0x9E3779B1u) >> (32 - CONFIG_INDEX_BITS);
+}
+
+static struct config_var * config_index_find_name(const char * name)
+{
+    unsigned slot = config_index_hash_name(name);
+
+    for (int i = 0; i < CONFIG_INDEX_SIZE; i++)
+    {
+        struct config_var * var = config_index_by_name[slot];
+        if (!var || streq(var->name, name))
+        {
+            return var;
+        }
+        slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+    }
+
+    return 0;
+}
+
+static struct config_var * config_index_find_ptr(int * ptr)
+{
+    unsigned slot = config_index_hash_ptr(ptr);
+
+    for (int i = 0; i < CONFIG_INDEX_SIZE; i++)
+    {
+        struct config_var * var = config_index_by_ptr[slot];
+        if (!var || var->value == ptr)
+        {
+            return var;
+        }
+        slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+    }
+
+    return 0;
+}
+
+/* returns 0 if the table is full; duplicates are not added (the first one wins, as with a linear scan) */
+static int config_index_insert(struct config_var ** table, unsigned slot, struct config_var * var, int by_name)
+{
+    for (int i = 0; i < CONFIG_INDEX_SIZE; i++)
+    {
+        struct config_var * other = table[slot];
+        if (!other)
+        {
+            table[slot] = var;
+            return 1;
+        }
+        if (by_name ? streq(other->name, var->name) : other->value == var->value)
+        {
+            return 1;
+        }
+        slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+    }
+
+    return 0;
+}
+
+void config_var_index_add(struct config_var * var)
+{
+    if (!config_index_insert(config_index_by_name, config_index_hash_name(var->name), var, 1) ||
+        !config_index_insert(config_index_by_ptr, config_index_hash_ptr(var->value), var, 0))
+    {
+        DebugMsg( DM_MAGIC, 3, "%s: index full, '%s' not added", __func__, var->name );
+        config_index_complete = 0;
+    }
+}
+
+/* linear probing without tombstones: entries after the removed one are moved back into the hole if they can be */
+static void config_index_delete(struct config_var ** table, unsigned slot, struct config_var * var, int by_name)
+{
+    int i;
+    for (i = 0; i < CONFIG_INDEX_SIZE; i++)
+    {
+        if (!table[slot])
+        {
+            return;
+        }
+        if (table[slot] == var)
+        {
+            break;
+        }
+        slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+    }
+
+    if (i == CONFIG_INDEX_SIZE)
+    {
+        return;
+    }
+
+    unsigned hole = slot;
+    for (i = 0; i < CONFIG_INDEX_SIZE; i++)
+    {
+        slot = (slot + 1) & (CONFIG_INDEX_SIZE - 1);
+        struct config_var * other = table[slot];
+        if (!other)
+        {
+            break;
+        }
+
+        /* it can fill the hole if its home slot is not between the hole and where it is now */
+        unsigned home = by_name ? config_index_hash_name(other->name) : config_index_hash_ptr(other->value);
+        if (((slot - home) & (CONFIG_INDEX_SIZE - 1)) >= ((slot - hole) & (CONFIG_INDEX_SIZE - 1)))
+        {
+            table[hole] = other;
+            hole = slot;
+        }
+    }
+
+    table[hole] = 0;
+}
+
+void config_var_index_remove(struct config_var * var)
+{
+    config_index_delete(config_index_by_name, config_index_hash_name(var->name), var, 1);
+    config_index_delete(config_index_by_ptr, config_index_hash_ptr(var->value), var, 0);
+}
+
+static void config_index_init()
+{
+    for(struct config_var *var = _config_vars_start; var < _config_vars_end ; var++ )
+    {
+#if defined(POSITION_INDEPENDENT)
+        var->name = PIC_RESOLVE(var->name);
+        var->value = PIC_RESOLVE(var->value);
+#endif
+        config_var_index_add(var);
+    }
+
+    config_index_ready = 1;
+}
+
 
 static struct config *config_parse_line(const char *line)
 {
@@ -128,53 +283,39 @@ parse_error:
     return 0;
 }
 
-static int get_char_from_config_file(char* out)
-{
-    if (config_file_pos >= config_file_size) return 0;
-    *out = config_file_buf[config_file_pos++];
-    return 1;
-}
-
-static int read_line(char *buf, size_t size)
+/* next line from config_file_buf, nul-terminated in place (the buffer is ours until it's freed after parsing) */
+/* returns 0 at the end of the file; an unterminated last line is ignored */
+static char * read_line()
 {
-    size_t          len = 0;
+    if (config_file_pos >= config_file_size)
+        return 0;
 
-    while( len < size )
-    {
-        int rc = get_char_from_config_file(buf+len);
-        if( rc <= 0 )
-            return -1;
+    char * line = config_file_buf + config_file_pos;
+    char * end = memchr(line, '\n', config_file_size - config_file_pos);
+    if (!end)
+        return 0;
 
-        if( buf[len] == '\r' )
-            continue;
-        if( buf[len] == '\n' )
-        {
-            buf[len] = '\0';
-            return len;
-        }
+    config_file_pos = end - config_file_buf + 1;
 
-        len++;
-    }
+    if (end > line && end[-1] == '\r')
+        end--;
+    *end = '\0';
 
-    return -1;
+    return line;
 }
 
 
+static struct config_var * get_config_var_struct(const char * name);
+
 static void config_auto_parse(struct config *cfg)
 {
-    for(struct config_var *var = _config_vars_start; var < _config_vars_end ; var++ )
-    {
-#if defined(POSITION_INDEPENDENT)
-        var->name = PIC_RESOLVE(var->name);
-        var->value = PIC_RESOLVE(var->value);
-#endif
-        if( !streq( var->name, cfg->name ) )
-            continue;
+    struct config_var * var = get_config_var_struct(cfg->name);
 
+    if (var)
+    {
         DebugMsg( DM_MAGIC, 3, "%s: '%s' => '%s'", __func__, cfg->name, cfg->value);
 
         *(int*) var->value = atoi( cfg->value );
-
         return;
     }
 
@@ -247,11 +388,11 @@ int config_save_file(const char *filename)
 
 static struct config *config_parse()
 {
-    char line_buf[1000];
+    char * line_buf;
     struct config * cfg = 0;
     int count = 0;
 
-    while( read_line(line_buf, sizeof(line_buf) ) >= 0 )
+    while( (line_buf = read_line()) )
     {
         //~ bmp_printf(FONT_SMALL, 0, 0, "cfg line: %s      ", line_buf);
         
@@ -322,6 +463,15 @@ int config_parse_file(const char *filename)
 
 static struct config_var* config_var_lookup(int* ptr)
 {
+    if (config_index_ready)
+    {
+        struct config_var * var = config_index_find_ptr(ptr);
+        if (var || config_index_complete)
+        {
+            return var;
+        }
+    }
+
     for(struct config_var *var = _config_vars_start; var < _config_vars_end ; var++ )
     {
         if (var->value == ptr)
@@ -339,6 +489,15 @@ static struct config_var* config_var_lookup(int* ptr)
 
 static struct config_var * get_config_var_struct(const char * name)
 {
+    if (config_index_ready)
+    {
+        struct config_var * var = config_index_find_name(name);
+        if (var || config_index_complete)
+        {
+            return var;
+        }
+    }
+
     for(struct config_var *  var = _config_vars_start ; var < _config_vars_end ; var++ )
     {
         if (streq(var->name, name))
@@ -434,9 +593,9 @@ int config_var_restore_default(int* ptr)
 
 static void
 module_config_parse(module_entry_t * module) {
-    char line_buf[ 1000 ];
+    char * line_buf;
 
-    while( read_line(line_buf, sizeof(line_buf) ) >= 0 )
+    while( (line_buf = read_line()) )
     {
         // Ignore any line that begins with # or is empty
         if( line_buf[0] == '#'
@@ -923,6 +1082,8 @@ static struct menu_entry cfg_menus[] = {
 /* called at startup, after init_func's */
 void config_load()
 {
+    config_index_init();
+
 #ifdef CONFIG_CONFIG_FILE
     config_selected = 1;
     config_preset_name = config_choose_startup_preset();
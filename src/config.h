@@ -134,6 +134,12 @@ int set_config_var_ptr(int* ptr, int new_value);
 /* lookup a config var by name */
 int get_config_var(const char * name);
 
+/* make a config var (e.g. from a module) visible to the name/pointer lookups; core config vars are added in config_load */
+void config_var_index_add(struct config_var * var);
+
+/* hide it again, e.g. when its module is unloaded */
+void config_var_index_remove(struct config_var * var);
+
 /* return the current settings directory (usually ML/SETTINGS, but not if you use a custom preset) */
 extern char* get_config_dir();
 
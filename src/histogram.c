@@ -12,6 +12,7 @@
 #include "imgconv.h"
 
 #include "histogram.h"
+#include "raw_hist.h"
 #include "module.h"
 
 #include "zebra.h"
@@ -423,111 +424,181 @@ MENU_UPDATE_FUNC(hist_warn_display)
  * and so on, until 16
  */
 
+/* one histogram (64K) for all the queries below, kept between calls; released with raw_hist_free_buffer.
+ * The progressive samples are valid while raw_hist_progressive_speed is set; any other query clears it. */
+static struct raw_hist * raw_hist_buf = 0;
+static int raw_hist_progressive_projection = -1;
+static int raw_hist_progressive_speed = 0;
+static struct semaphore * raw_hist_sem = 0;
+
+/* all green pixels from the full raw image */
+static void FAST raw_hist_sample_full_green(struct raw_hist * hist)
+{
+    uint32_t * bins = hist->bins;
+
+    /* time: 1-2 seconds on full raw 5D3 */
+    //~ int t0 = get_ms_clock();
+    for (struct raw_pixblock * row = (struct raw_pixblock *) raw_info.buffer + raw_info.active_area.y1 * raw_info.width / 8 + (raw_info.active_area.x1 + 7) / 8; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.active_area.y2; row += 2 * raw_info.width / 8)
+    {
+        struct raw_pixblock * row2 = row + raw_info.pitch / sizeof(struct raw_pixblock);
+
+        struct raw_pixblock * p;
+        struct raw_pixblock * q;
+        for (p = row, q = row2; (void*)p < (void*)row + raw_info.jpeg.width * 14/8; p++, q++)
+        {
+
+            /**
+             *  p: abcdefgh abcdefgh
+             *  q: abcdefgh abcdefgh
+             *
+             *     rgrgrgrg rgrgrgrg
+             *     gbgbgbgb gbgbgbgb
+             */
+
+            //~ int pa = ((int)(p->a));
+            int pb = ((int)(p->b_lo | (p->b_hi << 12)));
+            //~ int pc = ((int)(p->c_lo | (p->c_hi << 10)));
+            int pd = ((int)(p->d_lo | (p->d_hi << 8)));
+            //~ int pe = ((int)(p->e_lo | (p->e_hi << 6)));
+            int pf = ((int)(p->f_lo | (p->f_hi << 4)));
+            //~ int pg = ((int)(p->g_lo | (p->g_hi << 2)));
+            int ph = ((int)(p->h));
+            int qa = ((int)(q->a));
+            //~ int qb = ((int)(q->b_lo | (q->b_hi << 12)));
+            int qc = ((int)(q->c_lo | (q->c_hi << 10)));
+            //~ int qd = ((int)(q->d_lo | (q->d_hi << 8)));
+            int qe = ((int)(q->e_lo | (q->e_hi << 6)));
+            //~ int qf = ((int)(q->f_lo | (q->f_hi << 4)));
+            int qg = ((int)(q->g_lo | (q->g_hi << 2)));
+            //~ int qh = ((int)(q->h));
+
+            bins[pb]++;
+            bins[pd]++;
+            bins[pf]++;
+            bins[ph]++;
+            bins[qa]++;
+            bins[qc]++;
+            bins[qe]++;
+            bins[qg]++;
+
+            /* to check if we sample only the active area */
+            //~ p->a = rand();
+        }
+    }
+    //~ int t1 = get_ms_clock();
+    //~ NotifyBox(5000, "%d ", t1 - t0);
+    //~ save_dng("A:/foo.dng");
+
+    hist->passes++;
+}
+
+/* LiveView-sized grid, downsampled by "speed" on each axis; each pass uses a different offset (see raw_hist_grid_offset) */
+static void FAST raw_hist_sample_lv(struct raw_hist * hist, int gray_projection, int speed)
+{
+    int dx, dy;
+    raw_hist_grid_offset(speed, hist->passes, &dx, &dy);
+
+    int off = get_y_skip_offset_for_histogram();
+    for (int i = os.y0 + off + dy; i < os.y_max - off; i += speed)
+    {
+        int y = BM2RAW_Y(i);
+        for (int j = os.x0 + dx; j < os.x_max; j += speed)
+        {
+            int x = BM2RAW_X(j);
+            int px = raw_get_gray_pixel(x, y, gray_projection);
+            raw_hist_add(hist, px);
+        }
+    }
+
+    hist->passes++;
+}
+
+/* the shared histogram, allocated on first use; call with raw_hist_sem taken */
+static struct raw_hist * raw_hist_get_buf()
+{
+    if (!raw_hist_buf)
+    {
+        raw_hist_buf = malloc(sizeof(struct raw_hist));
+        raw_hist_progressive_speed = 0;
+    }
+    return raw_hist_buf;
+}
+
 int FAST raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed)
 {
     if (!raw_update_params()) goto err;
     get_yuv422_vram();
 
-    int* hist = malloc(16384*4);
-    if (!hist) goto err;
-    memset(hist, 0, 16384*4);
+    take_semaphore(raw_hist_sem, 0);
 
-    int off = get_y_skip_offset_for_histogram();
-    if (speed == 0 && gray_projection == GRAY_PROJECTION_GREEN)
+    struct raw_hist * hist = raw_hist_get_buf();
+    if (!hist)
     {
-        /* time: 1-2 seconds on full raw 5D3 */
-        //~ int t0 = get_ms_clock();
-        for (struct raw_pixblock * row = (struct raw_pixblock *) raw_info.buffer + raw_info.active_area.y1 * raw_info.width / 8 + (raw_info.active_area.x1 + 7) / 8; (void*)row < (void*)raw_info.buffer + raw_info.pitch * raw_info.active_area.y2; row += 2 * raw_info.width / 8)
-        {
-            struct raw_pixblock * row2 = row + raw_info.pitch / sizeof(struct raw_pixblock);
+        give_semaphore(raw_hist_sem);
+        goto err;
+    }
 
-            struct raw_pixblock * p;
-            struct raw_pixblock * q;
-            for (p = row, q = row2; (void*)p < (void*)row + raw_info.jpeg.width * 14/8; p++, q++)
-            {
+    /* the progressive samples are overwritten */
+    raw_hist_progressive_speed = 0;
+    raw_hist_clear(hist);
 
-                /**
-                 *  p: abcdefgh abcdefgh
-                 *  q: abcdefgh abcdefgh
-                 *
-                 *     rgrgrgrg rgrgrgrg
-                 *     gbgbgbgb gbgbgbgb
-                 */
-
-                //~ int pa = ((int)(p->a));
-                int pb = ((int)(p->b_lo | (p->b_hi << 12)));
-                //~ int pc = ((int)(p->c_lo | (p->c_hi << 10)));
-                int pd = ((int)(p->d_lo | (p->d_hi << 8)));
-                //~ int pe = ((int)(p->e_lo | (p->e_hi << 6)));
-                int pf = ((int)(p->f_lo | (p->f_hi << 4)));
-                //~ int pg = ((int)(p->g_lo | (p->g_hi << 2)));
-                int ph = ((int)(p->h));
-                int qa = ((int)(q->a));
-                //~ int qb = ((int)(q->b_lo | (q->b_hi << 12)));
-                int qc = ((int)(q->c_lo | (q->c_hi << 10)));
-                //~ int qd = ((int)(q->d_lo | (q->d_hi << 8)));
-                int qe = ((int)(q->e_lo | (q->e_hi << 6)));
-                //~ int qf = ((int)(q->f_lo | (q->f_hi << 4)));
-                int qg = ((int)(q->g_lo | (q->g_hi << 2)));
-                //~ int qh = ((int)(q->h));
-
-                hist[pb]++;
-                hist[pd]++;
-                hist[pf]++;
-                hist[ph]++;
-                hist[qa]++;
-                hist[qc]++;
-                hist[qe]++;
-                hist[qg]++;
-
-                /* to check if we sample only the active area */
-                //~ p->a = rand();
-            }
-        }
-        //~ int t1 = get_ms_clock();
-        //~ NotifyBox(5000, "%d ", t1 - t0);
-        //~ save_dng("A:/foo.dng");
+    if (speed == 0 && gray_projection == GRAY_PROJECTION_GREEN)
+    {
+        raw_hist_sample_full_green(hist);
     }
     else
     {
         speed = COERCE(speed, 1, 16);
-        for (int i = os.y0 + off; i < os.y_max - off; i += speed)
-        {
-            int y = BM2RAW_Y(i);
-            for (int j = os.x0; j < os.x_max; j += speed)
-            {
-                int x = BM2RAW_X(j);
-                int px = raw_get_gray_pixel(x, y, gray_projection);
-                hist[px & 16383]++;
-            }
-        }
+        raw_hist_sample_lv(hist, gray_projection, speed);
     }
 
-    int total = 0;
-    int i;
-    for( i=0 ; i < 16384 ; i++ )
-        total += hist[i];
+    raw_hist_finish(hist);
+    raw_hist_get_percentiles(hist, percentiles_x10, output_raw_values, n);
+
+    give_semaphore(raw_hist_sem);
+    return 1;
 
+err:
     for (int k = 0; k < n; k++)
     {
-        int thr = (uint64_t)total * percentiles_x10[k] / 1000 - 2;  // 50% => median; allow up to 2 stuck pixels
-        int n = 0;
-        int ans = -1;
+        output_raw_values[k] = -1;
+    }
+    return -1;
+}
 
-        for( i=0 ; i < 16384; i++ )
-        {
-            n += hist[i];
-            if (n >= thr)
-            {
-                ans = i;
-                break;
-            }
-        }
+int FAST raw_hist_get_percentile_levels_progressive(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed, int reset)
+{
+    if (!raw_update_params()) goto err;
+    get_yuv422_vram();
+
+    take_semaphore(raw_hist_sem, 0);
 
-        output_raw_values[k] = ans;
+    struct raw_hist * hist = raw_hist_get_buf();
+    if (!hist)
+    {
+        give_semaphore(raw_hist_sem);
+        goto err;
+    }
+
+    speed = COERCE(speed, 1, 16);
+
+    if (reset || gray_projection != raw_hist_progressive_projection || speed != raw_hist_progressive_speed)
+    {
+        raw_hist_clear(hist);
+        raw_hist_progressive_projection = gray_projection;
+        raw_hist_progressive_speed = speed;
+    }
+    else if (hist->passes % (speed * speed) == 0)
+    {
+        /* the whole grid was sampled; from now on, let the older samples fade out */
+        raw_hist_decay(hist);
     }
 
-    free(hist);
+    raw_hist_sample_lv(hist, gray_projection, speed);
+    raw_hist_finish(hist);
+    raw_hist_get_percentiles(hist, percentiles_x10, output_raw_values, n);
+
+    give_semaphore(raw_hist_sem);
     return 1;
 
 err:
@@ -538,6 +609,20 @@ err:
     return -1;
 }
 
+void raw_hist_free_buffer()
+{
+    if (!raw_hist_buf)
+    {
+        return;
+    }
+
+    take_semaphore(raw_hist_sem, 0);
+    free(raw_hist_buf);
+    raw_hist_buf = 0;
+    raw_hist_progressive_speed = 0;
+    give_semaphore(raw_hist_sem);
+}
+
 int raw_hist_get_percentile_level(int percentile_x10, int gray_projection, int speed)
 {
     int ans;
@@ -783,6 +868,7 @@ static struct lvinfo_item info_items[] = {
 
 static void hist_init()
 {
+    raw_hist_sem = create_named_semaphore("raw_hist_sem", 1);
     lvinfo_add_items(info_items, COUNT(info_items));
 }
 
@@ -46,6 +46,15 @@ hist_draw_image(
 
 int raw_hist_get_percentile_level(int percentile, int gray_projection, int speed);
 int raw_hist_get_percentile_levels(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed);
+
+/* same as raw_hist_get_percentile_levels, for repeated calls in LiveView (speed 1...16): each call samples
+ * a different subset of the speed x speed grid and adds it to the samples from the previous calls,
+ * so the result refines over frames, up to LiveView resolution after speed^2 calls (older samples fade out after that).
+ * reset: drop the previous samples (e.g. exposure changed) */
+int raw_hist_get_percentile_levels_progressive(int* percentiles_x10, int* output_raw_values, int n, int gray_projection, int speed, int reset);
+
+/* release the histogram kept between the calls above, with the progressive samples (e.g. when leaving LiveView) */
+void raw_hist_free_buffer();
 int raw_hist_get_overexposure_percentage(int gray_projection);
 
 extern struct menu_entry hist_menu_entry;
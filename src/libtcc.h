@@ -73,6 +73,17 @@ LIBTCCAPI int tcc_add_library(TCCState *s, const char *libraryname);
 /* add a symbol to the compiled program */
 LIBTCCAPI int tcc_add_symbol(TCCState *s, const char *name, const void *val);
 
+/* add many symbols at once, same as calling tcc_add_symbol for each of them,
+   but the names are already hashed (standard ELF hash) and packed in one
+   string table: 'names' (names_size bytes, zero-terminated strings) */
+typedef struct TCCSymbol {
+    unsigned value; /* symbol address */
+    unsigned hash;  /* ELF hash of the name */
+    unsigned name;  /* offset of the name in 'names' */
+} TCCSymbol;
+LIBTCCAPI int tcc_add_symbols(TCCState *s, const TCCSymbol *syms, int count,
+                              const char *names, int names_size);
+
 /* output an executable, library or object file. DO NOT call
    tcc_relocate() before. */
 LIBTCCAPI int tcc_output_file(TCCState *s, const char *filename);
@@ -96,6 +107,12 @@ LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name);
 /* return a reference to section data area */
 LIBTCCAPI void *tcc_get_section_ptr(TCCState *s, const char *name, int* size);
 
+/* call hook() for every location patched by tcc_relocate (ARM only): addr is the patched
+   address, type the ELF relocation type, target the address it now refers to
+   (the symbol value, or the veneer used to reach it) */
+typedef void (*tcc_reloc_hook_t)(void *opaque, unsigned addr, int type, unsigned target);
+LIBTCCAPI void tcc_set_reloc_hook(TCCState *s, tcc_reloc_hook_t hook, void *opaque);
+
 #ifdef __cplusplus
 }
 #endif
@@ -11,11 +11,15 @@
 #include "bmp.h"
 #include "lens.h"
 #include "ml-cbr.h"
+#include "module_cache.h"
+#include "module_syms.h"
+#include "version.h"
 
-#ifndef CONFIG_MODULES_MODEL_SYM
+#if !defined(CONFIG_MODULES_MODEL_SYM) || !defined(CONFIG_MODULES_MODEL_SYB)
 #error Not defined file name with symbols
 #endif
 #define MAGIC_SYMBOLS                 "ML/MODULES/"CONFIG_MODULES_MODEL_SYM
+#define MAGIC_SYMBOLS_BIN             "ML/MODULES/"CONFIG_MODULES_MODEL_SYB
 
 /* unloads TCC after linking the modules */
 /* note: this breaks module_exec and ETTR */
@@ -35,6 +39,8 @@ static TCCState *module_state = NULL;
 static struct menu_entry module_submenu[];
 static struct menu_entry module_menu[];
 
+static void module_update_cbr_lists();
+
 CONFIG_INT("module.autoload", module_autoload_disabled, 0);
 CONFIG_INT("module.console", module_console_enabled, 0);
 CONFIG_INT("module.ignore_crashes", module_ignore_crashes, 0);
@@ -46,84 +52,66 @@ static struct msg_queue * module_mq = 0;
 #define MSG_MODULE_LOAD_OFFLINE_STRINGS 3 /* argument: module index in high half (FFFF0000) */
 #define MSG_MODULE_UNLOAD_OFFLINE_STRINGS 4 /* same argument */
 
-static int module_load_symbols(TCCState *s, char *filename)
+static void module_add_symbol(void * state, const char * name, uint32_t address)
 {
-    uint32_t size = 0;
-    FILE* file = NULL;
-    char *buf = NULL;
-    uint32_t count = 0;
-    uint32_t pos = 0;
+    tcc_add_symbol(state, name, (void*)address);
+}
 
-    if( FIO_GetFileSize( filename, &size ) != 0 )
+/* binary symbol file: the same symbols, with hashed names, from build_tools/sym2bin */
+static int module_load_symbols_bin(TCCState *s, char *filename)
+{
+    int size = 0;
+    void *buf = read_entire_file(filename, &size);
+    if(!buf)
     {
-        printf("Error loading '%s': File does not exist\n", filename);
         return -1;
     }
-    buf = fio_malloc(size);
-    if(!buf)
+
+    const struct module_syms_header * syms = module_syms_check(buf, size);
+    if(!syms)
     {
-        printf("Error loading '%s': File too large\n", filename);
+        printf("Invalid symbol file: '%s'\n", filename);
+        fio_free(buf);
         return -1;
     }
 
-    file = FIO_OpenFile(filename, O_RDONLY | O_SYNC);
-    if (!file)
+    /* made for another build (e.g. only autoexec.bin and the .sym were copied to the card)? */
+    if(!module_syms_match(syms, build_version, build_id, build_date))
     {
-        printf("Error loading '%s': File does not exist\n", filename);
+        printf("Outdated symbol file: '%s'\n", filename);
         fio_free(buf);
         return -1;
     }
-    FIO_ReadFile(file, buf, size);
-    FIO_CloseFile(file);
 
-    while(pos < size && buf[pos])
-    {
-        char address_buf[16];
-        char symbol_buf[128];
-        uint32_t length = 0;
-        uint32_t address = 0;
+    /* module_syms_entry has the same layout as TCCSymbol */
+    tcc_add_symbols(s, (const TCCSymbol *) module_syms_entries(syms), syms->count,
+                    module_syms_strings(syms), syms->strings_size);
 
-        while (pos + length < size &&
-               buf[pos + length] &&
-               buf[pos + length] != ' ' &&
-               length < sizeof(address_buf))
-        {
-            address_buf[length] = buf[pos + length];
-            length++;
-        }
-        address_buf[length] = '\000';
+    fio_free(buf);
+    return 0;
+}
 
-        pos += length + 1;
-        length = 0;
+static int module_load_symbols(TCCState *s)
+{
+    /* the binary file is only used if it was made for this build, so it has the same symbols
+     * as the text one, which is not read at all then */
+    if(module_load_symbols_bin(s, MAGIC_SYMBOLS_BIN) == 0)
+    {
+        return 0;
+    }
 
-        while (pos + length < size &&
-               buf[pos + length] &&
-               buf[pos + length] != '\r' &&
-               buf[pos + length] != '\n' &&
-               length < sizeof(symbol_buf))
-        {
-            symbol_buf[length] = buf[pos + length];
-            length++;
-        }
-        symbol_buf[length] = '\000';
+    /* no binary file (e.g. installed by hand), or an outdated one:
+     * text symbol file, address name, one per line */
+    int size = 0;
+    char *buf = (char *) read_entire_file(MAGIC_SYMBOLS, &size);
+    if(!buf)
+    {
+        printf("Error loading '%s'\n", MAGIC_SYMBOLS);
+        return -1;
+    }
 
-        pos += length + 1;
-        length = 0;
+    module_syms_parse_text(buf, size, module_add_symbol, s);
 
-        while (pos + length < size &&
-               buf[pos + length] &&
-              (buf[pos + length] == '\r' ||
-               buf[pos + length] == '\n'))
-        {
-            pos++;
-        }
-        //~ sscanf(address_buf, "%x", &address);
-        address = strtoul(address_buf, NULL, 16);
-
-        tcc_add_symbol(s, symbol_buf, (void*)address);
-        count++;
-    }
-    
     fio_free(buf);
     return 0;
 }
@@ -146,19 +134,31 @@ static int module_valid_filename(char* filename)
     return 0;
 }
 
-/* must be called before unloading TCC */
-static void module_update_core_symbols(TCCState* state)
+extern struct module_symbol_entry _module_symbols_start[];
+extern struct module_symbol_entry _module_symbols_end[];
+
+/* look up the core symbols that may be overridden by modules (must be called before unloading TCC) */
+static void module_get_core_symbols(TCCState* state, void** addresses)
+{
+    struct module_symbol_entry * module_symbol_entry = _module_symbols_start;
+
+    for( ; module_symbol_entry < _module_symbols_end ; module_symbol_entry++ )
+    {
+        *(addresses++) = (void*) tcc_get_symbol(state, (char*) module_symbol_entry->name);
+    }
+}
+
+/* addresses: from module_get_core_symbols, or from the prelinked module cache */
+static void module_update_core_symbols(void** addresses)
 {
     printf("Updating symbols...\n");
 
-    extern struct module_symbol_entry _module_symbols_start[];
-    extern struct module_symbol_entry _module_symbols_end[];
     struct module_symbol_entry * module_symbol_entry = _module_symbols_start;
 
     for( ; module_symbol_entry < _module_symbols_end ; module_symbol_entry++ )
     {
         void* old_address = *(module_symbol_entry->address);
-        void* new_address = (void*) tcc_get_symbol(state, (char*) module_symbol_entry->name);
+        void* new_address = *(addresses++);
         if (new_address)
         {
             if (new_address != module_symbol_entry->address)
@@ -469,16 +469,164 @@ struct TCCState {
     int do_bench; /* option -bench */
     int gen_deps; /* option -MD  */
     char *deps_outfile; /* option -MF */
+
+    /* see tcc_set_reloc_hook */
+    void (*reloc_hook)(void *opaque, unsigned addr, int type, unsigned target);
+    void *reloc_hook_opaque;
 };
 
 #endif
 
+/* link all enabled modules with TCC; fills the module symbols (info, strings etc) and the core symbols updated from modules */
+/* returns 0 if linking failed */
+static int module_link_all(uint32_t module_cnt, void** core_symbols, uint32_t cache_key)
+{
+    int load_errors = 0;
+    
+    /* initialize linker */
+    TCCState *state = tcc_new();
+    tcc_set_options(state, "-nostdlib");
+    if(module_load_symbols(state) < 0)
+    {
+        NotifyBox(2000, "Missing symbol file: " MAGIC_SYMBOLS );
+        tcc_delete(state);
+        return 0;
+    }
+
+    /* load modules */
+    printf("Load modules...\n");
+    for (uint32_t mod = 0; mod < module_cnt; mod++)
+    {
+        if(module_list[mod].enabled)
+        {
+            printf("  [i] load: %s\n", module_list[mod].filename);
+
+            int32_t ret = tcc_add_file(state, module_list[mod].long_filename);
+
+            // SJE FIXME trying to determine module base address
+            // so I can use addr2line.  The listed address seems wrong,
+            // don't know why.  Instead I am dumping some function address
+            // from whatever module I'm testing, which is annoyingly module
+            // specific
+#if 0
+            int size = 0;
+            void *data_addr = NULL;
+            data_addr = tcc_get_section_ptr(state, ".text", &size);
+            DryosDebugMsg(0, 15, "loading module: %s", module_list[mod].filename);
+            DryosDebugMsg(0, 15, "module priv: 0x%x", module_list[mod].cbr);
+            DryosDebugMsg(0, 15, "module .text: 0x%x", data_addr);
+            DryosDebugMsg(0, 15, "module text_addr: 0x%x", state->text_addr);
+//            DryosDebugMsg(0, 15, "sections: %d", state->nb_sections);
+//            for (int ii = 1; ii < state->nb_sections; ii++)
+//            {
+//                Section *s = state->sections[ii];
+//                DryosDebugMsg(0, 15, "section: %s", s->name);
+//                DryosDebugMsg(0, 15, "section sh_addr: 0x%x", s->sh_addr);
+//                DryosDebugMsg(0, 15, "section data_offset: 0x%x", s->data_offset);
+//                DryosDebugMsg(0, 15, "section data: 0x%x", s->data);
+//            }
+#endif
+
+            module_list[mod].valid = 1;
+
+            /* seems bad, disable it */
+            if(ret < 0)
+            {
+                load_errors++;
+                module_list[mod].error = 1;
+                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "FileErr");
+                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Load failed: %s, ret 0x%02X");
+                printf("  [E] %s\n", module_list[mod].long_status);
+            }
+        }
+    }
+
+    printf("Linking..\n");
+#ifdef CONFIG_TCC_UNLOAD
+    int32_t size = tcc_relocate(state, NULL);
+    int32_t reloc_status = -1;
+    
+    if (size > 0)
+    {
+        /* 16-byte aligned, so the prelinked image can be moved to another buffer with the same alignment */
+        void* buf = (void*) malloc(size + 15);
+        
+        if (buf)
+        {
+            module_code = (void*)(((uintptr_t) buf + 15) & ~15);
+            tcc_set_reloc_hook(state, module_cache_reloc_hook, 0);
+            reloc_status = tcc_relocate(state, module_code);
+        }
+    }
+    if(size < 0 || reloc_status < 0)
+#else
+    int32_t ret = tcc_relocate(state, TCC_RELOCATE_AUTO);
+    if(ret < 0)
+#endif
+    {
+        printf("  [E] failed to link modules\n");
+        for (uint32_t mod = 0; mod < module_cnt; mod++)
+        {
+            if(module_list[mod].enabled)
+            {
+                module_list[mod].error = 1;
+                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "Err");
+                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Linking failed");
+            }
+        }
+        module_cache_forget();
+        tcc_delete(state);
+        return 0;
+    }
+    
+    /* load modules symbols */
+    for (uint32_t mod = 0; mod < module_cnt; mod++)
+    {
+        if(module_list[mod].valid && module_list[mod].enabled && !module_list[mod].error)
+        {
+            char module_info_name[32];
+
+            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_INFO_PREFIX), module_list[mod].name);
+            module_list[mod].info = tcc_get_symbol(state, module_info_name);
+            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_STRINGS_PREFIX), module_list[mod].name);
+            module_list[mod].strings = tcc_get_symbol(state, module_info_name);
+            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_PROPHANDLERS_PREFIX), module_list[mod].name);
+            module_list[mod].prop_handlers = tcc_get_symbol(state, module_info_name);
+            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CBR_PREFIX), module_list[mod].name);
+            module_list[mod].cbr = tcc_get_symbol(state, module_info_name);
+            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CONFIG_PREFIX), module_list[mod].name);
+            module_list[mod].config = tcc_get_symbol(state, module_info_name);
+        }
+    }
+    
+    module_get_core_symbols(state, core_symbols);
+    
+#ifdef CONFIG_TCC_UNLOAD
+    /* save the image before the modules get a chance to run (or to load their config) */
+    if (!load_errors)
+    {
+        module_cache_save(cache_key, MAGIC_SYMBOLS, module_code, size, module_list, module_cnt, core_symbols, _module_symbols_end - _module_symbols_start);
+    }
+    else
+    {
+        module_cache_forget();
+    }
+    
+    tcc_delete(state);
+#else
+    module_state = state;
+#endif
+    
+    return 1;
+}
+
 static void _module_load_all(uint32_t list_only)
 {
-    TCCState *state = NULL;
     uint32_t module_cnt = 0;
     struct fio_file file;
     uint32_t update_properties = 0;
+    uint32_t sym_size = 0;
+    uint32_t sym_timestamp = 0;
 
     if(module_console_enabled)
     {
@@ -500,28 +648,26 @@ static void _module_load_all(uint32_t list_only)
         return;
     }
 
-    /* initialize linker */
-    state = tcc_new();
-    tcc_set_options(state, "-nostdlib");
-    if(module_load_symbols(state, MAGIC_SYMBOLS) < 0)
-    {
-        NotifyBox(2000, "Missing symbol file: " MAGIC_SYMBOLS );
-        tcc_delete(state); console_show();
-        return;
-    }
-
     printf("Scanning modules...\n");
     struct fio_dirent * dirent = FIO_FindFirstEx( MODULE_PATH, &file );
     if( IS_ERROR(dirent) )
     {
         NotifyBox(2000, "Module dir missing" );
-        tcc_delete(state); console_show();
+        console_show();
         return;
     }
 
     do
     {
         if (file.mode & ATTR_DIRECTORY) continue; // is a directory
+        
+        /* the symbol file is here too; the prelinked module cache is keyed on its size and time */
+        if (strcasecmp(file.name, CONFIG_MODULES_MODEL_SYM) == 0)
+        {
+            sym_size = file.size;
+            sym_timestamp = file.timestamp;
+        }
+        
         if (module_valid_filename(file.name))
         {
             char module_name[MODULE_FILENAME_LENGTH];
@@ -534,6 +680,8 @@ static void _module_load_all(uint32_t list_only)
             strncpy(module_name, file.name, MODULE_NAME_LENGTH);
             strncpy(module_list[module_cnt].filename, file.name, MODULE_FILENAME_LENGTH);
             snprintf(module_list[module_cnt].long_filename, sizeof(module_list[module_cnt].long_filename), "%s%s", MODULE_PATH, module_list[module_cnt].filename);
+            module_list[module_cnt].file_size = file.size;
+            module_list[module_cnt].file_timestamp = file.timestamp;
 
             uint32_t pos = 0;
             while(module_name[pos])
@@ -613,109 +761,53 @@ static void _module_load_all(uint32_t list_only)
     /* dont load anything, just return */
     if(list_only)
     {
-        tcc_delete(state);
         return;
     }
     
-    /* load modules */
-    printf("Load modules...\n");
-    for (uint32_t mod = 0; mod < module_cnt; mod++)
+    int core_symbol_count = _module_symbols_end - _module_symbols_start;
+    void** core_symbols = malloc(core_symbol_count * sizeof(void*) + 1);
+    if (!core_symbols)
     {
-        if(module_list[mod].enabled)
-        {
-            printf("  [i] load: %s\n", module_list[mod].filename);
-
-            int32_t ret = tcc_add_file(state, module_list[mod].long_filename);
-
-            // SJE FIXME trying to determine module base address
-            // so I can use addr2line.  The listed address seems wrong,
-            // don't know why.  Instead I am dumping some function address
-            // from whatever module I'm testing, which is annoyingly module
-            // specific
-#if 0
-            int size = 0;
-            void *data_addr = NULL;
-            data_addr = tcc_get_section_ptr(state, ".text", &size);
-            DryosDebugMsg(0, 15, "loading module: %s", module_list[mod].filename);
-            DryosDebugMsg(0, 15, "module priv: 0x%x", module_list[mod].cbr);
-            DryosDebugMsg(0, 15, "module .text: 0x%x", data_addr);
-            DryosDebugMsg(0, 15, "module text_addr: 0x%x", state->text_addr);
-//            DryosDebugMsg(0, 15, "sections: %d", state->nb_sections);
-//            for (int ii = 1; ii < state->nb_sections; ii++)
-//            {
-//                Section *s = state->sections[ii];
-//                DryosDebugMsg(0, 15, "section: %s", s->name);
-//                DryosDebugMsg(0, 15, "section sh_addr: 0x%x", s->sh_addr);
-//                DryosDebugMsg(0, 15, "section data_offset: 0x%x", s->data_offset);
-//                DryosDebugMsg(0, 15, "section data: 0x%x", s->data);
-//            }
-#endif
-
-            module_list[mod].valid = 1;
-
-            /* seems bad, disable it */
-            if(ret < 0)
-            {
-                module_list[mod].error = 1;
-                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "FileErr");
-                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Load failed: %s, ret 0x%02X");
-                printf("  [E] %s\n", module_list[mod].long_status);
-            }
-        }
+        console_show();
+        return;
     }
-
-    printf("Linking..\n");
+    
 #ifdef CONFIG_TCC_UNLOAD
-    int32_t size = tcc_relocate(state, NULL);
-    int32_t reloc_status = -1;
+    /* nothing changed since the last boot? then we can skip TCC and use the modules linked back then */
+    printf("Checking prelinked modules...\n");
+    uint32_t cache_key = module_cache_key(sym_size, sym_timestamp, module_list, module_cnt);
+    module_code = module_cache_load(cache_key, MAGIC_SYMBOLS, module_list, module_cnt, core_symbols, core_symbol_count);
     
-    if (size > 0)
+    if (module_code)
     {
-        void* buf = (void*) malloc(size);
-        
-        reloc_status = tcc_relocate(state, buf);
-        module_code = buf;
+        for (uint32_t mod = 0; mod < module_cnt; mod++)
+        {
+            module_list[mod].valid = module_list[mod].enabled;
+        }
     }
-    if(size < 0 || reloc_status < 0)
-#else
-    int32_t ret = tcc_relocate(state, TCC_RELOCATE_AUTO);
-    if(ret < 0)
+    else
 #endif
     {
-        printf("  [E] failed to link modules\n");
-        for (uint32_t mod = 0; mod < module_cnt; mod++)
+#ifdef CONFIG_TCC_UNLOAD
+        int linked = module_link_all(module_cnt, core_symbols, cache_key);
+#else
+        int linked = module_link_all(module_cnt, core_symbols, 0);
+#endif
+        if (!linked)
         {
-            if(module_list[mod].enabled)
-            {
-                module_list[mod].error = 1;
-                snprintf(module_list[mod].status, sizeof(module_list[mod].status), "Err");
-                snprintf(module_list[mod].long_status, sizeof(module_list[mod].long_status), "Linking failed");
-            }
+            free(core_symbols);
+            console_show();
+            return;
         }
-        tcc_delete(state); console_show();
-        return;
     }
     
-    /* load modules symbols */
+    /* check modules symbols */
     printf("Register modules...\n");
     for (uint32_t mod = 0; mod < module_cnt; mod++)
     {
         if(module_list[mod].valid && module_list[mod].enabled && !module_list[mod].error)
         {
-            char module_info_name[32];
-
             /* now check for info structure */
-            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_INFO_PREFIX), module_list[mod].name);
-            module_list[mod].info = tcc_get_symbol(state, module_info_name);
-            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_STRINGS_PREFIX), module_list[mod].name);
-            module_list[mod].strings = tcc_get_symbol(state, module_info_name);
-            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_PROPHANDLERS_PREFIX), module_list[mod].name);
-            module_list[mod].prop_handlers = tcc_get_symbol(state, module_info_name);
-            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CBR_PREFIX), module_list[mod].name);
-            module_list[mod].cbr = tcc_get_symbol(state, module_info_name);
-            snprintf(module_info_name, sizeof(module_info_name), "%s%s", STR(MODULE_CONFIG_PREFIX), module_list[mod].name);
-            module_list[mod].config = tcc_get_symbol(state, module_info_name);
-
             /* check if the module symbol is defined. simple check for valid memory address just in case. */
             if((uint32_t)module_list[mod].info > 0x1000)
             {
@@ -763,6 +855,11 @@ static void _module_load_all(uint32_t list_only)
             char filename[64];
             snprintf(filename, sizeof(filename), "%s%s.cfg", get_config_dir(), module_list[mod].name);
             module_config_load(filename, &module_list[mod]);
+            
+            for (module_config_t * mconfig = module_list[mod].config; mconfig && mconfig->name; mconfig++)
+            {
+                config_var_index_add((struct config_var *) mconfig->ref);
+            }
         }
     }
     
@@ -848,18 +945,16 @@ static void _module_load_all(uint32_t list_only)
     }
     
     
+    /* group the callback routines by type, so the hot paths (vsync, keys, display filters) don't have to scan every module */
+    module_update_cbr_lists();
+    
     if(update_properties)
     {
         prop_update_registration();
     }
 
-    module_update_core_symbols(state);
-    
-    #ifdef CONFIG_TCC_UNLOAD
-    tcc_delete(state);
-    #else
-    module_state = state;
-    #endif
+    module_update_core_symbols(core_symbols);
+    free(core_symbols);
     
     printf("Modules loaded\n");
 }
@@ -877,6 +972,12 @@ static void _module_unload_all(void)
             {
                 module_list[mod].info->deinit();
                 module_list[mod].valid = 0;
+
+                /* config lookups only see valid modules */
+                for (module_config_t * mconfig = module_list[mod].config; mconfig && mconfig->name; mconfig++)
+                {
+                    config_var_index_remove((struct config_var *) mconfig->ref);
+                }
             }
             
             module_cbr_t *cbr = module_list[mod].cbr;
@@ -893,6 +994,9 @@ static void _module_unload_all(void)
             }
         }
     }
+    
+    /* drop the CBRs of unloaded modules */
+    module_update_cbr_lists();
 }
 
 void* module_load(char *filename)
@@ -903,7 +1007,7 @@ void* module_load(char *filename)
     state = tcc_new();
     tcc_set_options(state, "-nostdlib");
 
-    if(module_load_symbols(state, MAGIC_SYMBOLS) < 0)
+    if(module_load_symbols(state) < 0)
     {
         NotifyBox(2000, "Missing symbol file: " MAGIC_SYMBOLS );
         tcc_delete(state);
@@ -1019,29 +1123,142 @@ int module_unload(void *module)
 }
 
 
-/* execute all callback routines of given type. maybe it will get extended to support varargs */
-int FAST module_exec_cbr(unsigned int type)
+/* callback routines grouped by type, in module load order (see module_update_cbr_lists) */
+/* handlers of type t are list[first[t] ... first[t+1]-1] */
+#define MODULE_CBR_TYPES              16
+#define MODULE_CBR_MAX                128
+
+/* CBR_KEYPRESS and CBR_KEYPRESS_RAW share one list, so modules get the keys in load order, whatever cbr type they use */
+#define MODULE_CBR_SLOT(type)         ((type) == CBR_KEYPRESS_RAW ? CBR_KEYPRESS : (type))
+
+/* only 1 call out of MODULE_CBR_TIMING_INTERVAL is timed, to keep the frequent CBRs (VSYNC, DISPLAY_FILTER) cheap */
+#define MODULE_CBR_TIMING_INTERVAL    16
+
+typedef struct
 {
-    for(int mod = 0; mod < MODULE_COUNT_MAX; mod++)
+    uint32_t calls;
+    uint32_t timed;
+    uint32_t max_us;
+    uint32_t total_us;          /* of the timed calls */
+} module_cbr_stats_t;
+
+typedef struct
+{
+    module_cbr_t * list[MODULE_CBR_MAX];
+    module_cbr_stats_t stats[MODULE_CBR_MAX];
+    int first[MODULE_CBR_TYPES + 1];
+} module_cbr_table_t;
+
+/* two tables: the lists are rebuilt in the one nobody is reading, then published with a single pointer store */
+/* dispatchers read module_cbr_table once and use that table until they return */
+static module_cbr_table_t module_cbr_tables[2];
+static module_cbr_table_t * volatile module_cbr_table = &module_cbr_tables[0];
+
+/* timing counters of a given callback routine, or NULL if it's not in the callback table */
+static module_cbr_stats_t * module_cbr_get_stats(module_cbr_table_t * table, module_cbr_t * cbr)
+{
+    int count = table->first[MODULE_CBR_TYPES];
+    for (int i = 0; i < count; i++)
     {
-        module_cbr_t *cbr = module_list[mod].cbr;
-        if(module_list[mod].valid)
+        if (table->list[i] == cbr)
         {
-            while(cbr && cbr->name)
+            return &table->stats[i];
+        }
+    }
+    return NULL;
+}
+
+/* rebuild the per-type callback lists; call after modules were registered or unloaded */
+static void module_update_cbr_lists()
+{
+    module_cbr_table_t * old = module_cbr_table;
+    module_cbr_table_t * table = (old == &module_cbr_tables[0]) ? &module_cbr_tables[1] : &module_cbr_tables[0];
+    int count = 0;
+    
+    for (int type = 0; type < MODULE_CBR_TYPES; type++)
+    {
+        table->first[type] = count;
+        
+        for (int mod = 0; mod < MODULE_COUNT_MAX; mod++)
+        {
+            module_cbr_t *cbr = module_list[mod].cbr;
+            if (!module_list[mod].valid || !cbr)
+            {
+                continue;
+            }
+            
+            for ( ; cbr->name; cbr++)
             {
-                if(cbr->type == type)
+                if (MODULE_CBR_SLOT(cbr->type) != type)
                 {
-                    int ret = cbr->handler(cbr->ctx);
-                    
-                    if (ret != CBR_RET_CONTINUE)
-                    {
-                        return ret;
-                    }
+                    continue;
                 }
-                cbr++;
+                
+                if (count >= MODULE_CBR_MAX)
+                {
+                    printf("  [E] too many cbrs, '%s' ignored\n", cbr->name);
+                    continue;
+                }
+                
+                /* the CBRs that were already there keep their counters */
+                module_cbr_stats_t * stats = module_cbr_get_stats(old, cbr);
+                table->list[count] = cbr;
+                table->stats[count] = stats ? *stats : (module_cbr_stats_t) { 0 };
+                count++;
             }
         }
     }
+    table->first[MODULE_CBR_TYPES] = count;
+    
+    /* the new table must be complete in memory before anybody can see it */
+    asm volatile ("" : : : "memory");
+    module_cbr_table = table;
+}
+
+/* call a single entry from a callback table, count it and sample its execution time */
+static inline unsigned int module_cbr_call(module_cbr_table_t * table, int index, unsigned int ctx)
+{
+    module_cbr_stats_t * stats = &table->stats[index];
+    if (stats->calls++ % MODULE_CBR_TIMING_INTERVAL)
+    {
+        return table->list[index]->handler(ctx);
+    }
+    
+    uint32_t t0 = (uint32_t) get_us_clock();
+    unsigned int ret = table->list[index]->handler(ctx);
+    uint32_t dt = (uint32_t) get_us_clock() - t0;
+    
+    stats->timed++;
+    stats->total_us += dt;
+    stats->max_us = MAX(stats->max_us, dt);
+    return ret;
+}
+
+/* execute all callback routines of given type. maybe it will get extended to support varargs */
+int FAST module_exec_cbr(unsigned int type)
+{
+    int slot = MODULE_CBR_SLOT(type);
+    if (slot >= MODULE_CBR_TYPES)
+    {
+        return CBR_RET_CONTINUE;
+    }
+    
+    module_cbr_table_t * table = module_cbr_table;
+    int end = table->first[slot + 1];
+    for (int i = table->first[slot]; i < end; i++)
+    {
+        if (table->list[i]->type != type)
+        {
+            continue;
+        }
+        
+        int ret = module_cbr_call(table, i, table->list[i]->ctx);
+        
+        if (ret != CBR_RET_CONTINUE)
+        {
+            return ret;
+        }
+    }
     
     return CBR_RET_CONTINUE;
 }
@@ -1250,40 +1467,35 @@ int handle_module_keys(struct event * event)
         count = MAX(count, event->arg);
     }
     
-    for(int mod = 0; mod < MODULE_COUNT_MAX; mod++)
+    /* CBR_KEYPRESS and CBR_KEYPRESS_RAW handlers, in module load order */
+    module_cbr_table_t * table = module_cbr_table;
+    int end = table->first[CBR_KEYPRESS + 1];
+    for (int k = table->first[CBR_KEYPRESS]; k < end; k++)
     {
-        module_cbr_t *cbr = module_list[mod].cbr;
-        if(module_list[mod].valid && cbr)
+        if(table->list[k]->type == CBR_KEYPRESS)
         {
-            while(cbr->name)
+            int pass_event = 1;
+            /* one event may include multiple key presses - decompose it */
+            for (int i = 0; i < count; i++)
             {
-                if(cbr->type == CBR_KEYPRESS)
-                {
-                    int pass_event = 1;
-                    /* one event may include multiple key presses - decompose it */
-                    for (int i = 0; i < count; i++)
-                    {
-                        int portable_key = module_translate_key(event->param, MODULE_KEY_PORTABLE);
-                        pass_event &= cbr->handler(portable_key);
-                    }
-                    if (!pass_event)
-                    {
-                        /* key handled */
-                        return 0;
-                    }
-                }
-                if(cbr->type == CBR_KEYPRESS_RAW)
-                {
-                    /* raw event includes counter - let's pass it only once */
-                    int pass_event = cbr->handler((int)event);
+                int portable_key = module_translate_key(event->param, MODULE_KEY_PORTABLE);
+                pass_event &= module_cbr_call(table, k, portable_key);
+            }
+            if (!pass_event)
+            {
+                /* key handled */
+                return 0;
+            }
+        }
+        else
+        {
+            /* raw event includes counter - let's pass it only once */
+            int pass_event = module_cbr_call(table, k, (int)event);
 
-                    if (!pass_event)
-                    {
-                        /* key handled */
-                        return 0;
-                    }
-                }
-                cbr++;
+            if (!pass_event)
+            {
+                /* key handled */
+                return 0;
             }
         }
     }
@@ -1295,23 +1507,15 @@ int handle_module_keys(struct event * event)
 int module_display_filter_enabled()
 {
 #ifdef CONFIG_DISPLAY_FILTERS
-    for(int mod = 0; mod < MODULE_COUNT_MAX; mod++)
+    module_cbr_table_t * table = module_cbr_table;
+    int end = table->first[CBR_DISPLAY_FILTER + 1];
+    for (int i = table->first[CBR_DISPLAY_FILTER]; i < end; i++)
     {
-        module_cbr_t *cbr = module_list[mod].cbr;
-        if(module_list[mod].valid && cbr)
-        {
-            while(cbr->name)
-            {
-                if(cbr->type == CBR_DISPLAY_FILTER)
-                {
-                    /* arg=0: should this display filter run? */
-                    cbr->ctx = cbr->handler(0);
-                    if (cbr->ctx)
-                        return 1;
-                }
-                cbr++;
-            }
-        }
+        /* arg=0: should this display filter run? */
+        module_cbr_t *cbr = table->list[i];
+        cbr->ctx = module_cbr_call(table, i, 0);
+        if (cbr->ctx)
+            return 1;
     }
 #endif
     return 0;
@@ -1320,31 +1524,25 @@ int module_display_filter_enabled()
 int module_display_filter_update()
 {
 #ifdef CONFIG_DISPLAY_FILTERS
-    for(int mod = 0; mod < MODULE_COUNT_MAX; mod++)
+    module_cbr_table_t * table = module_cbr_table;
+    int end = table->first[CBR_DISPLAY_FILTER + 1];
+    for (int i = table->first[CBR_DISPLAY_FILTER]; i < end; i++)
     {
-        module_cbr_t *cbr = module_list[mod].cbr;
-        if(module_list[mod].valid && cbr)
+        /* run the first module display filter that returned 1 in module_display_filter_enabled */ 
+        if(table->list[i]->ctx)
         {
-            while(cbr->name)
+            /* arg!=0: draw the filtered image in these buffers */
+            struct display_filter_buffers buffers;
+            display_filter_get_buffers((uint32_t**)&(buffers.src_buf), (uint32_t**)&(buffers.dst_buf));
+            
+            /* do not call the CBR with invalid arguments */
+            if (buffers.src_buf && buffers.dst_buf)
             {
-                /* run the first module display filter that returned 1 in module_display_filter_enabled */ 
-                if(cbr->type == CBR_DISPLAY_FILTER && cbr->ctx)
-                {
-                    /* arg!=0: draw the filtered image in these buffers */
-                    struct display_filter_buffers buffers;
-                    display_filter_get_buffers((uint32_t**)&(buffers.src_buf), (uint32_t**)&(buffers.dst_buf));
-                    
-                    /* do not call the CBR with invalid arguments */
-                    if (buffers.src_buf && buffers.dst_buf)
-                    {
-                        cbr->handler((intptr_t) &buffers);
-                    }
-                    
-                    /* do not allow other display filters to run */
-                    return 1;
-                }
-                cbr++;
+                module_cbr_call(table, i, (intptr_t) &buffers);
             }
+            
+            /* do not allow other display filters to run */
+            return 1;
         }
     }
 #endif
@@ -1814,6 +2012,17 @@ static MENU_UPDATE_FUNC(module_menu_info_update)
                 bmp_printf(FONT_MED, x, y, "%s", cbr->name);
                 bmp_printf(FONT_MED, x_val, y, "%s", cbr->symbol);
                 y += font_med.height;
+                
+                /* call count and execution time (sampled), for the CBRs dispatched from the callback table */
+                module_cbr_stats_t * stats = module_cbr_get_stats(module_cbr_table, cbr);
+                if (stats && stats->timed)
+                {
+                    bmp_printf(FONT_SMALL, x_val, y, 
+                        "%d calls, avg %d us, max %d us",
+                        stats->calls, stats->total_us / stats->timed, stats->max_us
+                    );
+                    y += font_small.height;
+                }
             }
         }
     }
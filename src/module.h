@@ -181,6 +181,8 @@ typedef struct
     module_prophandler_t **prop_handlers;
     module_cbr_t *cbr;
     module_config_t *config;
+    uint32_t file_size;             /* from the directory listing, for the prelinked module cache */
+    uint32_t file_timestamp;
     int valid;
     int enabled;
     int error;
@@ -0,0 +1,637 @@
+/** \file
+ * Prelinked module cache
+ *
+ * Linking the modules with TCC (parsing the symbol file, loading each .mo, relocating)
+ * takes a few seconds at startup. After a successful link, we save the relocated image
+ * to MODULE_CACHE_FILE, together with the locations that depend on its load address
+ * (reported by TCC while relocating). At the next boot, if ML, the symbol file and the
+ * enabled modules are unchanged, the image is loaded from there and moved to wherever
+ * malloc placed it, without running TCC at all.
+ *
+ * "Unchanged" is checked on the directory listing (name, size and timestamp of each file),
+ * so a cache hit does not read anything else from the card. Only if that does not match
+ * (e.g. the same files were copied again), the files are hashed by contents.
+ *
+ * Anything unexpected (unknown relocation type, branch out of range after moving,
+ * file mismatch) simply means no cache, and the modules are linked as usual.
+ */
+
+#include "dryos.h"
+#include "module.h"
+#include "module_cache.h"
+#include "version.h"
+
+#define MODULE_CACHE_MAGIC            0x4C504C4D    /* "MLPL" */
+#define MODULE_CACHE_VERSION          1
+
+/* relocation types reported by TCC (see tcc/elf.h) */
+#define R_ARM_PC24                    1
+#define R_ARM_ABS32                   2
+#define R_ARM_REL32                   3
+#define R_ARM_THM_CALL                10
+#define R_ARM_COPY                    20
+#define R_ARM_CALL                    28
+#define R_ARM_JUMP24                  29
+#define R_ARM_THM_JUMP24              30
+#define R_ARM_V4BX                    40
+#define R_ARM_PREL31                  42
+#define R_ARM_MOVW_ABS_NC             43
+#define R_ARM_MOVT_ABS                44
+#define R_ARM_THM_MOVW_ABS_NC         47
+#define R_ARM_THM_MOVT_ABS            48
+
+/* what to do with a patched location when the image is moved by "delta" bytes */
+enum module_cache_fixup_type
+{
+    FIXUP_ABS,                  /* absolute address inside the image: += delta */
+    FIXUP_REL,                  /* PC-relative reference to a fixed address: -= delta */
+    FIXUP_ARM_BRANCH,           /* ARM B/BL/BLX to a fixed address */
+    FIXUP_THUMB_BRANCH,         /* Thumb-2 B.W/BL/BLX to a fixed address */
+    FIXUP_ARM_MOVW,             /* MOVW/MOVT loading an address inside the image */
+    FIXUP_ARM_MOVT,
+    FIXUP_THUMB_MOVW,
+    FIXUP_THUMB_MOVT,
+};
+
+/* file layout: header, modules, symbols, fixups, image */
+struct module_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key;               /* module_cache_key() */
+    uint32_t content_key;       /* module_cache_content_key() */
+    uint32_t base;              /* address the image was linked at */
+    uint32_t size;              /* image size, in bytes */
+    uint32_t module_count;      /* enabled modules, in load order */
+    uint32_t symbol_count;      /* entries in _module_symbols */
+    uint32_t fixup_count;
+};
+
+struct module_cache_module
+{
+    char name[MODULE_NAME_LENGTH+1];
+    uint32_t info;              /* addresses at the original base, 0 if missing */
+    uint32_t strings;
+    uint32_t prop_handlers;
+    uint32_t cbr;
+    uint32_t config;
+};
+
+struct module_cache_fixup
+{
+    uint32_t offset;            /* patched location, from the start of the image */
+    uint32_t type;              /* enum module_cache_fixup_type */
+    uint32_t target;            /* address it refers to, at the original base */
+};
+
+/* relocations reported by TCC while linking (absolute addresses; offset field unused until module_cache_save) */
+static struct
+{
+    struct module_cache_fixup * relocs;
+    int count;
+    int allocated;
+    int failed;                 /* out of memory; don't save anything */
+} module_cache_rec;
+
+static uint32_t module_cache_hash(uint32_t hash, const void * data, int size)
+{
+    /* FNV-1a */
+    const uint8_t * p = data;
+    for (int i = 0; i < size; i++)
+    {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static uint32_t module_cache_hash_file(uint32_t hash, const char * filename)
+{
+    int size = 0;
+    uint8_t * buf = read_entire_file(filename, &size);
+    if (!buf)
+    {
+        return 0;
+    }
+
+    hash = module_cache_hash(hash, buf, size);
+    hash = module_cache_hash(hash, &size, sizeof(size));
+    fio_free(buf);
+    return hash;
+}
+
+/* this ML build */
+static uint32_t module_cache_hash_build()
+{
+    uint32_t hash = 2166136261u;
+    int version = MODULE_CACHE_VERSION;
+
+    hash = module_cache_hash(hash, &version, sizeof(version));
+    hash = module_cache_hash(hash, build_version, strlen(build_version));
+    hash = module_cache_hash(hash, build_id, strlen(build_id));
+    hash = module_cache_hash(hash, build_date, strlen(build_date));
+    return hash;
+}
+
+uint32_t module_cache_key(uint32_t sym_size, uint32_t sym_timestamp, module_entry_t * modules, int count)
+{
+    if (!sym_size)
+    {
+        return 0;
+    }
+
+    uint32_t hash = module_cache_hash_build();
+    hash = module_cache_hash(hash, &sym_size, sizeof(sym_size));
+    hash = module_cache_hash(hash, &sym_timestamp, sizeof(sym_timestamp));
+
+    for (int mod = 0; mod < count; mod++)
+    {
+        if (modules[mod].enabled)
+        {
+            hash = module_cache_hash(hash, modules[mod].name, strlen(modules[mod].name) + 1);
+            hash = module_cache_hash(hash, &modules[mod].file_size, sizeof(modules[mod].file_size));
+            hash = module_cache_hash(hash, &modules[mod].file_timestamp, sizeof(modules[mod].file_timestamp));
+        }
+    }
+
+    return hash ? hash : 1;
+}
+
+/* same files as module_cache_key, hashed by contents; reads all of them, so only used when saving or when the key did not match.
+ * returns 0 if some file could not be read */
+static uint32_t module_cache_content_key(const char * sym_file, module_entry_t * modules, int count)
+{
+    uint32_t hash = module_cache_hash_file(module_cache_hash_build(), sym_file);
+
+    for (int mod = 0; mod < count && hash; mod++)
+    {
+        if (modules[mod].enabled)
+        {
+            hash = module_cache_hash(hash, modules[mod].name, strlen(modules[mod].name) + 1);
+            hash = module_cache_hash_file(hash, modules[mod].long_filename);
+        }
+    }
+
+    return hash;
+}
+
+void module_cache_reloc_hook(void * opaque, unsigned addr, int type, unsigned target)
+{
+    if (module_cache_rec.failed)
+    {
+        return;
+    }
+
+    if (module_cache_rec.count == module_cache_rec.allocated)
+    {
+        int allocated = MAX(module_cache_rec.allocated * 2, 1024);
+        struct module_cache_fixup * relocs = malloc(allocated * sizeof(relocs[0]));
+        if (!relocs)
+        {
+            module_cache_forget();
+            module_cache_rec.failed = 1;
+            return;
+        }
+
+        if (module_cache_rec.relocs)
+        {
+            memcpy(relocs, module_cache_rec.relocs, module_cache_rec.count * sizeof(relocs[0]));
+            free(module_cache_rec.relocs);
+        }
+        module_cache_rec.relocs = relocs;
+        module_cache_rec.allocated = allocated;
+    }
+
+    struct module_cache_fixup * r = &module_cache_rec.relocs[module_cache_rec.count++];
+    r->offset = addr;
+    r->type = type;
+    r->target = target;
+}
+
+void module_cache_forget()
+{
+    if (module_cache_rec.relocs)
+    {
+        free(module_cache_rec.relocs);
+    }
+    memset(&module_cache_rec, 0, sizeof(module_cache_rec));
+}
+
+/* patched locations may be unaligned (data, Thumb code) */
+static uint32_t read32(uint8_t * p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+static void write32(uint8_t * p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+/* immediate fields of MOVW/MOVT, encoded the way TCC adds them (tccelf.c, relocate_section) */
+static uint32_t arm_mov_imm(uint32_t value)
+{
+    return ((value >> 12 & 0xF) << 16) | (value & 0xFFF);
+}
+
+static uint32_t thumb_mov_imm(uint32_t value)
+{
+    return ((value >> 8 & 0x7) << 28) | ((value & 0xFF) << 16) | ((value >> 11 & 1) << 10) | (value >> 12 & 0xF);
+}
+
+static uint32_t fixup_mov_imm(int type, uint32_t target)
+{
+    switch (type)
+    {
+        case FIXUP_ARM_MOVW:    return arm_mov_imm(target & 0xFFFF);
+        case FIXUP_ARM_MOVT:    return arm_mov_imm(target >> 16);
+        case FIXUP_THUMB_MOVW:  return thumb_mov_imm(target & 0xFFFF);
+        default:                return thumb_mov_imm(target >> 16);
+    }
+}
+
+/* how a relocation reported by TCC must be adjusted when moving the image; -1 = nothing to do, -2 = can't handle it */
+static int module_cache_fixup_type(struct module_cache_fixup * r, uint32_t base, uint32_t size, uint8_t * image)
+{
+    /* does it refer to something inside the image, which moves together with it? */
+    int inside = (r->target >= base && r->target <= base + size);
+
+    switch (r->type)
+    {
+        case R_ARM_ABS32:
+            return inside ? FIXUP_ABS : -1;
+
+        case R_ARM_REL32:
+            return inside ? -1 : FIXUP_REL;
+
+        case R_ARM_PREL31:
+            /* TCC falls through to R_ARM_ABS32 here, so the word also includes the target address */
+            return inside ? FIXUP_ABS : -2;
+
+        case R_ARM_PC24:
+        case R_ARM_CALL:
+        case R_ARM_JUMP24:
+            return inside ? -1 : FIXUP_ARM_BRANCH;
+
+        case R_ARM_THM_CALL:
+        case R_ARM_THM_JUMP24:
+            /* target 0: weak reference, left alone by TCC */
+            return (inside || !r->target) ? -1 : FIXUP_THUMB_BRANCH;
+
+        case R_ARM_MOVW_ABS_NC:
+            return inside ? FIXUP_ARM_MOVW : -1;
+
+        case R_ARM_MOVT_ABS:
+            return inside ? FIXUP_ARM_MOVT : -1;
+
+        case R_ARM_THM_MOVW_ABS_NC:
+            return inside ? FIXUP_THUMB_MOVW : -1;
+
+        case R_ARM_THM_MOVT_ABS:
+        {
+            if (!inside)
+            {
+                return -1;
+            }
+
+            /* TCC ORs this one into the instruction; we can only redo it if the fields were empty */
+            uint32_t imm = fixup_mov_imm(FIXUP_THUMB_MOVT, r->target);
+            uint32_t mask = thumb_mov_imm(0xFFFF);
+            return ((read32(image + r->offset - base) & mask) == imm) ? FIXUP_THUMB_MOVT : -2;
+        }
+
+        case R_ARM_COPY:
+        case R_ARM_V4BX:
+            return -1;
+
+        default:
+            /* GOT/PLT and friends */
+            return -2;
+    }
+}
+
+/* adjust one location for an image moved by "delta" bytes; returns 0 if not possible (branch out of range) */
+static int module_cache_apply(uint8_t * image, struct module_cache_fixup * f, int32_t delta)
+{
+    uint8_t * p = image + f->offset;
+    uint32_t word = read32(p);
+
+    switch (f->type)
+    {
+        case FIXUP_ABS:
+            word += delta;
+            break;
+
+        case FIXUP_REL:
+            word -= delta;
+            break;
+
+        case FIXUP_ARM_BRANCH:
+        {
+            int32_t x = ((int32_t)(word << 8) >> 6) - delta;
+            if (x >= 0x2000000 || x < -0x2000000)
+            {
+                return 0;
+            }
+            word = (word & 0xFF000000) | ((x >> 2) & 0xFFFFFF);
+            break;
+        }
+
+        case FIXUP_THUMB_BRANCH:
+        {
+            uint32_t hi = word & 0xFFFF;
+            uint32_t lo = word >> 16;
+            int s  = (hi >> 10) & 1;
+            int i1 = !(((lo >> 13) & 1) ^ s);
+            int i2 = !(((lo >> 11) & 1) ^ s);
+            int32_t x = (s << 24) | (i1 << 23) | (i2 << 22) | ((hi & 0x3FF) << 12) | ((lo & 0x7FF) << 1);
+            if (x & 0x01000000)
+            {
+                x -= 0x02000000;
+            }
+
+            x -= delta;
+            if (x >= 0x1000000 || x < -0x1000000)
+            {
+                return 0;
+            }
+
+            s  = (x >> 24) & 1;
+            i1 = (x >> 23) & 1;
+            i2 = (x >> 22) & 1;
+            hi = (hi & 0xF800) | (s << 10) | ((x >> 12) & 0x3FF);
+            lo = (lo & 0xD000) | ((s ^ !i1) << 13) | ((s ^ !i2) << 11) | ((x >> 1) & 0x7FF);
+            word = hi | (lo << 16);
+            break;
+        }
+
+        default:
+            /* MOVW/MOVT: TCC added the immediate fields to the instruction; swap them for the new address */
+            word = word - fixup_mov_imm(f->type, f->target) + fixup_mov_imm(f->type, f->target + delta);
+            break;
+    }
+
+    write32(p, word);
+    return 1;
+}
+
+void module_cache_save(uint32_t key, const char * sym_file, void * image, uint32_t size, module_entry_t * modules, int count, void ** symbols, int symbol_count)
+{
+    uint32_t base = (uint32_t) image;
+    struct module_cache_fixup * fixups = module_cache_rec.relocs;
+    int fixup_count = 0;
+
+    if (!key || module_cache_rec.failed)
+    {
+        goto end;
+    }
+
+    uint32_t content_key = module_cache_content_key(sym_file, modules, count);
+    if (!content_key)
+    {
+        goto end;
+    }
+
+    /* keep only what has to be adjusted when moving the image (in place; fixups are never more than relocs) */
+    for (int i = 0; i < module_cache_rec.count; i++)
+    {
+        struct module_cache_fixup * r = &module_cache_rec.relocs[i];
+        if (r->offset < base || r->offset + 4 > base + size)
+        {
+            printf("  [E] prelink: reloc outside image\n");
+            goto end;
+        }
+
+        int type = module_cache_fixup_type(r, base, size, image);
+        if (type == -2)
+        {
+            printf("  [i] prelink: reloc type %d not supported\n", r->type);
+            goto end;
+        }
+
+        if (type >= 0)
+        {
+            fixups[fixup_count].offset = r->offset - base;
+            fixups[fixup_count].type = type;
+            fixups[fixup_count].target = r->target;
+            fixup_count++;
+        }
+    }
+
+    struct module_cache_header header = {
+        .magic          = MODULE_CACHE_MAGIC,
+        .version        = MODULE_CACHE_VERSION,
+        .key            = key,
+        .content_key    = content_key,
+        .base           = base,
+        .size           = size,
+        .symbol_count   = symbol_count,
+        .fixup_count    = fixup_count,
+    };
+
+    for (int mod = 0; mod < count; mod++)
+    {
+        header.module_count += modules[mod].enabled;
+    }
+
+    /* module and symbol addresses are saved as 32-bit values, like the fixups */
+    struct module_cache_module * mods = malloc(header.module_count * sizeof(mods[0]) + symbol_count * sizeof(uint32_t) + 1);
+    if (!mods)
+    {
+        goto end;
+    }
+    uint32_t * saved_symbols = (void *)(mods + header.module_count);
+
+    for (int i = 0; i < symbol_count; i++)
+    {
+        saved_symbols[i] = (uint32_t) symbols[i];
+    }
+
+    for (int mod = 0, k = 0; mod < count; mod++)
+    {
+        if (modules[mod].enabled)
+        {
+            memset(&mods[k], 0, sizeof(mods[k]));
+            snprintf(mods[k].name, sizeof(mods[k].name), "%s", modules[mod].name);
+            mods[k].info            = (uint32_t) modules[mod].info;
+            mods[k].strings         = (uint32_t) modules[mod].strings;
+            mods[k].prop_handlers   = (uint32_t) modules[mod].prop_handlers;
+            mods[k].cbr             = (uint32_t) modules[mod].cbr;
+            mods[k].config          = (uint32_t) modules[mod].config;
+            k++;
+        }
+    }
+
+    FILE * file = FIO_CreateFile(MODULE_CACHE_FILE);
+    if (file)
+    {
+        int ok =
+            FIO_WriteFile(file, &header, sizeof(header)) == sizeof(header) &&
+            FIO_WriteFile(file, mods, header.module_count * sizeof(mods[0])) == (int)(header.module_count * sizeof(mods[0])) &&
+            FIO_WriteFile(file, saved_symbols, symbol_count * sizeof(saved_symbols[0])) == (int)(symbol_count * sizeof(saved_symbols[0])) &&
+            FIO_WriteFile(file, fixups, fixup_count * sizeof(fixups[0])) == (int)(fixup_count * sizeof(fixups[0])) &&
+            FIO_WriteFile(file, image, size) == (int) size;
+        FIO_CloseFile(file);
+
+        if (ok)
+        {
+            printf("  [i] prelink: saved %d KB, %d fixups\n", size / 1024, fixup_count);
+        }
+        else
+        {
+            FIO_RemoveFile(MODULE_CACHE_FILE);
+        }
+    }
+
+    free(mods);
+
+end:
+    module_cache_forget();
+}
+
+/* address saved at the original base -> address in the moved image (addresses outside the image are kept) */
+static void * module_cache_rebase(uint32_t addr, struct module_cache_header * header, int32_t delta)
+{
+    if (addr >= header->base && addr <= header->base + header->size)
+    {
+        return (void *)(addr + delta);
+    }
+    return (void *) addr;
+}
+
+/* the files were copied again, but they are the same: remember the new key, so we don't have to hash them next time */
+static void module_cache_update_key(uint8_t * buf, int file_size, uint32_t key)
+{
+    struct module_cache_header * header = (void *) buf;
+    header->key = key;
+
+    FILE * file = FIO_CreateFile(MODULE_CACHE_FILE);
+    if (file)
+    {
+        int ok = FIO_WriteFile(file, buf, file_size) == file_size;
+        FIO_CloseFile(file);
+
+        if (!ok)
+        {
+            FIO_RemoveFile(MODULE_CACHE_FILE);
+        }
+    }
+}
+
+void * module_cache_load(uint32_t key, const char * sym_file, module_entry_t * modules, int count, void ** symbols, int symbol_count)
+{
+    int file_size = 0;
+    uint8_t * buf = 0;
+    uint8_t * image = 0;
+    uint8_t * image_raw = 0;
+
+    if (!key)
+    {
+        return 0;
+    }
+
+    buf = read_entire_file(MODULE_CACHE_FILE, &file_size);
+    if (!buf)
+    {
+        return 0;
+    }
+
+    struct module_cache_header * header = (void *) buf;
+    int enabled = 0;
+    for (int mod = 0; mod < count; mod++)
+    {
+        enabled += modules[mod].enabled;
+    }
+
+    if (file_size < (int) sizeof(*header) ||
+        header->magic != MODULE_CACHE_MAGIC ||
+        header->version != MODULE_CACHE_VERSION ||
+        header->module_count != (uint32_t) enabled ||
+        header->symbol_count != (uint32_t) symbol_count)
+    {
+        printf("  [i] prelink: cache outdated\n");
+        goto fail;
+    }
+
+    /* the directory listing changed? then only the contents can tell */
+    int key_changed = (header->key != key);
+    if (key_changed && header->content_key != module_cache_content_key(sym_file, modules, count))
+    {
+        printf("  [i] prelink: cache outdated\n");
+        goto fail;
+    }
+
+    struct module_cache_module * mods = (void *)(header + 1);
+    uint32_t * saved_symbols = (void *)(mods + header->module_count);
+    struct module_cache_fixup * fixups = (void *)(saved_symbols + header->symbol_count);
+    uint8_t * saved_image = (void *)(fixups + header->fixup_count);
+
+    if (saved_image + header->size != buf + file_size)
+    {
+        printf("  [E] prelink: bad cache size\n");
+        goto fail;
+    }
+
+    /* same alignment as the linked image (TCC aligns sections to 16 bytes), so the layout is identical */
+    image_raw = malloc(header->size + 15);
+    if (!image_raw)
+    {
+        goto fail;
+    }
+    image = (void *)(((uintptr_t) image_raw + 15) & ~15);
+    int32_t delta = (uint32_t) image - header->base;
+
+    memcpy(image, saved_image, header->size);
+
+    for (uint32_t i = 0; i < header->fixup_count; i++)
+    {
+        if (fixups[i].offset + 4 > header->size || !module_cache_apply(image, &fixups[i], delta))
+        {
+            printf("  [i] prelink: can't move image (fixup %d)\n", i);
+            goto fail;
+        }
+    }
+
+    for (int mod = 0, k = 0; mod < count; mod++)
+    {
+        if (modules[mod].enabled)
+        {
+            if (!streq(mods[k].name, modules[mod].name))
+            {
+                goto fail;
+            }
+
+            modules[mod].info           = module_cache_rebase(mods[k].info, header, delta);
+            modules[mod].strings        = module_cache_rebase(mods[k].strings, header, delta);
+            modules[mod].prop_handlers  = module_cache_rebase(mods[k].prop_handlers, header, delta);
+            modules[mod].cbr            = module_cache_rebase(mods[k].cbr, header, delta);
+            modules[mod].config         = module_cache_rebase(mods[k].config, header, delta);
+            k++;
+        }
+    }
+
+    for (int i = 0; i < symbol_count; i++)
+    {
+        symbols[i] = module_cache_rebase(saved_symbols[i], header, delta);
+    }
+
+    printf("  [i] prelink: %d KB at %x (linked at %x)\n", header->size / 1024, image, header->base);
+
+    if (key_changed)
+    {
+        module_cache_update_key(buf, file_size, key);
+    }
+
+    fio_free(buf);
+    return image;
+
+fail:
+    if (image_raw)
+    {
+        free(image_raw);
+    }
+    fio_free(buf);
+    return 0;
+}
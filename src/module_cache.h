@@ -0,0 +1,35 @@
+/** \file
+ * Prelinked module cache: skips TCC at startup when ML and the enabled modules did not change.
+ */
+
+#ifndef _module_cache_h_
+#define _module_cache_h_
+
+#include "module.h"
+
+#define MODULE_CACHE_FILE             MODULE_PATH"PRELINK.BIN"
+
+/* hash of everything the linked image depends on, from the directory listing: this ML build, size and timestamp
+ * of the symbol file, name, size and timestamp of the enabled modules, in load order (nothing is read from the card).
+ * returns 0 if there is no symbol file (no caching then) */
+uint32_t module_cache_key(uint32_t sym_size, uint32_t sym_timestamp, module_entry_t * modules, int count);
+
+/* load the image linked for this key and move it to a new buffer; NULL if there's no valid cache for this key.
+ * if only the key changed, but sym_file and the modules have the same contents as when the cache was saved,
+ * the cache is used too (and updated with the new key).
+ * fills the info/strings/prop_handlers/cbr/config pointers of the enabled modules and the addresses
+ * of the core symbols updated from modules (symbols[i] for _module_symbols_start[i], NULL if not found) */
+void * module_cache_load(uint32_t key, const char * sym_file, module_entry_t * modules, int count, void ** symbols, int symbol_count);
+
+/* pass this to tcc_set_reloc_hook before tcc_relocate, so module_cache_save knows which locations depend on the load address */
+void module_cache_reloc_hook(void * opaque, unsigned addr, int type, unsigned target);
+
+/* save the image right after tcc_relocate, before any module code or config had a chance to change it.
+ * sym_file and the modules are hashed by contents too, for module_cache_load.
+ * also forgets the relocations recorded by module_cache_reloc_hook */
+void module_cache_save(uint32_t key, const char * sym_file, void * image, uint32_t size, module_entry_t * modules, int count, void ** symbols, int symbol_count);
+
+/* forget the relocations recorded by module_cache_reloc_hook (e.g. linking failed) */
+void module_cache_forget();
+
+#endif
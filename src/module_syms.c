@@ -0,0 +1,200 @@
+/** \file
+ * Text and binary symbol files for the module loader (see module_syms.h)
+ */
+
+#include <string.h>
+#include "module_syms.h"
+
+uint32_t module_syms_hash(const char * name)
+{
+    const unsigned char * p = (const unsigned char *) name;
+    uint32_t h = 0;
+
+    while (*p)
+    {
+        h = (h << 4) + *p++;
+        uint32_t g = h & 0xf0000000;
+        if (g)
+        {
+            h ^= g >> 24;
+        }
+        h &= ~g;
+    }
+    return h;
+}
+
+static uint32_t module_syms_hash_string(uint32_t h, const char * s)
+{
+    const uint8_t * p = (const uint8_t *) s;
+
+    /* with the terminator, so the strings can't run into each other */
+    do
+    {
+        h = (h ^ *p) * 16777619u;
+    }
+    while (*p++);
+
+    return h;
+}
+
+uint32_t module_syms_build_hash(const char * version, const char * id, const char * date)
+{
+    uint32_t h = 2166136261u;
+    h = module_syms_hash_string(h, version);
+    h = module_syms_hash_string(h, id);
+    h = module_syms_hash_string(h, date);
+    return h;
+}
+
+/* what strtoul(s, NULL, 16) returns for the address column */
+static uint32_t module_syms_parse_hex(const char * s)
+{
+    uint32_t value = 0;
+
+    while (*s == ' ' || *s == '\t')
+    {
+        s++;
+    }
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        s += 2;
+    }
+
+    while (1)
+    {
+        char c = *s++;
+        if (c >= '0' && c <= '9')       value = (value << 4) + (c - '0');
+        else if (c >= 'a' && c <= 'f')  value = (value << 4) + (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F')  value = (value << 4) + (c - 'A' + 10);
+        else break;
+    }
+    return value;
+}
+
+int module_syms_parse_text(const char * buf, uint32_t size,
+    void (*add)(void * ctx, const char * name, uint32_t address), void * ctx)
+{
+    uint32_t pos = 0;
+    int count = 0;
+
+    while(pos < size && buf[pos])
+    {
+        char address_buf[16];
+        char symbol_buf[128];
+        uint32_t length = 0;
+
+        while (pos + length < size &&
+               buf[pos + length] &&
+               buf[pos + length] != ' ' &&
+               length < sizeof(address_buf) - 1)
+        {
+            address_buf[length] = buf[pos + length];
+            length++;
+        }
+        address_buf[length] = '\000';
+
+        pos += length + 1;
+        length = 0;
+
+        while (pos + length < size &&
+               buf[pos + length] &&
+               buf[pos + length] != '\r' &&
+               buf[pos + length] != '\n' &&
+               length < sizeof(symbol_buf) - 1)
+        {
+            symbol_buf[length] = buf[pos + length];
+            length++;
+        }
+        symbol_buf[length] = '\000';
+
+        pos += length + 1;
+
+        while (pos < size &&
+               buf[pos] &&
+              (buf[pos] == '\r' ||
+               buf[pos] == '\n'))
+        {
+            pos++;
+        }
+
+        add(ctx, symbol_buf, module_syms_parse_hex(address_buf));
+        count++;
+    }
+
+    return count;
+}
+
+const struct module_syms_header * module_syms_check(const void * buf, uint32_t size)
+{
+    const struct module_syms_header * header = buf;
+
+    if (size < sizeof(*header) ||
+        header->magic != MODULE_SYMS_MAGIC ||
+        header->version != MODULE_SYMS_VERSION)
+    {
+        return NULL;
+    }
+
+    uint32_t available = size - sizeof(*header);
+    if (header->count > available / sizeof(struct module_syms_entry) ||
+        header->strings_size == 0 ||
+        header->strings_size != available - header->count * sizeof(struct module_syms_entry))
+    {
+        return NULL;
+    }
+
+    /* every name must be inside the string table, which ends with a terminator */
+    const struct module_syms_entry * entries = module_syms_entries(header);
+    const char * strings = module_syms_strings(header);
+
+    if (strings[header->strings_size - 1])
+    {
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < header->count; i++)
+    {
+        if (entries[i].name >= header->strings_size)
+        {
+            return NULL;
+        }
+    }
+
+    return header;
+}
+
+int module_syms_match(const struct module_syms_header * header, const char * version, const char * id, const char * date)
+{
+    return header->build_hash == module_syms_build_hash(version, id, date);
+}
+
+int module_syms_find(const struct module_syms_header * header, const char * name, uint32_t * address)
+{
+    const struct module_syms_entry * entries = module_syms_entries(header);
+    const char * strings = module_syms_strings(header);
+    uint32_t lo = 0;
+    uint32_t hi = header->count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int cmp = strcmp(name, strings + entries[mid].name);
+
+        if (cmp == 0)
+        {
+            *address = entries[mid].address;
+            return 1;
+        }
+
+        if (cmp < 0)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,71 @@
+/** \file
+ * Symbols exported to modules: the text symbol file (address name, one per line)
+ * and its binary version, generated at build time by build_tools/sym2bin.
+ *
+ * The binary file has the same symbols, with the names already hashed for TCC
+ * (tcc_add_symbols) and sorted, so the module loader can register them in one go,
+ * without parsing. It is written in the host byte order (little endian, like the camera).
+ * It also records the build it was made for (the version strings from version.c), so the loader
+ * can tell when it does not belong to the running autoexec.bin (and parse the text file instead)
+ * without reading the text file at all.
+ *
+ * Plain C with no DryOS dependencies, so it can also be built on the host (build_tools, contrib/sym_test).
+ */
+
+#ifndef _module_syms_h_
+#define _module_syms_h_
+
+#include <stdint.h>
+
+#define MODULE_SYMS_MAGIC   0x42534C4D  /* "MLSB" */
+#define MODULE_SYMS_VERSION 3
+
+/* file layout: header, entries (sorted by name), strings (zero-terminated names) */
+struct module_syms_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;             /* number of entries */
+    uint32_t strings_size;      /* bytes */
+    uint32_t build_hash;        /* module_syms_build_hash() of the build it was made for */
+};
+
+/* same layout as TCCSymbol */
+struct module_syms_entry
+{
+    uint32_t address;
+    uint32_t hash;              /* module_syms_hash(name) */
+    uint32_t name;              /* offset in the string table */
+};
+
+static inline const struct module_syms_entry * module_syms_entries(const struct module_syms_header * header)
+{
+    return (const struct module_syms_entry *)(header + 1);
+}
+
+static inline const char * module_syms_strings(const struct module_syms_header * header)
+{
+    return (const char *)(module_syms_entries(header) + header->count);
+}
+
+/* the standard ELF hash, as used by TCC for its symbol table */
+uint32_t module_syms_hash(const char * name);
+
+/* hash of the version strings of a build (build_version, build_id, build_date), as stored in the binary file (FNV-1a) */
+uint32_t module_syms_build_hash(const char * version, const char * id, const char * date);
+
+/* parse a text symbol file (buf does not have to be zero-terminated), calling add() for each line;
+ * returns the number of symbols. The same name may appear more than once; TCC keeps the first one. */
+int module_syms_parse_text(const char * buf, uint32_t size,
+    void (*add)(void * ctx, const char * name, uint32_t address), void * ctx);
+
+/* validate a binary symbol file loaded in memory; returns its header, or NULL if it's not valid */
+const struct module_syms_header * module_syms_check(const void * buf, uint32_t size);
+
+/* was this binary symbol file made for this build? */
+int module_syms_match(const struct module_syms_header * header, const char * version, const char * id, const char * date);
+
+/* look up a symbol in a valid binary symbol file (binary search); returns 1 if found */
+int module_syms_find(const struct module_syms_header * header, const char * name, uint32_t * address);
+
+#endif
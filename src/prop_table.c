@@ -0,0 +1,73 @@
+/** \file
+ * Property ID -> handler lookup table (see prop_table.h)
+ */
+
+#include <string.h>
+#include "prop_table.h"
+
+static inline unsigned prop_table_hash(uint32_t property)
+{
+    /* multiplicative hashing; property IDs have most of their bits in the top and bottom bytes */
+    return (property * 0x9E3779B1u) >> (32 - PROP_TABLE_BITS);
+}
+
+/* slot for this property, either the one already used by it, or the empty one where it should go (PROP_TABLE_SIZE if full) */
+static inline unsigned prop_table_slot(struct prop_table * table, uint32_t property)
+{
+    unsigned slot = prop_table_hash(property);
+
+    for (int i = 0; i < PROP_TABLE_SIZE; i++)
+    {
+        if (!table->slots[slot].first || table->slots[slot].property == property)
+        {
+            return slot;
+        }
+        slot = (slot + 1) & (PROP_TABLE_SIZE - 1);
+    }
+
+    return PROP_TABLE_SIZE;
+}
+
+void prop_table_reset(struct prop_table * table)
+{
+    memset(table, 0, sizeof(*table));
+}
+
+int prop_table_add(struct prop_table * table, uint32_t property, int index)
+{
+    if (index < 0 || index >= PROP_TABLE_MAX_HANDLERS)
+    {
+        return -1;
+    }
+
+    unsigned slot = prop_table_slot(table, property);
+    if (slot == PROP_TABLE_SIZE)
+    {
+        return -1;
+    }
+
+    table->next[index] = 0;
+
+    if (!table->slots[slot].first)
+    {
+        table->slots[slot].property = property;
+        table->slots[slot].first = table->slots[slot].last = index + 1;
+        return 1;
+    }
+
+    /* append, so the handlers are called in the same order they were registered */
+    table->next[table->slots[slot].last - 1] = index + 1;
+    table->slots[slot].last = index + 1;
+    return 0;
+}
+
+int prop_table_first(struct prop_table * table, uint32_t property)
+{
+    unsigned slot = prop_table_slot(table, property);
+    if (slot == PROP_TABLE_SIZE)
+    {
+        return -1;
+    }
+
+    return table->slots[slot].first - 1;
+}
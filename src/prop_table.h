@@ -0,0 +1,45 @@
+/** \file
+ * Property ID -> handler lookup table, used by the global property handler (property.c).
+ *
+ * Open addressing hash table, with the handlers for each property linked in registration order.
+ * Plain C with no DryOS dependencies, so it can also be built on the host (contrib/prop_bench).
+ */
+
+#ifndef _prop_table_h_
+#define _prop_table_h_
+
+#include <stdint.h>
+
+#define PROP_TABLE_MAX_HANDLERS 256
+#define PROP_TABLE_BITS         9
+#define PROP_TABLE_SIZE         (1 << PROP_TABLE_BITS)  /* hash slots; at least twice the number of properties */
+
+struct prop_table
+{
+    struct
+    {
+        uint32_t property;
+        uint16_t first;                         /* handler index + 1; 0 = empty slot */
+        uint16_t last;
+    } slots[PROP_TABLE_SIZE];
+
+    uint16_t next[PROP_TABLE_MAX_HANDLERS];     /* next handler index + 1 for the same property; 0 = end of chain */
+};
+
+/* forget all handlers */
+void prop_table_reset(struct prop_table * table);
+
+/* link handler number "index" (0 ... PROP_TABLE_MAX_HANDLERS-1) to its property;
+ * returns 1 if this is the first handler for this property, 0 if not, -1 if the table is full */
+int prop_table_add(struct prop_table * table, uint32_t property, int index);
+
+/* index of the first handler for this property, -1 if there is none */
+int prop_table_first(struct prop_table * table, uint32_t property);
+
+/* index of the next handler for the same property, -1 at the end of the chain */
+static inline int prop_table_next(struct prop_table * table, int index)
+{
+    return table->next[index] - 1;
+}
+
+#endif
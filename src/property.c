@@ -18,6 +18,7 @@
 
 #include "dryos.h"
 #include "property.h"
+#include "prop_table.h"
 #include "bmp.h"
 
 #ifdef CONFIG_DIGIC_678
@@ -32,9 +33,12 @@ static void * global_token = NULL;
 /* we are building a list of property handlers that can be updated and re-registered */
 static int actual_num_handlers = 0;
 static int actual_num_properties = 0;
-static struct prop_handler property_handlers[256];
+static struct prop_handler property_handlers[PROP_TABLE_MAX_HANDLERS];
 static unsigned property_list[256];
 
+/* property ID -> handlers, so we don't have to scan all of them on every property event */
+static struct prop_table prop_table;
+
 /* the token is needed for unregistering handlers and property cleanup */
 static void global_token_handler(void * token)
 {
@@ -58,28 +62,25 @@ global_property_handler(
     if (property == 0x80010001) return (void*)_prop_cleanup(global_token, property);
 #endif
 
-    for (int entry = 0; entry < actual_num_handlers; entry++)
+    for (int entry = prop_table_first(&prop_table, property); entry >= 0; entry = prop_table_next(&prop_table, entry))
     {
         struct prop_handler *handler = &property_handlers[entry];
 
-        if (handler->property == property)
+        /* cache length of property if not set yet */
+        if (handler->property_length == 0)
+        {
+            handler->property_length = len;
+        }
+
+        /* signal that our property handler has fired */
+        handler->property_ack = 1;
+
+        /* execute handler, if any */
+        if (handler->handler != NULL)
         {
-            /* cache length of property if not set yet */
-            if (handler->property_length == 0)
-            {
-                handler->property_length = len;
-            }
-
-            /* signal that our property handler has fired */
-            handler->property_ack = 1;
-
-            /* execute handler, if any */
-            if (handler->handler != NULL)
-            {
-                //~ current_prop_handler = property;
-                handler->handler(property, priv, buf, len);
-                //~ current_prop_handler = 0;
-            }
+            //~ current_prop_handler = property;
+            handler->handler(property, priv, buf, len);
+            //~ current_prop_handler = 0;
         }
     }
     return (void*)_prop_cleanup(global_token, property);
@@ -107,21 +108,19 @@ void prop_add_handler (uint32_t property, void *handler)
 #if defined(POSITION_INDEPENDENT)
     handler[entry].handler = PIC_RESOLVE(handler[entry].handler);
 #endif
+    /* the table also tells whether this property was already in the list */
+    int first_handler = prop_table_add(&prop_table, property, actual_num_handlers);
+    if (first_handler < 0)
+    {
+        bmp_printf(FONT_CANON, 0, 0, "Too many prop handlers");
+        return;
+    }
+
     property_handlers[actual_num_handlers].handler = handler;
     property_handlers[actual_num_handlers].property = property;
     actual_num_handlers++;
 
-    int duplicate = 0;
-    for (int i = 0; i < actual_num_properties; i++)
-    {
-        if (property_list[i] == property)
-        {
-            duplicate = 1;
-            break;
-        }
-    }
-
-    if (!duplicate)
+    if (first_handler)
     {
         property_list[actual_num_properties] = property;
         actual_num_properties++;
@@ -180,6 +179,7 @@ prop_reset_registration()
     prop_unregister_handlers();
     actual_num_properties = 0;
     actual_num_handlers = 0;
+    prop_table_reset(&prop_table);
     prop_add_internal_handlers();
     prop_register_handlers();
 }
@@ -258,43 +258,23 @@ int _get_prop_len(int prop)
 /* return cached length of property */
 static uint32_t prop_get_prop_len(uint32_t property)
 {
-    for (int entry = 0; entry < actual_num_handlers; entry++)
-    {
-        struct prop_handler *handler = &property_handlers[entry];
-        if (handler->property == property)
-        {
-            return handler->property_length;
-        }
-    }
-
-    return 0;
+    int entry = prop_table_first(&prop_table, property);
+    return entry >= 0 ? property_handlers[entry].property_length : 0;
 }
 
 /* return the acknowledge flag (set if the handler was executed) */
 static uint32_t prop_get_ack(uint32_t property)
 {
-    for (int entry = 0; entry < actual_num_handlers; entry++)
-    {
-        struct prop_handler *handler = &property_handlers[entry];
-        if (handler->property == property)
-        {
-            return handler->property_ack;
-        }
-    }
-
-    return 0;
+    int entry = prop_table_first(&prop_table, property);
+    return entry >= 0 ? property_handlers[entry].property_ack : 0;
 }
 
 /* reset the acknowledge flag (will be set when the handler will get executed again) */
 static void prop_reset_ack(uint32_t property)
 {
-    for (int entry = 0; entry < actual_num_handlers; entry++)
+    for (int entry = prop_table_first(&prop_table, property); entry >= 0; entry = prop_table_next(&prop_table, entry))
     {
-        struct prop_handler *handler = &property_handlers[entry];
-        if (handler->property == property)
-        {
-            handler->property_ack = 0;
-        }
+        property_handlers[entry].property_ack = 0;
     }
 }
 
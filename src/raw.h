@@ -161,8 +161,8 @@ int get_dxo_dynamic_range(int raw_iso);
 /* raw image info (geometry, calibration levels, color, DR etc); parts of this were copied from CHDK */
 struct raw_info {
     uint32_t api_version;           // increase this when changing the structure
-    #if INTPTR_MAX == INT32_MAX     // only works on 32-bit systems
-    void* buffer;                   // points to image data
+    #if INTPTR_MAX == INT32_MAX || defined(RAW_INFO_NATIVE_POINTERS)
+    void* buffer;                   // points to image data (host tools that never save raw_info may use 64-bit pointers)
     #else
     uint32_t do_not_use_this;       // this can't work on 64-bit systems
     #endif
@@ -0,0 +1,89 @@
+/** \file
+ * Raw level histogram with a prefix index (see raw_hist.h)
+ */
+
+#include <string.h>
+#include "raw_hist.h"
+
+void raw_hist_clear(struct raw_hist * hist)
+{
+    memset(hist, 0, sizeof(*hist));
+}
+
+void raw_hist_finish(struct raw_hist * hist)
+{
+    uint32_t acc = 0;
+    const uint32_t * bins = hist->bins;
+
+    for (int c = 0; c < RAW_HIST_COARSE; c++)
+    {
+        for (int i = 0; i < (1 << RAW_HIST_COARSE_BITS); i += 4)
+        {
+            acc += bins[i] + bins[i+1] + bins[i+2] + bins[i+3];
+        }
+        bins += 1 << RAW_HIST_COARSE_BITS;
+        hist->prefix[c] = acc;
+    }
+
+    hist->total = acc;
+}
+
+int raw_hist_level(struct raw_hist * hist, int count)
+{
+    if (count <= 0)
+    {
+        /* any level will do; the old linear search stopped at the first one */
+        return 0;
+    }
+
+    if ((uint32_t) count > hist->total)
+    {
+        return -1;
+    }
+
+    /* first coarse bin that reaches "count" */
+    int lo = 0;
+    int hi = RAW_HIST_COARSE - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (hist->prefix[mid] >= (uint32_t) count)
+        {
+            hi = mid;
+        }
+        else
+        {
+            lo = mid + 1;
+        }
+    }
+
+    /* then the level inside it */
+    uint32_t acc = lo ? hist->prefix[lo - 1] : 0;
+    int level = lo << RAW_HIST_COARSE_BITS;
+    while (1)
+    {
+        acc += hist->bins[level];
+        if (acc >= (uint32_t) count)
+        {
+            return level;
+        }
+        level++;
+    }
+}
+
+void raw_hist_get_percentiles(struct raw_hist * hist, const int * percentiles_x10, int * output_raw_values, int n)
+{
+    for (int k = 0; k < n; k++)
+    {
+        int thr = (uint64_t)hist->total * percentiles_x10[k] / 1000 - 2;  // 50% => median; allow up to 2 stuck pixels
+        output_raw_values[k] = raw_hist_level(hist, thr);
+    }
+}
+
+void raw_hist_decay(struct raw_hist * hist)
+{
+    for (int i = 0; i < RAW_HIST_LEVELS; i++)
+    {
+        hist->bins[i] >>= 1;
+    }
+}
@@ -0,0 +1,57 @@
+/** \file
+ * Reusable histogram of raw levels, for percentile queries (raw_hist_get_percentile_levels in histogram.c).
+ *
+ * Counts all 14-bit levels, plus a prefix index over coarse bins, so each percentile
+ * is found with a binary search over the coarse bins and a short walk inside one of them.
+ * Plain C with no DryOS dependencies, so it can also be built on the host (contrib/raw_hist_bench).
+ */
+
+#ifndef _raw_hist_h_
+#define _raw_hist_h_
+
+#include <stdint.h>
+
+#define RAW_HIST_LEVELS         16384                               /* 14-bit raw */
+#define RAW_HIST_COARSE_BITS    7
+#define RAW_HIST_COARSE         (RAW_HIST_LEVELS >> RAW_HIST_COARSE_BITS)   /* 128 coarse bins of 128 levels */
+
+struct raw_hist
+{
+    uint32_t bins[RAW_HIST_LEVELS];
+    uint32_t prefix[RAW_HIST_COARSE];   /* samples up to the end of each coarse bin; valid after raw_hist_finish */
+    uint32_t total;                     /* valid after raw_hist_finish */
+    int passes;                         /* sampling passes added since the last clear (see raw_hist_grid_offset) */
+};
+
+/* start over (a new image) */
+void raw_hist_clear(struct raw_hist * hist);
+
+static inline void raw_hist_add(struct raw_hist * hist, int level)
+{
+    hist->bins[level & (RAW_HIST_LEVELS - 1)]++;
+}
+
+/* build the prefix index; call after adding samples, before the queries */
+void raw_hist_finish(struct raw_hist * hist);
+
+/* smallest level having at least "count" samples at or below it; -1 if there are not that many */
+int raw_hist_level(struct raw_hist * hist, int count);
+
+/* raw levels for the percentiles (x10, e.g. 500 = median), same rules as raw_hist_get_percentile_levels:
+ * up to 2 stuck pixels are allowed above the requested percentile */
+void raw_hist_get_percentiles(struct raw_hist * hist, const int * percentiles_x10, int * output_raw_values, int n);
+
+/* halve all counts, so older samples weigh less than the ones added next (call raw_hist_finish after) */
+void raw_hist_decay(struct raw_hist * hist);
+
+/* progressive sampling: pass k (0 ... stride*stride - 1) samples the grid with this stride, shifted by (dx, dy),
+ * so after stride*stride passes, every position was sampled once (same as stride 1) */
+static inline void raw_hist_grid_offset(int stride, int pass, int * dx, int * dy)
+{
+    /* diagonal order, so each pass adds samples from different rows and columns */
+    int k = pass % (stride * stride);
+    *dy = k % stride;
+    *dx = (k / stride + k) % stride;
+}
+
+#endif
@@ -958,6 +958,12 @@ LIBTCCAPI void *tcc_get_section_ptr(TCCState *s, const char *name, int* size)
     return NULL;
 }
 
+LIBTCCAPI void tcc_set_reloc_hook(TCCState *s, tcc_reloc_hook_t hook, void *opaque)
+{
+    s->reloc_hook = hook;
+    s->reloc_hook_opaque = opaque;
+}
+
 static int tcc_add_library_internal(TCCState *s, const char *fmt,
     const char *filename, int flags, char **paths, int nb_paths)
 {
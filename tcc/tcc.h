@@ -671,6 +671,10 @@ struct TCCState {
     int do_bench; /* option -bench */
     int gen_deps; /* option -MD  */
     char *deps_outfile; /* option -MF */
+
+    /* see tcc_set_reloc_hook */
+    void (*reloc_hook)(void *opaque, unsigned addr, int type, unsigned target);
+    void *reloc_hook_opaque;
 };
 
 /* The current value can be: */
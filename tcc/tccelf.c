@@ -83,20 +83,17 @@ static void rebuild_hash(Section *s, unsigned int nb_buckets)
     }
 }
 
-/* return the symbol number */
-ST_FUNC int put_elf_sym(Section *s, addr_t value, unsigned long size,
-    int info, int other, int shndx, const char *name)
+/* add a symbol whose name is already in the string table, at 'name_offset';
+   'h' is elf_hash() of the name (unused for local symbols) */
+static int put_elf_sym_hashed(Section *s, addr_t value, unsigned long size,
+    int info, int other, int shndx, int name_offset, unsigned long h)
 {
-    int name_offset, sym_index;
-    int nbuckets, h;
+    int sym_index;
+    int nbuckets;
     ElfW(Sym) *sym;
     Section *hs;
     
     sym = section_ptr_add(s, sizeof(ElfW(Sym)));
-    if (name)
-        name_offset = put_elf_str(s->link, name);
-    else
-        name_offset = 0;
     /* XXX: endianness */
     sym->st_name = name_offset;
     sym->st_value = value;
@@ -114,7 +111,7 @@ ST_FUNC int put_elf_sym(Section *s, addr_t value, unsigned long size,
         if (ELFW(ST_BIND)(info) != STB_LOCAL) {
             /* add another hashing entry */
             nbuckets = base[0];
-            h = elf_hash(name) % nbuckets;
+            h = h % nbuckets;
             *ptr = base[2 + h];
             base[2 + h] = sym_index;
             base[1]++;
@@ -131,20 +128,35 @@ ST_FUNC int put_elf_sym(Section *s, addr_t value, unsigned long size,
     return sym_index;
 }
 
-/* find global ELF symbol 'name' and return its index. Return 0 if not
-   found. */
-ST_FUNC int find_elf_sym(Section *s, const char *name)
+/* return the symbol number */
+ST_FUNC int put_elf_sym(Section *s, addr_t value, unsigned long size,
+    int info, int other, int shndx, const char *name)
+{
+    int name_offset;
+    unsigned long h = 0;
+
+    if (name)
+        name_offset = put_elf_str(s->link, name);
+    else
+        name_offset = 0;
+    if (s->hash && ELFW(ST_BIND)(info) != STB_LOCAL)
+        h = elf_hash((const unsigned char *)name);
+    return put_elf_sym_hashed(s, value, size, info, other, shndx, name_offset, h);
+}
+
+/* same as find_elf_sym, with elf_hash(name) already computed */
+static int find_elf_sym_hashed(Section *s, const char *name, unsigned long h)
 {
     ElfW(Sym) *sym;
     Section *hs;
-    int nbuckets, sym_index, h;
+    int nbuckets, sym_index;
     const char *name1;
     
     hs = s->hash;
     if (!hs)
         return 0;
     nbuckets = ((int *)hs->data)[0];
-    h = elf_hash(name) % nbuckets;
+    h = h % nbuckets;
     sym_index = ((int *)hs->data)[2 + h];
     while (sym_index != 0) {
         sym = &((ElfW(Sym) *)s->data)[sym_index];
@@ -156,6 +168,15 @@ ST_FUNC int find_elf_sym(Section *s, const char *name)
     return 0;
 }
 
+/* find global ELF symbol 'name' and return its index. Return 0 if not
+   found. */
+ST_FUNC int find_elf_sym(Section *s, const char *name)
+{
+    if (!s->hash)
+        return 0;
+    return find_elf_sym_hashed(s, name, elf_hash((const unsigned char *)name));
+}
+
 /* return elf symbol value, signal error if 'err' is nonzero */
 ST_FUNC addr_t get_elf_sym_addr(TCCState *s, const char *name, int err)
 {
@@ -264,6 +285,53 @@ ST_FUNC int add_elf_sym(Section *s, addr_t value, unsigned long size,
     return sym_index;
 }
 
+/* add many absolute symbols, as tcc_add_symbol would (see libtcc.h) */
+LIBTCCAPI int tcc_add_symbols(TCCState *s1, const TCCSymbol *syms, int count,
+                              const char *names, int names_size)
+{
+    Section *s = symtab_section;
+    Section *hs = s->hash;
+    int i, nbuckets, names_offset;
+    unsigned long new_size;
+
+    if (count <= 0)
+        return 0;
+
+    /* grow the hash table and the sections once, not while adding */
+    nbuckets = ((int *)hs->data)[0];
+    while (hs->nb_hashed_syms + count > 2 * nbuckets)
+        nbuckets *= 2;
+    if (nbuckets != ((int *)hs->data)[0])
+        rebuild_hash(s, nbuckets);
+
+    new_size = s->data_offset + count * sizeof(ElfW(Sym));
+    if (new_size > s->data_allocated)
+        section_realloc(s, new_size);
+    new_size = hs->data_offset + count * sizeof(int);
+    if (new_size > hs->data_allocated)
+        section_realloc(hs, new_size);
+
+    /* all names are copied in one go; the string table is only read by name offset */
+    names_offset = s->link->data_offset;
+    memcpy(section_ptr_add(s->link, names_size), names, names_size);
+
+    for (i = 0; i < count; i++) {
+        int name_offset = names_offset + syms[i].name;
+        const char *name = s->link->data + name_offset;
+        if (find_elf_sym_hashed(s, name, syms[i].hash)) {
+            /* already defined; let the usual rules decide */
+            add_elf_sym(s, syms[i].value, 0,
+                ELFW(ST_INFO)(STB_WEAK, STT_NOTYPE), 0,
+                SHN_ABS, name);
+            continue;
+        }
+        put_elf_sym_hashed(s, syms[i].value, 0,
+            ELFW(ST_INFO)(STB_WEAK, STT_NOTYPE), 0,
+            SHN_ABS, name_offset, syms[i].hash);
+    }
+    return 0;
+}
+
 /* put relocation */
 ST_FUNC void put_elf_reloc(Section *symtab, Section *s, unsigned long offset,
                           int type, int symbol)
@@ -502,6 +570,8 @@ static addr_t add_jmp_table(TCCState *s1, int val)
     /* ldr pc, [pc, #-4] */
     p[0] = 0xE51FF004;
     p[1] = val;
+    if (s1->reloc_hook)
+        s1->reloc_hook(s1->reloc_hook_opaque, (addr_t)&p[1], R_ARM_ABS32, val);
     return (addr_t)p;
 }
 #endif
@@ -618,7 +688,9 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s)
                 if (s1->output_type == TCC_OUTPUT_MEMORY) {
                     if ((x & 3) || x >= 0x2000000 || x < -0x2000000)
                         if (!(x & 3) || !blx_avail || !is_call) {
-                            x += add_jmp_table(s1, val) - val; /* add veneer */
+                            addr_t veneer = add_jmp_table(s1, val);
+                            x += veneer - val; /* add veneer */
+                            val = veneer;
                             is_thumb = 0; /* Veneer uses ARM instructions */
                         }
                 }
@@ -710,10 +782,11 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s)
         case R_ARM_MOVW_ABS_NC:
             {
                 int x, imm4, imm12;
+                addr_t v = val; /* val itself goes to reloc_hook below */
                 if (type == R_ARM_MOVT_ABS)
-                    val >>= 16;
-                imm12 = val & 0xfff;
-                imm4 = (val >> 12) & 0xf;
+                    v >>= 16;
+                imm12 = v & 0xfff;
+                imm4 = (v >> 12) & 0xf;
                 x = (imm4 << 16) | imm12;
                 if (type == R_ARM_THM_MOVT_ABS)
                     *(int *)ptr |= x;
@@ -725,12 +798,13 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s)
         case R_ARM_THM_MOVW_ABS_NC:
             {
                 int x, i, imm4, imm3, imm8;
+                addr_t v = val;
                 if (type == R_ARM_THM_MOVT_ABS)
-                    val >>= 16;
-                imm8 = val & 0xff;
-                imm3 = (val >> 8) & 0x7;
-                i = (val >> 11) & 1;
-                imm4 = (val >> 12) & 0xf;
+                    v >>= 16;
+                imm8 = v & 0xff;
+                imm3 = (v >> 8) & 0x7;
+                i = (v >> 11) & 1;
+                imm4 = (v >> 12) & 0xf;
                 x = (imm3 << 28) | (imm8 << 16) | (i << 10) | imm4;
                 if (type == R_ARM_THM_MOVT_ABS)
                     *(int *)ptr |= x;
@@ -882,6 +956,10 @@ ST_FUNC void relocate_section(TCCState *s1, Section *s)
 #error unsupported processor
 #endif
         }
+#if defined(TCC_TARGET_ARM)
+        if (s1->reloc_hook)
+            s1->reloc_hook(s1->reloc_hook_opaque, addr, type, val);
+#endif
     }
     /* if the relocation is allocated, we change its symbol table */
     if (sr->sh_flags & SHF_ALLOC)